@@ -368,6 +368,25 @@ echo "build rsm: phony \$builddir/rsm" >> "$NINJAFILE"
 echo "build \$builddir/rsm: link ${HOST_OBJECTS[@]}" >> "$NINJAFILE"
 echo >> "$NINJAFILE"
 
+# rsm-cachesim replays memory-access traces (see tools/cachesim.c)
+LIB_OBJECTS=( ${HOST_OBJECTS[@]/*host-src.main.c.o/} )
+CACHESIM_OBJECTS=( $(_gen_obj_build_rules "host" "" tools/cachesim.c) )
+echo "build rsm-cachesim: phony \$builddir/rsm-cachesim" >> "$NINJAFILE"
+echo "build \$builddir/rsm-cachesim: link ${CACHESIM_OBJECTS[@]} ${LIB_OBJECTS[@]}" >> "$NINJAFILE"
+echo >> "$NINJAFILE"
+
+# rsm-timebench measures nanotime overhead and accuracy (see tools/timebench.c)
+TIMEBENCH_OBJECTS=( $(_gen_obj_build_rules "host" "" tools/timebench.c) )
+echo "build rsm-timebench: phony \$builddir/rsm-timebench" >> "$NINJAFILE"
+echo "build \$builddir/rsm-timebench: link ${TIMEBENCH_OBJECTS[@]} ${LIB_OBJECTS[@]}" >> "$NINJAFILE"
+echo >> "$NINJAFILE"
+
+# rsm-schedbench measures scheduler latencies (see tools/schedbench.c)
+SCHEDBENCH_OBJECTS=( $(_gen_obj_build_rules "host" "" tools/schedbench.c) )
+echo "build rsm-schedbench: phony \$builddir/rsm-schedbench" >> "$NINJAFILE"
+echo "build \$builddir/rsm-schedbench: link ${SCHEDBENCH_OBJECTS[@]} ${LIB_OBJECTS[@]}" >> "$NINJAFILE"
+echo >> "$NINJAFILE"
+
 echo "build rsm.wasm: phony \$builddir/rsm.wasm" >> "$NINJAFILE"
 echo "build \$builddir/rsm.wasm: link_wasm ${WASM_OBJECTS[@]}" >> "$NINJAFILE"
 echo >> "$NINJAFILE"
@@ -0,0 +1,456 @@
+// ahead-of-time translation of ROMs to C (see aot.h)
+// SPDX-License-Identifier: Apache-2.0
+//
+// A guest function starts at pc 0 or at the target of a CALL or TSPAWN instruction
+// and extends to the next function. Instructions at which execution may enter or
+// resume a function get a label: function entries, branch & jump targets and the
+// instructions following branches, calls and syscalls. Each translated function
+// starts with a switch on pc which jumps to the corresponding label.
+//
+#include "rsmimpl.h"
+#include "abuf.h"
+#include "aot.h"
+#include "machine.h"
+
+// instruction flags
+#define F_ENTRY  (1u << 0) // function entry
+#define F_LABEL  (1u << 1) // execution may enter or resume at pc
+#define F_DATA   (1u << 2) // immediate data of a COPYV instruction
+
+// operand text, e.g. "iregs[3]" or "0x1fu"
+typedef struct { char s[24]; } operand_t;
+
+// instruction arguments
+#define GET_A(in)  RSM_GET_A(in)
+#define GET_B(in)  RSM_GET_B(in)
+#define GET_C(in)  RSM_GET_C(in)
+#define GET_D(in)  RSM_GET_D(in)
+
+
+// arg_u returns the text of a register-or-unsigned-immediate argument,
+// which matches RAru, RBru etc. of rsched_eval
+static operand_t arg_u(rin_t in, u32 reg, u32 imm) {
+  operand_t o;
+  if (RSM_GET_i(in)) {
+    snprintf(o.s, sizeof(o.s), "0x%xu", imm);
+  } else {
+    snprintf(o.s, sizeof(o.s), "iregs[%u]", reg);
+  }
+  return o;
+}
+
+// arg_s returns the text of a register-or-signed-immediate argument
+static operand_t arg_s(rin_t in, u32 reg, i32 imm) {
+  operand_t o;
+  if (RSM_GET_i(in)) {
+    snprintf(o.s, sizeof(o.s), "(%d)", imm);
+  } else {
+    snprintf(o.s, sizeof(o.s), "iregs[%u]", reg);
+  }
+  return o;
+}
+
+#define ARG_Au(in)  arg_u(in, GET_A(in), RSM_GET_Au(in)).s
+#define ARG_Bu(in)  arg_u(in, GET_B(in), RSM_GET_Bu(in)).s
+#define ARG_Cu(in)  arg_u(in, GET_C(in), RSM_GET_Cu(in)).s
+#define ARG_Du(in)  arg_u(in, GET_D(in), RSM_GET_Du(in)).s
+#define ARG_As(in)  arg_s(in, GET_A(in), RSM_GET_As(in)).s
+#define ARG_Bs(in)  arg_s(in, GET_B(in), RSM_GET_Bs(in)).s
+#define ARG_Cs(in)  arg_s(in, GET_C(in), RSM_GET_Cs(in)).s
+#define ARG_Ds(in)  arg_s(in, GET_D(in), RSM_GET_Ds(in)).s
+
+
+static void mark(u8* flags, usize codelen, u64 pc, u8 f) {
+  if (pc < (u64)codelen)
+    flags[pc] |= f;
+}
+
+
+// aot_scan finds functions and labels
+static void aot_scan(const rin_t* code, usize codelen, u8* flags) {
+  mark(flags, codelen, 0, F_ENTRY | F_LABEL);
+  for (usize pc = 0; pc < codelen; pc++) {
+    rin_t in = code[pc];
+    u64 npc = (u64)pc + 1;
+    bool imm = RSM_GET_i(in);
+    switch (RSM_GET_OP(in)) {
+      case rop_COPYV:
+        for (u32 i = 0; i < RSM_GET_Bu(in) && pc + 1 < codelen; i++)
+          flags[++pc] |= F_DATA;
+        break;
+      case rop_IF:
+      case rop_IFZ:
+        if (imm)
+          mark(flags, codelen, (u64)((i64)npc + (i64)RSM_GET_Bs(in)), F_LABEL);
+        mark(flags, codelen, npc, F_LABEL);
+        break;
+      case rop_JUMP:
+        if (imm)
+          mark(flags, codelen, RSM_GET_Au(in), F_LABEL);
+        break;
+      case rop_CALL:
+        if (imm)
+          mark(flags, codelen, RSM_GET_Au(in), F_ENTRY | F_LABEL);
+        mark(flags, codelen, npc, F_LABEL);
+        break;
+      case rop_TSPAWN:
+        if (imm)
+          mark(flags, codelen, RSM_GET_Au(in), F_ENTRY | F_LABEL);
+        break;
+      case rop_SYSCALL:
+        mark(flags, codelen, npc, F_LABEL);
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+
+// emit_goto transfers control to target, directly if it is a label in the
+// function [start,end) or else by returning it to aot_eval
+static void emit_goto(abuf_t* b, const u8* flags, usize start, usize end, u64 target) {
+  if (start <= target && target < end && (flags[target] & F_LABEL)) {
+    abuf_fmt(b, "goto L_%llx;", target);
+  } else {
+    abuf_fmt(b, "return 0x%llx;", target);
+  }
+}
+
+
+// emit_instr translates the instruction at pc, returning the number of
+// instructions consumed (more than one for COPYV)
+static usize emit_instr(
+  abuf_t* b, const rin_t* code, usize codelen, const u8* flags,
+  usize start, usize end, usize pc)
+{
+  rin_t in = code[pc];
+  usize npc = pc + 1;
+  u32 a = GET_A(in), br = GET_B(in);
+
+  #define OUT(fmt, args...) abuf_fmt(b, "  " fmt "\n", ##args)
+
+  // binary operations: RA = RB op C
+  #define BINOP(op, C)  OUT("iregs[%u] = iregs[%u] " op " %s;", a, br, C)
+  #define SBINOP(op, C) OUT("iregs[%u] = (i64)iregs[%u] " op " (i64)%s;", a, br, C)
+  #define LOAD(TYPE) \
+    OUT("iregs[%u] = AOT_LOAD(" #TYPE ", (u64)((i64)iregs[%u] + (i64)%s));", \
+      a, br, ARG_Cs(in))
+  #define STORE(TYPE) \
+    OUT("AOT_STORE(" #TYPE ", (u64)((i64)iregs[%u] + (i64)%s), iregs[%u]);", \
+      br, ARG_Cs(in), a)
+  #define OVERFLOW(OP, op) \
+    OUT("AOT_CHECK_OVERFLOW(" #OP ", rop_" #op ", iregs[%u], %s, &iregs[%u], 0x%zx);", \
+      br, ARG_Cs(in), a, npc)
+  #define SHIFT(expr) \
+    OUT("AOT_CHECK_SHIFT((u64)%s, 0x%zx);", ARG_Cu(in), npc); \
+    if (RSM_GET_i(in) && RSM_GET_Cu(in) >= 64) { \
+      OUT("iregs[%u] = 0;", a); \
+    } else { \
+      OUT(expr, a, br, ARG_Cu(in)); \
+    }
+
+  switch (RSM_GET_OP(in)) {
+
+  case rop_COPY: OUT("iregs[%u] = %s;", a, ARG_Bu(in)); break;
+  case rop_COPYV: {
+    u32 n = RSM_GET_Bu(in);
+    if (n == 0 || n > 2 || npc + n > codelen) {
+      OUT("AOT_INTERP(0x%zx); // invalid copyv", pc);
+      break;
+    }
+    u64 v = n == 1 ? (u64)code[npc] : ((u64)code[npc] << 32) | (u64)code[npc + 1];
+    OUT("iregs[%u] = 0x%llxull;", a, v);
+    return 1 + n;
+  }
+
+  case rop_LOAD:   LOAD(u64); break;
+  case rop_LOAD4U: LOAD(u32); break;
+  case rop_LOAD4S: LOAD(u32); break;
+  case rop_LOAD2U: LOAD(u16); break;
+  case rop_LOAD2S: LOAD(u16); break;
+  case rop_LOAD1U: LOAD(u8); break;
+  case rop_LOAD1S: LOAD(u8); break;
+  case rop_STORE:  STORE(u64); break;
+  case rop_STORE4: STORE(u32); break;
+  case rop_STORE2: STORE(u16); break;
+  case rop_STORE1: STORE(u8); break;
+
+  case rop_ADD:  BINOP("+", ARG_Cu(in)); break;
+  case rop_SUB:  BINOP("-", ARG_Cu(in)); break;
+  case rop_MUL:  BINOP("*", ARG_Cu(in)); break;
+  case rop_ADDS: OVERFLOW(add, ADDS); break;
+  case rop_SUBS: OVERFLOW(sub, SUBS); break;
+  case rop_MULS: OVERFLOW(mul, MULS); break;
+  case rop_DIV:  BINOP("/", ARG_Cu(in)); break;
+  case rop_MOD:  BINOP("%%", ARG_Cu(in)); break;
+  case rop_AND:  BINOP("&", ARG_Cu(in)); break;
+  case rop_OR:   BINOP("|", ARG_Cu(in)); break;
+  case rop_XOR:  BINOP("^", ARG_Cu(in)); break;
+  case rop_SHL:  SHIFT("iregs[%u] = iregs[%u] << %s;"); break;
+  case rop_SHRS: SHIFT("iregs[%u] = (u64)((i64)iregs[%u] >> %s);"); break;
+  case rop_SHRU: SHIFT("iregs[%u] = iregs[%u] >> %s;"); break;
+  case rop_BINV: OUT("iregs[%u] = ~%s;", a, ARG_Bu(in)); break;
+  case rop_NOT:  OUT("iregs[%u] = !%s;", a, ARG_Bu(in)); break;
+
+  case rop_EQ:   BINOP("==", ARG_Cu(in)); break;
+  case rop_NEQ:  BINOP("!=", ARG_Cu(in)); break;
+  case rop_LTU:  BINOP("<",  ARG_Cu(in)); break;
+  case rop_LTEU: BINOP("<=", ARG_Cu(in)); break;
+  case rop_GTU:  BINOP(">",  ARG_Cu(in)); break;
+  case rop_GTEU: BINOP(">=", ARG_Cu(in)); break;
+  case rop_LTS:  SBINOP("<",  ARG_Cs(in)); break;
+  case rop_LTES: SBINOP("<=", ARG_Cs(in)); break;
+  case rop_GTS:  SBINOP(">",  ARG_Cs(in)); break;
+  case rop_GTES: SBINOP(">=", ARG_Cs(in)); break;
+
+  case rop_IF:
+  case rop_IFZ: {
+    const char* cond = RSM_GET_OP(in) == rop_IF ? "" : "!";
+    if (RSM_GET_i(in)) {
+      u64 target = (u64)((i64)npc + (i64)RSM_GET_Bs(in));
+      abuf_fmt(b, "  if (%siregs[%u]) { AOT_PREEMPT(0x%llx); ", cond, a, target);
+      emit_goto(b, flags, start, end, target);
+      abuf_str(b, " }\n");
+    } else {
+      OUT("if (%siregs[%u]) {", cond, a);
+      OUT("  pc = (usize)((i64)0x%zx + (i64)iregs[%u]);", npc, br);
+      OUT("  AOT_PREEMPT(pc); goto dispatch;");
+      OUT("}");
+    }
+    OUT("AOT_PREEMPT(0x%zx);", npc);
+    break;
+  }
+
+  case rop_JUMP:
+    if (RSM_GET_i(in)) {
+      OUT("AOT_PREEMPT(0x%x);", RSM_GET_Au(in));
+      abuf_str(b, "  ");
+      emit_goto(b, flags, start, end, RSM_GET_Au(in));
+      abuf_c(b, '\n');
+    } else {
+      OUT("pc = (usize)iregs[%u]; AOT_PREEMPT(pc); goto dispatch;", a);
+    }
+    break;
+
+  case rop_CALL:
+    OUT("aot_push_pc(t, iregs, 0x%zx);", npc);
+    if (RSM_GET_i(in)) {
+      OUT("AOT_PREEMPT(0x%x);", RSM_GET_Au(in));
+      abuf_str(b, "  ");
+      emit_goto(b, flags, start, end, RSM_GET_Au(in));
+      abuf_c(b, '\n');
+    } else {
+      OUT("pc = (usize)iregs[%u]; AOT_PREEMPT(pc); goto dispatch;", a);
+    }
+    break;
+
+  case rop_RET:
+    OUT("pc = (usize)AOT_POP(); goto dispatch;");
+    break;
+
+  case rop_TSPAWN:
+    OUT("iregs[0] = (u64)task_spawn(t, (usize)%s, iregs);", ARG_Au(in));
+    break;
+  case rop_SYSCALL:
+    OUT("AOT_SYSCALL((u32)%s, 0x%zx);", ARG_Au(in), npc);
+    break;
+  case rop_WRITE:
+    OUT("iregs[%u] = (u64)aot_write(t, iregs, 0x%zx, (i64)%s, iregs[%u], iregs[%u]);",
+      a, npc, ARG_Ds(in), br, GET_C(in));
+    break;
+  case rop_MCOPY:
+    OUT("aot_mcopy(t, iregs, 0x%zx, iregs[%u], iregs[%u], %s);", npc, a, br, ARG_Cu(in));
+    break;
+  case rop_STKMEM:
+    OUT("iregs[RSM_MAX_REG] = aot_stkmem(t, iregs, 0x%zx, (i64)%s);", npc, ARG_As(in));
+    break;
+
+  case rop_READ:
+  case rop_MCMP:
+    OUT("panic(\"NOT IMPLEMENTED\");");
+    break;
+
+  default:
+    OUT("AOT_INTERP(0x%zx); // unknown op %u", pc, RSM_GET_OP(in));
+    break;
+  }
+
+  #undef OUT
+  #undef BINOP
+  #undef SBINOP
+  #undef LOAD
+  #undef STORE
+  #undef OVERFLOW
+  #undef SHIFT
+  return 1;
+}
+
+
+// has_dynamic_target returns true if any instruction of [start,end) transfers
+// control to a pc which is only known at runtime
+static bool has_dynamic_target(const rin_t* code, const u8* flags, usize start, usize end) {
+  for (usize pc = start; pc < end; pc++) {
+    if (flags[pc] & F_DATA)
+      continue;
+    switch (RSM_GET_OP(code[pc])) {
+      case rop_RET:
+        return true;
+      case rop_IF: case rop_IFZ: case rop_JUMP: case rop_CALL:
+        if (!RSM_GET_i(code[pc]))
+          return true;
+        break;
+      default:
+        break;
+    }
+  }
+  return false;
+}
+
+
+// emit_fun translates the function [start,end)
+static void emit_fun(
+  abuf_t* b, const rin_t* code, usize codelen, const u8* flags, usize start, usize end)
+{
+  abuf_fmt(b, "static usize f_%zx(T* t, u64* iregs, usize pc, aotstate_t* st) {\n", start);
+  if (has_dynamic_target(code, flags, start, end))
+    abuf_str(b, "dispatch:\n");
+  abuf_str(b, "  switch (pc) {\n");
+  for (usize pc = start; pc < end; pc++) {
+    if (flags[pc] & F_LABEL)
+      abuf_fmt(b, "  case 0x%zx: goto L_%zx;\n", pc, pc);
+  }
+  abuf_fmt(b,
+    "  }\n"
+    "  if (pc - 0x%zx < 0x%zx)\n"
+    "    AOT_INTERP(pc); // not a label\n"
+    "  return pc;\n", start, end - start);
+
+  for (usize pc = start; pc < end;) {
+    if (flags[pc] & F_LABEL)
+      abuf_fmt(b, "L_%zx:\n", pc);
+    abuf_fmt(b, "  // %4zx  ", pc);
+    fmtinstr(b, code[pc], 0);
+    abuf_c(b, '\n');
+    pc += emit_instr(b, code, codelen, flags, start, end, pc);
+  }
+
+  // fall through to the next function (or the epilogue)
+  abuf_fmt(b, "  return 0x%zx;\n}\n\n", end);
+}
+
+
+usize rsm_emitc(char* buf, usize bufcap, const rrom_t* rom, rmemalloc_t* ma) {
+  const rin_t* code = rom->code;
+  usize codelen = rom->codelen;
+  assert(code != NULL || codelen == 0); // rom must be loaded
+
+  rmem_t flagsmem = rmem_alloc(ma, codelen + 1);
+  if (!flagsmem.p)
+    return USIZE_MAX;
+  u8* flags = flagsmem.p;
+  memset(flags, 0, codelen);
+  if (codelen > 0)
+    aot_scan(code, codelen, flags);
+
+  abuf_t s1 = abuf_make(buf, bufcap); abuf_t* b = &s1;
+  abuf_str(b, "// generated by rsm -C; see aot.h\n#include \"aot.h\"\n\n");
+
+  // functions
+  u32 nfun = 0;
+  for (usize start = 0; start < codelen; nfun++) {
+    usize end = start + 1;
+    while (end < codelen && !(flags[end] & F_ENTRY))
+      end++;
+    emit_fun(b, code, codelen, flags, start, end);
+    start = end;
+  }
+
+  // function table
+  abuf_str(b, "static const u32 funpc[] = {");
+  for (usize pc = 0; pc < codelen; pc++) {
+    if (flags[pc] & F_ENTRY)
+      abuf_fmt(b, " 0x%zx,", pc);
+  }
+  abuf_str(b, " };\nstatic const aotfun_t funv[] = {");
+  for (usize pc = 0; pc < codelen; pc++) {
+    if (flags[pc] & F_ENTRY)
+      abuf_fmt(b, " f_%zx,", pc);
+  }
+  abuf_str(b, " };\n\n");
+
+  // ROM image, for the data section (and so that the code matches the translation)
+  abuf_str(b, "static const u8 romimg[] ATTR_ALIGNED(RSM_ROM_ALIGN) = {");
+  const u8* img = (const u8*)rom->img;
+  for (usize i = 0; i < rom->imgsize; i++)
+    abuf_fmt(b, i % 16 ? "0x%02x," : "\n  0x%02x,", img[i]);
+  abuf_fmt(b,
+    "\n};\n\n"
+    "static const aotprog_t prog = {\n"
+    "  .romimg = (const rromimg_t*)romimg,\n"
+    "  .romsize = sizeof(romimg),\n"
+    "  .codelen = 0x%zx,\n"
+    "  .nfun = %u,\n"
+    "  .funpc = funpc,\n"
+    "  .funv = funv,\n"
+    "};\n\n"
+    "int main() {\n"
+    "  return aot_main(&prog);\n"
+    "}\n",
+    codelen, nfun);
+
+  rmem_free(ma, flagsmem);
+  return abuf_terminate(b);
+}
+
+
+usize aot_eval(T* t, u64* iregs, const rin_t* inv, usize pc) {
+  const aotprog_t* prog = t->m->s->aot;
+  aotstate_t st = { .ticks = S_PREEMPT_INTERVAL };
+  for (;;) {
+    // the epilogue (and anything else past the translated code) is interpreted
+    if UNLIKELY(pc >= prog->codelen)
+      return rsched_eval(t, iregs, inv, pc);
+
+    // find the function containing pc; funpc[0] is always 0
+    u32 lo = 0, hi = prog->nfun;
+    while (hi - lo > 1) {
+      u32 mid = lo + (hi - lo)/2;
+      if (prog->funpc[mid] <= pc) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    pc = prog->funv[lo](t, iregs, pc, &st);
+    if (st.stop)
+      return pc;
+  }
+}
+
+
+int aot_main(const aotprog_t* prog) {
+  if (!rsm_init())
+    return 1;
+
+  rmm_t* mm = rmm_create_host_vmmap(1 * GiB);
+  if (!mm) {
+    log("failed to allocate memory");
+    return 1;
+  }
+  rmachine_t* machine = rmachine_create(mm);
+  if (!machine) {
+    log("failed to create machine");
+    return 1;
+  }
+  machine->sched.aot = prog;
+
+  rrom_t rom = { .img = (rromimg_t*)prog->romimg, .imgsize = prog->romsize };
+  rerr_t err = rmachine_execrom(machine, &rom);
+  rmachine_dispose(machine);
+  if (err) {
+    log("rmachine_execrom: %s", rerr_str(err));
+    return 1;
+  }
+  return 0;
+}
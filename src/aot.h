@@ -0,0 +1,104 @@
+// ahead-of-time compiled programs
+// SPDX-License-Identifier: Apache-2.0
+//
+// rsm_emitc translates the code of a ROM to C (rsm -C prog.rom > prog.c) with one
+// C function per guest function and a label per basic block that execution can
+// enter or resume at. The generated file includes this header and is linked with
+// the rest of rsm into a native executable, e.g.
+//   cc -std=c11 -O2 -iquote rsm/src -o prog prog.c librsm.a -lpthread
+//
+// Translated code runs on the regular scheduler: memory is accessed with VM_DLOAD and
+// VM_DSTORE through M's vm_cache or the map's direct window, syscalls, stack and I/O
+// operations use the same functions as the interpreter and preemption points are at
+// the same branches and calls. Calls, returns and jumps to other functions go through
+// aot_eval, which looks up the function of the target pc. A pc without a label, e.g.
+// a computed jump into the middle of a block or the epilogue, is handed to the
+// interpreter.
+//
+#pragma once
+#include "rsmimpl.h"
+#include "sched.h"
+#include "syscall.h"
+RSM_ASSUME_NONNULL_BEGIN
+
+typedef struct {
+  u32  ticks; // branches & calls until the next preemption point
+  bool stop;  // the task stopped running (parked, preempted or exited)
+} aotstate_t;
+
+// aotfun_t is a translated guest function. It runs t from pc, a label in the
+// function, and returns the pc to continue at. Sets st->stop if t stopped running.
+typedef usize(*aotfun_t)(T* t, u64* iregs, usize pc, aotstate_t* st);
+
+// aotprog_t is a translated program, defined by the generated code
+struct aotprog_ {
+  const rromimg_t* romimg;  // ROM the program was translated from
+  usize            romsize; // size of romimg in bytes
+  usize            codelen; // number of instructions in romimg
+  u32              nfun;    // number of functions
+  const u32*       funpc;   // pc of each function, in ascending order
+  const aotfun_t*  funv;    // function of each funpc
+};
+
+// aot_main runs prog on a new machine and returns a process exit status
+int aot_main(const aotprog_t* prog);
+
+// runtime for translated code, shared with the interpreter (see sched_exec.c.)
+// pc is the pc following the instruction being executed.
+void aot_mcopy(T* t, u64* iregs, usize pc, u64 dstaddr, u64 srcaddr, u64 size);
+i64  aot_write(T* t, u64* iregs, usize pc, i64 fd, u64 srcaddr, u64 size);
+u64  aot_stkmem(T* t, u64* iregs, usize pc, i64 delta);
+void aot_push_pc(T* t, u64* iregs, usize pc);
+bool aot_syscall(T* t, u64* iregs, usize pc, u32 syscall_op);
+void aot_overflow(T* t, usize pc, rop_t op, i64 x, i64 y, i64* dst);
+void aot_shifterr(T* t, u64* iregs, usize pc, u64 exponent);
+
+// The macros below are used by generated code, where t, iregs, pc and st are the
+// parameters of the aotfun_t.
+
+// inline u64 AOT_LOAD(TYPE, u64 vaddr)
+#define AOT_LOAD(TYPE, vaddr) \
+  VM_DLOAD(TYPE, m_vm_cache(t->m, VM_PERM_R), &t->m->s->vm_map, \
+    t->m->s->vm_map.direct_base, t->m->s->vm_map.direct_size, (vaddr))
+
+// inline void AOT_STORE(TYPE, u64 vaddr, u64 value)
+#define AOT_STORE(TYPE, vaddr, value) \
+  VM_DSTORE(TYPE, m_vm_cache(t->m, VM_PERM_RW), &t->m->s->vm_map, \
+    t->m->s->vm_map.direct_base, t->m->s->vm_map.direct_size, (vaddr), (value))
+
+// inline u64 AOT_POP() pops a return address off the stack
+#define AOT_POP() ({ \
+  u64 vaddr__ = iregs[RSM_MAX_REG]; \
+  iregs[RSM_MAX_REG] = vaddr__ + 8; \
+  AOT_LOAD(u64, vaddr__); \
+})
+
+// AOT_CHECK_OVERFLOW(name OP, rop_t op, i64 x, i64 y, u64* dstptr, usize npc)
+//   OP: add, sub, mul
+#define AOT_CHECK_OVERFLOW(OP, op, x, y, dstptr, npc) \
+  if UNLIKELY(__builtin_##OP##_overflow((i64)(x), (i64)(y), (i64*)(dstptr))) \
+    aot_overflow(t, (npc), (op), (i64)(x), (i64)(y), (i64*)(dstptr))
+
+#if RSM_SAFE
+  #define AOT_CHECK_SHIFT(exponent, npc) \
+    if UNLIKELY((exponent) >= 64) aot_shifterr(t, iregs, (npc), (exponent))
+#else
+  #define AOT_CHECK_SHIFT(exponent, npc) ((void)0)
+#endif
+
+// AOT_PREEMPT is a preemption point, like PREEMPT in rsched_eval.
+// npc is the pc to resume at if t is preempted.
+#define AOT_PREEMPT(npc) \
+  if UNLIKELY(--st->ticks == 0 && (st->ticks = S_PREEMPT_INTERVAL, task_preempt(t))) \
+    return st->stop = true, (npc)
+
+// AOT_SYSCALL(u32 syscall_op, usize npc)
+#define AOT_SYSCALL(syscall_op, npc) \
+  if (!aot_syscall(t, iregs, (npc), (syscall_op))) \
+    return st->stop = true, (npc)
+
+// AOT_INTERP continues running t in the interpreter, until t stops
+#define AOT_INTERP(pc) \
+  return st->stop = true, rsched_eval(t, iregs, t->instrv, (pc))
+
+RSM_ASSUME_NONNULL_END
@@ -7,6 +7,8 @@
 #include "abuf.h"
 #include "asm.h"
 #include "sched.h"
+#include "memtrace.h"
+#include "lz4.h"
 
 // DEBUG_LOG_DATALAYOUT: define to log debug messages about data layout
 #define DEBUG_LOG_DATALAYOUT
@@ -55,6 +57,7 @@ struct gdata { // base: gnamed
   usize                initlen; // bytes at initp (initlen<=size)
   const void* nullable initp;   // pointer to initial value, if any
   u64                  addr;    // address (valid only after layout)
+  u64                  hits;    // access count from rasm_t.profile (set by layout)
   gdata* nullable      next;    // for gstate.datalist
   rnode_t*             origin;
 };
@@ -91,6 +94,12 @@ struct gfunslab {
   gfun data[8];
 };
 
+// builtin_consts are constants predefined for all assembly source.
+// Source can define constants or data with the same name to shadow them.
+static const struct { const char* name; u64 value; } builtin_consts[] = {
+  { "VDSO_ADDR", VDSO_VADDR }, // guest address of the time page (vdso_t in sched.h)
+};
+
 struct gstate {
   rasm_t* a;       // compilation session/context
   rarray  iv;      // rin_t[]; instructions
@@ -114,6 +123,8 @@ struct gstate {
   gfunslab* fnvcurr;
 
   gfun* nullable fn; // current function
+
+  gdata builtins[countof(builtin_consts)]; // see builtin_consts
 };
 
 struct gref {
@@ -173,7 +184,8 @@ static bool check_alloc(gstate* g, void* nullable p) {
       if (check_alloc(g, tmp__))                                 \
         return ERRRET;                                           \
       tmp__->len = 0;                                            \
-      tmp__->next = g->CURRFIELD;                                \
+      tmp__->next = NULL;                                        \
+      g->CURRFIELD->next = tmp__;                                \
       g->CURRFIELD = tmp__;                                      \
     }                                                            \
   }                                                              \
@@ -1248,10 +1260,23 @@ static void dlog_gdata(gdata* nullable d) {
 }
 
 static int gdata_sort(const gdata** x, const gdata** y, void* ctx) {
+  // accessed data ("hot") first, then by alignment
+  if (((*x)->hits == 0) != ((*y)->hits == 0))
+    return (*x)->hits == 0 ? 1 : -1;
   return (int)(*y)->align - (int)(*x)->align;
 }
 
-static void layout_data(gstate* g) {
+// profile_lookup returns the count of the named function or data in prof, or 0
+static u64 profile_lookup(const smap* nullable prof, const char* name, u32 namelen) {
+  if (!prof)
+    return 0;
+  uintptr* vp = smap_lookup(prof, name, namelen);
+  return vp ? (u64)*vp : 0;
+}
+
+// layout_data assigns addresses to data.
+// prof maps data names to access counts when laying out data by profile.
+static void layout_data(gstate* g, const smap* nullable prof) {
   if (g->datavcurr->len == 0) {
     g->datasize = 0;
     return;
@@ -1272,6 +1297,7 @@ static void layout_data(gstate* g) {
       gdata* d = &slab->data[i];
       if UNLIKELY(d->namedtype == GNAMED_T_CONST)
         continue; // don't include constants
+      d->hits = profile_lookup(prof, d->name, d->namelen);
       *rarray_at(gdata*, &g->dataorder, datalen++) = &slab->data[i];
     }
   }
@@ -1279,13 +1305,14 @@ static void layout_data(gstate* g) {
   if (datalen == 0)
     return;
 
-  // sort data chunks by alignment
+  // sort data chunks by alignment, hot data first
   rsm_qsort(g->dataorder.v, g->dataorder.len, sizeof(void*),
     (rsm_qsort_cmp)&gdata_sort, NULL);
 
   // align is what we will use for the "align" field in the ROMs "data" table header
-  // (note: largest alignment is g->data.v[0] after sorting)
-  g->dataalign = (*rarray_at(gdata*, &g->dataorder, 0))->align;
+  g->dataalign = 1;
+  for (u32 i = 0; i < g->dataorder.len; i++)
+    g->dataalign = MAX(g->dataalign, (*rarray_at(gdata*, &g->dataorder, i))->align);
   u64 addr = VM_ADDR_MIN;
   dlog_gdata(NULL); // header
 
@@ -1345,6 +1372,21 @@ static void report_unresolved(gstate* g) {
   }
 }
 
+static void builtins_assign(gstate* g) {
+  for (usize i = 0; i < countof(builtin_consts); i++) {
+    gdata* d = &g->builtins[i];
+    memset(d, 0, sizeof(*d));
+    d->namedtype = GNAMED_T_CONST;
+    d->name = builtin_consts[i].name;
+    d->namelen = (u32)strlen(d->name);
+    d->align = sizeof(u64);
+    d->size = sizeof(u64);
+    d->initp = &builtin_consts[i].value;
+    d->initlen = sizeof(u64);
+    names_assign(g, (gnamed*)d);
+  }
+}
+
 static gstate* nullable init_gstate(rasm_t* a) {
   gstate* g = rasm_gstate(a);
   if (!g) {
@@ -1374,9 +1416,77 @@ static gstate* nullable init_gstate(rasm_t* a) {
   }
   g->datavcurr = &g->datavhead;
   g->fnvcurr = &g->fnvhead;
+  builtins_assign(g);
   return g;
 }
 
+typedef struct {
+  rnode_t* n;
+  u64      ncalls; // from profile
+  u32      index;  // position in source
+} gfunorder;
+
+static int gfunorder_sort(const gfunorder* x, const gfunorder* y, void* ctx) {
+  if (x->ncalls != y->ncalls)
+    return x->ncalls < y->ncalls ? 1 : -1;
+  return (int)x->index - (int)y->index;
+}
+
+// genmodule_profiled generates data and then functions, ordered by number of calls.
+// The first function stays first since it is the program's entry point.
+static void genmodule_profiled(gstate* g, rnode_t* module, const smap* prof) {
+  u32 nfuns = 0;
+  for (rnode_t* cn = module->children.head; cn; cn = cn->next) {
+    if (cn->t == RT_DATA || cn->t == RT_CONST) {
+      gendata(g, cn);
+    } else {
+      nfuns++;
+    }
+  }
+  if (nfuns == 0)
+    return;
+
+  rmem_t mem = rmem_alloc(g->a->memalloc, nfuns * sizeof(gfunorder));
+  gfunorder* funv = mem.p;
+  if (check_alloc(g, funv))
+    return;
+  u32 i = 0;
+  for (rnode_t* cn = module->children.head; cn; cn = cn->next) {
+    if (cn->t == RT_DATA || cn->t == RT_CONST)
+      continue;
+    funv[i].n = cn;
+    funv[i].ncalls = profile_lookup(prof, cn->sval.p, cn->sval.len);
+    funv[i].index = i;
+    i++;
+  }
+  rsm_qsort(funv + 1, nfuns - 1, sizeof(gfunorder),
+    (rsm_qsort_cmp)&gfunorder_sort, NULL);
+
+  for (i = 0; i < nfuns; i++) {
+    dlog_datalayout("function %.*s: %llu calls",
+      (int)funv[i].n->sval.len, funv[i].n->sval.p, funv[i].ncalls);
+    genfun(g, funv[i].n);
+  }
+  rmem_free(g->a->memalloc, mem);
+}
+
+// profile_map builds a map of names to counts from a->profile
+static bool profile_map(gstate* g, smap* prof) {
+  const rprofile_t* p = assertnotnull(g->a->profile);
+  if (!smap_make(prof, g->a->memalloc, (u32)(p->func + p->datac), MAPLF_2))
+    return false;
+  for (usize i = 0; i < p->func + p->datac; i++) {
+    const rprofent_t* e = i < p->func ? &p->funv[i] : &p->datav[i - p->func];
+    uintptr* vp = smap_assign(prof, e->name, e->namelen);
+    if (!vp) {
+      smap_dispose(prof);
+      return false;
+    }
+    *vp = (uintptr)e->count;
+  }
+  return true;
+}
+
 rerr_t rasm_gen(rasm_t* a, rnode_t* module, rrom_t* rom) {
   dlog("assembling \"%s\"", a->srcname);
   assert(module->t == RT_LPAREN);
@@ -1384,8 +1494,18 @@ rerr_t rasm_gen(rasm_t* a, rnode_t* module, rrom_t* rom) {
   if UNLIKELY(g == NULL)
     return rerr_nomem;
 
+  smap profmap;
+  smap* prof = NULL;
+  if (a->profile) {
+    if (!profile_map(g, &profmap))
+      return rerr_nomem;
+    prof = &profmap;
+  }
+
   // generate data and functions
-  for (rnode_t* cn = module->children.head; cn; cn = cn->next) {
+  if (prof) {
+    genmodule_profiled(g, module, prof);
+  } else for (rnode_t* cn = module->children.head; cn; cn = cn->next) {
     if (cn->t == RT_DATA || cn->t == RT_CONST) {
       gendata(g, cn);
     } else {
@@ -1393,12 +1513,17 @@ rerr_t rasm_gen(rasm_t* a, rnode_t* module, rrom_t* rom) {
     }
   }
 
-  if UNLIKELY(rasm_stop(a) || a->errcount)
+  if UNLIKELY(rasm_stop(a) || a->errcount) {
+    if (prof)
+      smap_dispose(prof);
     return rerr_invalid;
+  }
 
   // compute data layout and resolve data references
-  layout_data(g);
+  layout_data(g, prof);
   resolve_undefined_names(g);
+  if (prof)
+    smap_dispose(prof);
 
   // report unresolved references
   report_unresolved(g);
@@ -1420,6 +1545,135 @@ rerr_t rasm_gen(rasm_t* a, rnode_t* module, rrom_t* rom) {
   return rom_build(&rb, a->memalloc, rom);
 }
 
+// profile_addrec counts the function called or data accessed by a trace record
+static void profile_addrec(
+  gstate* g, const memtrace_rec_t* rec, u64* ncallv, u64* naccessv)
+{
+  // CALL stores the return address on the stack
+  if (rec->kind == MEMTRACE_STORE && rec->pc < g->iv.len) {
+    rin_t in = *rarray_at(rin_t, &g->iv, rec->pc);
+    if (RSM_GET_OP(in) == rop_CALL && RSM_GET_i(in) && RSM_GET_Au(in) < g->iv.len) {
+      ncallv[RSM_GET_Au(in)]++;
+      return;
+    }
+  }
+
+  // find the data containing vaddr (dataorder is sorted by address after layout)
+  u32 lo = 0, hi = g->dataorder.len;
+  while (lo < hi) {
+    u32 mid = lo + (hi - lo)/2;
+    gdata* d = *rarray_at(gdata*, &g->dataorder, mid);
+    if (rec->vaddr < d->addr) {
+      hi = mid;
+    } else if (rec->vaddr - d->addr >= (u64)d->size) {
+      lo = mid + 1;
+    } else {
+      naccessv[mid]++;
+      return;
+    }
+  }
+}
+
+rerr_t rasm_profile_memtrace(
+  rasm_t* a, const void* trace, usize tracesize, rprofile_t* profile)
+{
+  gstate* g = rasm_gstate(a);
+  if (!g || g->iv.len == 0)
+    return rerr_invalid; // rasm_gen has not been called
+
+  memtrace_hdr_t hdr;
+  if (tracesize < sizeof(hdr) || memcmp(trace, MEMTRACE_MAGIC, 4) != 0)
+    return rerr_invalid;
+  memcpy(&hdr, trace, sizeof(hdr));
+  if (hdr.version != MEMTRACE_VERSION)
+    return rerr_not_supported;
+  if (hdr.data_vaddr != VM_ADDR_MIN || hdr.data_size < g->datasize)
+    return rerr_invalid; // trace is of a different program
+
+  // counters (ncallv is indexed by pc, naccessv by dataorder) and record buffer
+  usize ncallv_size = g->iv.len * sizeof(u64);
+  usize naccessv_size = g->dataorder.len * sizeof(u64);
+  usize recv_size = MEMTRACE_NREC * sizeof(memtrace_rec_t);
+  rmem_t mem = rmem_alloc(a->memalloc, ncallv_size + naccessv_size + recv_size);
+  if (!mem.p)
+    return rerr_nomem;
+  memset(mem.p, 0, ncallv_size + naccessv_size);
+  u64* ncallv = mem.p;
+  u64* naccessv = mem.p + ncallv_size;
+  memtrace_rec_t* recv = mem.p + ncallv_size + naccessv_size;
+
+  rerr_t err = 0;
+  usize offs = sizeof(hdr);
+  while (offs < tracesize) {
+    memtrace_blk_t blk;
+    if (tracesize - offs < sizeof(blk)) {
+      err = rerr_invalid;
+      goto end;
+    }
+    memcpy(&blk, trace + offs, sizeof(blk));
+    offs += sizeof(blk);
+    if (blk.zsize > tracesize - offs || blk.rawsize > recv_size) {
+      err = rerr_invalid;
+      goto end;
+    }
+    int n = LZ4_decompress_safe(
+      (const char*)trace + offs, (char*)recv, (int)blk.zsize, (int)blk.rawsize);
+    if (n != (int)blk.rawsize || n % sizeof(memtrace_rec_t)) {
+      err = rerr_invalid;
+      goto end;
+    }
+    offs += blk.zsize;
+    for (usize i = 0; i < (usize)n / sizeof(memtrace_rec_t); i++)
+      profile_addrec(g, &recv[i], ncallv, naccessv);
+  }
+
+  // count profile entries and allocate space for them
+  usize func = 0, datac = 0;
+  for (gfunslab* s = &g->fnvhead; s; s = s->next) {
+    for (usize i = 0; i < s->len; i++)
+      func += (s->data[i].i < g->iv.len && ncallv[s->data[i].i] > 0);
+  }
+  for (u32 i = 0; i < g->dataorder.len; i++)
+    datac += naccessv[i] > 0;
+  memset(profile, 0, sizeof(*profile));
+  if (func + datac == 0)
+    goto end;
+  profile->funv = rmem_alloc(a->memalloc, (func + datac) * sizeof(rprofent_t)).p;
+  if (!profile->funv) {
+    err = rerr_nomem;
+    goto end;
+  }
+  profile->datav = profile->funv + func;
+
+  for (gfunslab* s = &g->fnvhead; s; s = s->next) {
+    for (usize i = 0; i < s->len; i++) {
+      gfun* fn = &s->data[i];
+      if (fn->i < g->iv.len && ncallv[fn->i] > 0) {
+        profile->funv[profile->func++] = (rprofent_t){
+          .name = fn->name, .namelen = fn->namelen, .count = ncallv[fn->i] };
+      }
+    }
+  }
+  for (u32 i = 0; i < g->dataorder.len; i++) {
+    gdata* d = *rarray_at(gdata*, &g->dataorder, i);
+    if (naccessv[i] > 0) {
+      profile->datav[profile->datac++] = (rprofent_t){
+        .name = d->name, .namelen = d->namelen, .count = naccessv[i] };
+    }
+  }
+
+end:
+  rmem_free(a->memalloc, mem);
+  return err;
+}
+
+void rasm_profile_free(rasm_t* a, rprofile_t* profile) {
+  usize n = profile->func + profile->datac;
+  if (n > 0)
+    rmem_free(a->memalloc, RMEM(profile->funv, n * sizeof(rprofent_t)));
+  memset(profile, 0, sizeof(*profile));
+}
+
 void gstate_dispose(gstate* g) {
   rmemalloc_t* ma = g->a->memalloc;
   if (g->fn)
@@ -33,6 +33,7 @@ typedef struct {
   usize        inlen;    // number of instructions at inv
   union { usize datasize, stacktop; };  // aka
   union { usize heapbase, stackbase; }; // aka
+  u64          memmask;  // RAM address mask in masked mode (RVM_MASKED), else 0
   // memory segments
   void* mbase[M_SEG_COUNT]; // [0]=RAM, [N]=devN ... [M_SEG_COUNT-1]=invalid
   usize msize[M_SEG_COUNT];
@@ -209,8 +210,8 @@ inline static usize mbase_index(VMPARAMS, u64 addr) {
   return index;
 }
 
-// hostaddr translates a vm address to a host address
-inline static void* hostaddr(VMPARAMS, u64 align, u64 addr, vmerror ooberr) {
+// hostaddr_checked translates a vm address to a host address
+inline static void* hostaddr_checked(VMPARAMS, u64 align, u64 addr, vmerror ooberr) {
   check_loadstore(addr, align, VM_E_UNALIGNED_ACCESS, ooberr);
   addr -= VM_ADDR_MIN;
   usize index = mbase_index(VMARGS, addr);
@@ -218,9 +219,36 @@ inline static void* hostaddr(VMPARAMS, u64 align, u64 addr, vmerror ooberr) {
   return vs->mbase[index] + addr;
 }
 
+// hostaddr_masked translates a vm address to a host address in masked mode.
+// addr is wrapped into RAM; an access of N bytes at the end of RAM reaches at most
+// N-1 bytes into the guard region which follows RAM.
+inline static void* hostaddr_masked(vmstate* vs, u64 addr) {
+  return vs->mbase[0] + ((addr - VM_ADDR_MIN) & vs->memmask);
+}
+
+// hostaddr translates a vm address to a host address in either mode
+inline static void* hostaddr(VMPARAMS, u64 align, u64 addr, vmerror ooberr) {
+  if (vs->memmask)
+    return hostaddr_masked(vs, addr);
+  return hostaddr_checked(VMARGS, align, addr, ooberr);
+}
+
+// rangesize returns the number of bytes of size that can be accessed at addr.
+// In masked mode the range is truncated at the end of RAM.
+inline static u64 rangesize(vmstate* vs, u64 addr, u64 size) {
+  if (!vs->memmask)
+    return size;
+  u64 offs = (addr - VM_ADDR_MIN) & vs->memmask;
+  return MIN(size, vs->msize[0] - offs);
+}
+
+// HOSTADDR(u64 align, u64 addr, vmerror ooberr) is the address translation used by
+// LOAD and STORE. vmexec redefines it for its handlers.
+#define HOSTADDR(align, addr, ooberr) hostaddr(VMARGS, (align), (addr), (ooberr))
+
 // inline u64 LOAD(TYPE, u64 addr)
 #define LOAD(TYPE, addr) ({ u64 a__=(addr); \
-  u64 v__ = *(TYPE*)hostaddr(VMARGS, sizeof(TYPE), a__, VM_E_OOB_LOAD); \
+  u64 v__ = *(TYPE*)HOSTADDR(sizeof(TYPE), a__, VM_E_OOB_LOAD); \
   log_loadstore("LOAD  %s mem[0x%llx] => 0x%llx", #TYPE, a__, v__); \
   v__; \
 })
@@ -228,7 +256,7 @@ inline static void* hostaddr(VMPARAMS, u64 align, u64 addr, vmerror ooberr) {
 // inline void STORE(TYPE, u64 addr, u64 value)
 #define STORE(TYPE, addr, value) { u64 a__=(addr), v__=(value); \
   log_loadstore("STORE %s mem[0x%llx] <= 0x%llx", #TYPE, a__, v__); \
-  TYPE* p__ = (TYPE*)hostaddr(VMARGS, sizeof(TYPE), a__, VM_E_OOB_STORE); \
+  TYPE* p__ = (TYPE*)HOSTADDR(sizeof(TYPE), a__, VM_E_OOB_STORE); \
   *p__ = v__; \
 }
 
@@ -239,12 +267,14 @@ isize read(int fd, void* buf, usize nbyte);
 static u64 _write(VMPARAMS, u64 fd, u64 addr, u64 size) {
   // RA = write srcaddr=RB size=R(C) fd=Du
   void* src = hostaddr(VMARGS, 1, addr, VM_E_OOB_LOAD);
+  size = rangesize(vs, addr, size);
   return (u64)write((int)fd, src, (usize)size);
 }
 
 static u64 _read(VMPARAMS, u64 fd, u64 addr, u64 size) {
   // RA = read dstaddr=RB size=R(C) fd=Du
   void* dst = hostaddr(VMARGS, 1, addr, VM_E_OOB_STORE);
+  size = rangesize(vs, addr, size);
   return (u64)read((int)fd, dst, (usize)size);
 }
 
@@ -284,12 +314,14 @@ static u64 copyv(VMPARAMS, u64 n) {
 static void mcopy(VMPARAMS, u64 dstaddr, u64 srcaddr, u64 size) {
   void* dst = hostaddr(VMARGS, 1, dstaddr, VM_E_OOB_STORE);
   void* src = hostaddr(VMARGS, 1, srcaddr, VM_E_OOB_LOAD);
-  memcpy(dst, src, (usize)size);
+  size = rangesize(vs, srcaddr, rangesize(vs, dstaddr, size));
+  memmove(dst, src, (usize)size);
 }
 
 static i64 mcmp(VMPARAMS, u64 xaddr, u64 yaddr, u64 size) {
   void* x = hostaddr(VMARGS, 1, xaddr, VM_E_OOB_LOAD);
   void* y = hostaddr(VMARGS, 1, yaddr, VM_E_OOB_LOAD);
+  size = rangesize(vs, yaddr, rangesize(vs, xaddr, size));
   return (i64)memcmp(x, y, (usize)size);
 }
 
@@ -297,6 +329,12 @@ static void vmexec(VMPARAMS) {
   // This is the interpreter loop.
   // It executes instructions until the entry function returns or an error occurs.
   //
+  // Load and store ops have separate handlers for masked mode (RVM_MASKED), selected
+  // by FOREACH_MEMOP, so that neither mode checks which mode it is in for every access.
+  #define FOREACH_MEMOP(_) \
+    _(LOAD) _(LOAD4U) _(LOAD4S) _(LOAD2U) _(LOAD2S) _(LOAD1U) _(LOAD1S) \
+    _(STORE) _(STORE4) _(STORE2) _(STORE1)
+  //
   // First, we define how we will map an instruction to its corresponding handler code.
   // There are two options: using a label jump table or using a switch statement.
   #if 1 // use label jump table
@@ -331,19 +369,36 @@ static void vmexec(VMPARAMS) {
       RSM_FOREACH_OP(_)
       #undef _
     };
+    // in masked mode, use a copy of jumptab with masked load & store handlers
+    const void* jumptab_masked[countof(jumptab)];
+    const void*const* jt = jumptab;
+    if (vs->memmask) {
+      memcpy(jumptab_masked, jumptab, sizeof(jumptab));
+      #define _(OP) \
+        jumptab_masked[(rop_##OP << 1)] = &&_opm_##OP; \
+        jumptab_masked[(rop_##OP << 1)|1] = &&_opm_##OP##_i;
+      FOREACH_MEMOP(_)
+      #undef _
+      jt = jumptab_masked;
+    }
     #define DISPATCH \
       u32 ji = (RSM_GET_OP(in) << 1) | RSM_GET_i(in); \
-      assertf(jumptab[ji], "\"%s\" i=%d", rop_name(RSM_GET_OP(in)), RSM_GET_i(in)); \
-      goto *jumptab[ji];
+      assertf(jt[ji], "\"%s\" i=%d", rop_name(RSM_GET_OP(in)), RSM_GET_i(in)); \
+      goto *jt[ji];
     #define NEXT     continue;
     #define R(OP)    _op_##OP:
     #define I(OP)    _op_##OP##_i:
+    #define M(OP)    _opm_##OP: do_##OP(RC); NEXT   _opm_##OP##_i: do_##OP(RCs); NEXT
     #define DEFAULT  /* check done in DISPATCH */
+    #undef HOSTADDR
+    #define HOSTADDR(align, addr, ooberr) \
+      hostaddr_checked(VMARGS, (align), (addr), (ooberr))
   #else // use switch
     #define DISPATCH switch ((RSM_GET_OP(in) << 1) | RSM_GET_i(in))
     #define NEXT     break;
     #define R(OP)    case (rop_##OP << 1):
     #define I(OP)    case (rop_##OP << 1)|1:
+    #define M(OP)    /* masked mode is handled by hostaddr */
     #ifdef DEBUG
       #define DEFAULT default: panic("\"%s\" i=%d", rop_name(RSM_GET_OP(in)), RSM_GET_i(in));
     #else
@@ -452,11 +507,20 @@ static void vmexec(VMPARAMS) {
     RSM_FOREACH_OP(_)
     #undef _
 
+    // masked-mode load & store handlers (all memory ops are encoded as ABCs)
+    #undef HOSTADDR
+    #define HOSTADDR(align, addr, ooberr) hostaddr_masked(vs, (addr))
+    FOREACH_MEMOP(M)
+
     DEFAULT
   } // DISPATCH
   not_supported:
     panic("%s not supported by v1 interpreter", rop_name(RSM_GET_OP(in)));
   } // loop
+  #undef M
+  #undef FOREACH_MEMOP
+  #undef HOSTADDR
+  #define HOSTADDR(align, addr, ooberr) hostaddr(VMARGS, (align), (addr), (ooberr))
 }
 
 #if DEBUG
@@ -521,6 +585,11 @@ rerr_t rsm_vmexec(rvm_t* vm, rrom_t* rom, rmemalloc_t* malloc) {
     vm->ramsize = M_SEG_SIZE;
   }
 
+  // masked mode requires pow2 RAM (which adjusting rambase alignment may have undone)
+  bool masked = vm->flags & RVM_MASKED;
+  if UNLIKELY(masked && !IS_POW2(vm->ramsize))
+    return rerr_invalid;
+
   // calculate stackbase and check if we have enough memory
   usize stackbase; {
     usize stacksize = MAX(STK_MIN, (vm->ramsize - rom->datasize)/2);
@@ -539,6 +608,7 @@ rerr_t rsm_vmexec(rvm_t* vm, rrom_t* rom, rmemalloc_t* malloc) {
     .stackbase = stackbase,     // aka heapbase
     .mbase = {vm->rambase},
     .msize = {vm->ramsize},
+    .memmask = masked ? (u64)vm->ramsize - 1 : 0,
   };
 
   // initialize registers
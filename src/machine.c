@@ -3,6 +3,18 @@
 #include "rsmimpl.h"
 #include "machine.h"
 
+// MACHINE_RUN_TEST_ON_INIT: define to run tests during exe init in DEBUG builds
+#define MACHINE_RUN_TEST_ON_INIT
+
+
+// machine_mempressure is the memory pressure handler of a machine's vm_map
+static void machine_mempressure(void* ctx, u64 npages, bool hard) {
+  rmachine_t* m = ctx;
+  rmachine_mempressure_f f = m->mempressure;
+  if (f)
+    f(m, (usize)npages * PAGE_SIZE, hard, m->mempressure_userdata);
+}
+
 
 rmachine_t* nullable rmachine_create(rmm_t* mm) {
   rmemalloc_t* malloc = rmem_allocator_create(mm, 4 * MiB);
@@ -25,12 +37,16 @@ rmachine_t* nullable rmachine_create(rmm_t* mm) {
   m->mm = mm;
   m->malloc = malloc;
   m->tailmemcap = tailmemcap;
+  m->mempressure = NULL;
+  m->mempressure_userdata = NULL;
 
   rerr_t err = rsched_init(&m->sched, m);
   if UNLIKELY(err) {
     log("rsched_init failed: %s", rerr_str(err));
     goto error;
   }
+  m->sched.vm_map.pressure = machine_mempressure;
+  m->sched.vm_map.pressure_ctx = m;
 
   return m;
 
@@ -47,8 +63,520 @@ rerr_t rmachine_execrom(rmachine_t* m, rrom_t* rom) {
 }
 
 
+rerr_t rmachine_load(rmachine_t* m, rrom_t* rom) {
+  return rsched_load(&m->sched, rom);
+}
+
+
+rerr_t rmachine_run_for(rmachine_t* m, u64 budget_ns, rrunresult_t* result) {
+  return rsched_run_for(&m->sched, budget_ns, result);
+}
+
+
 void rmachine_dispose(rmachine_t* m) {
   rsched_dispose(&m->sched);
+  #ifdef RSM_STATS
+    rmemstats_t st;
+    rmem_stats(m->malloc, &st);
+    statlog("malloc: resize %zu grown in place, %zu shrunk in place, %zu promoted, %zu copied;"
+      " %zu large allocations",
+      st.resize_grow, st.resize_shrink, st.resize_promote, st.resize_copy, st.large_alloc);
+  #endif
   rmem_allocator_free(m->malloc);
 }
 
+
+void rmachine_set_memlimit(rmachine_t* m, usize soft, usize hard) {
+  vm_map_t* map = &m->sched.vm_map;
+  AtomicStore(&map->soft_limit, IDIV_CEIL((u64)soft, PAGE_SIZE), memory_order_relaxed);
+  AtomicStore(&map->hard_limit, IDIV_CEIL((u64)hard, PAGE_SIZE), memory_order_relaxed);
+}
+
+
+void rmachine_set_mempressure(
+  rmachine_t* m, rmachine_mempressure_f nullable f, void* nullable userdata)
+{
+  m->mempressure = f;
+  m->mempressure_userdata = userdata;
+}
+
+
+usize rmachine_memusage(rmachine_t* m) {
+  return (usize)AtomicLoad(&m->sched.vm_map.npages, memory_order_relaxed) * PAGE_SIZE;
+}
+
+
+usize rmachine_compact(rmachine_t* m) {
+  vm_map_t* map = &m->sched.vm_map;
+  vm_map_lock(map);
+  usize nbyte = vm_map_compact(map);
+  vm_map_unlock(map);
+  return nbyte;
+}
+
+
+rerr_t rmachine_set_directvm(rmachine_t* m, unsigned addrbits) {
+  vm_map_t* map = &m->sched.vm_map;
+  vm_map_lock(map);
+  rerr_t err = vm_map_direct_init(map, addrbits);
+  vm_map_unlock(map);
+  return err;
+}
+
+
+rerr_t rmachine_set_faultaround(rmachine_t* m, unsigned npages) {
+  if (npages && !IS_POW2(npages))
+    return rerr_invalid;
+  vm_map_t* map = &m->sched.vm_map;
+  vm_map_lock(map);
+  map->faultaround = npages;
+  vm_map_unlock(map);
+  return 0;
+}
+
+
+rerr_t rmachine_set_memtrace(rmachine_t* m, int fd) {
+  return memtrace_open(&m->sched, fd);
+}
+
+
+void rmachine_set_taskbudget(rmachine_t* m, const rtaskbudget_t* budget) {
+  m->sched.taskbudget = *budget;
+}
+
+
+rerr_t rmachine_task_setbudget(rmachine_t* m, u64 tid, const rtaskbudget_t* budget) {
+  return rsched_taskbudget(&m->sched, tid, budget, NULL);
+}
+
+
+rerr_t rmachine_task_usage(rmachine_t* m, u64 tid, rtaskusage_t* usage) {
+  return rsched_taskbudget(&m->sched, tid, NULL, usage);
+}
+
+
+//————————————————————————————————————————————————————————————————————————————————————
+#if defined(MACHINE_RUN_TEST_ON_INIT) && DEBUG && !defined(RSM_NO_ASM)
+
+
+// test_compile assembles source text src into rom
+static void test_compile(rmemalloc_t* ma, const char* src, rrom_t* rom) {
+  rasm_t a = {
+    .memalloc = ma,
+    .srcname = "test",
+    .srcdata = src,
+    .srclen = strlen(src),
+  };
+  rnode_t* mod = assertnotnull(rasm_parse(&a));
+  assertf(a.errcount == 0, "%s", a.diag.msg);
+  *rom = (rrom_t){0};
+  assert(rasm_gen(&a, mod, rom) == 0);
+  // note: the AST is freed with ma (rasm_gen modifies it)
+}
+
+
+// test_run runs the program loaded into m until it exits; returns its error
+static rerr_t test_run(rmachine_t* m) {
+  rrunresult_t r;
+  do {
+    assert(rmachine_run_for(m, 1000000000, &r) == 0);
+    if (r.state == RRUN_BLOCKED)
+      rsm_nanosleep(r.timeout);
+  } while (r.state != RRUN_EXITED);
+  return r.err;
+}
+
+
+// test_taskbudget checks that a task's budget is enforced even when the guest
+// scribbles over its stack; the budget lives in host memory, out of its reach.
+static void test_taskbudget(rmm_t* mm, rmemalloc_t* ma) {
+  // scribbles over its stack, then stores to the guard page below it,
+  // which grows the stack (assumes a STK_DEFAULT main stack)
+  rrom_t rom;
+  test_compile(ma,
+    "fun main() {\n"
+    "  R1 = 0xdead\n"
+    "  R2 = SP - 8    ; store R1 R2 0\n"
+    "  R2 = SP - 4096 ; store R1 R2 0\n"
+    "  R2 = 0x100000\n"
+    "  R2 = SP - R2   ; store R1 R2 0\n"
+    "  R0 = 0\n"
+    "}\n", &rom);
+  static_assert(STK_DEFAULT == 0x100000, "update test program");
+
+  // a stack budget which allows no growth
+  rtaskbudget_t budget = { .stacksize = PAGE_SIZE };
+  rrunresult_t r;
+  rtaskusage_t usage;
+  for (int raise = 0; raise < 2; raise++) {
+    rmachine_t* m = assertnotnull(rmachine_create(mm));
+    rmachine_set_taskbudget(m, &budget);
+    assert(rmachine_load(m, &rom) == 0);
+
+    // a zero budget returns before running any task
+    assert(rmachine_run_for(m, 0, &r) == 0);
+    assert(r.state == RRUN_BUDGET);
+    assert(rmachine_task_usage(m, 0, &usage) == 0);
+    assertf(usage.stacksize == STK_DEFAULT, "%llu", usage.stacksize);
+    assert(!usage.overbudget);
+    assert(rmachine_task_usage(m, 1, &usage) == rerr_not_found);
+
+    if (raise) {
+      rtaskbudget_t unlimited = {0};
+      assert(rmachine_task_setbudget(m, 0, &unlimited) == 0);
+      rerr_t err = test_run(m);
+      assertf(err == 0, "%s", rerr_str(err));
+    } else {
+      rerr_t err = test_run(m);
+      assertf(err == rerr_nomem, "%s", rerr_str(err));
+    }
+    rmachine_dispose(m);
+  }
+
+  rsm_freerom(&rom, ma);
+}
+
+
+// test_budgetkill checks that a task which is already over its CPU budget is
+// terminated once its budget is changed to kill
+static void test_budgetkill(rmm_t* mm, rmemalloc_t* ma) {
+  // spins forever
+  rrom_t rom;
+  test_compile(ma,
+    "fun main() {\n"
+    "loop:\n"
+    "  jump loop\n"
+    "}\n", &rom);
+
+  rtaskbudget_t budget = { .cputime = 1 };
+  rrunresult_t r;
+  rtaskusage_t usage;
+  rmachine_t* m = assertnotnull(rmachine_create(mm));
+  rmachine_set_taskbudget(m, &budget);
+  assert(rmachine_load(m, &rom) == 0);
+
+  // the task goes over budget and is deprioritized
+  assert(rmachine_run_for(m, 1000000, &r) == 0);
+  assert(r.state == RRUN_BUDGET);
+  assert(rmachine_task_usage(m, 0, &usage) == 0);
+  assert(usage.overbudget);
+
+  budget.kill = true;
+  assert(rmachine_task_setbudget(m, 0, &budget) == 0);
+  rerr_t err = test_run(m);
+  assertf(err == rerr_canceled, "%s", rerr_str(err));
+
+  rmachine_dispose(m);
+  rsm_freerom(&rom, ma);
+}
+
+
+// test_runstate checks the states of rmachine_run_for, and that a machine can run
+// another program after one has exited, either way
+static void test_runstate(rmm_t* mm, rmemalloc_t* ma) {
+  // sleeps for 1ms
+  rrom_t rom;
+  test_compile(ma,
+    "fun main() {\n"
+    "  R0 = 1000000\n"
+    "  syscall 1\n"
+    "  R0 = 0\n"
+    "}\n", &rom);
+
+  rmachine_t* m = assertnotnull(rmachine_create(mm));
+  rrunresult_t r;
+  for (int i = 0; i < 2; i++) {
+    assertf(rmachine_load(m, &rom) == 0, "load #%d", i+1);
+    assert(rmachine_load(m, &rom) == rerr_exists);
+
+    assert(rmachine_run_for(m, 0, &r) == 0);
+    assert(r.state == RRUN_BUDGET);
+
+    assert(rmachine_run_for(m, 1000000000, &r) == 0);
+    assertf(r.state == RRUN_BLOCKED, "%d", r.state);
+    assertf(r.timeout > 0 && r.timeout <= 1000000, "%llu", r.timeout);
+
+    rsm_nanosleep(r.timeout);
+    do {
+      assert(rmachine_run_for(m, 1000000000, &r) == 0);
+    } while (r.state == RRUN_BLOCKED);
+    assertf(r.state == RRUN_EXITED, "%d", r.state);
+    assertf(r.err == 0, "%s", rerr_str(r.err));
+
+    // all of the program's memory has been released
+    assertf(rmachine_memusage(m) == 0, "%zu", rmachine_memusage(m));
+    assert(rmachine_run_for(m, 0, &r) == rerr_invalid);
+  }
+
+  // the machine can also run programs to completion on its own
+  for (int i = 0; i < 2; i++) {
+    rerr_t err = rmachine_execrom(m, &rom);
+    assertf(err == 0, "execrom #%d: %s", i+1, rerr_str(err));
+    assertf(rmachine_memusage(m) == 0, "%zu", rmachine_memusage(m));
+  }
+  assert(rmachine_load(m, &rom) == 0);
+  assert(test_run(m) == 0);
+
+  // with fault-around disabled, and with a window larger than the cache
+  assert(rmachine_set_faultaround(m, 3) == rerr_invalid);
+  for (u32 i = 0; i < 2; i++) {
+    assert(rmachine_set_faultaround(m, i ? 4096 : 0) == 0);
+    assert(rmachine_load(m, &rom) == 0);
+    assert(test_run(m) == 0);
+    assertf(rmachine_memusage(m) == 0, "%zu", rmachine_memusage(m));
+  }
+  rmachine_dispose(m);
+
+  // with a direct window (not supported on all hosts)
+  m = assertnotnull(rmachine_create(mm));
+  if (rmachine_set_directvm(m, 30) == 0) {
+    for (int i = 0; i < 2; i++) {
+      assertf(rmachine_load(m, &rom) == 0, "load #%d", i+1);
+      assert(test_run(m) == 0);
+      assertf(rmachine_memusage(m) == 0, "%zu", rmachine_memusage(m));
+    }
+
+    // a store to the guard page grows the stack; the value stored by the faulting
+    // access is in place after the fault is completed (assumes a STK_DEFAULT stack)
+    rsm_freerom(&rom, ma);
+    test_compile(ma,
+      "fun main() {\n"
+      "  R1 = 0x100000\n"
+      "  R1 = SP - R1 ; store R1 R1 0\n"
+      "  R2 = load R1 0\n"
+      "  R2 = R2 - R1\n"
+      "  ifz R2 ok\n"
+      "  R1 = 0x7fffffffffffffff\n"
+      "  R1 = adds R1 1 // fail\n"
+      "ok:\n"
+      "  R0 = 0\n"
+      "}\n", &rom);
+    assert(rmachine_load(m, &rom) == 0);
+    rerr_t err = test_run(m);
+    assertf(err == 0, "%s", rerr_str(err));
+    assertf(rmachine_memusage(m) == 0, "%zu", rmachine_memusage(m));
+  }
+  rmachine_dispose(m);
+
+  rsm_freerom(&rom, ma);
+}
+
+
+typedef struct {
+  u32  nsoft, nhard;
+  bool raise; // lift the limit when it's hit
+} test_pressure_t;
+
+static void test_pressure(rmachine_t* m, usize usage, bool hard, void* userdata) {
+  test_pressure_t* tp = userdata;
+  if (!hard) {
+    tp->nsoft++;
+    return;
+  }
+  tp->nhard++;
+  if (tp->raise)
+    rmachine_set_memlimit(m, 0, 0);
+}
+
+
+// test_memlimit checks that rmachine_set_memlimit limits a program's memory
+static void test_memlimit(rmm_t* mm, rmemalloc_t* ma) {
+  // touches a page of its stack which is backed on demand
+  rrom_t rom;
+  test_compile(ma,
+    "fun main() {\n"
+    "  R1 = 0x10000\n"
+    "  R1 = SP - R1 ; store R1 R1 0\n"
+    "  R0 = 0\n"
+    "}\n", &rom);
+
+  // without and with a direct window, where faults at the limit are completed
+  // after the signal handler returns (see vm_direct_complete)
+  for (int direct = 0; direct < 2; direct++) {
+    rmachine_t* m = assertnotnull(rmachine_create(mm));
+    if (direct && rmachine_set_directvm(m, 30)) {
+      rmachine_dispose(m);
+      break;
+    }
+    test_pressure_t tp = {0};
+    rmachine_set_mempressure(m, test_pressure, &tp);
+
+    // too little memory to load the program
+    rmachine_set_memlimit(m, 0, PAGE_SIZE);
+    assert(rmachine_load(m, &rom) == rerr_nomem);
+    assert(rmachine_memusage(m) == 0);
+    assert(tp.nhard == 1);
+
+    // enough memory to load the program, but not to run it
+    rmachine_set_memlimit(m, 0, 0);
+    assert(rmachine_load(m, &rom) == 0);
+    usize usage = rmachine_memusage(m);
+    rmachine_set_memlimit(m, 0, usage);
+    rerr_t err = test_run(m);
+    assertf(err == rerr_nomem, "%s", rerr_str(err));
+    assert(tp.nhard == 2);
+
+    // the pressure callback raises the limit
+    rmachine_set_memlimit(m, 0, 0);
+    assert(rmachine_load(m, &rom) == 0);
+    rmachine_set_memlimit(m, 0, usage);
+    tp.raise = true;
+    err = test_run(m);
+    assertf(err == 0, "%s", rerr_str(err));
+    assert(tp.nhard == 3);
+
+    // crossing the soft limit
+    assert(tp.nsoft == 0);
+    assert(rmachine_load(m, &rom) == 0);
+    rmachine_set_memlimit(m, usage + PAGE_SIZE, 0);
+    err = test_run(m);
+    assertf(err == 0, "%s", rerr_str(err));
+    assert(tp.nsoft == 1);
+
+    rmachine_dispose(m);
+  }
+
+  rsm_freerom(&rom, ma);
+}
+
+
+// test_spawnexit checks that the stacks of exited tasks don't accumulate; they are
+// either reused by tasks spawned later or unmapped
+static void test_spawnexit(rmm_t* mm, rmemalloc_t* ma) {
+  // main spawns 200 workers, one at a time, sleeping 100us in between.
+  // Every other worker grows its stack
+  // (see test_taskbudget.)
+  rrom_t rom;
+  test_compile(ma,
+    "fun main() {\n"
+    "  R8 = 200\n"
+    "loop:\n"
+    "  R0 = R8 & 1\n"
+    "  tspawn worker\n"
+    "  R0 = 100000 ; syscall 1\n"
+    "  R8 = R8 - 1\n"
+    "  if R8 loop\n"
+    "  R0 = 0\n"
+    "}\n"
+    "fun worker(grow i64) {\n"
+    "  R1 = SP - 8 ; store R0 R1 0\n"
+    "  ifz R0 end\n"
+    "  R1 = 0x100000\n"
+    "  R1 = SP - R1 ; store R0 R1 0\n"
+    "end:\n"
+    "  R0 = 0\n"
+    "}\n", &rom);
+  static_assert(STK_DEFAULT == 0x100000, "update test program");
+
+  rmachine_t* m = assertnotnull(rmachine_create(mm));
+  assert(rmachine_load(m, &rom) == 0);
+
+  // memory usage is the same whenever main sleeps, give or take a few pages
+  rrunresult_t r;
+  usize usage0 = 0;
+  u32 n = 0;
+  for (;; n++) {
+    assert(rmachine_run_for(m, 1000000000, &r) == 0);
+    if (r.state == RRUN_EXITED)
+      break;
+    assertf(r.state == RRUN_BLOCKED, "%d", r.state);
+    usize usage = rmachine_memusage(m);
+    if (n == 1)
+      usage0 = usage;
+    assertf(n < 2 || usage <= usage0 + 4*PAGE_SIZE,
+      "round %u: %zu > %zu", n, usage, usage0);
+    rsm_nanosleep(r.timeout);
+  }
+  assertf(n >= 10, "%u", n); // enough samples
+  assertf(r.err == 0, "%s", rerr_str(r.err));
+  assertf(rmachine_memusage(m) == 0, "%zu", rmachine_memusage(m));
+
+  rmachine_dispose(m);
+  rsm_freerom(&rom, ma);
+}
+
+
+// test_ksm_cow checks that a task on one M sees a store by a task on another M to
+// a deduplicated page, which gives the page a new translation (vm_ksm_cow)
+static void test_ksm_cow(rmm_t* mm, rmemalloc_t* ma) {
+  // main zeroes two stack pages A and B and sleeps while the host merges them.
+  // A reader task then loads from A, caching the translation of the shared page,
+  // until main's store to A shows up; it gives up (panics) after a while.
+  rrom_t rom;
+  test_compile(ma,
+    "fun main() {\n"
+    "  R8 = 0x10000\n"
+    "  R8 = SP - R8\n"
+    "  R8 = shru R8 12\n"
+    "  R8 = shl R8 12    // page A\n"
+    "  R1 = 0\n"
+    "  store R1 R8 0\n"
+    "  R2 = R8 - 4096 ; store R1 R2 0 // page B\n"
+    "  R0 = 1000000 ; syscall 1\n"
+    "  R0 = R8\n"
+    "  tspawn reader\n"
+    "  R0 = 1000000 ; syscall 1\n"
+    "  R1 = 1 ; store R1 R8 0\n"
+    "wait:\n"
+    "  R0 = 1000000 ; syscall 1\n"
+    "  R1 = load R8 8\n"
+    "  ifz R1 wait\n"
+    "  R0 = 0\n"
+    "}\n"
+    "fun reader(addr i64) {\n"
+    "  R1 = 0x1000000\n"
+    "loop:\n"
+    "  R2 = load R0 0\n"
+    "  if R2 done\n"
+    "  R1 = R1 - 1\n"
+    "  if R1 loop\n"
+    "  R1 = 0x7fffffffffffffff\n"
+    "  R1 = adds R1 1    // panic\n"
+    "done:\n"
+    "  store R2 R0 8\n"
+    "}\n", &rom);
+
+  assert(rmm_ksm_enable(mm) == 0);
+  rmachine_t* m = assertnotnull(rmachine_create(mm));
+  assert(rmachine_load(m, &rom) == 0);
+
+  rrunresult_t r;
+  assert(rmachine_run_for(m, 1000000000, &r) == 0);
+  assert(r.state == RRUN_BLOCKED);
+  rmm_ksm_scan(mm); // clears the pages' written flags
+  usize saved = rmm_ksm_scan(mm);
+  assertf(saved >= PAGE_SIZE, "%zu", saved);
+
+  rerr_t err = test_run(m);
+  assertf(err == 0, "%s", rerr_str(err));
+
+  rmachine_dispose(m);
+  rsm_freerom(&rom, ma);
+}
+
+
+static void test_rmachine() {
+  dlog("%s", __FUNCTION__);
+  rmm_t* mm = assertnotnull(rmm_create_host_vmmap(64 * MiB));
+  rmemalloc_t* ma = assertnotnull(rmem_allocator_create(mm, 4 * MiB));
+
+  test_taskbudget(mm, ma);
+  test_budgetkill(mm, ma);
+  test_runstate(mm, ma);
+  test_memlimit(mm, ma);
+  test_spawnexit(mm, ma);
+  test_ksm_cow(mm, ma); // last; enables deduplication for mm
+
+  rmem_allocator_free(ma);
+  rmm_dispose(mm);
+  dlog("—— end %s", __FUNCTION__);
+}
+#endif // MACHINE_RUN_TEST_ON_INIT
+
+
+rerr_t init_machine() {
+  #if defined(MACHINE_RUN_TEST_ON_INIT) && DEBUG && !defined(RSM_NO_ASM)
+  test_rmachine();
+  #endif
+  return 0;
+}
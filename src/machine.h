@@ -10,6 +10,9 @@ struct rmachine_ {
   rmemalloc_t* malloc; // memory allocator
   rsched_t     sched;  // scheduler
 
+  rmachine_mempressure_f nullable mempressure; // see rmachine_set_mempressure
+  void* nullable                  mempressure_userdata;
+
   // remaining free memory (tail of page-aligned rmachine_t)
   u16 tailmemcap; static_assert(PAGE_SIZE <= U16_MAX, "");
   u8 tailmem[];
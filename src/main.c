@@ -6,15 +6,23 @@
   #include <stdio.h>
   #include <stdlib.h>
   #include <unistd.h>
+  #include <fcntl.h>
+  #include <errno.h>
 #endif
 
 static const char* prog = ""; // argv[0]
 static const char* outfile = NULL;
 static bool opt_run = false;
 static bool opt_print_asm = false;
+static bool opt_emit_c = false;
 static bool opt_print_debug = false;
 static bool opt_newexec = false;
 static bool opt_nocompress = false;
+static bool opt_masked = false;
+static u32  opt_directvm = 0; // address bits of direct window (0 = off)
+static i64  opt_faultaround = -1; // pages per translation-cache miss (-1 = default)
+static const char* opt_memtrace = NULL; // file to write memory-access trace to
+static const char* opt_profile = NULL; // memory-access trace to lay out code & data by
 static usize vm_ramsize = 1024*1024;
 
 #define errmsg(fmt, args...) fprintf(stderr, "%s: " fmt "\n", prog, ##args)
@@ -85,9 +93,15 @@ static void usage() {
     "  -h           Show help and exit\n"
     "  -r           Run the program (implied unless -o or -p are set)\n"
     "  -p           Print assembly on stdout\n"
+    "  -C           Print program translated to C on stdout (see src/aot.h)\n"
     "  -d           Print timing and register state on stdout at end\n"
     "  -X           Run new experimental execution engine\n"
     "  -Z           Disable ROM compression (only effective with -o)\n"
+    "  -M           Mask memory addresses instead of checking them (-m must be pow2)\n"
+    "  -V <bits>    Back guest memory [0, 2^<bits>) directly with host memory (-X)\n"
+    "  -F <npages>  Resolve <npages> pages per memory translation miss (-X, pow2)\n"
+    "  -T <file>    Write memory-access trace to <file> (-X, needs SCHED_MEMTRACE)\n"
+    "  -P <file>    Lay out code & data using a trace written by -T (source input only)\n"
     "  -R<N>=<val>  Initialize register R<N> to <val> (e.g. -R0=4, -R3=0xff)\n"
     "  -m <nbytes>  Set VM memory to <nbytes> (default: %zu)\n"
     "  -o <file>    Write compiled ROM to <file>\n"
@@ -98,6 +112,7 @@ static void usage() {
     "  %s -R1=6 examples/factorial.rsm     # compile & run\n"
     "  %s -o compiled.rom source.rsm       # compile & save\n"
     "  %s compiled.rom                     # run precompiled ROM\n"
+    "  %s -C compiled.rom > prog.c         # translate ROM to C\n"
     "  echo 'fun main() { R0=123; }' | %s  # compile & run stdin\n"
     ,prog
     ,vm_ramsize
@@ -105,6 +120,7 @@ static void usage() {
     ,prog
     ,prog
     ,prog
+    ,prog
   );
 }
 
@@ -113,21 +129,31 @@ static int parse_cli_opts(int argc, char*const* argv, u64* iregs) {
   extern char* optarg; // global state in libc... coolcoolcool
   extern int optind, optopt;
   int nerrs = 0;
-  for (int c; (c = getopt(argc, argv, ":hrpdXZR:o:m:")) != -1;) switch(c) {
+  for (int c; (c = getopt(argc, argv, ":hrpCdXZMR:o:m:V:F:T:P:")) != -1;) switch(c) {
     case 'h': usage(); exit(0);
     case 'r': opt_run = true; break;
     case 'p': opt_print_asm = true; break;
+    case 'C': opt_emit_c = true; break;
     case 'd': opt_print_debug = true; break;
     case 'X': opt_newexec = true; break;
     case 'Z': opt_nocompress = true; break;
+    case 'M': opt_masked = true; break;
     case 'R': nerrs += setreg(iregs, optarg); break;
     case 'o': outfile = optarg; break;
     case 'm': nerrs += parse_bytesize_opt(optopt, optarg, &vm_ramsize); break;
+    case 'V': opt_directvm = (u32)strtoul(optarg, NULL, 10); break;
+    case 'F': opt_faultaround = (i64)strtoul(optarg, NULL, 10); break;
+    case 'T': opt_memtrace = optarg; break;
+    case 'P': opt_profile = optarg; break;
     case ':': errmsg("option -%c requires a value", optopt); nerrs++; break;
     case '?': errmsg("unrecognized option -%c", optopt); nerrs++; break;
   }
+  if (opt_masked && !IS_POW2(vm_ramsize)) {
+    errmsg("-m must be a power of two with -M");
+    nerrs++;
+  }
   if (nerrs) exit(1);
-  if (!outfile && !opt_print_asm) opt_run = true;
+  if (!outfile && !opt_print_asm && !opt_emit_c) opt_run = true;
   return optind;
 }
 
@@ -200,6 +226,23 @@ static void print_asm(rmemalloc_t* ma, const rin_t* iv, usize icount) {
   rmem_free(ma, m);
 }
 
+static bool emit_c(rmemalloc_t* ma, const rrom_t* rom) {
+  rmem_t m = rmem_must_alloc(ma, 64*KiB);
+  usize n = rsm_emitc(m.p, m.size, rom, ma);
+  if (n != USIZE_MAX && n >= m.size) {
+    rmem_must_resize(ma, &m, n + 1);
+    n = rsm_emitc(m.p, m.size, rom, ma);
+  }
+  if (n == USIZE_MAX) {
+    errmsg("failed to allocate memory");
+    rmem_free(ma, m);
+    return false;
+  }
+  fwrite(m.p, n, 1, stdout);
+  rmem_free(ma, m);
+  return true;
+}
+
 static void print_regstate_x64(bool pad, u64 v) {
   int w = ( // (OMG I'm ashamed of this "shitty log16" code...)
     v > 0xfffffffffffffff ? 16 : v > 0xffffffffffffff ? 15 :
@@ -236,8 +279,12 @@ static void print_regstate(u64* iregs) {
   printf("\n");
 }
 
+static bool diag_nowarn = false; // don't print warnings
+
 static bool diaghandler(const rdiag_t* d, void* userdata) {
   // called by the compiler when an error occurs
+  if (d->code == 0 && diag_nowarn)
+    return true;
   fwrite(d->msg, strlen(d->msg), 1, stderr);
   putc('\n', stderr);
   if (d->code > 0 && d->srclines[0]) {
@@ -247,6 +294,45 @@ static bool diaghandler(const rdiag_t* d, void* userdata) {
   return d->code == 0; // continue on warning, stop on error
 }
 
+// relayout assembles a's source again, with code & data laid out by a profile of
+// rom's program, derived from the memory-access trace at opt_profile.
+static bool relayout(rasm_t* a, rrom_t* rom) {
+  rmem_t trace;
+  rerr_t err = rsm_loadfile(opt_profile, &trace);
+  if (err) {
+    errmsg("%s: %s", opt_profile, rerr_str(err));
+    return false;
+  }
+  rprofile_t profile;
+  err = rasm_profile_memtrace(a, trace.p, trace.size, &profile);
+  rsm_unloadfile(trace);
+  if (err) {
+    errmsg("-P %s: %s", opt_profile, rerr_str(err));
+    return false;
+  }
+  dlog("profile: %zu functions called, %zu data accessed", profile.func, profile.datac);
+
+  // the AST is modified by rasm_gen, so parse the source again
+  rnode_t* mod = rasm_parse(a);
+  if UNLIKELY(mod == NULL) {
+    errmsg("failed to allocate memory for parser");
+    rasm_profile_free(a, &profile);
+    return false;
+  }
+  rsm_freerom(rom, a->memalloc);
+  a->profile = &profile;
+  diag_nowarn = true; // already reported
+  err = rasm_gen(a, mod, rom);
+  diag_nowarn = false;
+  a->profile = NULL;
+  rasm_profile_free(a, &profile);
+  if (err) {
+    errmsg("(rasm_gen) %s", rerr_str(err));
+    return false;
+  }
+  return true;
+}
+
 static bool compile(
   rmemalloc_t* ma, const char* nullable srcfile, rmem_t srcdata, rrom_t* rom)
 {
@@ -276,6 +362,9 @@ static bool compile(
     return false;
   }
 
+  if (opt_profile && !relayout(&a, rom))
+    return false;
+
   if (outfile) {
     dlog("writing ROM to %s (%zu B)", outfile, rom->imgsize);
     rerr_t err = writefile(outfile, 0777, rom->img, rom->imgsize);
@@ -334,6 +423,12 @@ int main(int argc, char*const* argv) {
     print_asm(ma, rom.code, rom.codelen);
   }
 
+  if (opt_emit_c) {
+    loadrom(&rom, ma);
+    if (!emit_c(ma, &rom))
+      return 1;
+  }
+
   if (!opt_run)
     return 0;
 
@@ -343,20 +438,51 @@ int main(int argc, char*const* argv) {
   if (opt_newexec) {
 
     rmachine_t* machine = safechecknotnull( rmachine_create(mm) );
+    if (opt_directvm) {
+      rerr_t err2 = rmachine_set_directvm(machine, opt_directvm);
+      if (err2) {
+        errmsg("-V %u: %s", opt_directvm, rerr_str(err2));
+        return 1;
+      }
+    }
+    if (opt_faultaround >= 0) {
+      rerr_t err2 = rmachine_set_faultaround(machine, (unsigned)opt_faultaround);
+      if (err2) {
+        errmsg("-F %lld: %s", opt_faultaround, rerr_str(err2));
+        return 1;
+      }
+    }
+    int tracefd = -1;
+    if (opt_memtrace) {
+      tracefd = open(opt_memtrace, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+      if (tracefd < 0) {
+        errmsg("%s: %s", opt_memtrace, rerr_str(rerr_errno(errno)));
+        return 1;
+      }
+      rerr_t err2 = rmachine_set_memtrace(machine, tracefd);
+      if (err2) {
+        errmsg("-T %s: %s", opt_memtrace, rerr_str(err2));
+        return 1;
+      }
+    }
     rerr_t err2 = rmachine_execrom(machine, &rom);
     if (err2) {
       errmsg("rmachine_execrom: %s", rerr_str(err2));
       return 1;
     }
     rmachine_dispose(machine);
+    if (tracefd > -1)
+      close(tracefd);
 
   // —————————————— old execution engine ——————————————
   } else {
     loadrom(&rom, ma);
 
-    // allocate memory and execute program
+    // allocate memory (plus guard region in masked mode) and execute program
     vm.ramsize = vm_ramsize;
-    vm.rambase = osvmem_alloc(vm_ramsize);
+    vm.rambase = osvmem_alloc(vm_ramsize + (opt_masked ? RVM_GUARD_SIZE : 0));
+    if (opt_masked)
+      vm.flags |= RVM_MASKED;
     if UNLIKELY(vm.rambase == NULL) {
       errmsg("failed to allocate %zu B of memory", vm_ramsize);
       return 1;
@@ -17,6 +17,11 @@
 // When no space is found for an allocation request in a subheap, another
 // subheap is allocated and added to the subheaps list.
 //
+// Allocations of LARGE_MIN_SIZE or more bytes bypass the subheaps and are made
+// directly from the memory manager as runs of pages ("large" allocations.)
+// They are tracked in the allocator's "large" list and their pages are returned
+// to the memory manager as soon as they are freed.
+//
 
 // RMEM_TRACE: define to enable logging a lot of info via dlog
 //#define RMEM_TRACE
@@ -75,6 +80,14 @@
 static_assert(IS_ALIGN2(SLABHEAP_BLOCK_SIZE, PAGE_SIZE), "");
 static_assert(SLABHEAP_COUNT > 0, "undef RMEM_SLABHEAP_ENABLE instead");
 
+// RMEM_LARGE_MIN_SIZE: allocations of at least this many bytes are made directly from
+// the memory manager, if the allocator has one.
+#ifndef RMEM_LARGE_MIN_SIZE
+  #define RMEM_LARGE_MIN_SIZE  (SLABHEAP_BLOCK_SIZE * 4)
+#endif
+#define LARGE_MIN_SIZE  ((usize)RMEM_LARGE_MIN_SIZE)
+static_assert(LARGE_MIN_SIZE % PAGE_SIZE == 0, "");
+
 #define HEAP_MIN_SIZE  (CHUNK_SIZE*2)
 #define HEAP_ALIGN     CHUNK_SIZE
 // HEAP_MAX_ALIGN: maximum alignment factor that heap_alloc can handle
@@ -141,6 +154,12 @@ typedef struct {
   ilist_t list_entry;
 } subheap_t;
 
+typedef struct {
+  ilist_t list_entry;
+  void*   p;
+  usize   npages; // pow2
+} largealloc_t;
+
 typedef struct slabchunk_ {
   struct slabchunk_* nullable next;
 } slabchunk_t;
@@ -171,6 +190,10 @@ typedef struct rmemalloc_ {
   slabheap_t slabheaps[SLABHEAP_COUNT];
   #endif
 
+  ilist_t large; // large allocations (largealloc_t)
+
+  rmemstats_t stats;
+
   DEBUG_ID_FIELD(next_heap_debug_id)
 } rmemalloc_t;
 
@@ -470,6 +493,44 @@ static void heap_free(heap_t* h, void* ptr, usize size) {
 }
 
 
+// heap_grow attempts to grow the allocation at ptr from oldsize to newsize bytes
+// by claiming the chunks that immediately follow it.
+// Returns false if any of those chunks are in use or beyond the end of the heap.
+static bool heap_grow(heap_t* h, void* ptr, usize oldsize, usize newsize) {
+  assert(heap_contains(h, ptr, oldsize));
+  assert(newsize > oldsize);
+  uintptr chunk_index = ((uintptr)ptr - (uintptr)h->chunks) / CHUNK_SIZE;
+  usize start = chunk_index + (oldsize / CHUNK_SIZE);
+  usize chunk_len = (newsize - oldsize) / CHUNK_SIZE;
+
+  if (start + chunk_len > h->chunk_cap || h->chunk_cap - h->chunk_len < chunk_len)
+    return false;
+  for (usize i = start; i < start + chunk_len; i++) {
+    if (bitset_get(h->chunk_use, i))
+      return false;
+  }
+
+  trace("[heap %zu] growing %p in place %zu -> %zu B (chunks [%zu…%zu))",
+    h->debug_id, ptr, oldsize, newsize, start, start + chunk_len);
+
+  bitset_set_range(h->chunk_use, start, chunk_len, true);
+  h->chunk_len += chunk_len;
+
+  if (RMEM_ALLOC_SCRUB_BYTE)
+    memset((u8*)ptr + oldsize, RMEM_ALLOC_SCRUB_BYTE, newsize - oldsize);
+
+  return true;
+}
+
+
+// heap_shrink releases the chunks of the allocation at ptr beyond newsize bytes
+static void heap_shrink(heap_t* h, void* ptr, usize oldsize, usize newsize) {
+  assert(newsize < oldsize);
+  assert(IS_ALIGN2(newsize, CHUNK_SIZE));
+  heap_free(h, (u8*)ptr + newsize, oldsize - newsize);
+}
+
+
 inline static void subheap_init(subheap_t* sh, u8* base, usize size  DEBUG_ID_PARAM) {
   heap_init(&sh->heap, base, size  DEBUG_ID_ARG);
 }
@@ -818,6 +879,11 @@ static int subheap_debug_is_allocated(rmemalloc_t* a, subheap_t* sh, rmem_t regi
 
 
 static bool rmem_debug_is_allocated(rmemalloc_t* a, rmem_t region) {
+  ilist_for_each(lent, &a->large) {
+    largealloc_t* la = ilist_entry(lent, largealloc_t, list_entry);
+    if (RMEM_IS_INTERSECTING(region, RMEM(la->p, la->npages * PAGE_SIZE)))
+      return true;
+  }
   #ifdef RMEM_SLABHEAP_ENABLE
     const usize slabsize = CEIL_POW2(ALIGN2(region.size, SLABHEAP_MIN_SIZE));
     usize slab_index = ILOG2(slabsize) - ILOG2(SLABHEAP_MIN_SIZE);
@@ -845,18 +911,71 @@ static bool rmem_debug_is_allocated(rmemalloc_t* a, rmem_t region) {
 //———————————————————————————————————————————————————————————————————————————————————————
 
 
-// rmem_alloc_aligned attempts to allocate *size bytes.
-// On success, *size is updated to its actual size.
-rmem_t rmem_alloc_aligned(rmemalloc_t* a, usize size, usize alignment) {
-  assertf(IS_POW2(alignment), "alignment %zu is not a power-of-two", alignment);
-  assertf(alignment <= PAGE_SIZE, "%zu", alignment);
+static rmem_t rmem_alloc_locked(rmemalloc_t* a, usize size, usize alignment);
+static void rmem_free_locked(rmemalloc_t* a, rmem_t region);
 
-  if (size == 0)
-    return (rmem_t){0};
 
+// large_npages returns the number of pages of a large allocation of size bytes
+inline static usize large_npages(usize size) {
+  return CEIL_POW2(ALIGN2(size, PAGE_SIZE) / PAGE_SIZE);
+}
+
+
+// large_alloc allocates *sizep bytes directly from a->mm.
+// On success, *sizep is updated to the size of the page run.
+static void* nullable large_alloc(rmemalloc_t* a, usize* sizep) {
+  largealloc_t* la = rmem_alloc_locked(a, sizeof(largealloc_t), _Alignof(largealloc_t)).p;
+  if UNLIKELY(!la)
+    return NULL;
+  usize npages = large_npages(*sizep);
+  void* ptr = rmm_allocpages(assertnotnull(a->mm), npages);
+  if UNLIKELY(!ptr) {
+    trace("[large] rmm_allocpages(%zu) failed", npages);
+    rmem_free_locked(a, RMEM(la, sizeof(largealloc_t)));
+    return NULL;
+  }
+  la->p = ptr;
+  la->npages = npages;
+  ilist_append(&a->large, &la->list_entry);
+  a->stats.large_alloc++;
+  *sizep = npages * PAGE_SIZE;
+  trace("[large] allocated %p (%zu pages)", ptr, npages);
+  return ptr;
+}
+
+
+// large_lookup returns the large allocation at ptr, or NULL if there is none
+static largealloc_t* nullable large_lookup(rmemalloc_t* a, void* ptr) {
+  ilist_for_each(lent, &a->large) {
+    largealloc_t* la = ilist_entry(lent, largealloc_t, list_entry);
+    if (la->p == ptr)
+      return la;
+  }
+  return NULL;
+}
+
+
+static void large_free(rmemalloc_t* a, largealloc_t* la) {
+  trace("[large] freeing %p (%zu pages)", la->p, la->npages);
+  if (RMEM_FREE_SCRUB_BYTE)
+    memset(la->p, RMEM_FREE_SCRUB_BYTE, la->npages * PAGE_SIZE);
+  rmm_freepages(assertnotnull(a->mm), la->p, la->npages);
+  ilist_del(&la->list_entry);
+  rmem_free_locked(a, RMEM(la, sizeof(largealloc_t)));
+}
+
+
+// rmem_alloc_locked allocates size bytes. a->lock must be held.
+static rmem_t rmem_alloc_locked(rmemalloc_t* a, usize size, usize alignment) {
   void* ptr = NULL;
 
-  mutex_lock(&a->lock);
+  // Attempt to allocate large sizes directly from the memory manager.
+  // Page runs are PAGE_SIZE aligned, which satisfies any alignment.
+  if (size >= LARGE_MIN_SIZE && a->mm) {
+    if ((ptr = large_alloc(a, &size)))
+      goto end;
+    // fall back to subheap allocation
+  }
 
   // Attempt to allocate space in a slabheap.
   // This succeeds for the common case of a small allocation size.
@@ -888,12 +1007,27 @@ rmem_t rmem_alloc_aligned(rmemalloc_t* a, usize size, usize alignment) {
 
 end:
   if (ptr) RMEM_PEDANTIC_SAFECHECK_ALLOCATED(a, ptr, size);
-  mutex_unlock(&a->lock);
-  trace("rmem_alloc_aligned => " RMEM_FMT, RMEM_FMT_ARGS(RMEM(ptr, size)));
   return (rmem_t){ .p=ptr, .size=size };
 }
 
 
+// rmem_alloc_aligned attempts to allocate *size bytes.
+// On success, *size is updated to its actual size.
+rmem_t rmem_alloc_aligned(rmemalloc_t* a, usize size, usize alignment) {
+  assertf(IS_POW2(alignment), "alignment %zu is not a power-of-two", alignment);
+  assertf(alignment <= PAGE_SIZE, "%zu", alignment);
+
+  if (size == 0)
+    return (rmem_t){0};
+
+  mutex_lock(&a->lock);
+  rmem_t m = rmem_alloc_locked(a, size, alignment);
+  mutex_unlock(&a->lock);
+  trace("rmem_alloc_aligned => " RMEM_FMT, RMEM_FMT_ARGS(m));
+  return m;
+}
+
+
 rmem_t rmem_must_alloc(rmemalloc_t* a, usize size) {
   rmem_t m = rmem_alloc(a, size);
   if UNLIKELY(!m.p)
@@ -915,22 +1049,37 @@ rmem_t rmem_alloc_array(rmemalloc_t* a, usize count, usize elemsize, usize align
 }
 
 
-static bool free_to_subheaps(rmemalloc_t* a, void* ptr, usize size) {
+// subheap_of returns the subheap which owns the allocation at ptr, or NULL
+static subheap_t* nullable subheap_of(rmemalloc_t* a, void* ptr, usize size) {
   ilist_for_each(lent, &a->subheaps) {
     subheap_t* sh = ilist_entry(lent, subheap_t, list_entry);
-    if (heap_contains(&sh->heap, ptr, size)) {
-      heap_free(&sh->heap, ptr, size);
-      return true;
-    }
+    if (heap_contains(&sh->heap, ptr, size))
+      return sh;
   }
-  return false;
+  return NULL;
 }
 
 
-void rmem_free(rmemalloc_t* a, rmem_t region) {
-  SAFECHECK_VALID_REGION(region);
+static bool free_to_subheaps(rmemalloc_t* a, void* ptr, usize size) {
+  subheap_t* sh = subheap_of(a, ptr, size);
+  if (!sh)
+    return false;
+  heap_free(&sh->heap, ptr, size);
+  return true;
+}
 
-  mutex_lock(&a->lock);
+
+// rmem_free_locked frees region. a->lock must be held.
+static void rmem_free_locked(rmemalloc_t* a, rmem_t region) {
+  if (region.size >= LARGE_MIN_SIZE) {
+    largealloc_t* la = large_lookup(a, region.p);
+    if (la) {
+      assertf(region.size == la->npages * PAGE_SIZE,
+        "rmem_free: invalid size of region " RMEM_FMT, RMEM_FMT_ARGS(region));
+      large_free(a, la);
+      return;
+    }
+  }
 
   #ifdef RMEM_SLABHEAP_ENABLE
     for (usize i = 0; i < SLABHEAP_COUNT; i++) {
@@ -946,6 +1095,13 @@ void rmem_free(rmemalloc_t* a, rmem_t region) {
 
 end:
   RMEM_PEDANTIC_SAFECHECK_FREE(a, region.p, region.size);
+}
+
+
+void rmem_free(rmemalloc_t* a, rmem_t region) {
+  SAFECHECK_VALID_REGION(region);
+  mutex_lock(&a->lock);
+  rmem_free_locked(a, region);
   mutex_unlock(&a->lock);
   trace("freed region " RMEM_FMT, RMEM_FMT_ARGS(region));
 }
@@ -981,15 +1137,71 @@ bool rmem_resize(rmemalloc_t* a, rmem_t* region, usize newsize) {
   if (newsize == oldsize)
     return true;
 
-  // The region could not be trivially resized; resort to actual resizing.
   trace("resizing %p  %zu -> %zu", region->p, oldsize, newsize);
 
-  // FIXME replace this daft "allocate new, copy, free old" code
+  // RESIZE_SUBHEAP_MIN: smallest size of a subheap allocation.
+  // Smaller regions are slab allocations (rmem_free tells them apart by size.)
+  #ifdef RMEM_SLABHEAP_ENABLE
+    #define RESIZE_SUBHEAP_MIN  ALIGN2(SLABHEAP_MAX_SIZE + 1, CHUNK_SIZE)
+  #else
+    #define RESIZE_SUBHEAP_MIN  CHUNK_SIZE
+  #endif
+
+  mutex_lock(&a->lock);
+
+  largealloc_t* la = NULL;
+  if (oldsize >= LARGE_MIN_SIZE)
+    la = large_lookup(a, region->p);
+
+  if (la) {
+    // Resize a large allocation by splitting or merging its page run in place,
+    // unless newsize is small enough for a subheap
+    usize newnpages = large_npages(newsize);
+    if (newsize >= LARGE_MIN_SIZE &&
+        rmm_resizepages(assertnotnull(a->mm), la->p, la->npages, newnpages))
+    {
+      usize nbyte = la->npages * PAGE_SIZE;
+      usize newnbyte = newnpages * PAGE_SIZE;
+      if (newnbyte > nbyte) {
+        if (RMEM_ALLOC_SCRUB_BYTE)
+          memset((u8*)la->p + nbyte, RMEM_ALLOC_SCRUB_BYTE, newnbyte - nbyte);
+        a->stats.resize_grow++;
+      } else if (newnbyte < nbyte) {
+        a->stats.resize_shrink++;
+      }
+      la->npages = newnpages;
+      region->size = newnbyte;
+      goto end;
+    }
+  } else if (oldsize >= RESIZE_SUBHEAP_MIN) {
+    subheap_t* sh = subheap_of(a, region->p, oldsize);
+    safecheckf(sh, "rmem_resize: invalid region " RMEM_FMT, RMEM_FMT_ARGS(*region));
+
+    // Shrink in place, unless newsize is small enough for a slab
+    if (newsize < oldsize) {
+      if (newsize >= RESIZE_SUBHEAP_MIN) {
+        heap_shrink(&sh->heap, region->p, oldsize, newsize);
+        a->stats.resize_shrink++;
+        region->size = newsize;
+        goto end;
+      }
+    } else if (heap_grow(&sh->heap, region->p, oldsize, newsize)) {
+      a->stats.resize_grow++;
+      region->size = newsize;
+      goto end;
+    }
+  }
+
+  // The region can not be resized in place; move it to a new allocation.
+  // A slab region which grows beyond SLABHEAP_MAX_SIZE is promoted to a subheap
+  // and a subheap region which shrinks to a slab size is moved to that slab.
   usize alignment =
     MIN(CEIL_POW2(MIN(newsize, HEAP_ALIGN)), (usize)CEIL_POW2((uintptr)region->p));
-  rmem_t new_region = rmem_alloc_aligned(a, newsize, alignment);
-  if (!new_region.p)
+  rmem_t new_region = rmem_alloc_locked(a, newsize, alignment);
+  if (!new_region.p) {
+    mutex_unlock(&a->lock);
     return false;
+  }
 
   assertf(!RMEM_IS_INTERSECTING(new_region, *region),
     "bug in rmem_alloc_aligned: allocated non-free memory."
@@ -1001,15 +1213,18 @@ bool rmem_resize(rmemalloc_t* a, rmem_t* region, usize newsize) {
     RMEM_FMT_ARGS(*region) );
 
   memcpy(new_region.p, region->p, MIN(oldsize, newsize));
-  rmem_free(a, *region);
+  rmem_free_locked(a, *region);
   *region = new_region;
-  return true;
+  if (oldsize < RESIZE_SUBHEAP_MIN && newsize >= RESIZE_SUBHEAP_MIN) {
+    a->stats.resize_promote++;
+  } else {
+    a->stats.resize_copy++;
+  }
 
-  // #ifdef RMEM_SLABHEAP_ENABLE
-  //   if (oldsize <= SLABHEAP_MAX_SIZE) {
-  //     panic("TODO slabheap resize");
-  //   }
-  // #endif
+end:
+  mutex_unlock(&a->lock);
+  return true;
+  #undef RESIZE_SUBHEAP_MIN
 }
 
 
@@ -1090,6 +1305,9 @@ usize rmem_alloc_size(usize size) {
     return CEIL_POW2(size);
   #endif
 
+  if (size >= LARGE_MIN_SIZE)
+    return large_npages(size) * PAGE_SIZE;
+
   return ALIGN2(size, CHUNK_SIZE);
 }
 
@@ -1109,11 +1327,13 @@ static rmemalloc_t* nullable rmem_allocator_init(
     return NULL;
 
   ilist_init(&a->subheaps);
+  ilist_init(&a->large);
 
   a->mm = mm;
   a->mm_origin = mm_origin;
   a->mm_npages = mm_npages;
 
+  memset(&a->stats, 0, sizeof(a->stats));
   DEBUG_ID_INIT(a, next_heap_debug_id, 0);
 
   // initialize slab heaps, starting with size=sizeof(void*)
@@ -1250,6 +1470,12 @@ rmemalloc_t* nullable rmem_allocator_create_buf(
 
 
 void rmem_allocator_free(rmemalloc_t* a) {
+  // Large allocations are not part of any subheap; return their pages to mm.
+  // (Their largealloc_t records live in slabs and go away with the subheaps.)
+  ilist_for_each(lent, &a->large) {
+    largealloc_t* la = ilist_entry(lent, largealloc_t, list_entry);
+    rmm_freepages(assertnotnull(a->mm), la->p, la->npages);
+  }
   // TODO: free slabheaps
   // TODO: free additional subheaps
   mutex_dispose(&a->lock);
@@ -1289,11 +1515,23 @@ usize rmem_cap(rmemalloc_t* a) {
     nbyte += subheap_cap(sh);
   }
 
+  ilist_for_each(lent, &a->large) {
+    largealloc_t* la = ilist_entry(lent, largealloc_t, list_entry);
+    nbyte += la->npages * PAGE_SIZE;
+  }
+
   mutex_unlock(&a->lock);
   return nbyte;
 }
 
 
+void rmem_stats(rmemalloc_t* a, rmemstats_t* dst) {
+  mutex_lock(&a->lock);
+  *dst = a->stats;
+  mutex_unlock(&a->lock);
+}
+
+
 const char* rmem_scrubcheck(void* ptr, usize size) {
   if (RMEM_ALLOC_SCRUB_BYTE | RMEM_FREE_SCRUB_BYTE) {
     u8 scrub_bytes[128] ATTR_ALIGNED(sizeof(void*));
@@ -1497,6 +1735,9 @@ static void test_rmem_alloc() {
   }
 
   { // resize a subheap allocation
+    // Uses an allocator of its own so that the layout of the heap is known:
+    // allocations are placed one after another, with no holes from earlier tests.
+    rmemalloc_t* sa = assertnotnull( rmem_allocator_create(mm, 1 * MiB) );
     rmem_t m, old;
 
     // canary data
@@ -1504,28 +1745,110 @@ static void test_rmem_alloc() {
     memset(expected_data, 0xab, sizeof(expected_data));
 
     // initial allocation (force subheap use, instead of slabs)
-    m = rmem_alloc(a, MAX(SLABHEAP_MAX_SIZE + 1, CHUNK_SIZE*2));
+    m = rmem_alloc(sa, MAX(SLABHEAP_MAX_SIZE + 1, CHUNK_SIZE*2));
     memcpy(m.p, expected_data, sizeof(expected_data));
 
     // shrink (noop)
     old = m;
-    assert( rmem_resize(a, &m, old.size - sizeof(void*)) );
+    assert( rmem_resize(sa, &m, old.size - sizeof(void*)) );
     assert( m.p == old.p );
     assert( m.size == old.size );
     assert( memcmp(m.p, expected_data, sizeof(expected_data)) == 0 );
 
     // shrink
     old = m;
-    assert( rmem_resize(a, &m, old.size - CHUNK_SIZE) );
+    assert( rmem_resize(sa, &m, old.size - CHUNK_SIZE) );
     assert( m.size < old.size );
     assert( memcmp(m.p, expected_data, sizeof(expected_data)) == 0 );
 
     // grow
     old = m;
-    assert( rmem_resize(a, &m, old.size + sizeof(void*)) );
+    assert( rmem_resize(sa, &m, old.size + sizeof(void*)) );
     assert( m.size > old.size );
     assert( memcmp(m.p, expected_data, sizeof(expected_data)) == 0 );
 
+    // grow in place; the chunks following m are free
+    old = m;
+    rmemstats_t stats0, stats1;
+    rmem_stats(sa, &stats0);
+    assert( rmem_resize(sa, &m, old.size + CHUNK_SIZE) );
+    rmem_stats(sa, &stats1);
+    assert( m.p == old.p );
+    assert( m.size == old.size + CHUNK_SIZE );
+    assert( stats1.resize_grow == stats0.resize_grow + 1 );
+    assert( memcmp(m.p, expected_data, sizeof(expected_data)) == 0 );
+
+    // grow by moving; the chunks following m are in use
+    rmem_t m2 = rmem_alloc_aligned(sa, CHUNK_SIZE*2, CHUNK_SIZE);
+    assert( (u8*)m2.p == (u8*)m.p + m.size );
+    old = m;
+    rmem_stats(sa, &stats0);
+    assert( rmem_resize(sa, &m, old.size + CHUNK_SIZE) );
+    rmem_stats(sa, &stats1);
+    assert( m.p != old.p );
+    assert( m.size == old.size + CHUNK_SIZE );
+    assert( stats1.resize_copy == stats0.resize_copy + 1 );
+    assert( memcmp(m.p, expected_data, sizeof(expected_data)) == 0 );
+    rmem_free(sa, m2);
+
+    // shrink in place
+    old = m;
+    rmem_stats(sa, &stats0);
+    assert( rmem_resize(sa, &m, old.size - CHUNK_SIZE) );
+    rmem_stats(sa, &stats1);
+    assert( m.p == old.p );
+    assert( m.size == old.size - CHUNK_SIZE );
+    assert( stats1.resize_shrink == stats0.resize_shrink + 1 );
+    assert( memcmp(m.p, expected_data, sizeof(expected_data)) == 0 );
+
+    rmem_free(sa, m);
+    rmem_allocator_free(sa);
+  }
+
+  { // large allocation
+    rmemstats_t stats0, stats1;
+    rmem_stats(a, &stats0);
+    usize mm_avail = rmm_avail_total(mm);
+    rmem_t m = rmem_alloc(a, LARGE_MIN_SIZE + 1);
+    assertnotnull(m.p);
+    rmem_stats(a, &stats1);
+    assert( stats1.large_alloc == stats0.large_alloc + 1 );
+    assert( m.size == rmem_alloc_size(LARGE_MIN_SIZE + 1) );
+    assert( IS_ALIGN2((uintptr)m.p, PAGE_SIZE) );
+    memset(m.p, 0xab, m.size);
+
+    // shrink in place (splits the page run)
+    rmem_t old = m;
+    assert( rmem_resize(a, &m, LARGE_MIN_SIZE) );
+    assert( m.p == old.p );
+    assert( m.size == LARGE_MIN_SIZE );
+
+    // grow; in place since the pages just freed are still free
+    assert( rmem_resize(a, &m, old.size) );
+    assert( m.p == old.p );
+    assert( ((u8*)m.p)[LARGE_MIN_SIZE - 1] == 0xab );
+
+    // pages are returned to mm when freed
+    rmem_free(a, m);
+    assert( rmm_avail_total(mm) == mm_avail );
+
+    // shrink to a subheap size (moves the region)
+    m = rmem_alloc(a, LARGE_MIN_SIZE);
+    memset(m.p, 0xab, m.size);
+    assert( rmem_resize(a, &m, LARGE_MIN_SIZE / 2) );
+    assert( ((u8*)m.p)[LARGE_MIN_SIZE/2 - 1] == 0xab );
+    rmem_free(a, m);
+  }
+
+  { // promote a slab allocation to a subheap
+    rmemstats_t stats0, stats1;
+    rmem_stats(a, &stats0);
+    rmem_t m = rmem_alloc(a, SLABHEAP_MAX_SIZE);
+    memset(m.p, 0xab, m.size);
+    assert( rmem_resize(a, &m, SLABHEAP_MAX_SIZE * 4) );
+    rmem_stats(a, &stats1);
+    assert( stats1.resize_promote == stats0.resize_promote + 1 );
+    assert( ((u8*)m.p)[SLABHEAP_MAX_SIZE - 1] == 0xab );
     rmem_free(a, m);
   }
 
@@ -76,6 +76,7 @@ typedef struct rmm_ {
   u8*     bitsets[MAX_ORDER + 1];
   ilist_t freelists[MAX_ORDER + 1];
   bool    owns_host_vmmap; // true if rmm_dispose should call osvmem_free
+  struct vm_ksm_* nullable ksm; // page deduplication state (see vm_ksm.c)
 } rmm_t;
 
 
@@ -195,15 +196,22 @@ static uintptr rmm_allocpages1(rmm_t* mm, int order) {
 }
 
 
+// rmm_order returns log2(npages) of a pow2 number of pages
+inline static int rmm_order(usize npages) {
+  int order = 0;
+  for (usize n = npages; n && !(n & 1); n >>= 1)
+    order++;
+  return order;
+}
+
+
 void* nullable rmm_allocpages(rmm_t* mm, usize npages) {
   if (npages == 0)
     return 0;
 
   safecheckf(IS_POW2(npages), "can only allocate pow2(npages)");
 
-  int order = 0;
-  for (usize n = npages; n && !(n & 1); n >>= 1)
-    order++;
+  int order = rmm_order(npages);
 
   mutex_lock(&mm->lock);
 
@@ -310,6 +318,65 @@ void rmm_freepages(rmm_t* mm, void* ptr, usize npages) {
 }
 
 
+bool rmm_resizepages(rmm_t* mm, void* ptr, usize npages, usize newnpages) {
+  assert(IS_ALIGN2((uintptr)ptr, PAGE_SIZE));
+  assertf(IS_POW2(npages), "npages %zu is not pow2", npages);
+  assertf(IS_POW2(newnpages), "newnpages %zu is not pow2", newnpages);
+  if (newnpages == npages)
+    return true;
+
+  uintptr addr = (uintptr)ptr - mm->start_addr;
+  int order = rmm_order(npages);
+  int neworder = rmm_order(newnpages);
+  bool ok = true;
+
+  trace("rmm_resizepages %p %zu -> %zu pages", ptr, npages, newnpages);
+  mutex_lock(&mm->lock);
+  assertf(bit_get(mm->bitsets[order], addr >> (PAGE_SIZE_BITS + order)),
+    "%p is not an allocation of %zu pages", ptr, npages);
+
+  if (neworder < order) {
+    // Shrink by splitting the block, keeping the lower half and freeing the
+    // upper half at each order. The block becomes the parent of the lower half.
+    for (int o = order - 1; o >= neworder; o--) {
+      usize blocksize = (usize)PAGE_SIZE << o;
+      bit_set(mm->bitsets[o], addr >> (PAGE_SIZE_BITS + o));
+      ilist_append(&mm->freelists[o], (ilist_t*)(addr + blocksize + mm->start_addr));
+      trace_freelist(mm, o);
+    }
+    mm->free_size += (npages - newnpages) * PAGE_SIZE;
+    goto end;
+  }
+
+  // Grow by merging the block with its buddies, which is only possible if the block
+  // is the lower buddy at each order and all of the upper buddies are free.
+  if (neworder > MAX_ORDER || !IS_ALIGN2(addr, (usize)PAGE_SIZE << neworder)) {
+    ok = false;
+    goto end;
+  }
+  for (int o = order; o < neworder; o++) {
+    uintptr buddy_addr = addr + ((usize)PAGE_SIZE << o);
+    if (bit_get(mm->bitsets[o], buddy_addr >> (PAGE_SIZE_BITS + o))) {
+      ok = false;
+      goto end;
+    }
+  }
+  for (int o = order; o < neworder; o++) {
+    uintptr buddy_addr = addr + ((usize)PAGE_SIZE << o);
+    ilist_del((ilist_t*)(buddy_addr + mm->start_addr));
+    bit_clear(mm->bitsets[o], addr >> (PAGE_SIZE_BITS + o));
+    trace_freelist(mm, o);
+  }
+  // the block at neworder was split into our block and its buddy; now it's allocated
+  assert(bit_get(mm->bitsets[neworder], addr >> (PAGE_SIZE_BITS + neworder)));
+  mm->free_size -= (newnpages - npages) * PAGE_SIZE;
+
+end:
+  mutex_unlock(&mm->lock);
+  return ok;
+}
+
+
 rmm_t* nullable rmm_create(void* memp, usize memsize) {
   // Align the start address to our minimum requirement,
   // compute the end address and adjust memsize.
@@ -331,6 +398,7 @@ rmm_t* nullable rmm_create(void* memp, usize memsize) {
   rmm_t* mm = (rmm_t*)ALIGN2_FLOOR(end - sizeof(rmm_t), _Alignof(rmm_t));
   mutex_init(&mm->lock);
   mm->owns_host_vmmap = false;
+  mm->ksm = NULL;
   trace("mm at      %p … %p (%zu B)", mm, (void*)mm + sizeof(rmm_t), sizeof(rmm_t));
 
   // adjust memsize to the usable space at start (memsize = mm - start)
@@ -486,6 +554,16 @@ uintptr rmm_startaddr(const rmm_t* mm) {
 }
 
 
+struct vm_ksm_* nullable rmm_ksm(const rmm_t* mm) {
+  return mm->ksm;
+}
+
+
+void rmm_set_ksm(rmm_t* mm, struct vm_ksm_* nullable ksm) {
+  mm->ksm = ksm;
+}
+
+
 #if defined(RMM_RUN_TEST_ON_INIT) && DEBUG
 static void test_rmm() {
   dlog("%s", __FUNCTION__);
@@ -529,6 +607,28 @@ static void test_rmm() {
 
   rmm_freepages(mm, p2, 1);
 
+  // resize in place
+  usize avail = rmm_avail_total(mm);
+  p = assertnotnull( rmm_allocpages(mm, 8) );
+  assert( rmm_resizepages(mm, p, 8, 1) );
+  assert( rmm_avail_total(mm) == avail - 1 );
+  assert( rmm_resizepages(mm, p, 1, 8) ); // the freed buddies are still free
+  assert( rmm_avail_total(mm) == avail - 8 );
+  rmm_freepages(mm, p, 8);
+  assert( rmm_avail_total(mm) == avail );
+
+  // can't grow in place when the buddy is in use.
+  // Shrinking a 16-page block frees its upper buddy last, and freelists are LIFO,
+  // so the next 8-page allocation is that buddy.
+  p = assertnotnull( rmm_allocpages(mm, 16) );
+  assert( rmm_resizepages(mm, p, 16, 8) );
+  p2 = assertnotnull( rmm_allocpages(mm, 8) );
+  assert( p2 == (u8*)p + 8*PAGE_SIZE );
+  assert( !rmm_resizepages(mm, p, 8, 16) );
+  rmm_freepages(mm, p2, 8);
+  rmm_freepages(mm, p, 8);
+  assert( rmm_avail_total(mm) == avail );
+
   // test "under free" and "over free" (panics)
   //p = assertnotnull( rmm_allocpages(mm, 8) );
   //rmm_freepages(mm, p, 4);  // under free
@@ -0,0 +1,62 @@
+// guest memory-access trace format
+// SPDX-License-Identifier: Apache-2.0
+//
+// A memory-access trace records every guest LOAD, STORE, MCOPY and stack access of
+// a program run with the new execution engine. Tracing is compiled in with
+// SCHED_MEMTRACE (./build.sh -DSCHED_MEMTRACE) and enabled per machine with
+// rmachine_set_memtrace (rsm -X -T <file>.) Traces are read by rsm-cachesim.
+//
+// A trace file starts with a memtrace_hdr_t, followed by blocks. A block is a
+// memtrace_blk_t followed by zsize bytes of LZ4-compressed memtrace_rec_t records.
+// Each M buffers records and writes a block when its buffer is full, so records are
+// in program order per M but blocks of different M's are interleaved.
+// All values are in host byte order.
+//
+#pragma once
+RSM_ASSUME_NONNULL_BEGIN
+
+#define MEMTRACE_MAGIC   "RSMT"
+#define MEMTRACE_VERSION 1u
+#define MEMTRACE_NREC    2730u // records per block (64 KiB)
+
+typedef struct {
+  u8  magic[4];     // MEMTRACE_MAGIC
+  u32 version;      // MEMTRACE_VERSION
+  u64 data_vaddr;   // address of the program's data section
+  u64 data_size;    // size of the data section in bytes
+  u32 page_size;    // PAGE_SIZE
+  u32 vm_cache_len; // VM_CACHE_LEN
+} memtrace_hdr_t;
+
+typedef struct {
+  u32 rawsize; // uncompressed size of the records in bytes
+  u32 zsize;   // compressed size in bytes
+} memtrace_blk_t;
+
+typedef u8 memtrace_kind_t;
+enum memtrace_kind {
+  MEMTRACE_LOAD  = 0,
+  MEMTRACE_STORE = 1,
+} RSM_END_ENUM2(memtrace_kind, memtrace_kind_t)
+
+typedef u8 memtrace_flag_t;
+enum memtrace_flag {
+  MEMTRACE_F_STACK = 1 << 0, // address is on the stack of the task
+  MEMTRACE_F_BULK  = 1 << 1, // MCOPY, MCMP, read or write; size may be any value
+} RSM_END_ENUM2(memtrace_flag, memtrace_flag_t)
+
+typedef struct {
+  u64             vaddr; // address accessed
+  u32             size;  // bytes accessed (bulk accesses: capped at U32_MAX)
+  u32             pc;    // pc of the instruction which accessed memory
+  u32             tid;   // task id (low 32 bits)
+  memtrace_kind_t kind;
+  memtrace_flag_t flags;
+  u16             _reserved;
+} memtrace_rec_t;
+
+static_assert(sizeof(memtrace_hdr_t) == 32, "");
+static_assert(sizeof(memtrace_rec_t) == 24, "");
+static_assert(MEMTRACE_NREC * sizeof(memtrace_rec_t) <= 64*1024, "");
+
+RSM_ASSUME_NONNULL_END
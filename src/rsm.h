@@ -323,21 +323,22 @@ enum rfmtflag {
 
 typedef int rerr_t; // error code
 enum rerr_ {
-  rerr_ok            =   0, // no error
-  rerr_invalid       =  -1, // invalid data or argument
-  rerr_sys_op        =  -2, // invalid syscall op or syscall op data
-  rerr_badfd         =  -3, // invalid file descriptor
-  rerr_bad_name      =  -4, // invalid or misformed name
-  rerr_not_found     =  -5, // resource not found
-  rerr_name_too_long =  -6, // name too long
-  rerr_canceled      =  -7, // operation canceled
-  rerr_not_supported =  -8, // not supported
-  rerr_exists        =  -9, // already exists
-  rerr_end           = -10, // end of resource
-  rerr_access        = -11, // permission denied
-  rerr_nomem         = -12, // cannot allocate memory
-  rerr_mfault        = -13, // bad memory address
-  rerr_overflow      = -14, // value too large
+  rerr_ok             =   0, // no error
+  rerr_invalid        =  -1, // invalid data or argument
+  rerr_sys_op         =  -2, // invalid syscall op or syscall op data
+  rerr_badfd          =  -3, // invalid file descriptor
+  rerr_bad_name       =  -4, // invalid or misformed name
+  rerr_not_found      =  -5, // resource not found
+  rerr_name_too_long  =  -6, // name too long
+  rerr_canceled       =  -7, // operation canceled
+  rerr_not_supported  =  -8, // not supported
+  rerr_exists         =  -9, // already exists
+  rerr_end            = -10, // end of resource
+  rerr_access         = -11, // permission denied
+  rerr_nomem          = -12, // cannot allocate memory
+  rerr_mfault         = -13, // bad memory address
+  rerr_overflow       = -14, // value too large
+  rerr_stack_overflow = -15, // stack overflow
 };
 
 // rsm_init initializes global state; must be called before using the rest of the API.
@@ -414,6 +415,23 @@ size_t rmm_avail_maxregion(rmm_t*);
 // On success, req_npages is updated with the actual number of pages allocated.
 void* nullable rmm_allocpages_min(rmm_t* mm, size_t* req_npages, size_t min_npages);
 
+// rmm_resizepages changes the size of an allocation of npages to newnpages without
+// moving it. Shrinking always succeeds. Growing succeeds only if the pages following
+// the allocation are free and it's aligned to newnpages; otherwise false is returned
+// and the allocation is unchanged. npages and newnpages must be pow2.
+bool rmm_resizepages(rmm_t* mm, void* ptr, size_t npages, size_t newnpages);
+
+// rmm_ksm_enable enables page deduplication for machines created with mm after
+// the call. Identical pages of these machines are merged by rmm_ksm_scan into one
+// read-only page, which is copied on the first write to it.
+rerr_t rmm_ksm_enable(rmm_t*);
+
+// rmm_ksm_scan performs one deduplication pass over the memory of all machines
+// using mm and returns the number of bytes currently saved by deduplication.
+// Pages are merged once they have not been written to since the previous scan.
+// Machines must not execute during the scan.
+size_t rmm_ksm_scan(rmm_t*);
+
 //———————————————————————————————————————————————————————————————————————————————————————
 // rmemalloc_t is a generic memory allocator
 typedef struct rmemalloc_ rmemalloc_t;
@@ -450,6 +468,8 @@ void rmem_allocator_free(rmemalloc_t*);
 // Eg. size=24 is rounded up to 32 and has a minimum of 32B alignment.
 // Allocations >= CHUNK_SIZE are sized in CHUNK_SIZE steps with a minimum alignment
 // of CHUNK_SIZE. Eg. size=130,alignment=16 returns 256 bytes with CHUNK_SIZE alignment.
+// Large allocations (256 KiB or more, by default) are made directly from the
+// memory manager as a pow2 number of pages when the allocator has one.
 // Returns .start==NULL if the allocator is out of memory.
 rmem_t rmem_alloc_aligned(rmemalloc_t*, size_t size, size_t alignment);
 
@@ -481,6 +501,9 @@ void rmem_free(rmemalloc_t*, rmem_t);
 // rmem_resize grows or shrinks the size of an allocated memory region to newsize.
 // If resizing fails, false is returned and the region is unchanged; it is still valid.
 // Address alignment of new address is min(pow2(newsize),oldalignment).
+// Regions larger than a slab are grown and shrunk in place when possible.
+// Large regions (made directly from the memory manager) are resized by
+// splitting or merging their page runs.
 bool rmem_resize(rmemalloc_t*, rmem_t*, size_t newsize);
 
 // rmem_must_* works like rmem_* but panics on failure
@@ -489,6 +512,7 @@ void rmem_must_resize(rmemalloc_t*, rmem_t*, size_t newsize);
 
 // rmem_alloc_size returns the effective size of an allocation of that size.
 // E.g. rmem_alloc_size(size) == rmem_alloc(a, size).size
+// (Large sizes assume an allocator with a memory manager.)
 size_t rmem_alloc_size(size_t);
 
 // rmem_avail returns the total number of bytes available to allocate
@@ -497,6 +521,18 @@ size_t rmem_avail(rmemalloc_t*);
 // rmem_cap returns the total number of bytes managed by the allocator
 size_t rmem_cap(rmemalloc_t*);
 
+// rmemstats_t: allocator counters
+typedef struct {
+  size_t resize_grow;    // rmem_resize calls which grew a region in place
+  size_t resize_shrink;  // rmem_resize calls which shrank a region in place
+  size_t resize_promote; // rmem_resize calls which moved a slab region to a subheap
+  size_t resize_copy;    // other rmem_resize calls which moved a region (copy)
+  size_t large_alloc;    // allocations made directly from the memory manager
+} rmemstats_t;
+
+// rmem_stats copies the allocator's counters to dst
+void rmem_stats(rmemalloc_t*, rmemstats_t* dst);
+
 //——————————————————————————————————————————————————————————————————————————————————————
 
 // rromflag_t: describes properties of a ROM image
@@ -552,14 +588,129 @@ typedef struct rmachine_ rmachine_t;
 rmachine_t* nullable rmachine_create(rmm_t*);
 void rmachine_dispose(rmachine_t*);
 
-// rmachine_execrom loads & runs a program from a ROM image
+// rmachine_execrom loads & runs a program from a ROM image.
+// A machine runs one program at a time. When a program has exited, the machine can
+// load another one, with rmachine_execrom or rmachine_load.
 rerr_t rmachine_execrom(rmachine_t*, rrom_t*);
 
+// rrunstate_t is the state of a program run with rmachine_run_for
+typedef enum {
+  RRUN_EXITED,  // all tasks have exited; the program has been unloaded
+  RRUN_BUDGET,  // the budget ran out; tasks are ready to run
+  RRUN_BLOCKED, // all tasks are sleeping; nothing to do for rrunresult_t.timeout ns
+} rrunstate_t;
+
+// rrunresult_t describes the outcome of a call to rmachine_run_for
+typedef struct {
+  rrunstate_t state;
+  rerr_t      err;     // RRUN_EXITED: like the return value of rmachine_execrom
+  rsm_u64_t   timeout; // RRUN_BLOCKED: nanoseconds until the next task wakes up
+} rrunresult_t;
+
+// rmachine_load loads a program from a ROM image, to be run in steps by the
+// calling thread with rmachine_run_for, e.g. from a host's event loop.
+// In this mode the machine doesn't start any OS threads and guest tasks only run
+// during calls to rmachine_run_for. Tasks which sleep don't block the thread.
+// Returns rerr_exists if a program is already loaded.
+rerr_t rmachine_load(rmachine_t*, rrom_t*);
+
+// rmachine_run_for runs the tasks of a program loaded with rmachine_load for about
+// budget_ns nanoseconds, or until all tasks are sleeping or have exited.
+// A task checks the budget every few thousand branches & calls, so a call may
+// overshoot it slightly. Doesn't allocate memory unless the program does.
+rerr_t rmachine_run_for(rmachine_t*, rsm_u64_t budget_ns, rrunresult_t* result);
+
+// rtaskbudget_t limits the resources of a task. 0 means "unlimited".
+// A task which has spent its CPU time is deprioritized: it yields to other tasks
+// at every preemption point and waits on the global run queue, unless kill is true,
+// in which case it is terminated (rmachine_execrom then returns rerr_canceled.)
+// A task which would exceed its stack budget is terminated (rerr_nomem.)
+typedef struct {
+  rsm_u64_t cputime;   // nanoseconds of CPU time
+  rsm_u64_t stacksize; // bytes of stack memory
+  bool      kill;      // terminate rather than deprioritize a task out of CPU time
+} rtaskbudget_t;
+
+// rtaskusage_t describes the resources used by a task
+typedef struct {
+  rsm_u64_t cputime;    // nanoseconds of CPU time, as of the task's last preemption point
+  rsm_u64_t stacksize;  // bytes of stack memory
+  bool      overbudget; // the task has spent its CPU time and is deprioritized
+} rtaskusage_t;
+
+// rmachine_set_taskbudget sets the budget of the main task of the next program run.
+// Tasks inherit the budget of the task that spawned them (each gets its own.)
+void rmachine_set_taskbudget(rmachine_t*, const rtaskbudget_t*);
+
+// rmachine_task_setbudget changes the budget of a running task.
+// Returns rerr_not_found if there's no such task.
+rerr_t rmachine_task_setbudget(rmachine_t*, rsm_u64_t tid, const rtaskbudget_t*);
+
+// rmachine_task_usage retrieves the resource usage of a running task.
+// Returns rerr_not_found if there's no such task.
+rerr_t rmachine_task_usage(rmachine_t*, rsm_u64_t tid, rtaskusage_t* usage);
+
+// rmachine_set_memlimit limits the memory used by the guest program of a machine
+// to hard bytes (code & data, stacks and other memory backing its address space.)
+// When usage crosses soft bytes, the pressure callback is called with hard=false.
+// When an allocation would exceed hard bytes, the callback is called with hard=true
+// and may raise the limit to let the allocation proceed. Otherwise the allocation
+// fails: rmachine_execrom fails with rerr_nomem, a task that runs out of memory is
+// terminated, and rmachine_execrom returns rerr_nomem when the program ends.
+// A limit of 0 means "no limit". Limits can be changed at any time.
+void rmachine_set_memlimit(rmachine_t*, size_t soft, size_t hard);
+
+// rmachine_mempressure_f is the type of the callback set with rmachine_set_mempressure.
+// usage is the number of bytes used by the machine's guest program.
+// The callback is called on the thread of the allocating task, with the machine's
+// memory map locked; it must not call rmachine functions other than
+// rmachine_set_memlimit and rmachine_memusage.
+typedef void(*rmachine_mempressure_f)(
+  rmachine_t*, size_t usage, bool hard, void* nullable userdata);
+
+// rmachine_set_mempressure sets (or clears, if f is NULL) the memory pressure callback
+void rmachine_set_mempressure(
+  rmachine_t*, rmachine_mempressure_f nullable f, void* nullable userdata);
+
+// rmachine_memusage returns the number of bytes used by the machine's guest program
+size_t rmachine_memusage(rmachine_t*);
+
+// rmachine_compact frees page-table memory of the machine which is not in use,
+// including page tables kept for reuse. Returns the number of bytes freed.
+// Must not be called from a memory pressure callback.
+size_t rmachine_compact(rmachine_t*);
+
+// rmachine_set_directvm backs the guest addresses [0, 2^addrbits) with one range of
+// host virtual memory, so that guest loads & stores to it translate with an add
+// rather than a vm_cache lookup. Pages are backed on first access (via SIGSEGV.)
+// The program's data and main stack are placed in the range.
+// Must be called before a program is loaded. addrbits must be in the range [20, 46].
+// Returns rerr_not_supported if the host doesn't support it (only Linux does.)
+rerr_t rmachine_set_directvm(rmachine_t*, unsigned addrbits);
+
+// rmachine_set_faultaround sets the number of pages a translation-cache miss
+// resolves, in the naturally-aligned window around the missed page, which makes
+// sequential access miss once per window rather than once per page. Stores streaming
+// through memory also back the rest of the window ahead of time.
+// npages must be a power of two, or 0; 0 or 1 disables fault-around. Larger values
+// than the cache size are capped. Can be changed at any time. The default is 16.
+// Returns rerr_invalid if npages is not a power of two.
+rerr_t rmachine_set_faultaround(rmachine_t*, unsigned npages);
+
+// rmachine_set_memtrace records every guest memory access of the program to fd,
+// for replay in a cache simulator (see src/memtrace.h and tools/cachesim.c.)
+// Must be called before a program is loaded. The trace is complete when the machine
+// is disposed; fd is owned by the caller and is not closed.
+// Returns rerr_not_supported unless rsm was built with SCHED_MEMTRACE.
+rerr_t rmachine_set_memtrace(rmachine_t*, int fd);
+
 //———————————————————————————————————————————————————————————————————————————————————————
 // rvm_t: VM instance  (execution engine v1)
 typedef uint8_t rvmstatus_t;
+typedef uint8_t rvmflag_t;
 typedef struct {
   rvmstatus_t status;
+  rvmflag_t   flags;
   rsm_u64_t   iregs[RSM_NREGS];
   double      fregs[RSM_NREGS];
   void*       rambase;
@@ -571,6 +722,14 @@ enum rvmstatus {
   RVM_ERROR, // check rvm.error
   RVM_END = 0xff,
 };
+enum rvmflag {
+  // RVM_MASKED: sanitize memory addresses by masking them with ramsize-1 instead of
+  // checking them. Out-of-bounds addresses wrap around rather than causing an error.
+  // ramsize must be a power of two and RVM_GUARD_SIZE bytes of memory must be
+  // accessible after rambase+ramsize.
+  RVM_MASKED = 1 << 0,
+};
+#define RVM_GUARD_SIZE 8 // bytes after RAM required by RVM_MASKED
 
 
 // rsm_vmexec executes a program, starting with instruction 0
@@ -599,6 +758,11 @@ RSMAPI size_t rsm_fmtprog(
 RSMAPI size_t rsm_fmtinstr(
   char* buf, size_t bufcap, rin_t, uint32_t* nullable pcaddp, rfmtflag_t);
 
+// rsm_emitc translates the code of a loaded rom to C source code which runs the
+// program natively when linked with rsm (see aot.h.) Writes to buf like rsm_fmtprog.
+// ma is used for temporary memory. Returns SIZE_MAX if ma is out of memory.
+RSMAPI size_t rsm_emitc(char* buf, size_t bufcap, const rrom_t* rom, rmemalloc_t* ma);
+
 
 //———————————————————————————————————————————————————————————————————————————————————————
 // assembler (optional)
@@ -698,6 +862,19 @@ enum rasmflag {
   RASM_NOCOMPRESS = 1 << 0, // disable ROM image compression
 };
 
+// rprofent_t: execution count of a function or data, by name
+typedef struct {
+  const char* name;
+  uint32_t    namelen;
+  uint64_t    count; // functions: number of calls; data: number of loads & stores
+} rprofent_t;
+
+// rprofile_t: execution profile, used by rasm_gen for code & data layout
+typedef struct {
+  rprofent_t* funv;  size_t func;  // functions which were called
+  rprofent_t* datav; size_t datac; // data which was accessed
+} rprofile_t;
+
 // rasm_t: assembly session (think of it as one source file)
 typedef struct {
   rmemalloc_t*   memalloc;    // memory allocator
@@ -705,6 +882,7 @@ typedef struct {
   size_t         srclen;      // length of srcdata
   const char*    srcname;     // symbolic name of source (e.g. filename)
   rasmflag_t     flags;       // control generation
+  const rprofile_t* nullable profile; // lay out code & data by profile (rasm_gen)
   uint32_t       errcount;    // number of errors reported
   rdiag_t        diag;        // last diagnostic report
   rdiaghandler_t diaghandler; // diagnostic report callback
@@ -744,6 +922,20 @@ RSMAPI rnode_t* nullable rasm_parse(rasm_t* a);
 // rasm_gen builds VM code from AST. a can be reused.
 // When you are done with the resulting rom, call rsm_freerom(rom, a->memalloc).
 RSMAPI rerr_t rasm_gen(rasm_t* a, rnode_t* module, rrom_t* rom);
+// If a->profile is set, functions are placed in order of call count, following the
+// first function, which is the program's entry point. Data which was accessed is
+// placed before data which was not, so that hot data shares pages.
+
+// rasm_profile_memtrace builds a profile from a memory-access trace (see memtrace.h)
+// of a program built by the last call to rasm_gen with a.
+// Function call counts are derived from the return addresses stored by CALL
+// instructions with an immediate destination.
+// When you are done with the profile, call rasm_profile_free(a, profile).
+RSMAPI rerr_t rasm_profile_memtrace(
+  rasm_t* a, const void* trace, size_t tracesize, rprofile_t* profile);
+
+// rasm_profile_free frees a profile created by rasm_profile_memtrace
+RSMAPI void rasm_profile_free(rasm_t* a, rprofile_t* profile);
 
 // rasm_dispose frees resources of a
 RSMAPI void rasm_dispose(rasm_t* a);
@@ -220,21 +220,22 @@ char abuf_zeroc = 0;
 
 const char* rerr_str(rerr_t e) {
   switch ((enum rerr_)e) {
-  case rerr_ok:            return "(no error)";
-  case rerr_invalid:       return "invalid data or argument";
-  case rerr_sys_op:        return "invalid syscall op or syscall op data";
-  case rerr_badfd:         return "invalid file descriptor";
-  case rerr_bad_name:      return "invalid or misformed name";
-  case rerr_not_found:     return "resource not found";
-  case rerr_name_too_long: return "name too long";
-  case rerr_canceled:      return "operation canceled";
-  case rerr_not_supported: return "not supported";
-  case rerr_exists:        return "already exists";
-  case rerr_end:           return "end of resource";
-  case rerr_access:        return "permission denied";
-  case rerr_nomem:         return "cannot allocate memory";
-  case rerr_mfault:        return "bad memory address";
-  case rerr_overflow:      return "value too large";
+  case rerr_ok:             return "(no error)";
+  case rerr_invalid:        return "invalid data or argument";
+  case rerr_sys_op:         return "invalid syscall op or syscall op data";
+  case rerr_badfd:          return "invalid file descriptor";
+  case rerr_bad_name:       return "invalid or misformed name";
+  case rerr_not_found:      return "resource not found";
+  case rerr_name_too_long:  return "name too long";
+  case rerr_canceled:       return "operation canceled";
+  case rerr_not_supported:  return "not supported";
+  case rerr_exists:         return "already exists";
+  case rerr_end:            return "end of resource";
+  case rerr_access:         return "permission denied";
+  case rerr_nomem:          return "cannot allocate memory";
+  case rerr_mfault:         return "bad memory address";
+  case rerr_overflow:       return "value too large";
+  case rerr_stack_overflow: return "stack overflow";
   }
   return "(unknown error)";
 }
@@ -654,6 +655,7 @@ rerr_t init_mm();
 rerr_t init_rmem();
 rerr_t init_vmem();
 rerr_t init_asmparse();
+rerr_t init_machine();
 
 bool rsm_init() {
   static bool y = false; if (y) return true; y = true;
@@ -683,6 +685,9 @@ bool rsm_init() {
     CHECK_ERR(init_asmparse(), "init_asmparse");
   #endif
 
+  // virtual machine (its tests use the assembler)
+  CHECK_ERR(init_machine(), "init_machine");
+
   return true;
 error:
   log("rsm_init error: %s (%s)", rerr_str(err), err_what);
@@ -738,6 +738,15 @@ typedef __builtin_va_list va_list;
   #define dlog(format, ...) ((void)0)
 #endif
 
+// void statlog(const char* fmt, ...)
+// RSM_STATS: define to log runtime statistics (scheduler, vm, allocator, ioring)
+// when a machine is disposed. Independent of DEBUG.
+#ifdef RSM_STATS
+  #define statlog(format, args...) log("[stats] " format, ##args)
+#else
+  #define statlog(format, ...) ((void)0)
+#endif
+
 // --------------------------------------------------------------------------------------
 RSM_ASSUME_NONNULL_BEGIN
 
@@ -20,17 +20,8 @@
 #include "hash.h"
 #include "syscall.h"
 
-// tctx
-// #define TCTX_ALIGN       PAGE_SIZE
-// #define TCTX_ALIGN       CEIL_POW2_X(sizeof(tctx_t))
-#define TCTX_ALIGN       _Alignof(tctx_t)
-#define TCTX_ALIGN_BITS  ILOG2(TCTX_ALIGN)
-
-// u64 TCTX_VADDR(u64 sp) calculates the address of tctx given a stack pointer
-#define TCTX_VADDR(sp)  ALIGN2_FLOOR((u64)(sp) - (u64)sizeof(tctx_t), TCTX_ALIGN)
-
 // stack constants
-static_assert(STK_MIN >= ALIGN2_X(sizeof(tctx_t), TCTX_ALIGN), "STK_MIN too small");
+static_assert(STK_MIN >= STK_ALIGN, "STK_MIN too small");
 static_assert(STK_MIN % STK_ALIGN == 0, "STK_MIN not aligned to STK_ALIGN");
 static_assert(STK_DEFAULT % STK_ALIGN == 0, "STK_DEFAULT not aligned to STK_ALIGN");
 
@@ -38,11 +29,21 @@ static_assert(STK_DEFAULT % STK_ALIGN == 0, "STK_DEFAULT not aligned to STK_ALIG
 #define MAIN_RET_PC  USIZE_MAX
 
 // STACK_VADDR is the virtual address of the base of the main stack
+// (see s_stack_vaddr)
 #define STACK_VADDR  ALIGN_FLOOR_X(VM_ADDR_MAX+1, STK_ALIGN)
 
 // DATA_VADDR is the virtual address of the data section
 #define DATA_VADDR  VM_ADDR_MIN
 
+// s_stack_vaddr returns the virtual address of the base of the main stack.
+// With a direct window (vm_map_direct_init) the stack is at the top of the window,
+// so that stack accesses are direct too.
+inline static u64 s_stack_vaddr(const rsched_t* s) {
+  if (s->vm_map.direct_size)
+    return ALIGN_FLOOR_X(s->vm_map.direct_size, STK_ALIGN);
+  return STACK_VADDR;
+}
+
 // EPILOGUE_LEN: number of instructions in the main epilogue.
 #define EPILOGUE_LEN 1
 
@@ -57,21 +58,28 @@ enum PStatus {
   P_DEAD,
 };
 
-// stackbase for a task
-#define TASK_STACKBASE(t) ((void*)ALIGN2_FLOOR((uintptr)(t),STK_ALIGN))
-
 
 #define trace  schedtrace1
 #define trace2 schedtrace2
 #define trace3 schedtrace3
 
+// _g_current_m is the M running on the current OS thread (see m_current)
+#ifdef RSM_NO_LIBC
+  static M* nullable _g_current_m = NULL; // no OS threads
+#else
+  static _Thread_local M* nullable _g_current_m = NULL;
+#endif
+M* nullable m_current() {
+  return _g_current_m;
+}
+
+void m_set_current(M* nullable m) {
+  _g_current_m = m;
+}
+
 #if SCHED_TRACE && !defined(RSM_NO_LIBC)
   #include <stdio.h>
 
-  // thread-local storage of the current M on current OS thread, for tracing
-  static _Thread_local M* _g_current_m = NULL;
-  #define TRACE_SET_CURRENT_M(m)  do{ _g_current_m = (m); }while(0)
-
   #define TRACE_LOG_PREFIX "\e[1m▍\e[0m "
 
   // "Mn Pn Tn  function  message"
@@ -104,8 +112,6 @@ enum PStatus {
     fprintf(fp, "\e[0m\n");
     funlockfile(fp);
   }
-#else
-  #define TRACE_SET_CURRENT_M(m)  ((void)0)
 #endif
 
 
@@ -139,6 +145,7 @@ UNUSED static const char* tstatus_str(tstatus_t status) {
     case T_RUNNABLE: return "T_RUNNABLE";
     case T_RUNNING:  return "T_RUNNING";
     case T_SYSCALL:  return "T_SYSCALL";
+    case T_WAITING:  return "T_WAITING";
     case T_DEAD:     return "T_DEAD";
   }
   return "?";
@@ -171,13 +178,32 @@ static void pbits_clear(pbitset_t* bs, u32 bit) {
 
 
 
-#define MNOTE_LOCKED  ((uintptr)1lu)
+#define MNOTE_LOCKED  1lu
 
 
 static void mnote_clear(mnote_t* n) {
   n->key = 0;
 }
 
+#ifdef RSM_FUTEX
+
+// note_wakeup notifies callers to note_sleep
+static void mnote_wakeup(mnote_t* n) {
+  UNUSED u32 key = AtomicExchange(&n->key, MNOTE_LOCKED, memory_order_seq_cst);
+  assertf(key == 0, "double %s", __FUNCTION__);
+  futex_wake(&n->key, 1);
+}
+
+// Note: there's no spinning here, unlike mutex_t and sema_t; an M only parks
+// after it has already spun looking for work in m_findrunnable.
+static void mnote_sleep(mnote_t* n, M* m) {
+  m->blocked = true;
+  while (AtomicLoad(&n->key, memory_order_seq_cst) == 0)
+    futex_wait(&n->key, 0, -1);
+  m->blocked = false;
+}
+
+#else // !RSM_FUTEX
 
 // note_wakeup notifies callers to note_sleep
 static void mnote_wakeup(mnote_t* n) {
@@ -196,7 +222,7 @@ static void mnote_wakeup(mnote_t* n) {
 
 static void mnote_sleep(mnote_t* n, M* m) {
   uintptr key = 0;
-  if (!AtomicCASRelaxed(&n->key, &key, (uintptr)&m->parksema)) {
+  if (!AtomicCASRelaxed(&n->key, &key, (uintptr)m)) {
     // note_wakeup called already
     // note: AtomicCAS loads current val of n.key into key on failure
     assert(key == MNOTE_LOCKED);
@@ -207,17 +233,13 @@ static void mnote_sleep(mnote_t* n, M* m) {
   m->blocked = false;
 }
 
+#endif // RSM_FUTEX
 
 
 static inline void m_acquire(M* m) { m->locks++; }
 static inline void m_release(M* m) { m->locks--; }
 
 
-// static void t_free(T* task) {
-//   usize memsize = (usize)(((uintptr)task + (uintptr)sizeof(T)) - task->stacktop);
-//   rmem_free(task->s->memalloc, (void*)task->stacktop, memsize);
-// }
-
 // void assert_tstatus(const T* t, tstatus_t expect_status)
 // void assert_not_tstatus(const T* t, tstatus_t anything_but_status)
 #if DEBUG
@@ -290,13 +312,13 @@ static void t_casstatus(T* t, tstatus_t oldval, tstatus_t newval) {
 
 // Put t and a batch of work from local runnable queue on global queue.
 // Executed only by the owner P.
-static bool p_runq_put_slow(P* p, T* t, u32 head, u32 tail) {
+static bool p_runq_put_slow(P* p, prunq_t* q, T* t, u32 head, u32 tail) {
   panic("TODO");
   return false;
 }
 
 
-// p_runq_put tries to put t on the local runnable queue.
+// p_runq_put tries to put t on the local runnable queue of its class.
 // If runnext if false, runqput adds T to the tail of the runnable queue.
 // If runnext is true, runqput puts T in the p.runnext slot.
 // If the run queue is full, runnext puts T on the global queue.
@@ -320,120 +342,185 @@ static void p_runq_put(P* p, T* t, bool runnext) {
     t = oldnext;
   }
 
+  prunq_t* q = &p->runq[AtomicLoad(&t->sclass, memory_order_relaxed)];
   while (1) {
     // load-acquire, sync with consumers
-    u32 head = AtomicLoadAcq(&p->runqhead);
-    u32 tail = p->runqtail;
+    u32 head = AtomicLoadAcq(&q->head);
+    u32 tail = q->tail;
     if (tail - head < P_RUNQSIZE) {
       trace3("set p.runq[%u] = T%llu", tail % P_RUNQSIZE, t->id);
-      p->runq[tail % P_RUNQSIZE] = t;
+      q->v[tail % P_RUNQSIZE] = t;
       // store memory_order_release makes the item available for consumption
-      AtomicStoreRel(&p->runqtail, tail + 1);
+      AtomicStoreRel(&q->tail, tail + 1);
       return;
     }
     // Put t and move half of the locally scheduled runnables to global runq
-    if (p_runq_put_slow(p, t, head, tail))
+    if (p_runq_put_slow(p, q, t, head, tail))
       return;
     // the queue is not full, now the put above must succeed. retry...
   }
 }
 
 
+// prunq_get dequeues a T from q, or returns NULL if q is empty
+static T* nullable prunq_get(prunq_t* q) {
+  while (1) {
+    u32 head = AtomicLoadAcq(&q->head); // load-acquire, sync with consumers
+    u32 tail = q->tail;
+    if (tail == head)
+      return NULL;
+    T* t = q->v[head % P_RUNQSIZE];
+    if (AtomicCASRel(&q->head, &head, head + 1)) // cas-release, commits consume
+      return t;
+    trace3("CAS failure; retry");
+  }
+}
+
+
+// prunq_isempty returns true if q has no Ts
+inline static bool prunq_isempty(prunq_t* q) {
+  return AtomicLoadAcq(&q->head) == AtomicLoadAcq(&q->tail);
+}
+
+
+// p_batch_due returns true if P should run a batch task next, even though
+// latency-critical tasks are waiting (see S_LATENCY_STREAK.)
+inline static bool p_batch_due(const P* p) {
+  return p->lcstreak >= S_LATENCY_STREAK;
+}
+
+
+// p_lcstreak_update records that P is about to run t
+static void p_lcstreak_update(P* p, const T* t) {
+  if (AtomicLoad(&t->sclass, memory_order_relaxed) == S_CLASS_LATENCY &&
+      !prunq_isempty(&p->runq[S_CLASS_BATCH]))
+  {
+    p->lcstreak++;
+  } else {
+    p->lcstreak = 0;
+  }
+}
+
+
 // Get T from local runnable queue.
+// Latency-critical tasks go first, unless p_batch_due.
 // If inherit_time is true, T should inherit the remaining time in the current time slice.
 // Otherwise, it should start a new time slice.
 // Executed only by the owner P.
 static T* nullable p_runq_get(P* p, bool* inherit_time) {
-  // If there's a runnext, it's the next G to run.
+  T* t;
+  *inherit_time = false;
+
+  if UNLIKELY(p_batch_due(p) && (t = prunq_get(&p->runq[S_CLASS_BATCH])))
+    goto end;
+
+  // If there's a runnext, it's the next G to run,
+  // unless it's a batch task and there are latency-critical tasks waiting.
   while (1) {
     T* next = p->runnext;
     if (next == NULL)
       break;
+    if (AtomicLoad(&next->sclass, memory_order_relaxed) != S_CLASS_LATENCY &&
+        !prunq_isempty(&p->runq[S_CLASS_LATENCY]))
+    {
+      break;
+    }
     if (AtomicCASAcqRel(&p->runnext, &next, NULL)) {
       *inherit_time = true;
-      return next;
+      t = next;
+      goto end;
     }
   }
 
   //trace("no runnext; trying dequeue p->runq");
-  *inherit_time = false;
+  for (u32 cls = S_NCLASS; cls-- > 0;) {
+    if ((t = prunq_get(&p->runq[cls])))
+      goto end;
+  }
 
-  while (1) {
-    u32 head = AtomicLoadAcq(&p->runqhead); // load-acquire, sync with consumers
-    u32 tail = p->runqtail;
-    if (tail == head)
-      return NULL;
-    // trace3("loop2 tail != head; load p->runq[%u]", head % P_RUNQSIZE);
-    T* t = p->runq[head % P_RUNQSIZE];
-    // trace3("loop2 t => %p", t);
-    // trace3("loop2 t => T%llu", t->id);
-    if (AtomicCASRel(&p->runqhead, &head, head + 1)) // cas-release, commits consume
-      return t;
-    trace3("CAS failure; retry");
+  // runnext was skipped in favor of latency-critical tasks that have since been stolen
+  while ((t = p->runnext)) {
+    if (AtomicCASAcqRel(&p->runnext, &t, NULL)) {
+      *inherit_time = true;
+      goto end;
+    }
   }
+  return NULL;
+
+end:
+  p_lcstreak_update(p, t);
+  return t;
 }
 
 
-// p_runq_grab grabs a batch of tasks from P's runnable queue into dst_runq.
+// p_runq_grab grabs a batch of tasks from P's runnable queue q into dst_runq.
 // dst_runq is a ring buffer starting at dst_head.
 // Returns number of grabbed tasks.
-static u32 p_runq_grab(P* p, T* dst_runq[P_RUNQSIZE], u32 dst_head, bool steal_runnext) {
-  trace3("source P%u (steal_runnext=%u)", p->id, steal_runnext);
+static u32 p_runq_grab(prunq_t* q, T* dst_runq[P_RUNQSIZE], u32 dst_head) {
   while (1) {
     // load-acquire, synchronize with other consumers
-    u32 h = AtomicLoadAcq(&p->runqhead);
+    u32 h = AtomicLoadAcq(&q->head);
     // load-acquire, synchronize with the producer
-    u32 t = AtomicLoadAcq(&p->runqtail);
+    u32 t = AtomicLoadAcq(&q->tail);
     u32 n = t - h;
     n = n - n/2;
-    if (n == 0) {
-      if (steal_runnext) {
-        // Try to steal from p.runnext.
-        T* next = p->runnext;
-        if (next != 0) {
-          // ensure that p isn't about to run the T we are about to steal.
-          // The important use case here is when the T running on p readies another T
-          // and then almost immediately blocks.
-          if (p->status == P_RUNNING)
-            thread_yield();
-          if (!AtomicCASRel(&p->runnext, &next, NULL))
-            continue;
-          dst_runq[dst_head % P_RUNQSIZE] = next;
-          return 1;
-        }
-      }
+    if (n == 0)
       return 0;
-    }
     if (n > (u32)(P_RUNQSIZE / 2)) // read inconsistent h and t
       continue;
     for (u32 i = 0; i < n; i++) {
-      T* t = p->runq[(h + i) % P_RUNQSIZE];
+      T* t = q->v[(h + i) % P_RUNQSIZE];
       dst_runq[(dst_head + i) % P_RUNQSIZE] = t;
     }
-    if (AtomicCASRel(&p->runqhead, &h, h + n)) // cas-release, commits consume
+    if (AtomicCASRel(&q->head, &h, h + n)) // cas-release, commits consume
       return n;
   }
 }
 
 
+// p_runnext_steal tries to steal src_p.runnext
+static T* nullable p_runnext_steal(P* src_p) {
+  while (1) {
+    T* next = src_p->runnext;
+    if (next == NULL)
+      return NULL;
+    // ensure that p isn't about to run the T we are about to steal.
+    // The important use case here is when the T running on p readies another T
+    // and then almost immediately blocks.
+    if (src_p->status == P_RUNNING)
+      thread_yield();
+    if (AtomicCASRel(&src_p->runnext, &next, NULL))
+      return next;
+  }
+}
+
+
 // p_runq_steal steals half of the tasks from src_p.runq, putting them on p.runq.
+// Latency-critical tasks are stolen first; src_p.runnext is stolen only when
+// steal_runnext is true and src_p has nothing else to steal.
 // Returns one of the stolen tasks, or NULL if failed.
 static T* nullable p_runq_steal(P* p, P* src_p, bool steal_runnext) {
-  u32 tail = AtomicLoad(&p->runqtail, memory_order_relaxed);
-  u32 n = p_runq_grab(src_p, p->runq, tail, steal_runnext);
-  if (n == 0) {
-    trace3("could not grab any tasks");
-    return NULL;
-  }
-  trace3("grabbed %u tasks from P%u", n, src_p->id);
-  n--;
-  T* t = p->runq[(tail + n) % P_RUNQSIZE];
-  if (n == 0) // just one task
+  trace3("source P%u (steal_runnext=%u)", src_p->id, steal_runnext);
+  for (u32 cls = S_NCLASS; cls-- > 0;) {
+    prunq_t* q = &p->runq[cls];
+    u32 tail = AtomicLoad(&q->tail, memory_order_relaxed);
+    u32 n = p_runq_grab(&src_p->runq[cls], q->v, tail);
+    if (n == 0)
+      continue;
+    trace3("grabbed %u tasks from P%u", n, src_p->id);
+    n--;
+    T* t = q->v[(tail + n) % P_RUNQSIZE];
+    if (n == 0) // just one task
+      return t;
+    UNUSED u32 h = AtomicLoadAcq(&q->head); // load-acquire, sync with consumers
+    assertf(tail - h + n < P_RUNQSIZE, "runq overflow");
+    AtomicStoreRel(&q->tail, tail+n); // store-release, make available for consumption
     return t;
-  UNUSED u32 h = AtomicLoadAcq(&p->runqhead); // load-acquire, sync with consumers
-  assertf(tail - h + n >= P_RUNQSIZE, "runq overflow");
-  AtomicStoreRel(&p->runqtail, tail+n); // store-release, make available for consumption
-  return t;
+  }
+  if (steal_runnext)
+    return p_runnext_steal(src_p);
+  trace3("could not grab any tasks");
+  return NULL;
 }
 
 
@@ -462,61 +549,9 @@ static rerr_t s_allt_add(rsched_t* s, T* t) {
 }
 
 
-// tctx_vaddr calculates the address of a tctx_t given a stack pointer
-static u64 tctx_vaddr(u64 sp) {
-  u64 vaddr = ALIGN2_FLOOR((u64)(sp) - (u64)sizeof(tctx_t), TCTX_ALIGN);
-
-  if LIKELY(VM_PAGE_ADDR(vaddr) == VM_PAGE_ADDR(vaddr + sizeof(tctx_t)))
-    return vaddr;
-
-  // the ctx address spans pages; store it at the end of the first page
-  return ALIGN2_FLOOR(vaddr + sizeof(tctx_t), PAGE_SIZE) - sizeof(tctx_t);
-}
-
-
-static tctx_t* nullable m_get_tctx(M* m, T* t) {
-  // A suspended task's tctx is stored on the task's stack, just above SP
-  u64 ctx_vaddr = tctx_vaddr(t->sp);
-  assertf(ctx_vaddr >= t->stack_lo, "%llx, %llx", ctx_vaddr, t->stack_lo);
-
-  // get backing memory
-  vm_cache_t* vm_cache = m_vm_cache(m, VM_PERM_RW);
-  uintptr haddr = VM_TRANSLATE(vm_cache, &m->s->vm_map, ctx_vaddr, TCTX_ALIGN);
-
-  //dlog("load ctx from stack at vaddr 0x%llx (haddr %p)", ctx_vaddr, (void*)haddr);
-  return (tctx_t*)haddr;
-}
-
-
-static void t_save_ctx(T* t) {
-  M* m = assertnotnull(t->m);
-  tctx_t* ctx = assertnotnull(m_get_tctx(m, t));
-  for (usize i = 0; i < countof(ctx->fregs); i++)
-    ctx->fregs[i] = m->fregs[i + RSM_NTMPREGS];
-  for (usize i = 0; i < countof(ctx->iregs); i++)
-    ctx->iregs[i] = m->iregs[i + RSM_NTMPREGS];
-  t->sp = m->iregs[RSM_MAX_REG];
-}
-
-
-static void t_restore_ctx(T* t) {
-  M* m = assertnotnull(t->m);
-  tctx_t* ctx = assertnotnull(m_get_tctx(m, t));
-  // tctx_t layout:
-  //   [byte 0] F{RSM_NTMPREGS} F{RSM_NTMPREGS+1} F{...} F{RSM_NREGS-1} ...
-  //        ... R{RSM_NTMPREGS} R{RSM_NTMPREGS+1} R{...} R{RSM_NREGS-2}
-  for (usize i = 0; i < countof(ctx->fregs); i++)
-    m->fregs[i + RSM_NTMPREGS] = ctx->fregs[i];
-  for (usize i = 0; i < countof(ctx->iregs); i++)
-    m->iregs[i + RSM_NTMPREGS] = ctx->iregs[i];
-  m->iregs[RSM_MAX_REG] = t->sp;
-}
-
-
 // m_dropt removes the association between M and the current task m->currt
 static void m_dropt(M* m) {
   assertnotnull(m->currt);
-  t_save_ctx(m->currt);
   m->currt->m = NULL;
   m->currt = NULL;
 }
@@ -527,8 +562,9 @@ static void s_startm(rsched_t* s, P* nullable p, bool spinning);
 
 // s_wakep tries to add one more P to execute T's.
 // Called when a T is made runnable (m_spawn.)
+// Does nothing if an M is already spinning (see "Spinning policy" in sched.h.)
 static void s_wakep(rsched_t* s) {
-  if (AtomicLoad(&s->nidlep, memory_order_relaxed) == 0)
+  if (AtomicLoad(&s->nidlep, memory_order_relaxed) == 0 || s->stepping)
     return;
 
   // be conservative about spinning threads
@@ -545,7 +581,8 @@ static void s_wakep(rsched_t* s) {
 
 
 // m_switchtask configures m to execute task t.
-// It first saves the current task's state, then restores the state of t.
+// A task's registers live in T and the interpreter operates on them directly,
+// so switching tasks doesn't need to save or restore any register state.
 static void m_switchtask(M* m, T* nullable t) {
   if (t) trace("-> T%llu", t->id);
   else   trace("-> T-");
@@ -558,23 +595,29 @@ static void m_switchtask(M* m, T* nullable t) {
   if (t) {
     m->currt = t;
     t->m = m;
-    t_restore_ctx(t);
   }
 }
 
 
-static T* nullable task_create(M* m, u64 stack_vaddr, usize stacksize, usize instrc) {
+// task_create initializes a new T with the stack at stack_vaddr, allocating it
+// unless a dead T to reuse is provided
+static T* nullable task_create(
+  M* m, u64 stack_vaddr, usize stacksize, usize instrc, T* nullable reuse)
+{
   // task memory layout:
   //
   //               ┌─────────────┬─ stack_lo
   //               │             │
   //               ~      ↑      ~
-  //               │    stack    │← tctx_t on top when task is idle
-  //               ├─────────────┼─ stack_hi (CTX and initial SP)
-  //               │  T struct   │
+  //               │    stack    │
+  //               ├─────────────┼─ stack_hi (initial SP)
+  //               │ return addr │
   //  stack_vaddr ─┴─────────────┘
+  //
+  // T itself, including the register file, is allocated from host memory
+  // so that the guest can't reach it.
 
-  // get backing memory
+  // get backing memory for the return address.
   // note that we subtract STK_ALIGN from stack_vaddr since stack_vaddr is the address
   // of the page just beyond our stack.
   assert(IS_ALIGN2(stack_vaddr, STK_ALIGN));
@@ -587,46 +630,55 @@ static T* nullable task_create(M* m, u64 stack_vaddr, usize stacksize, usize ins
   //dlog("stack 0x%llx => haddr %p ... %p",
   //  stack_vaddr, stackptr - stacksize, stackptr);
 
-  // space for T, below stack, with strongest alignment
-  usize tsize = ALIGN2(sizeof(T), MAX(_Alignof(T), STK_ALIGN));
-
-  T* t = stackptr - tsize;
+  T* t = reuse ? reuse : rmem_alloct(m->s->machine->malloc, T);
+  if (!t)
+    return NULL;
+  memset(t, 0, sizeof(T));
   t->stack_lo = stack_vaddr - stacksize;
-  t->stack_hi = stack_vaddr - (u64)tsize - sizeof(u64);
-  t->sp = t->stack_hi; // current stack pointer
+  t->stack_hi = stack_vaddr - sizeof(u64);
+  t->stackmem = stacksize;
+  t->iregs[RSM_MAX_REG] = t->stack_hi; // SP
 
   // push final return value to stack
-  static_assert(_Alignof(T) <= STK_ALIGN, "assuming u64 alignment of stack");
-  u64* sp = (void*)t - sizeof(u64);
+  static_assert(STK_ALIGN >= sizeof(u64), "assuming u64 alignment of stack");
+  u64* sp = stackptr - sizeof(u64);
   *sp = (u64)(instrc - EPILOGUE_LEN); // instruction offset of epilogue
 
-  // initialize tctx
-  tctx_t* ctx = (tctx_t*)ALIGN2_FLOOR((uintptr)sp - sizeof(tctx_t), TCTX_ALIGN);
-  ctx->iregs[RSM_MAX_REG - RSM_NTMPREGS - 1] = (u64)(uintptr)t; // CTX reg
+  trace2("T@%p stack 0x%llx-0x%llx", t, t->stack_lo, t->stack_hi);
 
-  //dlog("store ctx to stack at vaddr 0x%llx (haddr %p)", tctx_vaddr(t->sp), ctx);
+  return t;
+}
 
-  trace2("T@%p+%zu stack 0x%llx-0x%llx", t, tsize, t->stack_lo, t->stack_hi);
 
-  return t;
+// task_free frees the memory of t, which must not be referenced by the scheduler
+static void task_free(rsched_t* s, T* t) {
+  rmem_freet(s->machine->malloc, t);
 }
 
 
-// m_spawn creates a new T running fn with argsize bytes of arguments.
+// m_spawn creates a new T starting at pc with arguments in R0…R{RSM_NARGREGS-1}
+// (all zero if args is NULL), in scheduling class sclass.
+// If reuse is not NULL, it's a dead T which becomes the new T (see p_freet_get),
+// in which case m_spawn doesn't fail.
 // Put it on the queue of T's waiting to run.
 static T* nullable m_spawn(
   M* m,
-  const rin_t* instrv, usize instrc, usize pc,
-  u64 stack_vaddr, usize stack_vsize,
-  rerr_t* errp)
+  const rin_t* instrv, usize instrc, usize pc, const u64* nullable args,
+  u64 stack_vaddr, usize stack_vsize, const rtaskbudget_t* budget, u8 sclass,
+  T* nullable reuse, rerr_t* errp)
 {
   rerr_t err = 0;
 
   // disable preemption
   m_acquire(m);
 
+  // A reused T stays in s.allt, which is read concurrently by others (which skip
+  // dead T's.) Lock it while the T is initialized.
+  if (reuse)
+    rwmutex_lock(&m->s->allt.lock);
+
   // create task
-  T* newt = task_create(m, stack_vaddr, stack_vsize, instrc);
+  T* newt = task_create(m, stack_vaddr, stack_vsize, instrc, reuse);
   if (!newt) {
     err = rerr_nomem;
     goto onerr;
@@ -636,6 +688,12 @@ static T* nullable m_spawn(
   newt->pc = pc;
   newt->instrc = instrc;
   newt->instrv = instrv;
+  if (args)
+    memcpy(newt->iregs, args, RSM_NARGREGS*sizeof(u64));
+  newt->cpu_budget = budget->cputime;
+  newt->stack_budget = budget->stacksize;
+  newt->budget_kill = budget->kill;
+  newt->sclass = sclass;
   newt->id = AtomicAdd(&m->s->tidgen, 1, memory_order_acquire);
 
   // limit IDs to 0..I64_MAX
@@ -650,8 +708,12 @@ static T* nullable m_spawn(
 
   // add the task to the scheduler
   t_setstatus(newt, T_DEAD);
-  if ((err = s_allt_add(m->s, newt)))
+  if (reuse) {
+    rwmutex_unlock(&m->s->allt.lock);
+  } else if ((err = s_allt_add(m->s, newt))) {
+    task_free(m->s, newt);
     goto onerr;
+  }
 
   // set status to runnable
   t_setstatus(newt, T_RUNNABLE);
@@ -679,6 +741,10 @@ onerr:
 }
 
 
+static T* nullable p_freet_get(P* p);
+static void p_freet_add(P* p, T* t);
+
+
 i64 task_spawn(T* t, usize newtask_pc, const u64 args[RSM_NARGREGS]) {
   M* m = assertnotnull(t->m);
 
@@ -686,18 +752,45 @@ i64 task_spawn(T* t, usize newtask_pc, const u64 args[RSM_NARGREGS]) {
   const rin_t* instrv = t->instrv;
   usize instrc = t->instrc;
 
-  // stack
-  // TODO: allocate virtual memory for stack
-  u64 stack_vaddr = STACK_VADDR - PAGE_SIZE * 2; // FIXME
-  usize stack_vsize = PAGE_SIZE; // FIXME
+  // Reuse a dead T and its stack if there is one. Otherwise map a new stack,
+  // bounded by a guard page like the main task's stack.
+  usize stack_vsize = STK_DEFAULT;
+  u64 stack_vaddr;
+  P* p = assertnotnull(m->p);
+  T* deadt = p_freet_get(p);
+  if (deadt && deadt->stack_hi) {
+    stack_vaddr = deadt->stack_hi + sizeof(u64);
+  } else {
+    rerr_t err = task_stack_map(m, stack_vsize / PAGE_SIZE, &stack_vaddr);
+    if (err) {
+      if (deadt)
+        p_freet_add(p, deadt);
+      return (i64)err;
+    }
+  }
+
+  // new task inherits the budget of its parent task
+  rtaskbudget_t budget = {
+    .cputime = AtomicLoad(&t->cpu_budget, memory_order_relaxed),
+    .stacksize = AtomicLoad(&t->stack_budget, memory_order_relaxed),
+    .kill = AtomicLoad(&t->budget_kill, memory_order_relaxed),
+  };
 
-  // TODO: copy args
-  //memcpy(args)
+  // new task inherits the scheduling class of its parent task
+  u8 sclass = AtomicLoad(&t->sclass, memory_order_relaxed);
 
   rerr_t err;
-  T* newt = m_spawn(m, instrv, instrc, newtask_pc, stack_vaddr, stack_vsize, &err);
-  if (!newt)
+  T* newt = m_spawn(
+    m, instrv, instrc, newtask_pc, args, stack_vaddr, stack_vsize, &budget, sclass,
+    deadt, &err);
+  if (!newt) {
+    assert(!deadt);
+    vm_map_lock(&m->s->vm_map);
+    vm_map_del(&m->s->vm_map, stack_vaddr - stack_vsize - PAGE_SIZE,
+      stack_vsize / PAGE_SIZE + 1);
+    vm_map_unlock(&m->s->vm_map);
     return (i64)err;
+  }
   trace("-> T%llu (pc %lu)", newt->id, newtask_pc);
   return (i64)newt->id;
 }
@@ -726,6 +819,15 @@ static void p_acquire_m(P* p, M* m) {
   m->p = p;
   p->m = m;
   AtomicStoreRel(&p->status, P_RUNNING);
+  #ifdef SCHED_PIN_PROCS
+    // pin m's OS thread, unless m is acquiring p on behalf of another thread
+    if ((i32)p->cpu != m->cpu && m == m_current()) {
+      rerr_t err = os_pinthread(p->cpu);
+      if (err)
+        dlog("failed to pin M%u to CPU %u: %s", m->id, p->cpu, rerr_str(err));
+      m->cpu = err ? -1 : (i32)p->cpu;
+    }
+  #endif
 }
 
 // p_release_m disassociates P from its current M
@@ -739,7 +841,7 @@ static void p_release_m(P* p) {
 }
 
 
-// p_runq_isempty returns true if p has no Ts on its local run queue
+// p_runq_isempty returns true if p has no Ts on its local run queues
 static bool p_runq_isempty(P* p) {
   // return p->runqhead == p->runqtail && p->runnext == 0; //< unlocked impl
 
@@ -749,16 +851,32 @@ static bool p_runq_isempty(P* p) {
   // Simply observing that runqhead == runqtail and then observing that runqnext == NULL
   // does not mean the queue is empty.
   while (1) {
-    u32 head = AtomicLoadAcq(&p->runqhead);
-    u32 tail = AtomicLoadAcq(&p->runqtail);
-    T* runnext = AtomicLoadAcq(&p->runnext);
-    if (tail == AtomicLoadAcq(&p->runqtail)) {
-      return head == tail && runnext == NULL;
+    bool empty = true;
+    u32 tails[S_NCLASS];
+    for (u32 cls = 0; cls < S_NCLASS; cls++) {
+      u32 head = AtomicLoadAcq(&p->runq[cls].head);
+      tails[cls] = AtomicLoadAcq(&p->runq[cls].tail);
+      empty &= head == tails[cls];
     }
+    T* runnext = AtomicLoadAcq(&p->runnext);
+    bool consistent = true;
+    for (u32 cls = 0; cls < S_NCLASS; cls++)
+      consistent &= tails[cls] == AtomicLoadAcq(&p->runq[cls].tail);
+    if (consistent)
+      return empty && runnext == NULL;
   }
 }
 
 
+// p_has_latency_work returns true if latency-critical tasks are waiting to run on p
+static bool p_has_latency_work(P* p) {
+  if (!prunq_isempty(&p->runq[S_CLASS_LATENCY]))
+    return true;
+  T* next = AtomicLoadAcq(&p->runnext);
+  return next && AtomicLoad(&next->sclass, memory_order_relaxed) == S_CLASS_LATENCY;
+}
+
+
 // p_update_timerp_mask clears P's timer mask if it has no timers.
 //
 // Ideally, the timer mask would be kept immediately consistent on any timer
@@ -829,6 +947,22 @@ static M* nullable s_idlem_get(rsched_t* s) {
 }
 
 
+// s_idlem_take removes m from s.idlem list. Returns false if m is not idle.
+// s.lock must be held.
+static bool s_idlem_take(rsched_t* s, M* m) {
+  s_assert_locked(s);
+  for (M** mp = &s->idlem; *mp; mp = &(*mp)->nextm) {
+    if (*mp == m) {
+      *mp = m->nextm;
+      AtomicSub(&s->nidlem, 1, memory_order_relaxed);
+      trace2("M%u", m->id);
+      return true;
+    }
+  }
+  return false;
+}
+
+
 // idlep_put puts P on s.idlep list.
 // p.s.lock must be held.
 static void idlep_put(P* p) {
@@ -857,16 +991,26 @@ static void idlem_put(M* m) {
 }
 
 
+// s_runq_len returns the number of Ts on the global runnable queues
+inline static u32 s_runq_len(rsched_t* s) {
+  u32 len = 0;
+  for (u32 cls = 0; cls < S_NCLASS; cls++)
+    len += AtomicLoad(&s->runq[cls].len, memory_order_relaxed);
+  return len;
+}
+
+
 // s_runq_prepend puts T in front of the global runnable queue, to be run ASAP.
 // s.lock must be held.
 static void s_runq_prepend(rsched_t* s, T* t) {
   s_assert_locked(s);
   assertnull(t->schedlink);
-  t->schedlink = AtomicLoadAcq(&s->runq.head);
-  AtomicStoreRel(&s->runq.head, t);
-  if (AtomicLoadAcq(&s->runq.tail) == NULL)
-    AtomicStoreRel(&s->runq.tail, t);
-  AtomicAdd(&s->runq.len, 1, memory_order_release);
+  srunq_t* q = &s->runq[AtomicLoad(&t->sclass, memory_order_relaxed)];
+  t->schedlink = AtomicLoadAcq(&q->head);
+  AtomicStoreRel(&q->head, t);
+  if (AtomicLoadAcq(&q->tail) == NULL)
+    AtomicStoreRel(&q->tail, t);
+  AtomicAdd(&q->len, 1, memory_order_release);
 }
 
 
@@ -875,34 +1019,43 @@ static void s_runq_prepend(rsched_t* s, T* t) {
 static void s_runq_append(rsched_t* s, T* t) {
   s_assert_locked(s);
   assertnull(t->schedlink);
-  T* tail = AtomicLoadAcq(&s->runq.head);
+  srunq_t* q = &s->runq[AtomicLoad(&t->sclass, memory_order_relaxed)];
+  T* tail = AtomicLoadAcq(&q->tail);
   if (tail) {
     tail->schedlink = t;
   } else {
-    AtomicStoreRel(&s->runq.head, t);
+    AtomicStoreRel(&q->head, t);
   }
-  AtomicStoreRel(&s->runq.tail, t);
-  AtomicAdd(&s->runq.len, 1, memory_order_release);
+  AtomicStoreRel(&q->tail, t);
+  AtomicAdd(&q->len, 1, memory_order_release);
 }
 
 
 // s_runq_pop is a helper for s_runq_get
-static T* s_runq_pop(rsched_t* s) {
+static T* s_runq_pop(rsched_t* s, srunq_t* q) {
   s_assert_locked(s);
-  T* t = assertnotnull(AtomicLoadAcq(&s->runq.head));
-  AtomicStoreRel(&s->runq.head, t->schedlink);
+  T* t = assertnotnull(AtomicLoadAcq(&q->head));
+  AtomicStoreRel(&q->head, t->schedlink);
   if (t->schedlink == NULL)
-    AtomicStoreRel(&s->runq.head, NULL);
+    AtomicStoreRel(&q->tail, NULL);
+  t->schedlink = NULL;
   return t;
 }
 
 
-// s_runq_get attempts to dequeue a batch of T's from the global runnable queue.
+// s_runq_get attempts to dequeue a batch of T's from the global runnable queues.
+// Latency-critical tasks go first, unless p is due to run a batch task.
 // s.lock must be held.
 // If max=0, move up to runq_len/s->nprocs extra tasks to p.runq.
 static T* s_runq_get(rsched_t* s, P* nullable p, u32 max) {
   s_assert_locked(s);
-  u32 runq_len = AtomicLoadAcq(&s->runq.len);
+  srunq_t* q = &s->runq[S_CLASS_LATENCY];
+  if (AtomicLoadAcq(&q->len) == 0 ||
+      (p && p_batch_due(p) && AtomicLoadAcq(&s->runq[S_CLASS_BATCH].len) > 0))
+  {
+    q = &s->runq[S_CLASS_BATCH];
+  }
+  u32 runq_len = AtomicLoadAcq(&q->len);
   if (runq_len == 0)
     return NULL;
 
@@ -914,15 +1067,18 @@ static T* s_runq_get(rsched_t* s, P* nullable p, u32 max) {
   if (n > P_RUNQSIZE / 2) // ok, P_RUNQSIZE is 2^N
     n = P_RUNQSIZE / 2;
 
-  AtomicSub(&s->runq.len, n, memory_order_release);
+  AtomicSub(&q->len, n, memory_order_release);
 
   // Take top T, to be returned
-  T* t = s_runq_pop(s);
+  T* t = s_runq_pop(s, q);
 
   // Move n Ts from top of s->runq to end of p->runq
-  if (p) while (--n > 0) {
-    T* t = s_runq_pop(s);
-    p_runq_put(p, t, /*next=*/false);
+  if (p) {
+    while (--n > 0) {
+      T* t = s_runq_pop(s, q);
+      p_runq_put(p, t, /*next=*/false);
+    }
+    p_lcstreak_update(p, t);
   }
 
   return t;
@@ -972,9 +1128,29 @@ static void p_freet_add(P* p, T* t) {
   static_assert(P_FREET_WATERMARK_LOW > 0, "");
   static_assert(P_FREET_WATERMARK_LOW <= P_FREET_WATERMARK_HIGH, "");
 
-  while (p->freet.len >= P_FREET_WATERMARK_LOW) {
-    T* t = tlist_pop(&p->freet);
+  rsched_t* s = p->s;
+  mutex_lock(&s->freet_lock);
+  while (p->freet.len > P_FREET_WATERMARK_LOW)
+    tlist_push(&s->freet, tlist_pop(&p->freet));
+  mutex_unlock(&s->freet_lock);
+}
+
+
+// p_freet_get takes a T from P's freet list, refilling it from the global s.freet
+// list if it's empty. Returns NULL if there are no free T's.
+// T's on freet lists keep their stack for reuse, unless it has no stack_hi.
+static T* nullable p_freet_get(P* p) {
+  if (p->freet.len == 0) {
+    rsched_t* s = p->s;
+    mutex_lock(&s->freet_lock);
+    while (p->freet.len < P_FREET_WATERMARK_LOW / 2 && s->freet.len > 0)
+      tlist_push(&p->freet, tlist_pop(&s->freet));
+    mutex_unlock(&s->freet_lock);
   }
+  T* t = tlist_pop(&p->freet);
+  if (t)
+    trace3("T%llu <- P%u.freet", t->id, p->id);
+  return t;
 }
 
 
@@ -983,12 +1159,17 @@ static void handoff_p(P* p) {
   // we must start an M in any situation where s_findrunnable would return a T to run.
 
   // if there are tasks waiting to run, start P on an M
-  if (!p_runq_isempty(p) || p->s->runq.len != 0) {
+  if (!p_runq_isempty(p) || s_runq_len(p->s) != 0) {
     s_startm(p->s, p, /*spinning*/false);
     return;
   }
 
-  dlog("TODO");
+  // TODO: the other cases of Go's handoffp (e.g. timers and netpoll)
+
+  // no work; put P on the idle list
+  mutex_lock(&p->s->lock);
+  idlep_put(p);
+  mutex_unlock(&p->s->lock);
 }
 
 
@@ -1025,9 +1206,11 @@ static void m_stop(M* m) {
 
   m_park(m);
 
-  // TODO: nextp
-  // p_acquire_m(m->nextp, m);
-  // m->nextp = NULL;
+  // s_startm assigned us a P
+  assertnotnull(m->nextp);
+  p_acquire_m(m->nextp, m);
+  m->nextp = NULL;
+  AtomicAdd(&m->s->stats.wakens, nanotime() - m->waketime, memory_order_relaxed);
 }
 
 
@@ -1056,11 +1239,33 @@ static rerr_t m_exit_main(M* m) {
 
 // m_exit tears down and exits the current thread
 static rerr_t m_exit(M* m) {
-  if (m == &m->s->m0)
+  u64 nmiss = 0, nfill = 0;
+  for (usize i = 0; i < countof(m->vmcache); i++) {
+    nmiss += m->vmcache[i].nmiss;
+    nfill += m->vmcache[i].nprefill;
+  }
+  AtomicAdd(&m->s->stats.nvmmiss, nmiss, memory_order_relaxed);
+  AtomicAdd(&m->s->stats.nvmfill, nfill, memory_order_relaxed);
+
+  rsched_t* s = m->s;
+  if (m == &s->m0)
     return m_exit_main(m);
 
-  trace("TODO");
-  // TODO
+  // All tasks are dead. m0 may be parked in m_stop, in which case nothing would
+  // ever wake it up; hand it a P so that it too finds no live tasks and returns
+  // from rsched_execrom.
+  mutex_lock(&s->lock);
+  P* p = NULL;
+  if (s_idlem_take(s, &s->m0) && !(p = s_idlep_get(s)))
+    idlem_put(&s->m0);
+  mutex_unlock(&s->lock);
+  if (p) {
+    s->m0.nextp = p;
+    s->m0.waketime = nanotime();
+    mnote_wakeup(&s->m0.park);
+  }
+
+  // TODO: free M
 
   return 0;
 }
@@ -1069,7 +1274,7 @@ static rerr_t m_exit(M* m) {
 // m_start is the entry-point for new M's, the thread main function.
 // M doesn't have a P yet.
 NOINLINE static rerr_t m_start(M* m) {
-  TRACE_SET_CURRENT_M(m);
+  m_set_current(m);
 
   // Associate the assigned P with M (unless M is the main thread)
   // Note: m->nextp is set by p_newm
@@ -1077,12 +1282,48 @@ NOINLINE static rerr_t m_start(M* m) {
     assertnotnull(m->nextp);
     p_acquire_m(m->nextp, m);
     m->nextp = NULL;
+    AtomicAdd(&m->s->stats.wakens, nanotime() - m->waketime, memory_order_relaxed);
   }
 
   MUSTTAIL return m_schedule(m);
 }
 
 
+// m_exec executes t on m until t parks or exits, or fails with task_fail
+NOINLINE static void m_exec(M* m, T* t) {
+  #if SCHED_EVALJMP
+    if (__builtin_setjmp(m->evaljmp)) {
+      // unwound by task_fail; registers were clobbered, so don't trust locals
+      m_current()->ineval = false;
+      return;
+    }
+    m->ineval = true;
+  #endif
+  if (m->s->aot) {
+    t->pc = aot_eval(t, t->iregs, t->instrv, t->pc);
+  } else {
+    t->pc = rsched_eval(t, t->iregs, t->instrv, t->pc);
+  }
+  m->ineval = false;
+
+  // preempted by task_preempt; put t back on a run queue behind other tasks.
+  // A task that is over its budget goes on the global run queue, which is checked
+  // only once in a while when a P has local work.
+  if UNLIKELY(m->yield) {
+    m->yield = false;
+    m_dropt(m);
+    t_casstatus(t, T_RUNNING, T_RUNNABLE);
+    if (t->overbudget) {
+      mutex_lock(&m->s->lock);
+      s_runq_append(m->s, t);
+      mutex_unlock(&m->s->lock);
+    } else {
+      p_runq_put(assertnotnull(m->p), t, /*runnext*/false);
+    }
+  }
+}
+
+
 static void m_dispose(M* m) {
   sema_dispose(&m->parksema);
 }
@@ -1093,6 +1334,8 @@ static rerr_t m_init(M* m, rsched_t* s, u64 id) {
   m->s = s;
   mnote_clear(&m->park);
   safecheckx(sema_init(&m->parksema, 0) == 0);
+  m->ineval = false;
+  m->cpu = -1;
 
   // virtual memory caches
   for (usize i = 0; i < countof(m->vmcache); i++)
@@ -1102,6 +1345,28 @@ static rerr_t m_init(M* m, rsched_t* s, u64 id) {
 }
 
 
+void m_vm_sync_cow(M* m) {
+  // Read cowlog with the map read-locked, which keeps vm_ksm_cow from reusing
+  // entries while we look at them. This only happens after a copy-on-write.
+  vm_map_t* map = &m->s->vm_map;
+  vm_map_rlock(map);
+  u32 cowgen = AtomicLoad(&map->cowgen, memory_order_relaxed);
+  if (cowgen - m->vmcowgen > VM_COWLOG_LEN) {
+    // missed entries; drop everything
+    for (usize i = 0; i < countof(m->vmcache); i++)
+      vm_cache_invalidate_all(&m->vmcache[i]);
+  } else {
+    for (u32 g = m->vmcowgen; g != cowgen; g++) {
+      u64 vaddr = map->cowlog[g & (VM_COWLOG_LEN - 1)];
+      for (usize i = 0; i < countof(m->vmcache); i++)
+        vm_cache_invalidate_one(&m->vmcache[i], vaddr);
+    }
+  }
+  m->vmcowgen = cowgen;
+  vm_map_runlock(map);
+}
+
+
 // p_allocm allocates a new M, not associated with any thread.
 // Can use P for allocation context if needed.
 static M* nullable p_allocm(P* p) {
@@ -1141,6 +1406,7 @@ static rerr_t p_newm(P* p, bool start_spinning) {
   assertnull(m->nextp);
   m->nextp = p;
   m->spinning = start_spinning;
+  m->waketime = nanotime();
 
   trace2("M%u", m->id);
 
@@ -1167,8 +1433,11 @@ static void s_startm(rsched_t* s, P* nullable p, bool spinning) {
       UNUSED u32 v = AtomicSub(&s->nmspinning, 1, memory_order_release) - 1;
       assertf(v != 0xFFFFFFFF, "nmspinning decrement does not match increment");
     }
+    return;
   }
 
+  AtomicAdd(&s->stats.nwake, 1, memory_order_relaxed);
+
   // try to acquire an idle M
   M* m = s_idlem_get(s);
 
@@ -1193,10 +1462,12 @@ static void s_startm(rsched_t* s, P* nullable p, bool spinning) {
 
   assert(!m->spinning);
   assertf(m->nextp == 0, "M should not have a P");
-  assertf(spinning && !p_runq_isempty(p), "P should not have runnable tasks");
+  // caller incremented nmspinning, so P should not have runnable tasks
+  assertf(!spinning || p_runq_isempty(p), "P should not have runnable tasks");
 
   m->spinning = spinning;
   m->nextp = p;
+  m->waketime = nanotime();
   mnote_wakeup(&m->park);
 }
 
@@ -1209,54 +1480,9 @@ typedef struct {
   bool        new_work;
 } stealresult_t;
 
-typedef struct {
-  u32 _i, _len, _inc;
-  u32 index;
-} randord_it_t;
-
-
-static u32 gcd(u32 a, u32 b) {
-  while (b != 0) {
-    // a, b = b, a%b
-    u32 tmp = a % b;
-    a = b;
-    b = tmp;
-  }
-  return a;
-}
-
-
-static u32 randord_init(u32* coprimev, u32 nindices) {
-  u32 coprimec = 0;
-  for (u32 i = 1; i <= nindices; i++) {
-    if (gcd(i, nindices) == 1)
-      coprimev[coprimec++] = i;
-  }
-  return coprimec;
-}
-
-
-static randord_it_t randord_it(
-  const u32* coprimev, u32 coprimec, u32 nindices, u32 seed)
-{
-  return (randord_it_t){
-    ._i   = 0,
-    ._len = coprimec,
-    ._inc = coprimev[seed % nindices],
-    .index = seed % coprimec,
-  };
-}
-
-inline static bool randord_it_next(randord_it_t* it) {
-  if (it->_i == it->_len)
-    return false;
-  it->_i++;
-  it->index = (it->index + it->_inc) % it->_len;
-  return true;
-}
-
-
 // m_steal_work attempts to steal work from other P's.
+// Victims are tried tier by tier, nearest first (see s_topo_init), starting at a
+// random P within each tier.
 // Marks m as "spinning".
 static stealresult_t m_steal_work(M* m, bool* inherit_time) {
   stealresult_t res = {0};
@@ -1271,38 +1497,41 @@ static stealresult_t m_steal_work(M* m, bool* inherit_time) {
 
     bool is_final_attempt = i == steal_attempts-1;
 
-    // pick victim P's at random
-    randord_it_t it = randord_it(s->stealord, s->stealordlen, s->nprocs, fastrand());
-    while (randord_it_next(&it)) {
-      P* p2 = s->allp[it.index];
-      if (p2 == p)
-        continue;
-      trace3("victim P%u", p2->id);
-
-      if (is_final_attempt && pbits_isset(&s->timerp_mask, it.index)) {
-        // Steal timers from p2. This call to p_check_timers is the only place where
-        // we might hold a lock on a different P's timers. We do this once on the
-        // last pass before checking runnext because stealing from the other P's runnext
-        // should be the last resort, so if there are timers to steal do that first.
-        //
-        // We only check timers on one of the stealing iterations because the time
-        // stored in now doesn't change in this loop and checking the timers for each P
-        // more than once with the same value of now is probably a waste of time.
-        trace("TODO p_check_timers");
-      }
-
-      // don't bother to attempt to steal if p2 is idle
-      if (pbits_isset(&s->idlep_mask, it.index))
-        continue;
+    for (u32 tier = 0, start = 0; tier < STEAL_NTIERS; start = p->stealtier[tier++]) {
+      u32 n = p->stealtier[tier] - start;
+      u32 r = n ? fastrand() % n : 0;
+      for (u32 j = 0; j < n; j++) {
+        u32 id = p->stealv[start + (r + j) % n];
+        P* p2 = s->allp[id];
+        trace3("victim P%u (tier %u)", p2->id, tier);
+
+        if (is_final_attempt && pbits_isset(&s->timerp_mask, id)) {
+          // Steal timers from p2. This call to p_check_timers is the only place where
+          // we might hold a lock on a different P's timers. We do this once on the
+          // last pass before checking runnext because stealing from the other P's
+          // runnext should be the last resort, so if there are timers to steal do
+          // that first.
+          //
+          // We only check timers on one of the stealing iterations because the time
+          // stored in now doesn't change in this loop and checking the timers for
+          // each P more than once with the same value of now is probably a waste
+          // of time.
+          trace("TODO p_check_timers");
+        }
 
-      // steal half of p2's runq
-      T* t = p_runq_steal(p, p2, is_final_attempt);
-      if (t) {
-        trace2("T%llu (stolen from P%u)", t->id, p2->id);
-        res.t = t;
-        goto end;
+        // don't bother to attempt to steal if p2 is idle
+        if (pbits_isset(&s->idlep_mask, id))
+          continue;
+
+        // steal half of p2's runq
+        T* t = p_runq_steal(p, p2, is_final_attempt);
+        if (t) {
+          trace2("T%llu (stolen from P%u)", t->id, p2->id);
+          AtomicAdd(&s->stats.nsteal[tier], 1, memory_order_relaxed);
+          res.t = t;
+          goto end;
+        }
       }
-
     }
   }
 
@@ -1355,12 +1584,18 @@ static P* nullable s_find_runnable_p(rsched_t* s, u32 nprocs) {
 static void m_resetspinning(M* m) {
   trace2("M%u", m->id);
   assert(m->spinning);
+  rsched_t* s = m->s;
   m->spinning = false;
-  UNUSED i32 nmspinning = AtomicSub(&m->s->nmspinning, 1, memory_order_release);
-  assertf(nmspinning > 0, "negative nmspinning %d", m->s->nmspinning);
+  UNUSED i32 nmspinning = AtomicSub(&s->nmspinning, 1, memory_order_release);
+  assertf(nmspinning > 0, "negative nmspinning %d", s->nmspinning);
   // M wakeup policy is deliberately somewhat conservative, so check if we
-  // need to wakeup another P here
-  s_wakep(m->s);
+  // need to wakeup another P here.
+  // To coalesce wakeups, only do so if there's more work queued up than what this
+  // M is about to run. Otherwise a burst of spawns would cause a chain of wakeups
+  // where each woken M just spins and parks again.
+  P* p = assertnotnull(m->p);
+  if (!p_runq_isempty(p) || s_runq_len(s) > 0)
+    s_wakep(s);
 }
 
 
@@ -1380,10 +1615,24 @@ top:
   p = assertnotnull(m->p);
 
   // check for expired timers
-  u64 now = 0;
+  u64 now = p_nanotime_refresh(p);
   u64 poll_until = 0;
   // TODO: now = p_check_timers(p, &poll_until)
 
+  // latency-critical tasks on the global runq go before local batch tasks
+  if (AtomicLoad(&s->runq[S_CLASS_LATENCY].len, memory_order_relaxed) &&
+      !p_has_latency_work(p) && !p_batch_due(p))
+  {
+    trace3("try s.runq (latency-critical)");
+    mutex_lock(&s->lock);
+    t = s_runq_get(s, p, 0);
+    mutex_unlock(&s->lock);
+    if (t) {
+      *inherit_time = false;
+      return t;
+    }
+  }
+
   // try to dequeue a ready-to-run task from p.runq
   trace3("try p.runq");
   t = p_runq_get(p, inherit_time);
@@ -1394,7 +1643,7 @@ top:
 
   // global runq
   trace3("try s.runq");
-  if (AtomicLoad(&s->runq.len, memory_order_relaxed)) {
+  if (s_runq_len(s)) {
     mutex_lock(&s->lock);
     t = s_runq_get(s, p, 0); // 0 means "move all to P"
     mutex_unlock(&s->lock);
@@ -1407,6 +1656,7 @@ top:
 
   // Check for I/O events
   //TODO: I/O (e.g. netpoll)
+  ioring_kick(s);
 
   // Steal work from other P's
   //
@@ -1415,20 +1665,39 @@ top:
   // when MAXPROCS>1 but the program parallelism is low.
   i32 nmspinning = AtomicLoadAcq(&s->nmspinning);
   i32 npbusy = (i32)( s->nprocs - AtomicLoadAcq(&s->nidlep) );
-  if (m->spinning || 2*nmspinning < npbusy) {
+  if (m->spinning || (2*nmspinning < npbusy && nmspinning < S_MAXSPINNING)) {
     if (!m->spinning) {
       m->spinning = true;
       AtomicAdd(&s->nmspinning, 1, memory_order_release);
     }
-    stealresult_t r = m_steal_work(m, inherit_time);
-    if (r.t)
-      return r.t;
-    now = r.now;
-    // Running a timer may have made some task ready, so try again
-    if (r.new_work)
-      goto top; // retry while loop
-    if (r.poll_until && (poll_until == 0 || r.poll_until < poll_until))
-      poll_until = r.poll_until;
+    // spin with exponential backoff for at most S_SPIN_NSEC
+    u64 spin_start = nanotime();
+    u32 backoff = S_SPIN_BACKOFF_MIN;
+    AtomicAdd(&s->stats.nspin, 1, memory_order_relaxed);
+    for (;;) {
+      stealresult_t r = m_steal_work(m, inherit_time);
+      now = r.now;
+      if (r.poll_until && (poll_until == 0 || r.poll_until < poll_until))
+        poll_until = r.poll_until;
+      // note: running a timer may have made some task ready (r.new_work)
+      if (r.t || r.new_work ||
+          !p_runq_isempty(p) || s_runq_len(s))
+      {
+        AtomicAdd(&s->stats.spinns, nanotime() - spin_start, memory_order_relaxed);
+        if (r.t)
+          return r.t;
+        goto top; // retry while loop
+      }
+      u64 spin_ns = nanotime() - spin_start;
+      if (spin_ns >= S_SPIN_NSEC) {
+        AtomicAdd(&s->stats.spinns, spin_ns, memory_order_relaxed);
+        AtomicAdd(&s->stats.nspinpark, 1, memory_order_relaxed);
+        break;
+      }
+      for (u32 i = 0; i < backoff; i++)
+        cpu_yield();
+      backoff = MIN(backoff*2, S_SPIN_BACKOFF_MAX);
+    }
   }
 
   // if we get here, there's probably no work
@@ -1439,9 +1708,9 @@ top:
   // Before we drop our P, make a snapshot of nprocs
   u32 nprocs = s->nprocs;
   // We might just find a task on the global s.runq, but probably not.
-  if (AtomicLoad(&s->runq.len, memory_order_relaxed) > 0) {
+  if (s_runq_len(s) > 0) {
     t = s_runq_get(s, p, 0); // 0 means "move all to P"
-    assertnotnull(t); // lock held; runq.len not able to change
+    assertnotnull(t); // lock held; runq lengths not able to change
     mutex_unlock(&s->lock);
     trace3("found T%llu in s.runq", t->id);
     *inherit_time = false;
@@ -1510,7 +1779,9 @@ top:
   // look again if there are live tasks
   if (has_live_tasks) {
     // stop the M
+    ioring_poll_end(m);
     m_stop(m);
+    ioring_poll_begin(m);
     // M was woken up
     goto top;
   }
@@ -1521,6 +1792,35 @@ top:
 }
 
 
+// m_run executes runnable task t on m until it yields, parks or exits
+static void m_run(M* m, T* t, bool inherit_time) {
+  P* p = assertnotnull(m->p);
+
+  // save any current task's (m->currt) state and restore state of t (sets m->currt)
+  m_switchtask(m, t);
+
+  // Assign t->m before entering T_RUNNING so running Ts have an M
+  t_casstatus(t, T_RUNNABLE, T_RUNNING);
+  t->waitsince = 0;
+
+  p->schedtick += (u32)inherit_time;
+
+  // start accounting CPU time and publish it, together with the current time
+  u64 now = p_nanotime_refresh(p);
+  t->runsince = now;
+  if (!inherit_time)
+    p->schedwhen = now; // start a new time slice
+  vdso_update(m->s, now);
+  vdso_task_start(m->s, t, now);
+  m_vm_sync(m);
+
+  // execute task
+  trace3("eval (pc %lu)", t->pc);
+  m_exec(m, t);
+  // returns here when the task has been parked with task_park
+}
+
+
 // m_schedule performs scheduling: in a loop, it finds a runnable task and executes it.
 // Returns when all run queues are empty.
 static rerr_t m_schedule(M* m) {
@@ -1536,7 +1836,7 @@ static rerr_t m_schedule(M* m) {
     // Otherwise two tasks can completely occupy the local runqueue by constantly
     // respawning each other.
     if (p && p->schedtick % 61 == 0 &&
-        AtomicLoad(&s->runq.len, memory_order_relaxed) > 0)
+        s_runq_len(s) > 0)
     {
       mutex_lock(&s->lock);
       t = s_runq_get(s, p, 1);
@@ -1544,6 +1844,10 @@ static rerr_t m_schedule(M* m) {
       if (t) trace2("random runq steal of T%llu", t->id);
     }
 
+    // Check for guest submissions once in a while, in case no M is idle to poll
+    if (p && p->schedtick % IORING_POLL_INTERVAL == 0)
+      ioring_kick(s);
+
     // if M does not have an associated P, wait for a P to become available
     if (!p) {
       mutex_lock(&s->lock);
@@ -1555,10 +1859,13 @@ static rerr_t m_schedule(M* m) {
     }
 
     p->preempt = false;
+    p_nanotime_refresh(p);
 
     // m_findrunnable blocks until work is available or all tasks have exited
     if (!t) {
+      ioring_poll_begin(m);
       t = m_findrunnable(m, &inherit_time);
+      ioring_poll_end(m);
       if (!t)
         return m_exit(m);
     }
@@ -1569,19 +1876,7 @@ static rerr_t m_schedule(M* m) {
     if (m->spinning)
       m_resetspinning(m);
 
-    // save any current task's (m->currt) state and restore state of t (sets m->currt)
-    m_switchtask(m, t);
-
-    // Assign t->m before entering T_RUNNING so running Ts have an M
-    t_casstatus(t, T_RUNNABLE, T_RUNNING);
-    t->waitsince = 0;
-
-    p->schedtick += (u32)inherit_time;
-
-    // execute task
-    trace3("eval (pc %lu)", t->pc);
-    t->pc = rsched_eval(t, m->iregs, t->instrv, t->pc);
-    // returns here when the task has been parked with task_park
+    m_run(m, t, inherit_time);
   }
 }
 
@@ -1599,6 +1894,10 @@ void enter_syscall(T* t) {
 
   // save pointer to P attached to M for exit_syscall
   m->oldp = p;
+  u64 now = p_nanotime_refresh(p);
+  t->waitsince = now;
+  t->cputime += now - t->runsince;
+  vdso_update(m->s, now);
 
   // release the P so it can be used by other tasks waiting to run
   p_release_m(p); // disassociate P from M
@@ -1634,6 +1933,12 @@ bool exit_syscall(T* t, int priority) {
     // we have a processor; continue execution
     p_acquire_m(p, m);
     t_casstatus(t, T_SYSCALL, T_RUNNING);
+    t->waitsince = 0;
+    u64 now = p_nanotime_refresh(p);
+    t->runsince = now;
+    vdso_update(m->s, now);
+    vdso_task_start(m->s, t, now);
+    m_vm_sync(m);
     return true;
   }
 
@@ -1675,15 +1980,162 @@ void task_exit(T* t) {
   M* m = t->m;
   P* p = m->p;
 
+  // Keep t's stack for the next task spawned on P, unless it has grown, in which
+  // case it's unmapped so that a long-gone deep recursion doesn't pin its memory.
+  // The main task is not reused; its stack is released when the program is unloaded.
+  bool ismain = t->id == 0;
+  if (!ismain && (t->nsplitstack || t->stackmem != STK_DEFAULT))
+    task_stack_free(t);
+
   m_droptask(m);  // disassociate T from M
 
   // put T on P's freet list
-  p_freet_add(p, t);
+  if (!ismain)
+    p_freet_add(p, t);
 
   // return to m_schedule
 }
 
 
+bool task_sleep(T* t, u64 nsec) {
+  M* m = t->m;
+  rsched_t* s = m->s;
+  if (!s->stepping)
+    return false;
+
+  u64 now = p_nanotime_refresh(assertnotnull(m->p));
+  t->cputime += now - t->runsince;
+  t->waketime = now + MIN(nsec, U64_MAX - now);
+  trace("T%llu sleeps for %llu ns", t->id, nsec);
+
+  m_dropt(m);
+  t_casstatus(t, T_RUNNING, T_WAITING);
+
+  // insert t into s.sleepq after tasks which are due at the same time or earlier
+  T** tp = &s->sleepq;
+  while (*tp && (*tp)->waketime <= t->waketime)
+    tp = &(*tp)->schedlink;
+  t->schedlink = *tp;
+  *tp = t;
+  return true;
+}
+
+
+// s_sleepq_wake moves sleeping tasks which are due at now to p's run queue
+static void s_sleepq_wake(rsched_t* s, P* p, u64 now) {
+  while (s->sleepq && s->sleepq->waketime <= now) {
+    T* t = s->sleepq;
+    s->sleepq = t->schedlink;
+    t->schedlink = NULL;
+    t_casstatus(t, T_WAITING, T_RUNNABLE);
+    p_runq_put(p, t, /*runnext*/false);
+  }
+}
+
+
+bool task_preempt(T* t) {
+  M* m = t->m;
+  u64 now = p_nanotime_refresh(assertnotnull(m->p));
+  m_vm_sync(m);
+  t->cputime += now - t->runsince;
+  t->runsince = now;
+
+  // note: the budget may have been raised since t went over it
+  u64 budget = AtomicLoad(&t->cpu_budget, memory_order_relaxed);
+  // note: kill may have been set since t went over its budget
+  bool overbudget = budget && t->cputime > budget;
+  if UNLIKELY(overbudget) {
+    if (AtomicLoad(&t->budget_kill, memory_order_relaxed))
+      task_fail(t, rerr_canceled);
+    if (!t->overbudget)
+      trace("T%llu spent its CPU budget (%llu ns); deprioritizing", t->id, budget);
+  }
+  t->overbudget = overbudget;
+
+  // rsched_run_for's budget is spent
+  rsched_t* s = m->s;
+  if UNLIKELY(s->run_until && now >= s->run_until) {
+    m->yield = true;
+    return true;
+  }
+
+  // End t's time slice when it has expired, or when latency-critical tasks are
+  // waiting and t is a batch task. An over-budget task yields at every preemption
+  // point. There's no point in yielding when there's nothing else to run.
+  P* p = m->p;
+  bool yield;
+  if (AtomicLoad(&t->sclass, memory_order_relaxed) == S_CLASS_LATENCY) {
+    yield = t->overbudget || now - p->schedwhen >= S_SLICE_LATENCY;
+  } else {
+    yield = t->overbudget || now - p->schedwhen >= S_SLICE_BATCH ||
+            p_has_latency_work(p) ||
+            AtomicLoad(&s->runq[S_CLASS_LATENCY].len, memory_order_relaxed) > 0;
+  }
+  if (yield && (!p_runq_isempty(p) || s_runq_len(s) > 0)) {
+    m->yield = true;
+    return true;
+  }
+  return false;
+}
+
+
+bool task_stack_charge(T* t, u64 size) {
+  u64 budget = AtomicLoad(&t->stack_budget, memory_order_relaxed);
+  if (budget && t->stackmem + size > budget) {
+    trace("T%llu stack budget exceeded (%llu + %llu > %llu bytes)",
+      t->id, t->stackmem, size, budget);
+    return false;
+  }
+  t->stackmem += size;
+  return true;
+}
+
+
+rerr_t rsched_taskbudget(
+  rsched_t* s, u64 tid, const rtaskbudget_t* nullable budget, rtaskusage_t* nullable usage)
+{
+  rerr_t err = rerr_not_found;
+  rwmutex_rlock(&s->allt.lock);
+  for (u32 i = 0, len = AtomicLoad(&s->allt.len, memory_order_acquire); i < len; i++) {
+    T* t = s->allt.ptr[i];
+    if (t->id != tid || t_status(t) == T_DEAD)
+      continue;
+    if (budget) {
+      AtomicStore(&t->cpu_budget, budget->cputime, memory_order_relaxed);
+      AtomicStore(&t->stack_budget, budget->stacksize, memory_order_relaxed);
+      AtomicStore(&t->budget_kill, budget->kill, memory_order_relaxed);
+    }
+    // note: the fields are updated by the task's M without synchronization;
+    // values are approximate while the task is running
+    if (usage) {
+      usage->cputime = t->cputime;
+      usage->stacksize = t->stackmem;
+      usage->overbudget = t->overbudget;
+    }
+    err = 0;
+    break;
+  }
+  rwmutex_runlock(&s->allt.lock);
+  return err;
+}
+
+
+noreturn void task_fail(T* t, rerr_t err) {
+  M* m = t->m;
+  assert(m->currt == t);
+  int noerr = 0;
+  AtomicCAS(&m->s->exiterr, &noerr, err, memory_order_relaxed, memory_order_relaxed);
+  log("task T%llu failed: %s", t->id, rerr_str(err));
+  #if SCHED_EVALJMP
+    if (m->ineval) {
+      task_exit(t);
+      __builtin_longjmp(m->evaljmp, 1);
+    }
+  #endif
+  panic("task T%llu failed: %s", t->id, rerr_str(err));
+}
+
+
 // task_park takes a task out of running state (disassoc. M & P from T.)
 // Must be explicitly resumed with a call to task_unpark
 //
@@ -1702,6 +2154,140 @@ void task_park(T* t, tstatus_t reason) {
 // }
 
 
+#ifndef RSM_NO_LIBC
+
+static mnote_t g_bench_park_pong;
+static sema_t  g_bench_park_done;
+static u32     g_bench_park_iterations;
+
+static rerr_t bench_park_thread(M* m) {
+  m_set_current(m);
+  for (u32 i = 0; i < g_bench_park_iterations; i++) {
+    m_park(m);
+    mnote_wakeup(&g_bench_park_pong);
+  }
+  sema_signal(&g_bench_park_done, 1);
+  return 0;
+}
+
+u64 rsched_bench_park(rsched_t* s, u32 iterations) {
+  M* m0 = &s->m0;
+  M* m1 = rmem_alloct(s->machine->malloc, M);
+  safecheckx(m1 != NULL);
+  memset(m1, 0, sizeof(M));
+  safecheckx(m_init(m1, s, 1) == 0);
+  safecheckx(sema_init(&g_bench_park_done, 0) == 0);
+  mnote_clear(&g_bench_park_pong);
+  g_bench_park_iterations = iterations;
+  safecheckx(m_spawn_osthread(m1, bench_park_thread) != 0);
+
+  u64 start = nanotime();
+  for (u32 i = 0; i < iterations; i++) {
+    mnote_wakeup(&m1->park);
+    mnote_sleep(&g_bench_park_pong, m0);
+    mnote_clear(&g_bench_park_pong);
+  }
+  u64 elapsed = nanotime() - start;
+
+  // wait for m1's thread to exit its loop; it doesn't touch m1 after that
+  sema_wait(&g_bench_park_done, -1);
+  sema_dispose(&g_bench_park_done);
+  m_dispose(m1);
+  rmem_freet(s->machine->malloc, m1);
+  return elapsed / MAX(1u, iterations);
+}
+
+#endif // RSM_NO_LIBC
+
+
+#ifndef RSM_NO_LIBC
+
+double rsched_bench_switch(rsched_t* s, u32 iterations) {
+  M* m = &s->m0;
+  P* p = assertnotnull(m->p);
+  T* tv[2];
+  for (u32 i = 0; i < countof(tv); i++) {
+    safecheckx((tv[i] = rmem_alloct(s->machine->malloc, T)) != NULL);
+    memset(tv[i], 0, sizeof(T));
+    tv[i]->id = i + 1;
+    t_setstatus(tv[i], T_RUNNABLE);
+  }
+  p_runq_put(p, tv[1], /*runnext*/false);
+  m_switchtask(m, tv[0]);
+  t_casstatus(tv[0], T_RUNNABLE, T_RUNNING);
+
+  bool inherit_time;
+  u64 start = nanotime();
+  for (u32 i = 0; i < iterations; i++) {
+    T* t = m->currt;
+    t->iregs[0]++; // touch the register file like the interpreter would
+    m_dropt(m);
+    t_casstatus(t, T_RUNNING, T_RUNNABLE);
+    p_runq_put(p, t, /*runnext*/false);
+    t = assertnotnull(p_runq_get(p, &inherit_time));
+    m_switchtask(m, t);
+    t_casstatus(t, T_RUNNABLE, T_RUNNING);
+  }
+  u64 elapsed = nanotime() - start;
+
+  m_dropt(m);
+  safecheckx(p_runq_get(p, &inherit_time) != NULL);
+  safecheckx(p_runq_isempty(p));
+  safecheckx(tv[0]->iregs[0] + tv[1]->iregs[0] == iterations);
+  for (u32 i = 0; i < countof(tv); i++)
+    task_free(s, tv[i]);
+  return (double)elapsed / (double)MAX(1u, iterations);
+}
+
+#endif // RSM_NO_LIBC
+
+
+// s_topo_init assigns host CPUs to P's and computes the steal order of each P.
+// P's are spread over the CPUs the process may run on, in topology order, so that
+// P's with adjacent IDs share caches. A P's victims are grouped in steal tiers by
+// the caches their CPUs share with the P's CPU.
+static void s_topo_init(rsched_t* s) {
+  u32 nprocs = s->nprocs;
+  cputopo_t topo[S_MAXPROCS];
+  u32 ncpu = os_cputopo(topo, countof(topo));
+  trace("host topology: %u CPUs", ncpu);
+
+  for (u32 id = 0; id < nprocs; id++)
+    s->allp[id]->cpu = ncpu ? topo[id % ncpu].cpu : id;
+
+  for (u32 id = 0; id < nprocs; id++) {
+    P* p = s->allp[id];
+    u8 tierv[S_MAXPROCS];
+    u32 count[STEAL_NTIERS] = {0};
+    for (u32 id2 = 0; id2 < nprocs; id2++) {
+      if (id2 == id)
+        continue;
+      u8 tier = STEAL_REMOTE;
+      if (ncpu) {
+        const cputopo_t* a = &topo[id % ncpu];
+        const cputopo_t* b = &topo[id2 % ncpu];
+        tier = a->l2 == b->l2 ? STEAL_L2 :
+               a->l3 == b->l3 ? STEAL_L3 :
+               a->pkg == b->pkg ? STEAL_PKG :
+               STEAL_REMOTE;
+      }
+      tierv[id2] = tier;
+      count[tier]++;
+    }
+    u32 end = 0;
+    for (u32 tier = 0; tier < STEAL_NTIERS; tier++) {
+      end += count[tier];
+      p->stealtier[tier] = (u16)end;
+      count[tier] = end - count[tier]; // start of tier; next index to fill
+    }
+    for (u32 id2 = 0; id2 < nprocs; id2++) {
+      if (id2 != id)
+        p->stealv[count[tierv[id2]]++] = (u16)id2;
+    }
+  }
+}
+
+
 rerr_t rsched_init(rsched_t* s, rmachine_t* machine) {
   rerr_t err;
   memset(s, 0, sizeof(rsched_t));
@@ -1717,6 +2303,8 @@ rerr_t rsched_init(rsched_t* s, rmachine_t* machine) {
   // virtual memory page directory
   if ((err = vm_map_init(&s->vm_map, machine->mm)))
     return err;
+  s->vm_map.fault = rsched_vm_fault;
+  s->vm_map.fault_ctx = s;
 
   // initialize main M (id=0) on current OS thread
   s->midgen = 1;
@@ -1725,7 +2313,7 @@ rerr_t rsched_init(rsched_t* s, rmachine_t* machine) {
   if UNLIKELY(err)
     goto error;
 
-  TRACE_SET_CURRENT_M(&s->m0);
+  m_set_current(&s->m0);
 
   // create processors
   u32 nprocs = 2;
@@ -1751,8 +2339,8 @@ rerr_t rsched_init(rsched_t* s, rmachine_t* machine) {
     pbits_set(&s->idlep_mask, p_id);
   }
 
-  // randomize steal order
-  s->stealordlen = randord_init(s->stealord, nprocs);
+  // assign CPUs and steal order
+  s_topo_init(s);
 
   // associate P0 with M0
   P* p = s->allp[0];
@@ -1767,6 +2355,38 @@ error:
 
 
 void rsched_dispose(rsched_t* s) {
+  #ifdef RSM_STATS
+  {
+    u64 nwake = AtomicLoad(&s->stats.nwake, memory_order_relaxed);
+    u64 nspin = AtomicLoad(&s->stats.nspin, memory_order_relaxed);
+    char wakedur[25], spindur[25];
+    fmtduration(wakedur, nwake ? AtomicLoad(&s->stats.wakens, memory_order_relaxed)/nwake : 0);
+    fmtduration(spindur, AtomicLoad(&s->stats.spinns, memory_order_relaxed));
+    statlog("sched: %llu wakeups (avg latency %s), %llu spins (%llu parked, %s total)",
+      nwake, wakedur, nspin, AtomicLoad(&s->stats.nspinpark, memory_order_relaxed), spindur);
+    statlog("vm: %llu translation cache misses, %llu entries filled by fault-around",
+      AtomicLoad(&s->stats.nvmmiss, memory_order_relaxed),
+      AtomicLoad(&s->stats.nvmfill, memory_order_relaxed));
+    static_assert(VM_PTAB_LEVELS == 4, "");
+    statlog("vm: page tables L1 %zu B, L2 %zu B, L3 %zu B, L4 %zu B (%u cached)",
+      vm_map_ptab_size(&s->vm_map, 0), vm_map_ptab_size(&s->vm_map, 1),
+      vm_map_ptab_size(&s->vm_map, 2), vm_map_ptab_size(&s->vm_map, 3),
+      s->vm_map.ptab_ncache);
+    statlog("steal: %llu L2-local, %llu L3-local, %llu same-package, %llu remote",
+      AtomicLoad(&s->stats.nsteal[STEAL_L2], memory_order_relaxed),
+      AtomicLoad(&s->stats.nsteal[STEAL_L3], memory_order_relaxed),
+      AtomicLoad(&s->stats.nsteal[STEAL_PKG], memory_order_relaxed),
+      AtomicLoad(&s->stats.nsteal[STEAL_REMOTE], memory_order_relaxed));
+  }
+  #endif
+  memtrace_dispose(s);
+  ioring_dispose(s);
+  vdso_dispose(s);
+  T** allt = AtomicLoad(&s->allt.ptr, memory_order_acquire);
+  for (u32 i = 0, len = AtomicLoad(&s->allt.len, memory_order_acquire); i < len; i++)
+    task_free(s, allt[i]);
+  if (allt)
+    rmem_free(s->machine->malloc, RMEM(allt, (usize)s->allt.cap * sizeof(void*)));
   mutex_dispose(&s->lock);
   rwmutex_dispose(&s->exec_lock);
   rwmutex_dispose(&s->allocm_lock);
@@ -1788,8 +2408,12 @@ static rmem_t rsched_alloc_basemem(rsched_t* s, rrom_t* rom) {
     ( (STK_MIN + PAGE_SIZE-1) / PAGE_SIZE ) // minimum stack (fail early)
   );
 
-  // allocate pages
+  // allocate pages, which count toward the memory limit of the address space
+  if (vm_map_charge(&s->vm_map, npages))
+    return (rmem_t){0};
   void* p = rmm_allocpages(s->machine->mm, npages);
+  if (!p)
+    vm_map_uncharge(&s->vm_map, npages);
   rmem_t basemem = RMEM(p, npages*PAGE_SIZE);
 
   dlog("basemem " RMEM_FMT " %zu pages", RMEM_FMT_ARGS(basemem), npages);
@@ -1904,6 +2528,11 @@ static rerr_t rsched_loadrom(
   //   ├────────────┼─────────┴─────────────── ··· ──────────┤
   //   not mapped   0x1000                                   0xfffffffffff8
   //                VM_ADDR_MIN                              STACK_VADDR
+  //
+  // With a direct window, the stack is at the top of the window and data & stack
+  // pages are backed by the window; data is copied into it.
+  bool direct = s->vm_map.direct_size != 0;
+  u64 stack_vaddr = s_stack_vaddr(s);
 
   // calculate page mappings for data
   uintptr data_haddr = (uintptr)data;
@@ -1913,10 +2542,10 @@ static rerr_t rsched_loadrom(
 
   // calculate page mappings for stack
   uintptr stack_haddr = ALIGN2((uintptr)dataend, PAGE_SIZE);
-  usize stack_nhpages = (u64)(uintptr)(stack - dataend) / PAGE_SIZE;
+  usize stack_nhpages = direct ? 0 : (u64)(uintptr)(stack - dataend) / PAGE_SIZE;
   usize stack_npages = MAX(STK_DEFAULT/PAGE_SIZE, stack_nhpages);
-  u64 stack_vaddr_lo = ALIGN2(STACK_VADDR - stack_npages*PAGE_SIZE, PAGE_SIZE);
-  UNUSED u64 stack_vaddr_hi = STACK_VADDR;
+  u64 stack_vaddr_lo = ALIGN2(stack_vaddr - stack_npages*PAGE_SIZE, PAGE_SIZE);
+  UNUSED u64 stack_vaddr_hi = stack_vaddr;
 
   dlog_memory_map(
     (uintptr)basemem.p, codesize,
@@ -1926,6 +2555,8 @@ static rerr_t rsched_loadrom(
   vm_map_lock(&s->vm_map);
 
   // map data pages with backing pages
+  if (direct)
+    data_haddr = 0;
   trace_vm_map("data", data_vaddr_lo, data_haddr, data_npages);
   err = vm_map_add(&s->vm_map, data_vaddr_lo, data_haddr, data_npages, VM_PERM_RW);
   if UNLIKELY(err) {
@@ -1934,6 +2565,19 @@ static rerr_t rsched_loadrom(
     return rerr_mfault;
   }
 
+  // copy data into the direct window
+  for (usize i = 0; direct && i < data_npages; i++) {
+    vm_page_t* page = vm_map_access(&s->vm_map, VM_VFN(data_vaddr_lo) + i, false);
+    if UNLIKELY(!page || page->hfn == 0) {
+      vm_map_del(&s->vm_map, data_vaddr_lo, data_npages);
+      vm_map_unlock(&s->vm_map);
+      return rerr_nomem;
+    }
+    usize offs = i*PAGE_SIZE;
+    memcpy((void*)(uintptr)vm_page_haddr(page), data + offs,
+      MIN((usize)PAGE_SIZE, rom->datasize - offs));
+  }
+
   // map stack pages WITHOUT backing pages
   usize stack_nvpages = stack_npages - stack_nhpages;
   trace_vm_map("stack", stack_vaddr_lo, 0, stack_nvpages);
@@ -1946,7 +2590,7 @@ static rerr_t rsched_loadrom(
   }
 
   // map stack pages with backing pages
-  if (stack_npages > stack_nhpages) {
+  if (stack_nhpages > 0) {
     u64 vaddr = stack_vaddr_lo + stack_nvpages*PAGE_SIZE;
     usize npages = stack_npages - stack_nvpages;
     trace_vm_map("stack", vaddr, stack_haddr, npages);
@@ -1960,12 +2604,23 @@ static rerr_t rsched_loadrom(
     }
   }
 
-  vm_map_unlock(&s->vm_map);
+  // map a guard page below the stack; overflowing into it grows the stack
+  // (see rsched_vm_fault)
+  trace_vm_map("stack guard", stack_vaddr_lo - PAGE_SIZE, 0, 1);
+  err = vm_map_add(&s->vm_map, stack_vaddr_lo - PAGE_SIZE, 0, 1, VM_PERM_NONE);
+  if UNLIKELY(err) {
+    dlog("vm_map failed: %s", rerr_str(err));
+    vm_map_del(&s->vm_map, data_vaddr_lo, data_npages);
+    vm_map_del(&s->vm_map, stack_vaddr_lo, stack_npages);
+    vm_map_unlock(&s->vm_map);
+    return rerr_mfault;
+  }
 
-  // setup main function arguments
-  // main(argc u32, argv u64)
-  s->m0.iregs[0] = 0;
-  s->m0.iregs[1] = 0;
+  // stacks of spawned tasks go below the range the main stack can grow into
+  // (see task_stack_map)
+  s->stack_next = direct ? STACK_VADDR : stack_vaddr - STK_MAX - PAGE_SIZE;
+
+  vm_map_unlock(&s->vm_map);
 
   *stacksizep = stack_npages*PAGE_SIZE;
 
@@ -1973,13 +2628,25 @@ static rerr_t rsched_loadrom(
 }
 
 
-static rerr_t rsched_unloadrom(rsched_t* s, rrom_t* rom) {
-  dlog("TODO %s: vm_map_del", __FUNCTION__);
-  return 0;
+// rsched_unloadrom unmaps all memory of the program loaded by rsched_loadrom,
+// including task stacks and memory mapped by syscalls
+static void rsched_unloadrom(rsched_t* s) {
+  ioring_dispose(s);
+  vdso_dispose(s);
+  vm_map_clear(&s->vm_map);
 }
 
 
-rerr_t rsched_execrom(rsched_t* s, rrom_t* rom) {
+// s_prog_load loads a program from rom and spawns its main task
+static rerr_t s_prog_load(rsched_t* s, rrom_t* rom) {
+  // M0 gives up its P when a program run by rsched_execrom ends
+  if (!s->m0.p) {
+    mutex_lock(&s->lock);
+    P* p = s_idlep_get(s);
+    mutex_unlock(&s->lock);
+    p_acquire_m(assertnotnull(p), &s->m0);
+  }
+
   // allocate base memory; pages for rom code and data.
   // We will load the rom image into this space and move code & data to page boundaries.
   rmem_t basemem = rsched_alloc_basemem(s, rom);
@@ -1990,26 +2657,145 @@ rerr_t rsched_execrom(rsched_t* s, rrom_t* rom) {
   usize stack_vsize = STK_DEFAULT;
   rerr_t err = rsched_loadrom(s, rom, basemem, &stack_vsize);
   if (err)
-    goto end;
+    goto error;
+  memtrace_start(s, DATA_VADDR, rom->datasize);
+
+  // map the time page
+  if ((err = vdso_init(s)))
+    goto error_unload;
 
   // spawn main task
   const rin_t* instrv = basemem.p;
   usize instrc = rom->codelen + EPILOGUE_LEN;
   u64 pc = 0; // TODO: use instruction address of "main" function
-  T* maintask = m_spawn(&s->m0, instrv, instrc, pc, STACK_VADDR, stack_vsize, &err);
+  // main(argc u32, argv u64)
+  const u64 mainargs[RSM_NARGREGS] = { 0, 0 };
+  T* maintask = m_spawn(
+    &s->m0, instrv, instrc, pc, mainargs, s_stack_vaddr(s), stack_vsize, &s->taskbudget,
+    S_CLASS_BATCH, NULL, &err);
   if (!maintask)
-    goto end;
+    goto error_unload;
 
   s->main_started = true;
+  s->rom = rom;
+  s->basemem = basemem;
+  return 0;
+
+error_unload:
+  rsched_unloadrom(s);
+error:
+  rmm_freepages(s->machine->mm, basemem.p, basemem.size/PAGE_SIZE);
+  vm_map_uncharge(&s->vm_map, basemem.size/PAGE_SIZE);
+  return err;
+}
+
+
+// s_prog_unload releases the memory and tasks of the program loaded by s_prog_load,
+// which must have exited, so that another program can be loaded
+static void s_prog_unload(rsched_t* s) {
+  assertnotnull(s->rom);
+  rsched_unloadrom(s);
+  rmm_freepages(s->machine->mm, s->basemem.p, s->basemem.size/PAGE_SIZE);
+  vm_map_uncharge(&s->vm_map, s->basemem.size/PAGE_SIZE);
+  s->rom = NULL;
+  s->basemem = (rmem_t){0};
+
+  // free tasks; all of them are dead
+  rwmutex_lock(&s->allt.lock);
+  for (u32 i = 0; i < s->allt.len; i++) {
+    assert_tstatus(s->allt.ptr[i], T_DEAD);
+    task_free(s, s->allt.ptr[i]);
+  }
+  AtomicStore(&s->allt.len, 0, memory_order_release);
+  rwmutex_unlock(&s->allt.lock);
+  for (u32 i = 0; i < s->nprocs; i++)
+    s->allp[i]->freet = (tlist_t){0};
+  s->freet = (tlist_t){0};
+
+  // the next program's main task gets ID 0
+  AtomicStore(&s->tidgen, 0, memory_order_relaxed);
+  AtomicStore(&s->exiterr, 0, memory_order_relaxed);
+  s->main_started = false;
+  s->stepping = false;
+}
+
+
+rerr_t rsched_execrom(rsched_t* s, rrom_t* rom) {
+  rerr_t err = s_prog_load(s, rom);
+  if (err)
+    return err;
 
   // enter scheduler loop in M0
   err = m_start(&s->m0);
+  if (!err)
+    err = AtomicLoad(&s->exiterr, memory_order_relaxed);
 
-  // finish
-  rsched_unloadrom(s, rom);
+  s_prog_unload(s);
+  return err;
+}
 
-end:
-  rmm_freepages(s->machine->mm, basemem.p, basemem.size/PAGE_SIZE);
+
+rerr_t rsched_load(rsched_t* s, rrom_t* rom) {
+  if (s->rom)
+    return rerr_exists;
+  s->stepping = true;
+  rerr_t err = s_prog_load(s, rom);
+  if (err)
+    s->stepping = false;
   return err;
 }
 
+
+rerr_t rsched_run_for(rsched_t* s, u64 budget, rrunresult_t* result) {
+  if (!s->stepping || !s->rom)
+    return rerr_invalid;
+
+  // the calling thread acts as M0 until we return
+  M* m = &s->m0;
+  P* p = assertnotnull(m->p);
+  M* prevm = m_current();
+  m_set_current(m);
+
+  u64 now = p_nanotime_refresh(p);
+  s->run_until = now + MIN(budget, U64_MAX - now);
+  *result = (rrunresult_t){0};
+
+  for (;;) {
+    s_sleepq_wake(s, p, now);
+    ioring_poll(s);
+
+    if (p_runq_isempty(p) && s_runq_len(s) == 0) {
+      if (s->sleepq) {
+        result->state = RRUN_BLOCKED;
+        result->timeout = s->sleepq->waketime - now;
+      } else {
+        trace("no live tasks");
+        result->state = RRUN_EXITED;
+        result->err = AtomicLoad(&s->exiterr, memory_order_relaxed);
+        s_prog_unload(s);
+      }
+      break;
+    }
+
+    if (now >= s->run_until) {
+      result->state = RRUN_BUDGET;
+      break;
+    }
+
+    bool inherit_time;
+    T* t = p_runq_get(p, &inherit_time);
+    if (!t) {
+      mutex_lock(&s->lock);
+      t = assertnotnull(s_runq_get(s, p, 0));
+      mutex_unlock(&s->lock);
+      inherit_time = false;
+    }
+    m_run(m, t, inherit_time);
+    now = p_nanotime_refresh(p);
+  }
+
+  s->run_until = 0;
+  m_set_current(prevm);
+  return 0;
+}
+
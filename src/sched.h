@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: Apache-2.0
 #pragma once
 #include "vm.h"
+#include "memtrace.h"
 RSM_ASSUME_NONNULL_BEGIN
 
 // SCHED_TRACE: when defined, verbose log tracing on stderr is enabled.
@@ -18,20 +19,87 @@ RSM_ASSUME_NONNULL_BEGIN
 #define STK_ALIGN    8lu                // stack alignment
 #define STK_MIN      ((usize)PAGE_SIZE) // min backing memory allocated for stack
 #define STK_DEFAULT  1lu * MiB          // default stack size (virtual)
+#define STK_MAX      64lu * MiB         // limit of stack growth on guard-page faults
 
 // INTERPRET_USE_JUMPTABLE: define to enable use of jump table in the interpreter.
 // Requires that the compiler supports taking the address of labels, ie. "&&label".
 #define INTERPRET_USE_JUMPTABLE
 
+// INTERPRET_PIN_REGS: define to keep guest registers in a local register file in the
+// interpreter, which the compiler knows isn't aliased by guest memory (see rsched_eval.)
+#define INTERPRET_PIN_REGS
+
+// INTERPRET_SHADOW_STACK: define to have the interpreter keep a host-side shadow of
+// the return addresses pushed by CALL, so that RET doesn't need to translate SP
+// (see rsched_eval.) INTERPRET_SHADOW_STACK_SIZE is its number of entries (pow2.)
+// Off by default: a RET which hits in the vm_cache costs about the same.
+//#define INTERPRET_SHADOW_STACK
+#define INTERPRET_SHADOW_STACK_SIZE 64
+
+// SCHED_MEMTRACE: define to compile in support for tracing the memory accesses of
+// guest programs (see memtrace.h.) Adds a test to every guest load & store.
+//#define SCHED_MEMTRACE
+
+// SCHED_EVALJMP is 1 when a failing task can be unwound from the interpreter
+// (see task_fail.) The GCC/clang setjmp builtins don't depend on libc.
+#if __has_builtin(__builtin_setjmp) && !defined(__wasm__)
+  #define SCHED_EVALJMP 1
+#else
+  #define SCHED_EVALJMP 0
+#endif
+
+// S_PREEMPT_INTERVAL is the number of branches & calls a task executes between
+// preemption points (see task_preempt.) Must be pow2.
+#define S_PREEMPT_INTERVAL 4096
+static_assert(IS_POW2_X(S_PREEMPT_INTERVAL), "");
+
 // S_MAXPROCS is the upper limit of concurrent P's; the effective CPU parallelism limit.
 // There are no fundamental restrictions on the value. Must be pow2.
 #define S_MAXPROCS  256
 static_assert(IS_POW2_X(S_MAXPROCS), "");
 
-// P_RUNQSIZE is the size of P.runq. Must be power-of-two (2^N)
+// Spinning policy.
+// An M which is out of work "spins" looking for work (stealing from other P's) before
+// it releases its P and parks its OS thread. Spinning trades CPU time for lower
+// latency of picking up new work. The policy is:
+// - At most S_MAXSPINNING M's spin at once, and no more than half the number of
+//   busy P's (so a mostly-serial program doesn't burn CPUs.)
+// - A spinning M retries for at most S_SPIN_NSEC, with exponential backoff
+//   (S_SPIN_BACKOFF_MIN...S_SPIN_BACKOFF_MAX cpu_yields) between attempts,
+//   then parks (on a futex, when available.)
+// - Wakeups are coalesced: s_wakep only wakes an M when none is spinning, and an M
+//   that stops spinning only wakes another if there's still queued work. So a burst
+//   of m_spawn calls wakes at most one M at a time, in a chain that ends when the
+//   queued work has been picked up.
+#define S_MAXSPINNING       4
+#define S_SPIN_NSEC         20000lu /* 20us */
+#define S_SPIN_BACKOFF_MIN  8u
+#define S_SPIN_BACKOFF_MAX  1024u
+static_assert(S_SPIN_BACKOFF_MIN > 0 && S_SPIN_BACKOFF_MIN <= S_SPIN_BACKOFF_MAX, "");
+
+// SCHED_PIN_PROCS: when defined, each P is assigned a host CPU and an M's OS thread
+// is pinned to the CPU of the P it acquires. Work stealing prefers P's on CPUs which
+// share caches with the thief (see steal tiers) whether or not this is defined, but
+// the preference only pays off when M's stay put.
+//#define SCHED_PIN_PROCS
+
+// P_RUNQSIZE is the size of each P.runq queue. Must be power-of-two (2^N)
 #define P_RUNQSIZE  256 // 256 is the value Go 1.16 uses
 static_assert(IS_POW2_X(P_RUNQSIZE), "");
 
+// Scheduling classes. Each class has its own run queues (per P and global.)
+// Latency-critical tasks are dequeued and stolen before batch tasks and run with a
+// shorter time slice; a running batch task yields at its next preemption point
+// when latency-critical tasks are waiting. To keep batch tasks from starving, a P
+// runs a waiting batch task after S_LATENCY_STREAK latency-critical tasks in a row.
+// Class values are part of the guest ABI (SC_TCLASS.)
+#define S_CLASS_BATCH    0 // default class, for throughput-oriented work
+#define S_CLASS_LATENCY  1 // latency-critical, e.g. request handlers
+#define S_NCLASS         2
+#define S_SLICE_BATCH    10000000lu /* 10ms */
+#define S_SLICE_LATENCY  1000000lu  /* 1ms */
+#define S_LATENCY_STREAK 16u
+
 // Main scheduling concepts:
 // - T for Task, a coroutine task
 // - M for Machine, an OS thread
@@ -42,16 +110,25 @@ typedef struct rsched_ rsched_t;
 typedef struct T T; // Task, a coroutine task
 typedef struct M M; // Machine, an OS thread
 typedef struct P P; // Processor, an execution resource required to execute a T
+typedef struct aotprog_ aotprog_t; // ahead-of-time compiled program (see aot.h)
+typedef struct memtrace_buf_ memtrace_buf_t; // memory-access records (see memtrace_add)
 typedef u8 tstatus_t; // Task status
 typedef u8 pstatus_t; // Processor status
 
 // mnote_t: sleep and wakeup on one-time events
 typedef struct {
+  #ifdef RSM_FUTEX
+  // key is a futex word holding:
+  // a) 0 when unused.
+  // b) MNOTE_LOCKED when signalled.
+  _Atomic(u32) key; // must be initialized to 0
+  #else
   // key holds:
   // a) NULL when unused.
   // b) pointer to some M.
   // c) opaque value indicating locked state.
   _Atomic(uintptr) key; // must be initialized to 0
+  #endif
 } mnote_t;
 
 typedef struct {
@@ -63,6 +140,39 @@ typedef struct {
   _Atomic(usize) bits[S_MAXPROCS / sizeof(usize) / 8];
 } pbitset_t;
 
+// cputopo_t describes a host CPU and the caches it shares with other CPUs.
+// IDs are only meaningful when compared with each other.
+typedef struct {
+  u32 cpu; // host CPU number
+  u32 l2;  // L2 cache
+  u32 l3;  // last-level (L3) cache
+  u32 pkg; // physical package (socket)
+} cputopo_t;
+
+// Steal tiers, in the order m_steal_work tries victim P's (see s_topo_init)
+enum {
+  STEAL_L2,     // P's on CPUs sharing an L2 cache with the thief
+  STEAL_L3,     // P's on CPUs sharing a last-level cache
+  STEAL_PKG,    // P's in the same package
+  STEAL_REMOTE, // all other P's (all P's if the host topology is unknown)
+  STEAL_NTIERS
+};
+
+// prunq_t is a P's queue of runnable tasks of one class, accessed without lock
+typedef struct {
+  _Atomic(u32) head;
+  _Atomic(u32) tail;
+  T*           v[P_RUNQSIZE];
+} prunq_t;
+
+// srunq_t is a global queue of runnable tasks of one class, linked via T.schedlink.
+// Writes use rsched_t.lock.
+typedef struct {
+  _Atomic(T*)  head;
+  _Atomic(T*)  tail;
+  _Atomic(u32) len;
+} srunq_t;
+
 struct T {
   u64         id;
   T* nullable parent;    // task that spawned this task
@@ -73,13 +183,27 @@ struct T {
   usize        instrc; // instruction count
   const rin_t* instrv; // instruction array
 
-  u64 sp;       // saved SP register value used by m_switchtask
   u64 stack_lo; // top of stack (lowest valid stack address)
   u64 stack_hi; // bottom of stack (highest valid stack address)
 
   u64                waitsince; // approx time when the T became blocked
+  u64                waketime;  // nanotime when a sleeping T is due (see task_sleep)
+  u64                cputime;   // nanoseconds spent running, excluding syscalls
+  u64                runsince;  // nanotime when the T last started running
   _Atomic(tstatus_t) status;
+  _Atomic(u8)        sclass;      // scheduling class (S_CLASS_)
   u32                nsplitstack; // number of stack splits
+  u64                stackmem;    // bytes of stack mapped, including split stacks
+
+  // resource budgets; 0 means "unlimited" (see rtaskbudget_t)
+  _Atomic(u64) cpu_budget;    // nanoseconds of CPU time
+  _Atomic(u64) stack_budget;  // bytes of stack memory
+  _Atomic(bool) budget_kill;  // terminate, rather than deprioritize, when out of CPU
+  bool          overbudget;   // spent cpu_budget; yields at every preemption point
+
+  // register values; the interpreter operates directly on these
+  u64    iregs[RSM_NREGS];
+  double fregs[RSM_NREGS];
 };
 
 struct M {
@@ -93,16 +217,27 @@ struct M {
   u32         locks;    // number of logical locks held by Ts to this M
   bool        spinning; // m is out of work and is actively looking for work
   bool        blocked;  // m is blocked on a note
+  u64         waketime; // nanotime when M was last woken by s_startm (for stats)
   mnote_t     park;     // park notification
   sema_t      parksema; // park notification semaphore
 
-  // register values
-  u64    iregs[RSM_NREGS];
-  double fregs[RSM_NREGS];
-
   // virtual memory cache for read-only and read-write pages.
   // index is offset by 1, since "no permissions" is never cached.
   vm_cache_t vmcache[VM_PERM_MAX]; // 0=r, 1=w, 2=rw
+  u32        vmgen;    // vm_map_t.gen which vmcache reflects
+  u32        vmcowgen; // vm_map_t.cowgen which vmcache reflects
+
+  #ifdef SCHED_MEMTRACE
+    memtrace_buf_t* nullable mtbuf; // memory-access records (see memtrace_add)
+  #endif
+
+  // evaljmp is where task_fail unwinds to; valid while ineval is true
+  bool  ineval;
+  void* evaljmp[5];
+
+  bool yield;  // set by task_preempt; currt goes back to a run queue after eval
+  bool iopoll; // M is counted in ioring_t.npoll (see ioring_poll_begin)
+  i32  cpu;    // host CPU the OS thread is pinned to (-1 if not pinned)
 };
 
 struct P {
@@ -111,13 +246,20 @@ struct P {
   _Atomic(pstatus_t) status;    // status
   bool               preempt;   // this P should enter scheduling ASAP
   rsched_t*          s;         // parent scheduler
+  u64                now;       // coarse nanotime, refreshed at scheduling points
   M* nullable        m;         // associated m (NULL when P is idle)
   P* nullable        nextp;     // next P in list (for s.idlep)
 
-  // runq -- queue of runnable tasks, accessed without lock
-  _Atomic(u32) runqhead;
-  _Atomic(u32) runqtail;
-  T*           runq[P_RUNQSIZE];
+  u64                schedwhen; // nanotime when the current time slice started
+  u32                lcstreak;  // latency-critical Ts run in a row while batch Ts wait
+  u32                cpu;       // host CPU (see SCHED_PIN_PROCS)
+
+  // stealv lists the other P's, nearest first; stealtier[n] is the end of tier n
+  u16 stealv[S_MAXPROCS - 1];
+  u16 stealtier[STEAL_NTIERS];
+
+  // runq -- queues of runnable tasks, indexed by scheduling class
+  prunq_t runq[S_NCLASS];
   // runnext, if non-NULL, is a runnable T that was ready'd by
   // the current T and should be run next instead of what's in
   // runq if there's time remaining in the running T's time
@@ -149,11 +291,164 @@ struct P {
   _Atomic(u64) timer_modified_earliest;
 };
 
+// ioring: shared-memory submission & completion rings between guest and host.
+// The guest enqueues ioring_sqe_t entries with plain stores and advances sq_tail.
+// The host consumes submissions in batches on a dedicated I/O M, which scheduler
+// Ms wake up when they see pending submissions (in m_findrunnable and periodically
+// from m_schedule), or synchronously on SC_IORING_ENTER, under the syscall handoff.
+// Either way, a slow fd never stalls a P. The host posts ioring_cqe_t entries,
+// advancing cq_tail.
+// The guest only needs to make a SC_IORING_ENTER syscall after submitting when
+// IORING_F_NEED_WAKEUP is set in flags (i.e. when no M is polling the ring.)
+//
+// Memory layout at the guest address returned by SC_IORING_SETUP:
+//   ┌──────────────┬───────────────────────────────┬───────────────────────────────┐
+//   │ ioring_hdr_t │ ioring_sqe_t[sq_mask+1]       │ ioring_cqe_t[cq_mask+1]       │
+//   └──────────────┴───────────────────────────────┴───────────────────────────────┘
+//   0              sq_off                          cq_off
+#define IORING_NENTRIES_MAX  4096u  // upper limit of submission entries (must be pow2)
+#define IORING_POLL_INTERVAL 61     // m_schedule polls the ring every N schedticks
+static_assert(IS_POW2_X(IORING_NENTRIES_MAX), "");
+
+enum ioring_op {
+  IORING_OP_NOP   = 0, // no operation; completes with result 0
+  IORING_OP_WRITE = 1, // write len bytes at addr to fd; result is bytes written
+};
+
+enum ioring_flag {
+  IORING_F_NEED_WAKEUP = 1 << 0, // no M is polling; guest must use SC_IORING_ENTER
+};
+
+typedef struct {
+  _Atomic(u32) sq_head; // next submission to be consumed (written by host)
+  _Atomic(u32) sq_tail; // next free submission slot (written by guest)
+  _Atomic(u32) cq_head; // next completion to be consumed (written by guest)
+  _Atomic(u32) cq_tail; // next free completion slot (written by host)
+  u32          sq_mask; // number of submission entries - 1
+  u32          cq_mask; // number of completion entries - 1
+  _Atomic(u32) flags;   // IORING_F_ flags (written by host)
+  u32          _reserved;
+  u64          sq_off;  // byte offset of submission entries, relative to header
+  u64          cq_off;  // byte offset of completion entries, relative to header
+} ioring_hdr_t;
+
+typedef struct {
+  u32 op;       // enum ioring_op
+  u32 fd;       // file descriptor (IORING_OP_WRITE)
+  u64 addr;     // guest address of data
+  u64 len;      // size of data in bytes
+  u64 userdata; // copied verbatim to the completion entry
+} ioring_sqe_t;
+
+typedef struct {
+  u64 userdata; // ioring_sqe_t.userdata
+  i64 result;   // >=0 on success, rerr_t on failure
+} ioring_cqe_t;
+
+static_assert(sizeof(ioring_hdr_t) == 48, "guest ABI");
+static_assert(sizeof(ioring_sqe_t) == 32, "guest ABI");
+static_assert(sizeof(ioring_cqe_t) == 16, "guest ABI");
+
+// ioring_t is the host-side state of a scheduler's ioring
+typedef struct {
+  _Atomic(ioring_hdr_t*) hdr;     // host address of shared header (NULL if not set up)
+  _Atomic(u32)           busy;    // 1 while an M is consuming submissions
+  _Atomic(u32)           npoll;   // number of Ms between ioring_poll_{begin,end}
+  u32                    sq_head; // host copy of hdr.sq_head (guest may scribble hdr)
+  u32                    cq_tail; // host copy of hdr.cq_tail
+  u32                    sq_mask;
+  u32                    cq_mask;
+  u64                    vaddr;   // guest address of hdr
+  usize                  npages;  // number of backing pages at hdr
+  _Atomic(u64)           nsubmit; // stats: total submissions consumed
+  _Atomic(u64)           nenter;  // stats: total SC_IORING_ENTER syscalls
+
+  // I/O M which consumes submissions (see ioring_kick)
+  M            iom;
+  sema_t       iosema;  // signalled to wake up iom
+  sema_t       iodone;  // signalled by iom when it exits
+  _Atomic(u32) iokick;  // 1 while iom has been woken up but not yet polled
+  _Atomic(u32) iostop;  // 1 when iom should exit
+  bool         iostarted;
+} ioring_t;
+
+// memtrace_buf_t is an M's buffer of memory-access records (see sched_memtrace.c)
+struct memtrace_buf_ {
+  memtrace_buf_t* nullable next; // next buffer in memtrace_t.bufs
+  u32            len;           // number of records in recv
+  memtrace_rec_t recv[MEMTRACE_NREC];
+};
+
+// memtrace_t is the state of a scheduler's memory-access trace
+typedef struct {
+  u8* nullable             zbuf; // compression buffer; non-NULL while tracing
+  int                      fd;   // file the trace is written to
+  rerr_t                   err;  // first write error
+  mutex_t                  lock; // protects bufs, zbuf and writes to fd
+  memtrace_buf_t* nullable bufs; // buffers of all Ms
+} memtrace_t;
+
+// vdso: a read-only "time page" mapped into every guest at the fixed address
+// VDSO_VADDR (available to assembly source as the constant VDSO_ADDR.)
+// Guests read time with a few loads instead of making a syscall.
+// The runtime updates it at scheduling points and on syscall entry & exit,
+// so a task which neither yields nor makes syscalls observes a frozen clock.
+//
+// Clock fields are protected by a seqlock. To read them:
+//   1. load seq; if it is odd, an update is in progress: try again
+//   2. load mono_ns and/or unix_ns
+//   3. load seq again; if it changed, try again
+//
+// Per-task CPU time lives in tasks[tid % VDSO_NTASKS] (tid from SC_TASKID.)
+// A slot is only rewritten when its task is scheduled, so a task reading its own
+// slot sees a consistent value. tid is VDSO_TID_NONE while the slot is updated
+// and a slot may be taken over by another task with the same index; check that
+// tid matches before and after reading. CPU time used by the task up until now is
+//   cpu_ns + (mono_ns - since_ns)   (or just cpu_ns when mono_ns < since_ns)
+#define VDSO_VADDR    0x800000000000llu // must be page aligned
+#define VDSO_NTASKS   64u               // number of per-task slots (must be pow2)
+#define VDSO_TASKOFF  2048u             // byte offset of vdso_t.tasks
+#define VDSO_TID_NONE U64_MAX           // vdso_task_t.tid of a slot being updated
+#define VDSO_WALL_RESYNC 1000000000llu  // nanoseconds between wall-clock resyncs
+static_assert(IS_POW2_X(VDSO_NTASKS), "");
+
+typedef struct {
+  _Atomic(u64) tid;      // task ID
+  _Atomic(u64) cpu_ns;   // CPU time used by the task before since_ns
+  _Atomic(u64) since_ns; // time (as mono_ns) when the task was last scheduled
+  u64          _reserved;
+} vdso_task_t;
+
+typedef struct {
+  _Atomic(u32) seq;     // seqlock sequence number; odd while being updated
+  u32          _reserved;
+  _Atomic(u64) mono_ns; // monotonic time in nanoseconds (undefined epoch)
+  _Atomic(i64) unix_ns; // wall-clock time in nanoseconds since 1970-01-01 UTC
+  u8           _pad[VDSO_TASKOFF - 24];
+  vdso_task_t  tasks[VDSO_NTASKS];
+} vdso_t;
+
+static_assert(offsetof(vdso_t, mono_ns) == 8, "guest ABI");
+static_assert(offsetof(vdso_t, unix_ns) == 16, "guest ABI");
+static_assert(offsetof(vdso_t, tasks) == VDSO_TASKOFF, "guest ABI");
+static_assert(sizeof(vdso_task_t) == 32, "guest ABI");
+static_assert(sizeof(vdso_t) <= PAGE_SIZE, "");
+
+// vdso_state_t is the host-side state of a scheduler's time page
+typedef struct {
+  vdso_t* nullable page;      // host address of the time page (NULL if not mapped)
+  i64              wall_off;  // unix_ns - mono_ns (written with seq held)
+  u64              wall_sync; // mono_ns at last wall_off resync (written with seq held)
+} vdso_state_t;
+
 struct rsched_ {
   rmachine_t*  machine;      // host machine
   _Atomic(u64) tidgen;       // T.id generator
+  _Atomic(int) exiterr;      // rerr_t of the first task_fail, returned by execrom
+  rtaskbudget_t taskbudget;  // budget of the main task (rmachine_set_taskbudget)
   mutex_t      lock;         // protects access to idlem, idlep, allp, runq
   vm_map_t     vm_map;       // virtual memory page directory
+  u64          stack_next;   // top of next spawned task's stack region (vm_map locked)
   bool         main_started; // true when main task has started
 
   // M's
@@ -171,8 +466,6 @@ struct rsched_ {
   _Atomic(u32) nprocs;               // max active Ps (num valid P's in allp; maxprocs)
   P* nullable  idlep;                // list of idle P's
   _Atomic(u32) nidlep;               // (note: writes use lock)
-  u32          stealord[S_MAXPROCS]; // steal order of P's in allp
-  u32          stealordlen;          // entries at stealord
 
   // idlep_mask is a bitmask of Ps in PIdle list, one bit per P in allp.
   // Reads and writes must be atomic. Length may change at safe points.
@@ -205,30 +498,51 @@ struct rsched_ {
     u32          cap;
   } allt;
 
-  // global run queue (when a task is resumed without a P.)
-  // T's are linked via T.schedlink
+  // spinning & wakeup statistics, reported by rsched_dispose with RSM_STATS
   struct {
-    _Atomic(T*)  head;
-    _Atomic(T*)  tail;
-    _Atomic(u32) len;
-  } runq;
+    _Atomic(u64) nwake;     // M's woken up or started by s_startm
+    _Atomic(u64) wakens;    // total nanoseconds from wakeup to M running
+    _Atomic(u64) nspin;     // spinning phases in m_findrunnable
+    _Atomic(u64) nspinpark; // spinning phases which ended without finding work
+    _Atomic(u64) spinns;    // total nanoseconds spent spinning
+    _Atomic(u64) nvmmiss;   // vm_cache misses of exited M's
+    _Atomic(u64) nvmfill;   // vm_cache entries filled by fault-around, of exited M's
+    _Atomic(u64) nsteal[STEAL_NTIERS]; // successful steals, by steal tier
+  } stats;
+
+  // guest<->host submission & completion rings (see sched_ioring.c)
+  ioring_t ioring;
+
+  // guest-readable time page (see sched_vdso.c)
+  vdso_state_t vdso;
+
+  #ifdef SCHED_MEMTRACE
+    memtrace_t memtrace; // memory-access trace (see sched_memtrace.c)
+  #endif
+
+  // global run queues (when a task is resumed without a P), indexed by class
+  srunq_t runq[S_NCLASS];
 
   // freet is a list of unused T's (status==T_DEAD)
   tlist_t freet;
   mutex_t freet_lock;
 
+  // single-threaded mode, where the host steps tasks with rsched_run_for.
+  // Only accessed by the thread calling rsched_run_for, i.e. by M0.
+  bool             stepping;  // no Ms are started; set by rsched_load
+  u64              run_until; // tasks yield at preemption points from this nanotime
+  T* nullable      sleepq;    // T_WAITING tasks by waketime, linked via schedlink
+  rrom_t* nullable rom;       // loaded program
+  rmem_t           basemem;   // code & data pages of loaded program
+
+  // translated code of the program, run instead of the interpreter (see aot.h)
+  const aotprog_t* nullable aot;
+
   M m0; // main M (bound to the OS thread which rvm_main is called on)
   P p0; // first P
 };
 
 
-// tctx_t: task execution context used for task switching, stored on stack
-typedef struct {
-  double fregs[RSM_NREGS - RSM_NTMPREGS];
-  u64    iregs[RSM_NREGS - RSM_NTMPREGS - 1]; // does not include SP
-} tctx_t;
-
-
 enum tstatus {
   // T_IDLE: task was just allocated and has not yet been initialized
   T_IDLE = 0,
@@ -251,6 +565,12 @@ enum tstatus {
   // It is assigned an M.
   T_SYSCALL,
 
+  // T_WAITING: task is sleeping (see task_sleep.)
+  // It is not executing user code.
+  // It is not on a run queue; it is on rsched_t.sleepq.
+  // It is not assigned an M.
+  T_WAITING,
+
   // T_DEAD: task is unused.
   // It may be just exited, on a free list, or just being initialized.
   // It is not executing user code.
@@ -264,11 +584,38 @@ enum tstatus {
 rerr_t rsched_init(rsched_t* s, rmachine_t* machine);
 void rsched_dispose(rsched_t* s);
 
+// rsched_bench_park measures M park/unpark latency (see tools/schedbench.c.)
+// M0 and a new M ping-pong a wakeup via mnote_wakeup & m_park; returns the average
+// round trip in nanoseconds, i.e. two unpark+wakeup transitions.
+// Must be called on the thread which initialized s, with no program loaded.
+u64 rsched_bench_park(rsched_t* s, u32 iterations);
+
+// rsched_bench_switch measures the cost of a task switch (see tools/schedbench.c.)
+// Ping-pongs two tasks on M0 through P0's run queue: the running task is put back
+// on the run queue, as when it yields, and the other task is taken off it and
+// switched to, as m_schedule would, without executing any guest code.
+// Returns the average nanoseconds per switch.
+// Must be called on the thread which initialized s, with no program loaded.
+double rsched_bench_switch(rsched_t* s, u32 iterations);
+
 rerr_t rsched_execrom(rsched_t* s, rrom_t* rom);
 
+// rsched_load loads a program from rom and spawns its main task, to be run by the
+// calling thread with rsched_run_for. The scheduler doesn't start any OS threads.
+rerr_t rsched_load(rsched_t* s, rrom_t* rom);
+
+// rsched_run_for runs tasks of the program loaded with rsched_load on the calling
+// thread until budget nanoseconds have passed (checked at preemption points),
+// all tasks are sleeping, or all tasks have exited, in which case the program is
+// unloaded. Returns rerr_invalid if no program is loaded.
+rerr_t rsched_run_for(rsched_t* s, u64 budget, rrunresult_t* result);
+
 // return pc
 usize rsched_eval(T* t, u64* iregs, const rin_t* inv, usize pc);
 
+// aot_eval is like rsched_eval but runs the translated code of rsched_t.aot
+usize aot_eval(T* t, u64* iregs, const rin_t* inv, usize pc);
+
 // task_spawn spawns a new task executing code at pc newtask_pc.
 // t is the task that calls spawns, not the task being spawned.
 // args hold the initial arguments (R0...R7) for the new task.
@@ -278,6 +625,44 @@ i64 task_spawn(T* t, usize newtask_pc, const u64 args[RSM_NARGREGS]);
 // task_exit is called by the interpreter when a task's main function exits
 void task_exit(T*);
 
+// task_sleep suspends t for nsec nanoseconds without blocking its M.
+// Only supported in single-threaded mode (see rsched_load); returns false otherwise,
+// in which case the caller should sleep in a blocking syscall instead.
+// When true is returned, t has been parked and the caller must stop executing it.
+bool task_sleep(T* t, u64 nsec);
+
+// task_preempt is called by the interpreter at preemption points, every
+// S_PREEMPT_INTERVAL branches & calls. It accounts CPU time, enforces t's budget
+// and ends t's time slice when it has expired or latency-critical tasks are waiting.
+// Returns true if t should stop executing, in which case the scheduler puts t back
+// on a run queue once rsched_eval has returned.
+bool task_preempt(T*);
+
+// task_stack_charge accounts size bytes of new stack memory to t.
+// Returns false if that would exceed t's stack budget.
+bool task_stack_charge(T*, u64 size);
+
+// task_stack_map maps npages of lazily-backed stack memory with a guard page below
+// it, for a task to be spawned on m. Stores the address just above the stack (the
+// initial SP) at stack_vaddr.
+rerr_t task_stack_map(M* m, usize npages, u64* stack_vaddr);
+
+// task_stack_free unmaps the stack of t, including split stacks, releasing its
+// memory. t must be on its M and not executing. Leaves t without a stack.
+void task_stack_free(T* t);
+
+// rsched_taskbudget sets the budget of task tid, if budget is not NULL, and
+// stores its resource usage at usage, if not NULL. Returns rerr_not_found if there
+// is no live task with ID tid.
+rerr_t rsched_taskbudget(
+  rsched_t*, u64 tid, const rtaskbudget_t* nullable budget, rtaskusage_t* nullable usage);
+
+// task_fail terminates t, which must be running on the calling thread, because of
+// an error it can't recover from, like running out of memory. Execution of t is
+// abandoned and rsched_execrom returns err (the first such err) when the program
+// ends. Does not return.
+noreturn void task_fail(T*, rerr_t err);
+
 // enter_syscall releases the P associated with the task,
 // making that P available for use by other tasks waiting to run.
 // After this call the task can not be executed until exit_syscall is called.
@@ -290,10 +675,116 @@ void enter_syscall(T*);
 // and the caller should not continue execution of the task.
 bool exit_syscall(T*, int priority);
 
+// ioring_setup allocates and maps the scheduler's ioring into guest memory.
+// nentries is the number of submission entries and must be a power of two.
+// Returns the guest address of the ioring_hdr_t, or <0 on error (value is a rerr_t).
+i64 ioring_setup(rsched_t*, u32 nentries);
+
+// ioring_dispose unmaps and frees the scheduler's ioring, if set up.
+void ioring_dispose(rsched_t*);
+
+// ioring_poll consumes pending submissions and posts their completions.
+// It may block on I/O; scheduler Ms holding a P must use ioring_kick instead.
+// Returns immediately if another M is already consuming submissions.
+// Returns the number of completions posted.
+u32 ioring_poll(rsched_t*);
+
+// ioring_kick wakes up the I/O M if there are pending submissions
+void ioring_kick(rsched_t*);
+
+// ioring_poll_begin and ioring_poll_end bracket a period during which an M polls
+// the ring (i.e. while it's looking for work in m_findrunnable.)
+// IORING_F_NEED_WAKEUP is cleared while at least one M is polling.
+// ioring_poll_end of the last poller sets the flag and then kicks the ring one final
+// time, so that submissions made by a guest which observed the flag as cleared are
+// not missed. m->iopoll records whether m was counted by ioring_poll_begin.
+void ioring_poll_begin(M*);
+void ioring_poll_end(M*);
+
+// vdso_init allocates the time page and maps it read-only at VDSO_VADDR
+rerr_t vdso_init(rsched_t*);
+
+// vdso_dispose unmaps and frees the time page, if mapped
+void vdso_dispose(rsched_t*);
+
+// vdso_update publishes time now (a nanotime value) to the time page.
+// Returns without updating if another M is updating the page or if the page
+// already holds a time at or after now.
+void vdso_update(rsched_t*, u64 now);
+
+// vdso_task_start publishes t's CPU time to its slot when t starts running at now
+void vdso_task_start(rsched_t*, const T* t, u64 now);
+
+// memtrace_open starts tracing the memory accesses of s's program to fd.
+// memtrace_start writes the trace header; called when the program has been loaded.
+// memtrace_dispose writes out all buffered records and stops tracing.
+// memtrace_add records an access of size bytes at vaddr by the instruction at pc.
+// memtrace_open returns rerr_not_supported unless compiled with SCHED_MEMTRACE.
+rerr_t memtrace_open(rsched_t*, int fd);
+void memtrace_start(rsched_t*, u64 data_vaddr, u64 data_size);
+void memtrace_dispose(rsched_t*);
+void memtrace_add(T*, memtrace_kind_t, memtrace_flag_t, u64 vaddr, u64 size, usize pc);
+
+// m_current returns the M running on the calling OS thread, if any
+M* nullable m_current();
+
+// m_set_current sets the M running on the calling OS thread.
+// Thread main functions passed to m_spawn_osthread call it first.
+void m_set_current(M* nullable m);
+
+// rsched_vm_fault is the handler for faults in the scheduler's vm_map (vm_fault_f.)
+// Faults on a task's stack guard page grow the task's stack, up to STK_MAX.
+// A task which runs out of memory is terminated with task_fail.
+bool rsched_vm_fault(void* s, u64 vaddr, vm_op_t op);
+
 // m_spawn_osthread creates & starts an OS thread, calling mainf on the new thread.
 // Returns the OS-specific thread ID, or 0 on failure.
 uintptr m_spawn_osthread(M* m, rerr_t(*mainf)(M*));
 
+// os_cputopo discovers the host CPUs the process may run on, storing at most cap
+// of them at v, ordered so that CPUs which share caches are adjacent.
+// Returns the number of CPUs stored, or 0 if the host's topology is unknown.
+// The topology is discovered on the first call; later calls return the same CPUs.
+u32 os_cputopo(cputopo_t* v, u32 cap);
+
+// os_pinthread restricts the calling OS thread to run only on host CPU cpu
+rerr_t os_pinthread(u32 cpu);
+
+// p_nanotime returns a coarse timestamp, cached at the last scheduling point on P.
+// Use for timers, tracing and statistics where ~one scheduling quantum of
+// staleness is acceptable; use nanotime() for precise measurements.
+inline static u64 p_nanotime(const P* p) {
+  return p->now;
+}
+
+// p_nanotime_refresh updates P's cached timestamp and returns it
+inline static u64 p_nanotime_refresh(P* p) {
+  return p->now = nanotime();
+}
+
+// m_vm_sync_cow invalidates the pages of M's translation caches which vm_ksm_cow
+// gave a new translation since M last looked (see vm_map_t.cowgen)
+void m_vm_sync_cow(M* m);
+
+// m_vm_sync invalidates M's translation caches if the scheduler's vm_map changed
+// behind its back (see vm_map_t.gen & cowgen.)
+// Called before running a task and at preemption points; translations of pages
+// which another M copies on write (vm_ksm_cow) are thus picked up within one
+// preemption interval. Until then M still reads the shared page, which has the
+// same contents as the copy had at the time it was made.
+inline static void m_vm_sync(M* m) {
+  vm_map_t* map = &m->s->vm_map;
+  u32 gen = AtomicLoadAcq(&map->gen);
+  if UNLIKELY(gen != m->vmgen) {
+    m->vmgen = gen;
+    m->vmcowgen = AtomicLoadAcq(&map->cowgen);
+    for (usize i = 0; i < countof(m->vmcache); i++)
+      vm_cache_invalidate_all(&m->vmcache[i]);
+  }
+  if (map->ksm && AtomicLoadAcq(&map->cowgen) != m->vmcowgen)
+    m_vm_sync_cow(m);
+}
+
 // m_vm_cache accesses the vm cache for perm on M
 inline static vm_cache_t* m_vm_cache(M* m, vm_perm_t perm) {
   assertf(perm > 0 && (perm-1) < (vm_perm_t)countof(m->vmcache), "%u", perm);
@@ -5,15 +5,13 @@
 #include "thread.h"
 #include "sched.h"
 #include "syscall.h"
+#include "aot.h"
 
 //#define TRACE_MEMORY // define to dlog LOAD and STORE operations
 
 // MAIN_RET_PC: special PC value representing the main return address
 #define MAIN_RET_PC  USIZE_MAX
 
-// stackbase for a task
-#define TASK_STACKBASE(t) ((void*)ALIGN2_FLOOR((uintptr)(t),STK_ALIGN))
-
 // EXEC_PARAMS: parameters of an exec function
 // EXEC_ARGS: arguments inside a exec function, for calling another function
 #define EXEC_PARAMS T* t, u64* iregs, const rin_t* inv, usize pc
@@ -164,11 +162,27 @@ enum execerr_t {
 //———————————————————————————————————————————————————————————————————————————————————
 // memory operations
 
+// EXEC_VM_CACHE & EXEC_VM_MAP are the vm cache and map used by MLOAD and MSTORE.
+// EXEC_VM_DBASE & EXEC_VM_DSIZE are the map's direct window (see vm_map_direct_init.)
+#define EXEC_VM_CACHE(perm) m_vm_cache((t)->m, (perm))
+#define EXEC_VM_MAP         (&(t)->m->s->vm_map)
+#define EXEC_VM_DBASE       (EXEC_VM_MAP->direct_base)
+#define EXEC_VM_DSIZE       (EXEC_VM_MAP->direct_size)
+
+// MEMTRACE records a memory access by the current instruction (see memtrace.h)
+#ifdef SCHED_MEMTRACE
+  #define MEMTRACE(kind, flags, vaddr, size) \
+    memtrace_add(t, (kind), (flags), (vaddr), (size), pc - 1)
+#else
+  #define MEMTRACE(kind, flags, vaddr, size) ((void)0)
+#endif
+
 // inline u64 MLOAD(TYPE, u64 addr)
 #define MLOAD(TYPE, vaddr) ({ \
   u64 vaddr__ = (vaddr); \
-  u64 value__ = VM_LOAD( \
-    TYPE, m_vm_cache((t)->m, VM_PERM_RW), &(t)->m->s->vm_map, vaddr__); \
+  MEMTRACE(MEMTRACE_LOAD, 0, vaddr__, sizeof(TYPE)); \
+  u64 value__ = VM_DLOAD(TYPE, EXEC_VM_CACHE(VM_PERM_R), EXEC_VM_MAP, \
+    EXEC_VM_DBASE, EXEC_VM_DSIZE, vaddr__); \
   tracemem("load %s 0x%llx (align %lu) => 0x%llx", \
     #TYPE, vaddr__, _Alignof(TYPE), value__); \
   value__; \
@@ -178,12 +192,19 @@ enum execerr_t {
 #define MSTORE(TYPE, vaddr, value) { \
   u64 vaddr__ = (vaddr); \
   u64 value__ = (value); \
+  MEMTRACE(MEMTRACE_STORE, 0, vaddr__, sizeof(TYPE)); \
   tracemem("store %s 0x%llx (align %lu) => 0x%llx", \
     #TYPE, value__, _Alignof(TYPE), vaddr__); \
-  VM_STORE( \
-    TYPE, m_vm_cache((t)->m, VM_PERM_RW), &(t)->m->s->vm_map, vaddr__, value__); \
+  VM_DSTORE(TYPE, EXEC_VM_CACHE(VM_PERM_RW), EXEC_VM_MAP, \
+    EXEC_VM_DBASE, EXEC_VM_DSIZE, vaddr__, value__); \
 }
 
+// inline TYPE* MSTORE_PTR(TYPE, u64 addr) translates addr for a store of TYPE.
+// Call vm_direct_check after the store (see vm_map_direct_init.)
+#define MSTORE_PTR(TYPE, vaddr) ((TYPE*)vm_translate_direct( \
+  EXEC_VM_CACHE(VM_PERM_RW), EXEC_VM_MAP, EXEC_VM_DBASE, EXEC_VM_DSIZE, \
+  (vaddr), _Alignof(TYPE), VM_OP_STORE + _Alignof(TYPE)))
+
 #define HADDR_OFFS_MASK  ((uintptr)( (uintptr)PAGE_SIZE - (uintptr)1 ))
 #define HADDR_PAGE_MASK  ((uintptr)( ~(uintptr)0 ^ ((uintptr)PAGE_SIZE - (uintptr)1) ))
 
@@ -218,9 +239,12 @@ static void mcopy(EXEC_PARAMS, u64 dstaddr, u64 srcaddr, u64 size) {
   //   copy 1320 B  0x3000-0x3528 ⟶ 0x7000-0x7528
   //
   vm_map_t* map = &(t)->m->s->vm_map;
-  vm_cache_t* cache = m_vm_cache((t)->m, VM_PERM_RW);
+  vm_cache_t* rcache = m_vm_cache((t)->m, VM_PERM_R);
+  vm_cache_t* wcache = m_vm_cache((t)->m, VM_PERM_RW);
 
   tracemem("mcopy %012llx <- %012llx (%llu B)", dstaddr, srcaddr, size);
+  MEMTRACE(MEMTRACE_LOAD, MEMTRACE_F_BULK, srcaddr, size);
+  MEMTRACE(MEMTRACE_STORE, MEMTRACE_F_BULK, dstaddr, size);
 
   // check for overlapping address ranges
   #if RSM_SAFE
@@ -231,8 +255,8 @@ static void mcopy(EXEC_PARAMS, u64 dstaddr, u64 srcaddr, u64 size) {
   }
   #endif
 
-  void* src = (void*)vm_translate(cache, map, srcaddr, 1, VM_OP_LOAD_1);
-  void* dst = (void*)vm_translate(cache, map, dstaddr, 1, VM_OP_STORE_1);
+  void* src = (void*)vm_translate(rcache, map, srcaddr, 1, VM_OP_LOAD_1);
+  void* dst = (void*)vm_translate(wcache, map, dstaddr, 1, VM_OP_STORE_1);
   //tracemem("[haddr] dst %p, src %p, size %llu", dst, src, size);
 
   for (;;) {
@@ -258,8 +282,8 @@ static void mcopy(EXEC_PARAMS, u64 dstaddr, u64 srcaddr, u64 size) {
     srcaddr += (u64)nbyte;
     dstaddr += (u64)nbyte;
 
-    src = (void*)vm_translate(cache, map, srcaddr, 1, VM_OP_LOAD_1);
-    dst = (void*)vm_translate(cache, map, dstaddr, 1, VM_OP_STORE_1);
+    src = (void*)vm_translate(rcache, map, srcaddr, 1, VM_OP_LOAD_1);
+    dst = (void*)vm_translate(wcache, map, dstaddr, 1, VM_OP_STORE_1);
   }
 }
 
@@ -281,22 +305,18 @@ static u64 copyv(EXEC_PARAMS, u64 n) {
 }
 
 // —————————— stack operations
+//
+// Stacks are bounded by a guard page (VM_PERM_NONE) just below stack_lo, so push
+// and pop don't check SP against the stack bounds. Instead, overflowing the stack
+// faults on the guard page and rsched_vm_fault either grows the stack or reports
+// a stack overflow.
 
 inline static void push(EXEC_PARAMS, u64 size, u64 value) {
-  u64 vaddr = SP;
-  check(vaddr >= t->stack_lo + size, EX_E_STACK_OVERFLOW, vaddr);
-  vaddr -= size;
+  u64 vaddr = SP - size;
   SP = vaddr;
   MSTORE(u64, vaddr, value);
 }
 
-inline static u64 pop(EXEC_PARAMS, u64 size) {
-  u64 vaddr = SP;
-  check(vaddr + size >= t->stack_lo, EX_E_STACK_OVERFLOW, vaddr);
-  SP = vaddr + size;
-  return MLOAD(u64, vaddr);
-}
-
 static void push_PC(EXEC_PARAMS) {
   // save PC on stack
   check(IS_ALIGN2(SP, STK_ALIGN), EX_E_UNALIGNED_STACK, SP, STK_ALIGN);
@@ -308,6 +328,201 @@ static void push_PC(EXEC_PARAMS) {
 static_assert(IS_ALIGN2(STK_SPLIT_LINK_SIZE, STK_ALIGN), "");
 
 
+// stack_map_guard maps a guard page at vaddr, making sure M doesn't have
+// a stale cache entry for it from an earlier mapping at the same address
+static rerr_t stack_map_guard(M* m, vm_map_t* vm_map, u64 vaddr) {
+  rerr_t err = vm_map_add(vm_map, vaddr, 0, 1, VM_PERM_NONE);
+  if (!err) {
+    for (usize i = 0; i < countof(m->vmcache); i++)
+      vm_cache_invalidate_one(&m->vmcache[i], vaddr);
+  }
+  return err;
+}
+
+
+// stack_extend grows t's stack in place by size bytes, below stack_lo.
+// If the stack has a guard page, the guard page is moved below the new stack_lo.
+// vm_map must be locked. Returns rerr_exists if the address range is in use and
+// rerr_nomem if t's stack budget would be exceeded.
+static rerr_t stack_extend(T* t, vm_map_t* vm_map, u64 size) {
+  assert(IS_ALIGN2(t->stack_lo, PAGE_SIZE));
+  assert(IS_ALIGN2(size, PAGE_SIZE));
+  u64 npages = size / PAGE_SIZE;
+  u64 stack_lo;
+  if (check_sub_overflow(t->stack_lo, size + PAGE_SIZE, &stack_lo) ||
+      stack_lo < VM_ADDR_MIN)
+  {
+    return rerr_exists;
+  }
+  stack_lo += PAGE_SIZE; // room for guard page
+  if (!task_stack_charge(t, size))
+    return rerr_nomem;
+
+  // does the stack have a guard page?
+  u64 guard = t->stack_lo - PAGE_SIZE;
+  vm_page_t* page = vm_map_access(vm_map, VM_VFN(guard), /*isaccess*/false);
+  bool hasguard = page && page->type == VM_PAGE_T_GUARD;
+  if (hasguard) {
+    UNUSED rerr_t err = vm_map_del(vm_map, guard, 1);
+    assertf(err == 0, "vm_map_del: %s", rerr_str(err));
+  }
+
+  rerr_t err = vm_map_add(vm_map, stack_lo, 0, npages, VM_PERM_RW);
+  if (!err && hasguard) {
+    err = stack_map_guard(t->m, vm_map, stack_lo - PAGE_SIZE);
+    if (err)
+      vm_map_del(vm_map, stack_lo, npages);
+  }
+  if (err) {
+    if (hasguard)
+      safecheckx(stack_map_guard(t->m, vm_map, guard) == 0);
+    t->stackmem -= size;
+    return err;
+  }
+
+  t->stack_lo = stack_lo;
+  tracemem("stack extended to %012llx-%012llx (%llu pages)",
+    t->stack_lo, t->stack_hi, IDIV_CEIL(t->stack_hi - t->stack_lo, PAGE_SIZE));
+  return 0;
+}
+
+
+// stack_map maps npages of lazily-backed stack memory at stack_lo, with a guard page
+// just below it. vm_map must be locked.
+static rerr_t stack_map(M* m, vm_map_t* vm_map, u64 stack_lo, usize npages) {
+  rerr_t err = stack_map_guard(m, vm_map, stack_lo - PAGE_SIZE);
+  if (err)
+    return err;
+  if ((err = vm_map_add(vm_map, stack_lo, 0, npages, VM_PERM_RW)))
+    vm_map_del(vm_map, stack_lo - PAGE_SIZE, 1);
+  return err;
+}
+
+
+rerr_t task_stack_map(M* m, usize npages, u64* stack_vaddr) {
+  rsched_t* s = m->s;
+  vm_map_t* vm_map = &s->vm_map;
+  u64 size = (u64)npages * PAGE_SIZE;
+  assert(size <= STK_MAX);
+  rerr_t err = rerr_nomem;
+  vm_map_lock(vm_map);
+
+  // Place the stack at the top of an address range of STK_MAX bytes (plus guard page)
+  // of its own, below the range of the previously spawned task, so that the stack
+  // can grow in place (see stack_extend.) Otherwise use any free address range.
+  u64 stack_hi = s->stack_next;
+  u64 stack_lo = stack_hi - size;
+  if (stack_hi >= VM_ADDR_MIN + STK_MAX + PAGE_SIZE) {
+    s->stack_next = stack_hi - STK_MAX - PAGE_SIZE;
+    err = stack_map(m, vm_map, stack_lo, npages);
+  }
+  if (err) {
+    stack_lo = 0;
+    if ((err = vm_map_findspace(vm_map, &stack_lo, npages + 1)) == 0) {
+      stack_lo += PAGE_SIZE;
+      err = stack_map(m, vm_map, stack_lo, npages);
+    }
+  }
+
+  vm_map_unlock(vm_map);
+  if (err)
+    return err;
+  *stack_vaddr = stack_lo + size;
+  tracemem("stack mapped %012llx-%012llx (%zu pages)", stack_lo, *stack_vaddr, npages);
+  return 0;
+}
+
+
+void task_stack_free(T* t) {
+  M* m = t->m;
+  vm_map_t* vm_map = &m->s->vm_map;
+
+  // unmap split stacks (see stkmem_grow), then the stack the task started with
+  for (;;) {
+    u64 stack_lo = t->stack_lo - PAGE_SIZE; // including guard page
+    u64 stack_end = t->stack_hi + sizeof(u64);
+    u64 link[3];
+    if (t->nsplitstack) {
+      stack_end = t->stack_hi + STK_SPLIT_LINK_SIZE;
+      vm_cache_t* vm_cache = m_vm_cache(m, VM_PERM_R);
+      memcpy(link, (void*)VM_TRANSLATE(vm_cache, vm_map, t->stack_hi, STK_ALIGN),
+        sizeof(link));
+    }
+    assert(IS_ALIGN2(stack_end, PAGE_SIZE));
+    u64 npages = (stack_end - stack_lo) / PAGE_SIZE;
+    tracemem("stack unmap %012llx-%012llx (%llu pages)", stack_lo, stack_end, npages);
+    vm_ksm_release(vm_map, stack_lo, npages);
+    vm_map_lock(vm_map);
+    UNUSED rerr_t err = vm_map_del(vm_map, stack_lo, npages);
+    vm_map_unlock(vm_map);
+    assertf(err == 0, "vm_map_del %012llx: %s", stack_lo, rerr_str(err));
+    if (t->nsplitstack == 0)
+      break;
+    t->stack_hi = link[1];
+    t->stack_lo = link[2];
+    t->nsplitstack--;
+  }
+
+  t->stack_lo = 0;
+  t->stack_hi = 0;
+  t->stackmem = 0;
+  m_vm_sync(m); // drop translations of the stacks' backing pages
+}
+
+
+// rsched_vm_fault is the vm_map fault handler of a scheduler (vm_map_t.fault)
+bool rsched_vm_fault(void* ctx, u64 vaddr, vm_op_t op) {
+  rsched_t* s = ctx;
+  M* m = m_current();
+  T* t = m ? m->currt : NULL;
+  if (!t)
+    return false;
+
+  // the machine's memory limit is reached (or the host is out of memory)
+  if (op & VM_OP_F_NOMEM)
+    task_fail(t, rerr_nomem);
+
+  // store to a deduplicated page. If the page got a new translation, vm_ksm_cow
+  // logged it in vm_map.cowlog; every M (this one right away, others at their next
+  // preemption point) drops the page from its caches, which may hold the
+  // translation of the shared page from a load.
+  if (VM_OP_TYPE(op) == VM_OP_STORE) {
+    rerr_t err = vm_ksm_cow(&s->vm_map, vaddr);
+    if (err == 0) {
+      m_vm_sync(m);
+      return true;
+    }
+    if (err == rerr_nomem)
+      task_fail(t, err);
+  }
+
+  // otherwise we are only interested in faults on the guard page of t's stack
+  if (vaddr >= t->stack_lo || vaddr < t->stack_lo - PAGE_SIZE)
+    return false;
+
+  // grow the stack to twice its size, up to STK_MAX
+  u64 stacksize = t->stack_hi - t->stack_lo;
+  if (stacksize < STK_MAX) {
+    u64 size = ALIGN2(MIN(stacksize, STK_MAX - stacksize), PAGE_SIZE);
+    vm_map_lock(&s->vm_map);
+    rerr_t err = stack_extend(t, &s->vm_map, size);
+    vm_map_unlock(&s->vm_map);
+    if (!err)
+      return true;
+    if (err == rerr_nomem)
+      task_fail(t, err);
+  }
+
+  // A stack that can't grow in place can't be split either, since unlike stkmem,
+  // the fault happened in the middle of an instruction that uses SP.
+  // (not logging SP since t->iregs is stale while rsched_eval runs; INTERPRET_PIN_REGS)
+  log("stack overflow in task T%llu: %s 0x%llx (stack 0x%llx…0x%llx)",
+    t->id, VM_OP_TYPE(op) == VM_OP_LOAD ? "load from" : "store to", vaddr,
+    t->stack_lo, t->stack_hi);
+  task_fail(t, rerr_stack_overflow);
+}
+
+
 static i64 stkmem_grow(EXEC_PARAMS, u64 delta) {
   u64 sp = SP;
   check(IS_ALIGN2(sp, STK_ALIGN), EX_E_UNALIGNED_STACK, sp, STK_ALIGN);
@@ -319,36 +534,44 @@ static i64 stkmem_grow(EXEC_PARAMS, u64 delta) {
   u64 npages = newsize/PAGE_SIZE;
   rerr_t err;
 
-  assert(IS_ALIGN2(t->stack_lo, PAGE_SIZE));
-
   vm_map_lock(vm_map);
 
   // attempt to expand the stack by mapping addresses above the current stack
-  u64 stack_lo = t->stack_lo - newsize;
-  err = vm_map_add(vm_map, stack_lo, 0, npages, VM_PERM_RW);
+  err = stack_extend(t, vm_map, newsize);
   if (!err) {
     vm_map_unlock(vm_map);
-    t->stack_lo = stack_lo;
-    tracemem("stack extended to %012llx-%012llx (%llu pages)",
-      t->stack_lo, t->stack_hi, IDIV_CEIL(t->stack_hi - t->stack_lo, PAGE_SIZE));
     return sp - delta;
   }
 
-  // vm_map_add should have failed with rerr_exists
+  // stack_extend should have failed with rerr_exists, or because of t's budget
+  if (err == rerr_nomem) {
+    vm_map_unlock(vm_map);
+    task_fail(t, err);
+  }
   safecheckf(err == rerr_exists, "vm_map_add %s", rerr_str(err));
 
   // region above current stack is not free
-  // find any free region and split the stack
-  stack_lo = 0;
-  err = vm_map_findspace(vm_map, &stack_lo, npages);
-  if UNLIKELY(err) {
-    if (err == rerr_nomem)
-      panic("out of memory white trying to grow stack");
-    safecheckf(err==0, "vm_map_findspace: %s", rerr_str(err));
+  // find any free region (plus a guard page) and split the stack
+  if (!task_stack_charge(t, newsize)) {
+    vm_map_unlock(vm_map);
+    task_fail(t, rerr_nomem);
+  }
+  u64 stack_lo = 0;
+  err = vm_map_findspace(vm_map, &stack_lo, npages + 1);
+  if (!err) {
+    err = stack_map_guard(t->m, vm_map, stack_lo);
+    stack_lo += PAGE_SIZE;
+  }
+  if (!err) {
+    err = vm_map_add(vm_map, stack_lo, 0, npages, VM_PERM_RW);
+    if (err)
+      vm_map_del(vm_map, stack_lo - PAGE_SIZE, 1);
   }
-  err = vm_map_add(vm_map, stack_lo, 0, npages, VM_PERM_RW);
-  safecheckf(err==0, "vm_map %s", rerr_str(err));
   vm_map_unlock(vm_map);
+  if UNLIKELY(err) {
+    safecheckf(err == rerr_nomem, "vm_map %s", rerr_str(err));
+    task_fail(t, err);
+  }
 
   // new stack pointer.
   // reserve space on new stack for saving link to previous stack
@@ -378,14 +601,16 @@ static i64 stkmem_unlink(EXEC_PARAMS, u64 delta) {
   // end of a split stack -- unmap it & unlink
   u64 sp = SP + delta;
 
-  // unmap current stack being retired
+  // unmap current stack being retired, including its guard page
   vm_map_t* vm_map = &t->m->s->vm_map;
   usize stacksize = (t->stack_hi + STK_SPLIT_LINK_SIZE) - t->stack_lo;
   assert(IS_ALIGN2(stacksize, PAGE_SIZE));
+  vm_ksm_release(vm_map, t->stack_lo - PAGE_SIZE, stacksize/PAGE_SIZE + 1);
   vm_map_lock(vm_map);
-  UNUSED rerr_t err = vm_map_del(vm_map, t->stack_lo, stacksize/PAGE_SIZE);
+  UNUSED rerr_t err = vm_map_del(vm_map, t->stack_lo - PAGE_SIZE, stacksize/PAGE_SIZE + 1);
   vm_map_unlock(vm_map);
   safecheckf(err==0, "splitstack vm_unmap %llx: %s", t->stack_lo, rerr_str(err));
+  m_vm_sync(t->m); // drop translations of the stack's backing pages
 
   tracemem("splitstack del %012llx-%012llx (%zu KiB)",
     t->stack_lo, t->stack_hi + STK_SPLIT_LINK_SIZE, stacksize/KiB);
@@ -398,6 +623,7 @@ static i64 stkmem_unlink(EXEC_PARAMS, u64 delta) {
   t->stack_lo = stack[2]; // newsp+16
 
   t->nsplitstack--;
+  t->stackmem -= stacksize;
 
   return newsp;
 }
@@ -442,7 +668,8 @@ static i64 _write(EXEC_PARAMS, i64 fd, u64 srcaddr, u64 size) {
     return 0;
 
   vm_map_t* map = &(t)->m->s->vm_map;
-  vm_cache_t* cache = m_vm_cache((t)->m, VM_PERM_RW);
+  vm_cache_t* cache = m_vm_cache((t)->m, VM_PERM_R);
+  MEMTRACE(MEMTRACE_LOAD, MEMTRACE_F_BULK, srcaddr, size);
   void* src = (void*)vm_translate(cache, map, srcaddr, 1, VM_OP_LOAD_1);
   u64 remaining = size;
 
@@ -494,6 +721,9 @@ static bool _syscall(T* t, u64* iregs, usize pc, u32 syscall_op) {
     u64 nsec = iregs[0];
     if (nsec == 0)
       return true; // no-op
+    iregs[0] = 0; // remaining time when woken by the scheduler
+    if (task_sleep(t, nsec))
+      return false;
     enter_syscall(t);
     dlog("sleeping for %llu ns", nsec);
     u64 remaining = rsm_nanosleep(nsec);
@@ -502,6 +732,32 @@ static bool _syscall(T* t, u64* iregs, usize pc, u32 syscall_op) {
     return exit_syscall(t, /*priority*/0);
   }
 
+  case SC_IORING_SETUP:
+    iregs[0] = (u64)ioring_setup(t->m->s, (u32)iregs[0]);
+    return true;
+
+  case SC_IORING_ENTER: {
+    rsched_t* s = t->m->s;
+    AtomicAdd(&s->ioring.nenter, 1, memory_order_relaxed);
+    enter_syscall(t);
+    iregs[0] = (u64)ioring_poll(s);
+    return exit_syscall(t, /*priority*/0);
+  }
+
+  case SC_TASKID:
+    iregs[0] = t->id;
+    return true;
+
+  case SC_TCLASS: {
+    if (iregs[0] >= S_NCLASS) {
+      iregs[0] = (u64)(i64)rerr_invalid;
+      return true;
+    }
+    // takes effect at t's next preemption point
+    iregs[0] = AtomicExchange(&t->sclass, (u8)iregs[0], memory_order_relaxed);
+    return true;
+  }
+
   }
   panic("NOT IMPLEMENTED syscall %u", syscall_op);
   return true;
@@ -567,10 +823,52 @@ static void on_overflow(T* t, usize pc, rop_t op, i64 x, i64 y, i64* dst) {
 #endif
 
 
+#ifdef INTERPRET_PIN_REGS
+usize rsched_eval(T* t, u64* tregs, const rin_t* inv, usize pc) {
+#else
 usize rsched_eval(EXEC_PARAMS) {
+#endif
   // This is the interpreter loop.
   // It executes instructions until a syscall parks the task (or an error occurs.)
   //
+  // With INTERPRET_PIN_REGS, guest registers live in a local register file while
+  // the loop runs. Its address never escapes, so the compiler knows that guest memory
+  // stores don't modify registers (t->iregs is in guest memory) and doesn't need to
+  // reload them. Likewise the vm map & caches of t's M are loaded once.
+  // The local registers are spilled to tregs (t->iregs) before calling functions
+  // which read registers and before returning. Helpers are passed tregs via EXEC_ARGS.
+  #ifdef INTERPRET_PIN_REGS
+    u64 iregs[RSM_NREGS];
+    memcpy(iregs, tregs, sizeof(iregs));
+    // t doesn't change M while the loop runs
+    vm_map_t* const   vm_map = EXEC_VM_MAP;
+    vm_cache_t* const vm_rcache = EXEC_VM_CACHE(VM_PERM_R);
+    vm_cache_t* const vm_wcache = EXEC_VM_CACHE(VM_PERM_RW);
+    const uintptr     vm_dbase = EXEC_VM_DBASE;
+    const u64         vm_dsize = EXEC_VM_DSIZE;
+    #undef EXEC_VM_MAP
+    #undef EXEC_VM_CACHE
+    #undef EXEC_VM_DBASE
+    #undef EXEC_VM_DSIZE
+    #define EXEC_VM_MAP vm_map
+    #define EXEC_VM_CACHE(perm) ((perm) == VM_PERM_R ? vm_rcache : vm_wcache)
+    #define EXEC_VM_DBASE vm_dbase
+    #define EXEC_VM_DSIZE vm_dsize
+    #define SPILL()  memcpy(tregs, iregs, sizeof(iregs))
+    #define RELOAD() memcpy(iregs, tregs, sizeof(iregs))
+    #undef EXEC_ARGS
+    #define EXEC_ARGS t, tregs, inv, pc
+    #if RSM_SAFE
+      #undef execerr
+      #define execerr(...) \
+        (SPILL(), _execerr(EXEC_ARGS, __execerr_DISP(__execerr,__VA_ARGS__)))
+    #endif
+  #else
+    u64* tregs = iregs;
+    #define SPILL()  ((void)0)
+    #define RELOAD() ((void)0)
+  #endif
+  //
   // First, we define how we will map an instruction to its corresponding handler code.
   // There are two options: using a label jump table or a switch statement.
   #ifdef INTERPRET_USE_JUMPTABLE // use label jump table
@@ -645,10 +943,32 @@ usize rsched_eval(EXEC_PARAMS) {
 
   exec_logstate_header();
 
+  u32 ticks = S_PREEMPT_INTERVAL; // branches & calls until the next preemption point
+
+  #ifdef INTERPRET_SHADOW_STACK
+    // The shadow stack holds, for the most recent CALLs, the SP a return address was
+    // pushed at and the host address it was stored to. A RET at the SP of the top
+    // entry loads the return address from the guest stack through the host address,
+    // without translating SP. It's a cache of the translation of SP, so a guest which
+    // rewrites its return address still returns to where the guest stack says.
+    // Entries are valid as long as the vm_cache is (translations of writable pages
+    // only change behind M's back between runs, see m_vm_sync), so the shadow stack
+    // lives for one run of t on M and is reset by operations which may remap the
+    // stack: syscalls and STKMEM which splits or unlinks a stack. Entries are reused
+    // in a ring; older calls miss.
+    static_assert(IS_POW2_X(INTERPRET_SHADOW_STACK_SIZE), "");
+    struct { u64 sp; u64* haddr; } shadow[INTERPRET_SHADOW_STACK_SIZE];
+    u32 shadowtop = 0; // index of next entry, modulo INTERPRET_SHADOW_STACK_SIZE
+    u32 shadowlen = 0; // number of valid entries below shadowtop
+    #define SHADOW_RESET() (shadowlen = 0)
+  #else
+    #define SHADOW_RESET() ((void)0)
+  #endif
+
   // instruction feed loop
   for (;;) {
     // load the next instruction and advance program counter
-    assertf(pc < t->instrc, "pc overrun %lu", pc); exec_logstate(EXEC_ARGS);
+    assertf(pc < t->instrc, "pc overrun %lu", pc); exec_logstate(t, iregs, inv, pc);
     rin_t in = inv[pc++];
     // preload arguments A and B as most instructions need it
     u8 ar = RSM_GET_A(in);
@@ -664,7 +984,8 @@ usize rsched_eval(EXEC_PARAMS) {
     //———————————————————————————————————————————————————————————————————————————————————
 
     #define do_COPY(B)  RA = B
-    #define do_COPYV(B) RA = copyv(EXEC_ARGS, B); pc += B;
+    #define do_COPYV(B) \
+      check(pc+B < t->instrc, EX_E_OOB_PC, (u64)pc); RA = copyv(EXEC_ARGS, B); pc += B;
 
     #define do_LOAD(C)   RA = MLOAD(u64, (u64)((i64)RB+(i64)C))
     #define do_LOAD4U(C) RA = MLOAD(u32, (u64)((i64)RB+(i64)C)) // zero-extend i32 to i64
@@ -682,9 +1003,10 @@ usize rsched_eval(EXEC_PARAMS) {
     #define do_ADD(C)  RA = RB + C
     #define do_SUB(C)  RA = RB - C
     #define do_MUL(C)  RA = RB * C
-    #define do_ADDS(C) CHECK_OVERFLOW(add, i64, RB, C, &RA);
-    #define do_SUBS(C) CHECK_OVERFLOW(sub, i64, RB, C, &RA);
-    #define do_MULS(C) CHECK_OVERFLOW(mul, i64, RB, C, &RA);
+    // (result is stored via a temporary since on_overflow takes its address)
+    #define do_ADDS(C) { i64 r; CHECK_OVERFLOW(add, i64, RB, C, &r); RA = (u64)r; }
+    #define do_SUBS(C) { i64 r; CHECK_OVERFLOW(sub, i64, RB, C, &r); RA = (u64)r; }
+    #define do_MULS(C) { i64 r; CHECK_OVERFLOW(mul, i64, RB, C, &r); RA = (u64)r; }
     // TODO: if we keep ...S overflow-safe ops, expand to i32, i16 and i8 (e.g. do_ADDS4)
     #define do_DIV(C)  RA = RB / C
     #define do_MOD(C)  RA = RB % C
@@ -708,21 +1030,72 @@ usize rsched_eval(EXEC_PARAMS) {
     #define do_GTS(C)  RA = (i64)RB >  (i64)C
     #define do_GTES(C) RA = (i64)RB >= (i64)C
 
-    #define do_IF(B)   if (RA)      pc = (isize)((i64)pc + (i64)B)
-    #define do_IFZ(B)  if (RA == 0) pc = (isize)((i64)pc + (i64)B)
-
-    #define do_JUMP(A)  pc = (usize)A
-    #define do_CALL(A)  push_PC(EXEC_ARGS); pc = (usize)A;
+    // preemption point, every S_PREEMPT_INTERVAL branches & calls (see task_preempt)
+    #define PREEMPT() \
+      if UNLIKELY(--ticks == 0 && (ticks = S_PREEMPT_INTERVAL, task_preempt(t))) \
+        return SPILL(), pc
+
+    #define do_IF(B)   if (RA)      pc = (isize)((i64)pc + (i64)B); PREEMPT()
+    #define do_IFZ(B)  if (RA == 0) pc = (isize)((i64)pc + (i64)B); PREEMPT()
+
+    // push & pop of return addresses operate on SP of the local register file
+    #define do_JUMP(A)  pc = (usize)A; PREEMPT()
+    #ifdef INTERPRET_SHADOW_STACK
+      #define SHADOW_MASK (INTERPRET_SHADOW_STACK_SIZE - 1u)
+      #define do_CALL(A) { \
+        check(IS_ALIGN2(SP, STK_ALIGN), EX_E_UNALIGNED_STACK, SP, STK_ALIGN); \
+        SP -= 8; \
+        u64* haddr = MSTORE_PTR(u64, SP); \
+        MEMTRACE(MEMTRACE_STORE, 0, SP, 8); \
+        *haddr = (u64)pc; \
+        vm_direct_check(EXEC_VM_MAP); \
+        shadow[shadowtop & SHADOW_MASK].sp = SP; \
+        shadow[shadowtop & SHADOW_MASK].haddr = haddr; \
+        shadowtop++; \
+        shadowlen += (shadowlen < INTERPRET_SHADOW_STACK_SIZE); \
+        pc = (usize)A; PREEMPT(); \
+      }
+    #else
+      #define do_CALL(A) \
+        check(IS_ALIGN2(SP, STK_ALIGN), EX_E_UNALIGNED_STACK, SP, STK_ALIGN); \
+        SP -= 8; MSTORE(u64, SP, (u64)pc); \
+        pc = (usize)A; PREEMPT();
+    #endif
 
-    #define do_TSPAWN(A)  iregs[0] = task_spawn(t, A, iregs);
-    #define do_SYSCALL(A) if (!_syscall(t, iregs, pc, A)) return pc;
+    #define do_TSPAWN(A)  SPILL(); iregs[0] = task_spawn(t, A, tregs);
+    #define do_SYSCALL(A) { \
+      SPILL(); \
+      if (!_syscall(t, tregs, pc, A)) return pc; \
+      RELOAD(); \
+      SHADOW_RESET(); \
+    }
     #define do_WRITE(D)   RA = _write(EXEC_ARGS, D, RB, RC) // addr=RB size=RC fd=D
     #define do_READ(D)    RA = _read(EXEC_ARGS, D, RB, RC) // addr=RB size=RC fd=D
     #define do_MCOPY(C)   mcopy(EXEC_ARGS, RA, RB, C)
     #define do_MCMP(D)    RA = (u64)mcmp(EXEC_ARGS, RB, RC, D)
-    #define do_STKMEM(A)  SP = stkmem(EXEC_ARGS, A);
+    #define do_STKMEM(A) { \
+      u32 nsplitstack = t->nsplitstack; \
+      SPILL(); SP = stkmem(EXEC_ARGS, A); \
+      if UNLIKELY(t->nsplitstack != nsplitstack) SHADOW_RESET(); \
+    }
 
-    #define do_RET() pc = (usize)pop(EXEC_ARGS, 8) // load return address from stack
+    #ifdef INTERPRET_SHADOW_STACK
+      #define do_RET() { /* load return address from stack */ \
+        u64 vaddr = SP; SP = vaddr + 8; \
+        if LIKELY(shadowlen && shadow[(shadowtop - 1) & SHADOW_MASK].sp == vaddr) { \
+          shadowtop--; shadowlen--; \
+          MEMTRACE(MEMTRACE_LOAD, 0, vaddr, 8); \
+          pc = (usize)*shadow[shadowtop & SHADOW_MASK].haddr; \
+        } else { \
+          shadowlen = 0; \
+          pc = (usize)MLOAD(u64, vaddr); \
+        } \
+      }
+    #else
+      #define do_RET() { /* load return address from stack */ \
+        u64 vaddr = SP; SP = vaddr + 8; pc = (usize)MLOAD(u64, vaddr); \
+      }
+    #endif
 
     //———————————————————————————————————————————————————————————————————————————————————
     // generators for handler labels (or case statements if a switch is used)
@@ -753,5 +1126,58 @@ usize rsched_eval(EXEC_PARAMS) {
   #undef CASE_R
   #undef CASE_I
   #undef DEFAULT
+  #undef SPILL
+  #undef RELOAD
+  #undef SHADOW_RESET
+  #undef SHADOW_MASK
+  #ifdef INTERPRET_PIN_REGS
+    #undef EXEC_ARGS
+    #define EXEC_ARGS t, iregs, inv, pc
+    #undef EXEC_VM_MAP
+    #undef EXEC_VM_CACHE
+    #undef EXEC_VM_DBASE
+    #undef EXEC_VM_DSIZE
+    #define EXEC_VM_CACHE(perm) m_vm_cache((t)->m, (perm))
+    #define EXEC_VM_MAP         (&(t)->m->s->vm_map)
+    #define EXEC_VM_DBASE       (EXEC_VM_MAP->direct_base)
+    #define EXEC_VM_DSIZE       (EXEC_VM_MAP->direct_size)
+    #if RSM_SAFE
+      #undef execerr
+      #define execerr(...) _execerr(EXEC_ARGS, __execerr_DISP(__execerr,__VA_ARGS__))
+    #endif
+  #endif
+}
+
+
+//———————————————————————————————————————————————————————————————————————————————————
+// runtime of ahead-of-time translated code (see aot.h)
+// pc is the pc following the instruction being executed, as in rsched_eval.
+
+void aot_mcopy(T* t, u64* iregs, usize pc, u64 dstaddr, u64 srcaddr, u64 size) {
+  mcopy(t, iregs, t->instrv, pc, dstaddr, srcaddr, size);
+}
+
+i64 aot_write(T* t, u64* iregs, usize pc, i64 fd, u64 srcaddr, u64 size) {
+  return _write(t, iregs, t->instrv, pc, fd, srcaddr, size);
+}
+
+u64 aot_stkmem(T* t, u64* iregs, usize pc, i64 delta) {
+  return (u64)stkmem(t, iregs, t->instrv, pc, delta);
 }
 
+void aot_push_pc(T* t, u64* iregs, usize pc) {
+  push_PC(t, iregs, t->instrv, pc);
+}
+
+bool aot_syscall(T* t, u64* iregs, usize pc, u32 syscall_op) {
+  return _syscall(t, iregs, pc, syscall_op);
+}
+
+void aot_overflow(T* t, usize pc, rop_t op, i64 x, i64 y, i64* dst) {
+  on_overflow(t, pc, op, x, y, dst);
+}
+
+void aot_shifterr(T* t, u64* iregs, usize pc, u64 exponent) {
+  UNUSED const rin_t* inv = t->instrv;
+  check_shift(exponent);
+}
@@ -0,0 +1,354 @@
+// guest<->host submission & completion rings
+// SPDX-License-Identifier: Apache-2.0
+//
+// See ioring_hdr_t in sched.h for a description of the shared memory layout.
+//
+// Submissions are executed with blocking host I/O, so they are never consumed by
+// an M which holds a P. Instead, scheduler Ms wake up a dedicated I/O M
+// (ioring_t.iom, ioring_kick) and SC_IORING_ENTER consumes submissions inside
+// enter_syscall/exit_syscall. In stepping mode (rsched_run_for) there's only the
+// embedder's thread, which polls the ring itself.
+//
+// Memory ordering: the guest publishes submissions by storing sq_tail and then
+// loading flags, while a host M going idle stores flags and then loads sq_tail
+// (ioring_poll_end). Both sides must use sequentially-consistent ordering
+// for this to be race free; the host side does so here.
+//
+#include "rsmimpl.h"
+#include "thread.h"
+#include "sched.h"
+#include "machine.h"
+
+#define trace  schedtrace1
+#define trace2 schedtrace2
+#define trace3 schedtrace3
+
+#ifndef RSM_NO_LIBC
+  isize write(int fd, const void* buf, usize nbyte); // unistd.h
+  #include <errno.h>
+#endif
+
+
+// ioring_size calculates the byte size of an ioring with nentries submission entries.
+// The completion ring has twice as many entries as the submission ring, like
+// io_uring, so that the host rarely has to stall on a full completion ring.
+static usize ioring_size(u32 nentries, u64* sq_off, u64* cq_off) {
+  *sq_off = ALIGN2_X((u64)sizeof(ioring_hdr_t), 64lu);
+  *cq_off = *sq_off + (u64)nentries*sizeof(ioring_sqe_t);
+  return (usize)(*cq_off + (u64)nentries*2*sizeof(ioring_cqe_t));
+}
+
+
+static rerr_t ioring_iom_main(M* m);
+
+
+// ioring_iom_start starts the I/O M. s->lock must be held.
+static rerr_t ioring_iom_start(rsched_t* s) {
+  ioring_t* r = &s->ioring;
+  if (s->stepping)
+    return 0;
+  rerr_t err = sema_init(&r->iosema, 0);
+  if (err)
+    return err;
+  if ((err = sema_init(&r->iodone, 0))) {
+    sema_dispose(&r->iosema);
+    return err;
+  }
+  memset(&r->iom, 0, sizeof(r->iom));
+  r->iom.s = s;
+  r->iom.id = (u32)AtomicAdd(&s->midgen, 1, memory_order_acquire);
+  r->iom.cpu = -1;
+  AtomicStore(&r->iokick, 0, memory_order_relaxed);
+  AtomicStore(&r->iostop, 0, memory_order_relaxed);
+  if (!m_spawn_osthread(&r->iom, ioring_iom_main)) {
+    sema_dispose(&r->iodone);
+    sema_dispose(&r->iosema);
+    return rerr_nomem;
+  }
+  r->iostarted = true;
+  return 0;
+}
+
+
+// ioring_iom_stop waits for the I/O M to exit
+static void ioring_iom_stop(rsched_t* s) {
+  ioring_t* r = &s->ioring;
+  if (!r->iostarted)
+    return;
+  AtomicStore(&r->iostop, 1, memory_order_release);
+  sema_signal(&r->iosema, 1);
+  sema_wait(&r->iodone, -1);
+  sema_dispose(&r->iodone);
+  sema_dispose(&r->iosema);
+  r->iostarted = false;
+}
+
+
+// ioring_iom_main is the I/O M's thread main function.
+// It consumes submissions each time it's kicked, until ioring_iom_stop.
+static rerr_t ioring_iom_main(M* m) {
+  m_set_current(m);
+  ioring_t* r = &m->s->ioring;
+  trace("ioring: M%u started", m->id);
+  for (;;) {
+    sema_wait(&r->iosema, -1);
+    if (AtomicLoadAcq(&r->iostop))
+      break;
+    // clear the kick before polling so that a later submission kicks us again
+    AtomicStore(&r->iokick, 0, memory_order_seq_cst);
+    ioring_poll(m->s);
+  }
+  trace("ioring: M%u exiting", m->id);
+  sema_signal(&r->iodone, 1);
+  return 0;
+}
+
+
+i64 ioring_setup(rsched_t* s, u32 nentries) {
+  ioring_t* r = &s->ioring;
+  vm_map_t* map = &s->vm_map;
+
+  if (nentries == 0 || nentries > IORING_NENTRIES_MAX || !IS_POW2(nentries))
+    return rerr_invalid;
+
+  u64 sq_off, cq_off;
+  usize size = ioring_size(nentries, &sq_off, &cq_off);
+  usize npages = CEIL_POW2(IDIV_CEIL(size, PAGE_SIZE)); // rmm_allocpages needs pow2
+
+  u64 vaddr = 0;
+  mutex_lock(&s->lock);
+
+  rerr_t err = rerr_exists;
+  if (AtomicLoad(&r->hdr, memory_order_relaxed))
+    goto end;
+
+  if ((err = vm_map_charge(map, npages)))
+    goto end;
+  err = rerr_nomem;
+  ioring_hdr_t* hdr = rmm_allocpages(s->machine->mm, npages);
+  if (!hdr) {
+    vm_map_uncharge(map, npages);
+    goto end;
+  }
+  memset(hdr, 0, npages*PAGE_SIZE);
+
+  if ((err = ioring_iom_start(s))) {
+    rmm_freepages(s->machine->mm, hdr, npages);
+    vm_map_uncharge(map, npages);
+    goto end;
+  }
+
+  // map backing pages into guest memory (host pages can't be in the direct window)
+  vm_map_lock(map);
+  vaddr = map->direct_size;
+  err = vm_map_findspace(map, &vaddr, npages);
+  if (!err)
+    err = vm_map_add(map, vaddr, (uintptr)hdr, npages, VM_PERM_RW);
+  vm_map_unlock(map);
+  if UNLIKELY(err) {
+    dlog("ioring: vm_map failed: %s", rerr_str(err));
+    ioring_iom_stop(s);
+    rmm_freepages(s->machine->mm, hdr, npages);
+    vm_map_uncharge(map, npages);
+    goto end;
+  }
+
+  hdr->sq_mask = nentries - 1;
+  hdr->cq_mask = nentries*2 - 1;
+  hdr->sq_off = sq_off;
+  hdr->cq_off = cq_off;
+  // no M is polling until the next m_findrunnable
+  AtomicStore(&hdr->flags, IORING_F_NEED_WAKEUP, memory_order_relaxed);
+
+  r->sq_head = 0;
+  r->cq_tail = 0;
+  r->sq_mask = hdr->sq_mask;
+  r->cq_mask = hdr->cq_mask;
+  r->vaddr = vaddr;
+  r->npages = npages;
+  AtomicStoreRel(&r->hdr, hdr);
+
+  trace("ioring at 0x%llx (%u entries, %zu pages)", vaddr, nentries, npages);
+
+end:
+  mutex_unlock(&s->lock);
+  return err ? (i64)err : (i64)vaddr;
+}
+
+
+void ioring_dispose(rsched_t* s) {
+  ioring_t* r = &s->ioring;
+  ioring_iom_stop(s);
+  ioring_hdr_t* hdr = AtomicExchange(&r->hdr, NULL, memory_order_acq_rel);
+  if (!hdr)
+    return;
+  vm_map_lock(&s->vm_map);
+  UNUSED rerr_t err = vm_map_del(&s->vm_map, r->vaddr, r->npages);
+  vm_map_unlock(&s->vm_map);
+  assertf(err == 0, "vm_map_del: %s", rerr_str(err));
+  rmm_freepages(s->machine->mm, hdr, r->npages);
+  vm_map_uncharge(&s->vm_map, r->npages);
+  statlog("ioring: %llu submissions, %llu enter syscalls",
+    AtomicLoad(&r->nsubmit, memory_order_relaxed),
+    AtomicLoad(&r->nenter, memory_order_relaxed));
+}
+
+
+// ioring_write implements IORING_OP_WRITE.
+// It resolves the guest range page by page via the vm map (rather than through an
+// M's vm_cache) so that a bad address results in an error instead of a panic.
+static i64 ioring_write(rsched_t* s, const ioring_sqe_t* sqe) {
+  #ifdef RSM_NO_LIBC
+    return rerr_not_supported;
+  #else
+  vm_map_t* map = &s->vm_map;
+  u64 vaddr = sqe->addr;
+  u64 len = sqe->len;
+  u64 vaddr_end;
+  if (len == 0)
+    return 0;
+  if (check_add_overflow(vaddr, len, &vaddr_end) ||
+      vaddr < VM_ADDR_MIN || vaddr_end - 1 > VM_ADDR_MAX)
+  {
+    return rerr_mfault;
+  }
+
+  i64 total = 0;
+  while (vaddr < vaddr_end) {
+    vm_map_rlock(map);
+    vm_page_t* page = vm_map_access(map, VM_VFN(vaddr), /*isaccess*/true);
+    bool ok = page && VM_PERM_CHECK(vm_page_perm(page), VM_PERM_R);
+    rerr_t err = ok ? 0 : rerr_mfault;
+    if (ok && page->hfn == 0)
+      err = rerr_nomem; // failed to allocate backing page
+    void* haddr = err ? 0 : (void*)(uintptr)(vm_page_haddr(page) + VM_ADDR_OFFSET(vaddr));
+    if (!err)
+      page->accessed = true;
+    vm_map_runlock(map);
+    if (err)
+      return total ? total : err;
+
+    usize n = (usize)MIN(vaddr_end - vaddr, PAGE_SIZE - VM_ADDR_OFFSET(vaddr));
+    isize z = write((int)sqe->fd, haddr, n);
+    if (z < 0)
+      return total ? total : rerr_errno(errno);
+    total += (i64)z;
+    if ((usize)z < n)
+      break; // short write
+    vaddr += (u64)n;
+  }
+  return total;
+  #endif
+}
+
+
+static i64 ioring_exec(rsched_t* s, const ioring_sqe_t* sqe) {
+  switch ((enum ioring_op)sqe->op) {
+    case IORING_OP_NOP:   return 0;
+    case IORING_OP_WRITE: return ioring_write(s, sqe);
+  }
+  return rerr_sys_op;
+}
+
+
+u32 ioring_poll(rsched_t* s) {
+  ioring_t* r = &s->ioring;
+  ioring_hdr_t* hdr = AtomicLoadAcq(&r->hdr);
+  if (!hdr)
+    return 0;
+
+  // only one M at a time consumes submissions
+  u32 busy = 0;
+  if (!AtomicCAS(&r->busy, &busy, 1, memory_order_acquire, memory_order_relaxed))
+    return 0;
+
+  // note: offsets are recomputed rather than read from hdr, which the guest can write
+  u64 sq_off, cq_off;
+  ioring_size(r->sq_mask + 1, &sq_off, &cq_off);
+  ioring_sqe_t* sqv = (void*)hdr + (uintptr)sq_off;
+  ioring_cqe_t* cqv = (void*)hdr + (uintptr)cq_off;
+  u32 sq_head = r->sq_head;
+  u32 cq_tail = r->cq_tail;
+  u32 sq_tail = AtomicLoad(&hdr->sq_tail, memory_order_seq_cst);
+  u32 cq_head = AtomicLoadAcq(&hdr->cq_head);
+  u32 n = 0;
+
+  // A misbehaving guest may have advanced sq_tail beyond the ring.
+  // Consume at most one full ring worth of submissions per poll.
+  if (sq_tail - sq_head > r->sq_mask + 1)
+    sq_tail = sq_head + r->sq_mask + 1;
+
+  while (sq_head != sq_tail) {
+    if (cq_tail - cq_head > r->cq_mask) {
+      // completion ring is full; leave remaining submissions for later
+      cq_head = AtomicLoadAcq(&hdr->cq_head);
+      if (cq_tail - cq_head > r->cq_mask)
+        break;
+    }
+    // copy the submission since the guest might modify it concurrently
+    ioring_sqe_t sqe = sqv[sq_head & r->sq_mask];
+    sq_head++;
+    ioring_cqe_t* cqe = &cqv[cq_tail & r->cq_mask];
+    cqe->userdata = sqe.userdata;
+    cqe->result = ioring_exec(s, &sqe);
+    cq_tail++;
+    n++;
+  }
+
+  if (n) {
+    r->sq_head = sq_head;
+    r->cq_tail = cq_tail;
+    AtomicStoreRel(&hdr->sq_head, sq_head);
+    AtomicStoreRel(&hdr->cq_tail, cq_tail);
+    AtomicAdd(&r->nsubmit, (u64)n, memory_order_relaxed);
+    trace2("ioring: %u completions", n);
+  }
+
+  AtomicStoreRel(&r->busy, 0);
+  return n;
+}
+
+
+void ioring_kick(rsched_t* s) {
+  ioring_t* r = &s->ioring;
+  ioring_hdr_t* hdr = AtomicLoadAcq(&r->hdr);
+  if (!hdr)
+    return;
+  if (!r->iostarted) {
+    ioring_poll(s); // stepping mode
+    return;
+  }
+  // note: hdr->sq_head may be scribbled on by the guest, which at worst causes
+  // a spurious or a missed wakeup for that guest itself
+  u32 sq_tail = AtomicLoad(&hdr->sq_tail, memory_order_seq_cst);
+  if (sq_tail == AtomicLoadAcq(&hdr->sq_head))
+    return;
+  u32 kick = 0;
+  if (AtomicCAS(&r->iokick, &kick, 1, memory_order_seq_cst, memory_order_relaxed))
+    sema_signal(&r->iosema, 1);
+}
+
+
+void ioring_poll_begin(M* m) {
+  rsched_t* s = m->s;
+  assert(!m->iopoll);
+  ioring_hdr_t* hdr = AtomicLoadAcq(&s->ioring.hdr);
+  if (!hdr)
+    return;
+  m->iopoll = true;
+  if (AtomicAdd(&s->ioring.npoll, 1, memory_order_seq_cst) == 0)
+    AtomicAnd(&hdr->flags, ~(u32)IORING_F_NEED_WAKEUP, memory_order_seq_cst);
+}
+
+
+void ioring_poll_end(M* m) {
+  rsched_t* s = m->s;
+  if (!m->iopoll)
+    return; // begin didn't count m (the ring was set up after it)
+  m->iopoll = false;
+  ioring_hdr_t* hdr = AtomicLoadAcq(&s->ioring.hdr);
+  if (AtomicSub(&s->ioring.npoll, 1, memory_order_seq_cst) == 1 && hdr) {
+    AtomicOr(&hdr->flags, IORING_F_NEED_WAKEUP, memory_order_seq_cst);
+    ioring_kick(s);
+  }
+}
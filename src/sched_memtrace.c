@@ -0,0 +1,187 @@
+// guest memory-access tracing
+// SPDX-License-Identifier: Apache-2.0
+//
+// See memtrace.h for the trace format. Each M appends records to its own buffer
+// (M.mtbuf) without synchronization. A full buffer is compressed and written to the
+// trace file as one block, with memtrace_t.lock held.
+//
+#include "rsmimpl.h"
+#include "thread.h"
+#include "sched.h"
+#include "machine.h"
+
+#ifdef SCHED_MEMTRACE
+  #include "lz4.h"
+#endif
+
+#define trace  schedtrace1
+
+#ifndef RSM_NO_LIBC
+  isize write(int fd, const void* buf, usize nbyte); // unistd.h
+  #include <errno.h>
+#endif
+
+
+#ifdef SCHED_MEMTRACE
+
+#define ZBUF_SIZE  ((usize)LZ4_COMPRESSBOUND(MEMTRACE_NREC * sizeof(memtrace_rec_t)))
+
+
+// memtrace_write writes size bytes to the trace file. mt->lock must be held.
+static void memtrace_write(memtrace_t* mt, const void* data, usize size) {
+  #ifndef RSM_NO_LIBC
+    while (size > 0 && mt->err == 0) {
+      isize n = write(mt->fd, data, size);
+      if (n < 0) {
+        mt->err = rerr_errno(errno);
+        dlog("memtrace: write failed: %s", rerr_str(mt->err));
+        break;
+      }
+      data = (const u8*)data + n;
+      size -= (usize)n;
+    }
+  #else
+    mt->err = rerr_not_supported;
+  #endif
+}
+
+
+// memtrace_flush writes buf's records as a block. mt->lock must be held.
+static void memtrace_flush(memtrace_t* mt, memtrace_buf_t* buf) {
+  if (buf->len == 0)
+    return;
+  int rawsize = (int)(buf->len * sizeof(memtrace_rec_t));
+  int zsize = LZ4_compress_default(
+    (const char*)buf->recv, (char*)mt->zbuf, rawsize, (int)ZBUF_SIZE);
+  safecheckf(zsize > 0, "LZ4_compress_default");
+  memtrace_blk_t blk = { .rawsize = (u32)rawsize, .zsize = (u32)zsize };
+  memtrace_write(mt, &blk, sizeof(blk));
+  memtrace_write(mt, mt->zbuf, (usize)zsize);
+  buf->len = 0;
+}
+
+
+// memtrace_newbuf allocates a record buffer for an M.
+// Returns NULL if s isn't tracing or if out of memory.
+static memtrace_buf_t* nullable memtrace_newbuf(rsched_t* s) {
+  memtrace_t* mt = &s->memtrace;
+  if (!mt->zbuf)
+    return NULL;
+  memtrace_buf_t* buf = rmem_alloct(s->machine->malloc, memtrace_buf_t);
+  if (!buf) {
+    dlog("memtrace: out of memory; not tracing M");
+    return NULL;
+  }
+  buf->len = 0;
+  mutex_lock(&mt->lock);
+  buf->next = mt->bufs;
+  mt->bufs = buf;
+  mutex_unlock(&mt->lock);
+  return buf;
+}
+
+
+rerr_t memtrace_open(rsched_t* s, int fd) {
+  memtrace_t* mt = &s->memtrace;
+  if (mt->zbuf)
+    return rerr_exists;
+  rerr_t err = mutex_init(&mt->lock);
+  if (err)
+    return err;
+  mt->zbuf = rmem_alloc(s->machine->malloc, ZBUF_SIZE).p;
+  if (!mt->zbuf) {
+    mutex_dispose(&mt->lock);
+    return rerr_nomem;
+  }
+  mt->fd = fd;
+  mt->err = 0;
+  mt->bufs = NULL;
+  return 0;
+}
+
+
+void memtrace_start(rsched_t* s, u64 data_vaddr, u64 data_size) {
+  memtrace_t* mt = &s->memtrace;
+  if (!mt->zbuf)
+    return;
+  memtrace_hdr_t hdr = {
+    .magic = MEMTRACE_MAGIC,
+    .version = MEMTRACE_VERSION,
+    .data_vaddr = data_vaddr,
+    .data_size = data_size,
+    .page_size = PAGE_SIZE,
+    .vm_cache_len = VM_CACHE_LEN,
+  };
+  mutex_lock(&mt->lock);
+  memtrace_write(mt, &hdr, sizeof(hdr));
+  mutex_unlock(&mt->lock);
+}
+
+
+void memtrace_dispose(rsched_t* s) {
+  memtrace_t* mt = &s->memtrace;
+  if (!mt->zbuf)
+    return;
+  mutex_lock(&mt->lock);
+  for (memtrace_buf_t* buf = mt->bufs; buf; ) {
+    memtrace_buf_t* next = buf->next;
+    memtrace_flush(mt, buf);
+    rmem_freet(s->machine->malloc, buf);
+    buf = next;
+  }
+  rmem_free(s->machine->malloc, RMEM(mt->zbuf, ZBUF_SIZE));
+  mt->zbuf = NULL;
+  mt->bufs = NULL;
+  mutex_unlock(&mt->lock);
+  mutex_dispose(&mt->lock);
+  s->m0.mtbuf = NULL;
+  if (mt->err)
+    log("memtrace: trace is incomplete: %s", rerr_str(mt->err));
+}
+
+
+void memtrace_add(
+  T* t, memtrace_kind_t kind, memtrace_flag_t flags, u64 vaddr, u64 size, usize pc)
+{
+  M* m = assertnotnull(t->m);
+  memtrace_buf_t* buf = m->mtbuf;
+  if UNLIKELY(!buf) {
+    if (!(buf = memtrace_newbuf(m->s)))
+      return;
+    m->mtbuf = buf;
+  }
+
+  if (vaddr - t->stack_lo <= t->stack_hi - t->stack_lo)
+    flags |= MEMTRACE_F_STACK;
+
+  buf->recv[buf->len++] = (memtrace_rec_t){
+    .vaddr = vaddr,
+    .size = CAST_U32(size),
+    .pc = (u32)pc,
+    .tid = (u32)t->id,
+    .kind = kind,
+    .flags = flags,
+  };
+
+  if (buf->len == MEMTRACE_NREC) {
+    mutex_lock(&m->s->memtrace.lock);
+    memtrace_flush(&m->s->memtrace, buf);
+    mutex_unlock(&m->s->memtrace.lock);
+  }
+}
+
+
+#else // !SCHED_MEMTRACE
+
+rerr_t memtrace_open(rsched_t* s, int fd) {
+  return rerr_not_supported;
+}
+
+void memtrace_start(rsched_t* s, u64 data_vaddr, u64 data_size) {}
+void memtrace_dispose(rsched_t* s) {}
+
+void memtrace_add(
+  T* t, memtrace_kind_t kind, memtrace_flag_t flags, u64 vaddr, u64 size, usize pc)
+{}
+
+#endif // SCHED_MEMTRACE
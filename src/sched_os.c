@@ -9,6 +9,8 @@
   #include <pthread.h>
   #include <signal.h>
   #include <errno.h>
+  #include <fcntl.h>
+  #include <unistd.h>
 // #elif !__STDC_NO_THREADS__
 //   #include <threads.h>
 #else
@@ -69,3 +71,107 @@ error:
   pthread_attr_destroy(&attr);
   return 0;
 }
+
+
+#ifdef __linux__
+// sysfs_readu32 reads the number at the start of a sysfs file, e.g. "12" or "0-3,8"
+static bool sysfs_readu32(const char* path, u32* result) {
+  char buf[32];
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  isize n = read(fd, buf, sizeof(buf));
+  close(fd);
+  if (n <= 0 || buf[0] < '0' || buf[0] > '9')
+    return false;
+  u32 v = 0;
+  for (isize i = 0; i < n && buf[i] >= '0' && buf[i] <= '9'; i++)
+    v = v*10 + (u32)(buf[i] - '0');
+  *result = v;
+  return true;
+}
+
+static int cputopo_cmp(const void* x, const void* y, void* nullable ctx) {
+  const cputopo_t* a = x;
+  const cputopo_t* b = y;
+  if (a->pkg != b->pkg) return a->pkg < b->pkg ? -1 : 1;
+  if (a->l3 != b->l3)   return a->l3 < b->l3 ? -1 : 1;
+  if (a->l2 != b->l2)   return a->l2 < b->l2 ? -1 : 1;
+  return a->cpu < b->cpu ? -1 : a->cpu > b->cpu;
+}
+#endif
+
+
+// os_cputopo_scan reads the host topology from sysfs (see os_cputopo)
+static u32 os_cputopo_scan(cputopo_t* v, u32 cap) {
+  #ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+      return 0;
+    char path[96];
+    u32 n = 0;
+    for (u32 cpu = 0; cpu < CPU_SETSIZE && n < cap; cpu++) {
+      if (!CPU_ISSET(cpu, &set))
+        continue;
+      cputopo_t* c = &v[n++];
+      c->cpu = cpu;
+      snprintf(path, sizeof(path),
+        "/sys/devices/system/cpu/cpu%u/topology/physical_package_id", cpu);
+      if (!sysfs_readu32(path, &c->pkg))
+        return 0; // no sysfs
+      // A cache is identified by the lowest-numbered CPU sharing it.
+      // Caches not described by sysfs are assumed to be private to the CPU.
+      c->l2 = cpu;
+      c->l3 = U32_MAX;
+      for (u32 i = 0; i < 8; i++) {
+        u32 level, id;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%u/level", cpu, i);
+        if (!sysfs_readu32(path, &level))
+          break;
+        if (level != 2 && level != 3)
+          continue;
+        snprintf(path, sizeof(path),
+          "/sys/devices/system/cpu/cpu%u/cache/index%u/shared_cpu_list", cpu, i);
+        if (sysfs_readu32(path, &id))
+          *(level == 2 ? &c->l2 : &c->l3) = id;
+      }
+      if (c->l3 == U32_MAX)
+        c->l3 = c->l2;
+    }
+    rsm_qsort(v, n, sizeof(cputopo_t), cputopo_cmp, NULL);
+    return n;
+  #else
+    return 0;
+  #endif
+}
+
+
+// The host topology is discovered once per process; scanning sysfs costs about
+// 100us, which is more than the rest of rsched_init.
+static cputopo_t      g_cputopo[S_MAXPROCS];
+static u32            g_cputopo_len;
+static pthread_once_t g_cputopo_once = PTHREAD_ONCE_INIT;
+
+static void cputopo_init() {
+  g_cputopo_len = os_cputopo_scan(g_cputopo, countof(g_cputopo));
+}
+
+u32 os_cputopo(cputopo_t* v, u32 cap) {
+  safecheckexpr(pthread_once(&g_cputopo_once, cputopo_init), 0);
+  u32 n = MIN(cap, g_cputopo_len);
+  memcpy(v, g_cputopo, n * sizeof(cputopo_t));
+  return n;
+}
+
+
+rerr_t os_pinthread(u32 cpu) {
+  #ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    return err ? rerr_errno(err) : 0;
+  #else
+    return rerr_not_supported;
+  #endif
+}
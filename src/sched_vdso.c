@@ -0,0 +1,112 @@
+// guest-readable time page
+// SPDX-License-Identifier: Apache-2.0
+//
+// See vdso_t in sched.h for a description of the page and how guests read it.
+//
+// Any M may update the clock fields. Writers are serialized by the seqlock itself:
+// a writer moves seq from even to odd with a CAS and an M which loses that race
+// simply skips its update, since the winner publishes an equally fresh time.
+//
+#include "rsmimpl.h"
+#include "thread.h"
+#include "sched.h"
+#include "machine.h"
+
+#define trace  schedtrace1
+#define trace2 schedtrace2
+#define trace3 schedtrace3
+
+static_assert(VDSO_VADDR % PAGE_SIZE == 0, "");
+static_assert(VDSO_VADDR >= VM_ADDR_MIN && VDSO_VADDR < VM_ADDR_MAX, "");
+
+
+rerr_t vdso_init(rsched_t* s) {
+  if (s->vdso.page)
+    return 0; // already mapped
+  vm_map_t* map = &s->vm_map;
+
+  vdso_t* page = rmm_allocpages(s->machine->mm, 1);
+  if (!page)
+    return rerr_nomem;
+  memset(page, 0, PAGE_SIZE);
+  for (u32 i = 0; i < VDSO_NTASKS; i++)
+    page->tasks[i].tid = VDSO_TID_NONE;
+
+  vm_map_lock(map);
+  rerr_t err = vm_map_add(map, VDSO_VADDR, (uintptr)page, 1, VM_PERM_R);
+  vm_map_unlock(map);
+  if UNLIKELY(err) {
+    dlog("vdso: vm_map failed: %s", rerr_str(err));
+    rmm_freepages(s->machine->mm, page, 1);
+    return err;
+  }
+
+  s->vdso.page = page;
+  s->vdso.wall_sync = 0; // force resync on first update
+  vdso_update(s, nanotime());
+
+  trace("vdso at 0x%llx", VDSO_VADDR);
+  return 0;
+}
+
+
+void vdso_dispose(rsched_t* s) {
+  vdso_t* page = s->vdso.page;
+  if (!page)
+    return;
+  s->vdso.page = NULL;
+  vm_map_lock(&s->vm_map);
+  UNUSED rerr_t err = vm_map_del(&s->vm_map, VDSO_VADDR, 1);
+  vm_map_unlock(&s->vm_map);
+  assertf(err == 0, "vm_map_del: %s", rerr_str(err));
+  rmm_freepages(s->machine->mm, page, 1);
+}
+
+
+void vdso_update(rsched_t* s, u64 now) {
+  vdso_t* page = s->vdso.page;
+  if (!page)
+    return;
+
+  // cheap check first so that Ms don't fight over the cache line needlessly
+  if (AtomicLoad(&page->mono_ns, memory_order_relaxed) >= now)
+    return;
+
+  u32 seq = AtomicLoad(&page->seq, memory_order_relaxed);
+  if ((seq & 1) ||
+      !AtomicCAS(&page->seq, &seq, seq + 1, memory_order_acquire, memory_order_relaxed))
+  {
+    return; // another M is updating the page
+  }
+  atomic_thread_fence(memory_order_release);
+
+  // Reading the wall clock is more expensive than nanotime, so we derive wall time
+  // from the monotonic clock and only resync the offset once in a while, which
+  // picks up adjustments made to the host's wall clock.
+  vdso_state_t* vs = &s->vdso;
+  if (now - vs->wall_sync >= VDSO_WALL_RESYNC || vs->wall_sync == 0) {
+    i64 sec; u64 nsec;
+    if (unixtime(&sec, &nsec) == 0) {
+      u64 mono = nanotime();
+      vs->wall_off = (sec*1000000000ll + (i64)nsec) - (i64)mono;
+      vs->wall_sync = mono;
+    }
+  }
+
+  AtomicStore(&page->mono_ns, now, memory_order_relaxed);
+  AtomicStore(&page->unix_ns, (i64)now + vs->wall_off, memory_order_relaxed);
+  AtomicStoreRel(&page->seq, seq + 2);
+}
+
+
+void vdso_task_start(rsched_t* s, const T* t, u64 now) {
+  vdso_t* page = s->vdso.page;
+  if (!page)
+    return;
+  vdso_task_t* slot = &page->tasks[t->id & (VDSO_NTASKS - 1)];
+  AtomicStore(&slot->tid, VDSO_TID_NONE, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  AtomicStore(&slot->cpu_ns, t->cputime, memory_order_relaxed);
+  AtomicStore(&slot->since_ns, now, memory_order_relaxed);
+  AtomicStoreRel(&slot->tid, t->id);
+}
@@ -5,6 +5,10 @@
 #define RSM_FOREACH_SYSCALL(_) /* _(name, code, args, description) */ \
 _( SC_EXIT,  0, "status i32", "exit program" )\
 _( SC_SLEEP, 1, "nsec u64", "sleep for up to nsec; returns remaining time or error" )\
+_( SC_IORING_SETUP, 2, "nentries u32", "set up I/O rings; returns address or error" )\
+_( SC_IORING_ENTER, 3, "", "consume I/O submissions; returns completion count" )\
+_( SC_TASKID, 4, "", "returns the calling task's ID" )\
+_( SC_TCLASS, 5, "class u32", "set the calling task's scheduling class, inherited by tasks it spawns; returns the previous class or error" )\
 \
 _( SC_TEXIT, _SC_MAX, "", "exit task" )\
 // end RSM_FOREACH_SYSCALL
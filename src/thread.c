@@ -2,7 +2,13 @@
 #include "thread.h"
 #include "hash.h"
 
-#ifndef RSM_SEMAPHORE_POSIX
+#if defined(RSM_FUTEX)
+  #include <errno.h>
+  #include <time.h>
+  #include <unistd.h>
+  #include <sys/syscall.h>
+  #include <linux/futex.h>
+#elif !defined(RSM_SEMAPHORE_POSIX)
   #if defined(WIN32)
     #include <windows.h>
   #elif defined(__MACH__)
@@ -22,10 +28,80 @@
 RSM_ASSUME_NONNULL_BEGIN
 
 
+//———————————————————————————————————————————————————————————————————————————————————
+// futex
+//———————————————————————————————————————————————————————————————————————————————————
+#if defined(RSM_FUTEX)
+
+void futex_wait(_Atomic(u32)* addr, u32 val, i64 timeout_nsec) {
+  // note: FUTEX_WAIT takes a relative timeout, measured against CLOCK_MONOTONIC
+  struct timespec ts;
+  struct timespec* tsp = NULL;
+  if (timeout_nsec >= 0) {
+    ts.tv_sec = (time_t)(timeout_nsec / 1000000000ll);
+    ts.tv_nsec = (long)(timeout_nsec % 1000000000ll);
+    tsp = &ts;
+  }
+  // EAGAIN (*addr!=val), EINTR and ETIMEDOUT are all expected; callers re-check state
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, tsp, NULL, 0);
+}
+
+void futex_wake(_Atomic(u32)* addr, u32 n) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, (int)MIN(n, (u32)0x7fffffff), NULL, NULL, 0);
+}
+
+// thread_spin performs one iteration of active spinning.
+// Returns false when the caller should stop spinning and park.
+static bool thread_spin(u32* iter) {
+  if (*iter >= THREAD_SPIN_ACTIVE)
+    return false;
+  (*iter)++;
+  for (u32 i = 0; i < THREAD_SPIN_CPUYIELD; i++)
+    cpu_yield();
+  return true;
+}
+
+#endif // RSM_FUTEX
+
 //———————————————————————————————————————————————————————————————————————————————————
 // mutex_t
 //———————————————————————————————————————————————————————————————————————————————————
-#if defined(RSM_THREAD_C11)
+#if defined(RSM_FUTEX)
+
+rerr_t mutex_init(mutex_t* mu) {
+  mu->w = 0;
+  return 0;
+}
+
+void mutex_dispose(mutex_t* mu) {
+  #if DEBUG
+  if (mutex_islocked(mu))
+    dlog("warning: mutex_dispose called on locked mutex");
+  #endif
+}
+
+// _mutex_lock_slow is called by mutex_lock when the mutex is locked.
+// It spins for a little while, hoping the lock holder releases the lock soon,
+// then marks the mutex as contended (w=2) and parks on the futex.
+void _mutex_lock_slow(mutex_t* mu) {
+  u32 iter = 0;
+  do {
+    u32 w = AtomicLoad(&mu->w, memory_order_relaxed);
+    if (w == 0 &&
+        AtomicCAS(&mu->w, &w, 1, memory_order_seq_cst, memory_order_relaxed))
+    {
+      return;
+    }
+  } while (thread_spin(&iter));
+
+  // Since we don't know if there are other waiters, we must set w=2 when
+  // acquiring the lock, so that mutex_unlock wakes up the next waiter.
+  while (AtomicExchange(&mu->w, 2, memory_order_seq_cst) != 0)
+    futex_wait(&mu->w, 2, -1);
+}
+
+//———————————————————————————————————————————————————————————————————————————————————
+#elif defined(RSM_THREAD_C11)
 
 rerr_t mutex_init(mutex_t* mu) {
   mu->w = 0;
@@ -168,7 +244,71 @@ void rwmutex_unlock(rwmutex_t* m) {
 //———————————————————————————————————————————————————————————————————————————————————
 // sema_t
 //———————————————————————————————————————————————————————————————————————————————————
-#if defined(RSM_SEMAPHORE_POSIX)
+#if defined(RSM_SEMAPHORE_FUTEX)
+
+rerr_t sema_init(sema_t* sp, u32 initcount) {
+  sp->count = initcount;
+  sp->nwait = 0;
+  return 0;
+}
+
+void sema_dispose(sema_t* sp) {
+  assertf(AtomicLoad(&sp->nwait, memory_order_relaxed) == 0, "sema has waiters");
+}
+
+static bool sema_trywait(sema_t* sp) {
+  u32 n = AtomicLoad(&sp->count, memory_order_relaxed);
+  while (n > 0) {
+    if (AtomicCASWeak(&sp->count, &n, n - 1, memory_order_seq_cst, memory_order_relaxed))
+      return true;
+  }
+  return false;
+}
+
+bool sema_wait(sema_t* sp, i64 timeout_nsec) {
+  u32 iter = 0;
+  do {
+    if (sema_trywait(sp))
+      return true;
+  } while (timeout_nsec != 0 && thread_spin(&iter));
+
+  if (timeout_nsec == 0)
+    return false;
+
+  u64 deadline = timeout_nsec > 0 ? nanotime() + (u64)timeout_nsec : 0;
+  bool ok = false;
+
+  // Register as a waiter before the final check of count.
+  // sema_signal increments count and then checks nwait, so either we see the new
+  // count here or sema_signal sees us as a waiter and wakes us up.
+  AtomicAdd(&sp->nwait, 1, memory_order_seq_cst);
+  for (;;) {
+    if (sema_trywait(sp)) {
+      ok = true;
+      break;
+    }
+    i64 remaining = -1;
+    if (deadline) {
+      u64 now = nanotime();
+      if (now >= deadline)
+        break;
+      remaining = (i64)(deadline - now);
+    }
+    futex_wait(&sp->count, 0, remaining);
+  }
+  AtomicSub(&sp->nwait, 1, memory_order_seq_cst);
+  return ok;
+}
+
+void sema_signal(sema_t* sp, u32 count) {
+  assert(count > 0);
+  AtomicAdd(&sp->count, count, memory_order_seq_cst);
+  if (AtomicLoad(&sp->nwait, memory_order_seq_cst) > 0)
+    futex_wake(&sp->count, count);
+}
+
+//———————————————————————————————————————————————————————————————————————————————————
+#elif defined(RSM_SEMAPHORE_POSIX)
 
 rerr_t sema_init(sema_t* sp, u32 initcount) {
   int err = sem_init((sem_t*)sp, 0, initcount);
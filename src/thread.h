@@ -17,8 +17,17 @@
   #include <threads.h>
 #endif
 
+// RSM_FUTEX is defined when native futexes are available.
+// mutex_t, sema_t and mnote_t (sched.h) are then implemented directly on futexes,
+// with an adaptive spin-then-park phase. Define RSM_NO_FUTEX to disable.
+#if defined(__linux__) && !defined(RSM_NO_LIBC) && !defined(RSM_NO_FUTEX)
+  #define RSM_FUTEX
+#endif
+
 // select semaphore API
-#if defined(WIN32) || defined(__MACH__)
+#if defined(RSM_FUTEX)
+  #define RSM_SEMAPHORE_FUTEX
+#elif defined(WIN32) || defined(__MACH__)
   typedef uintptr sema_t;
   #define RSM_SEMAPHORE_PTR
 #elif defined(__unix__)
@@ -121,14 +130,30 @@
 RSM_ASSUME_NONNULL_BEGIN
 
 
+// THREAD_SPIN_ACTIVE is the number of times mutex_t and sema_t spin (in user space)
+// before parking the calling thread. Each spin iteration is THREAD_SPIN_CPUYIELD
+// cpu_yield calls. Only used with RSM_FUTEX.
+#define THREAD_SPIN_ACTIVE    4
+#define THREAD_SPIN_CPUYIELD  30
+
+#ifdef RSM_FUTEX
+  // futex_wait blocks the calling thread while *addr==val, for at most timeout_nsec
+  // (CLOCK_MONOTONIC; <0 means "no timeout".) May return spuriously.
+  void futex_wait(_Atomic(u32)* addr, u32 val, i64 timeout_nsec);
+  // futex_wake wakes up at most n threads blocked in futex_wait on addr
+  void futex_wake(_Atomic(u32)* addr, u32 n);
+#endif
+
 // mutex_t is a regular mutex
 typedef struct {
-  #ifdef RSM_THREAD_PTHREAD
+  #ifdef RSM_FUTEX
+    // no OS mutex; w is the futex word
+  #elif defined(RSM_THREAD_PTHREAD)
     pthread_mutex_t m;
   #elif defined(RSM_THREAD_C11)
     mtx_t m;
   #endif
-  _Atomic(u32) w; // writer count
+  _Atomic(u32) w; // writer count (RSM_FUTEX: 0 unlocked, 1 locked, 2 contended)
   _Atomic(u32) r; // reader count (only used by rwmutex, here for compactness)
 } mutex_t;
 rerr_t mutex_init(mutex_t*);
@@ -159,6 +184,11 @@ static bool rwmutex_isrlocked(rwmutex_t*); // test if locked for reading (not wr
 // sema_t is a (thin layer over the OS's) semaphore implementation
 #ifdef RSM_SEMAPHORE_POSIX
   typedef sem_t sema_t;
+#elif defined(RSM_SEMAPHORE_FUTEX)
+  typedef struct {
+    _Atomic(u32) count; // available signals (futex word)
+    _Atomic(u32) nwait; // number of threads which may be blocked in futex_wait
+  } sema_t;
 #else
   typedef uintptr sema_t;
 #endif
@@ -175,6 +205,25 @@ bool sema_wait(sema_t*, i64 timeout_nsec);
 //———————————————————————————————————————————————————————————————————————————————————————
 // inline impl
 
+#ifdef RSM_FUTEX
+
+void _mutex_lock_slow(mutex_t*);
+
+inline static void mutex_lock(mutex_t* mu) {
+  u32 w = 0;
+  if UNLIKELY(!AtomicCAS(&mu->w, &w, 1, memory_order_seq_cst, memory_order_relaxed))
+    _mutex_lock_slow(mu);
+}
+
+inline static void mutex_unlock(mutex_t* mu) {
+  u32 w = AtomicExchange(&mu->w, 0, memory_order_seq_cst);
+  assertf(w != 0, "mutex_unlock of unlocked mutex");
+  if UNLIKELY(w == 2)
+    futex_wake(&mu->w, 1);
+}
+
+#else // !RSM_FUTEX
+
 #ifdef RSM_THREAD_C11
   #define _mutex_lock(mu)    (mtx_lock(&(mu)->m) == 0)
   #define _mutex_unlock(mu)  (mtx_unlock(&(mu)->m) == 0)
@@ -193,6 +242,8 @@ inline static void mutex_unlock(mutex_t* mu) {
     safecheckxf(_mutex_unlock(mu), "mutex_unlock");
 }
 
+#endif // RSM_FUTEX
+
 inline static bool mutex_trylock(mutex_t* mu) {
   u32 w = 0;
   return AtomicCAS(&mu->w, &w, 1, memory_order_seq_cst, memory_order_relaxed);
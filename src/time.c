@@ -1,4 +1,5 @@
 #include "rsmimpl.h"
+#include "thread.h"
 
 #ifndef RSM_NO_LIBC
   #include <errno.h>
@@ -14,6 +15,67 @@
   static mach_timebase_info_data_t tbase;
 #endif
 
+// NANOTIME_TSC: use the CPU's time-stamp counter for nanotime when it's invariant
+// (constant rate, not stopped in deep C-states.) Otherwise, or if RSM_NO_TSC is
+// defined, nanotime uses clock_gettime(CLOCK_MONOTONIC), which on Linux is
+// serviced by the vDSO without entering the kernel.
+#if defined(__x86_64__) && defined(__linux__) && !defined(RSM_NO_LIBC) && \
+    !defined(RSM_NO_TSC) && __has_include(<cpuid.h>)
+  #define NANOTIME_TSC
+  #include <cpuid.h>
+  #include <x86intrin.h>
+
+  // TSC_CALIBRATE_NSEC: minimum duration of TSC frequency calibration.
+  // Longer is more accurate; error is roughly clock_gettime resolution / this.
+  // Calibration is passive: the first nanotime call samples both clocks, and the
+  // first call at least TSC_CALIBRATE_NSEC later samples them again and switches
+  // nanotime to the TSC. Until then nanotime uses clock_gettime.
+  #define TSC_CALIBRATE_NSEC  2000000lu /* 2ms */
+
+  // TSC_CALIBRATE_TRIES: calibrations which may yield an implausible frequency
+  // (outside TSC_MIN_HZ...TSC_MAX_HZ) before nanotime gives up on the TSC
+  #define TSC_CALIBRATE_TRIES 4
+  #define TSC_MIN_HZ          100000000llu   /* 100 MHz */
+  #define TSC_MAX_HZ          20000000000llu /* 20 GHz */
+
+  // A sample reads the TSC before and after clock_gettime and is only accepted if
+  // they are at most TSC_SAMPLE_MAXTICKS apart; a wider window means the thread was
+  // interrupted. The narrowest of TSC_SAMPLE_TRIES windows is used.
+  #define TSC_SAMPLE_MAXTICKS 20000u
+  #define TSC_SAMPLE_TRIES    4
+
+  // TSC_ANCHOR_NSEC: interval at which nanotime re-anchors to clock_gettime.
+  // mult is re-derived from the whole time since calibration, and the difference
+  // to clock_gettime is slewed out over the next interval, so that nanotime neither
+  // drifts without bound nor jumps (it stays monotonic.)
+  #define TSC_ANCHOR_NSEC     1000000000lu /* 1s */
+
+  // tsc.state
+  enum {
+    TSC_UNINIT,  // not yet sampled
+    TSC_BUSY,    // a thread is sampling
+    TSC_SAMPLED, // ns0 & tsc0 are set
+    TSC_ON,      // base_tsc, base_ns & mult are set; nanotime uses the TSC
+    TSC_OFF,     // TSC is not usable; nanotime uses clock_gettime
+  };
+
+  // ns = base_ns + ((rdtsc() - base_tsc) * mult) >> TSC_SHIFT
+  // base_tsc, base_ns & mult change together, guarded by seq (a seqlock; odd while
+  // an update is in progress.)
+  #define TSC_SHIFT 32
+  static struct {
+    _Atomic(u32) state;
+    _Atomic(u32) seq;
+    u32          ncalibrate;   // calibrations attempted
+    u64          ns0, tsc0;    // first sample
+    u64          anchor_ticks; // TSC ticks between re-anchoring
+    _Atomic(u64) anchor_tsc;   // TSC at which to re-anchor next
+    _Atomic(u64) base_tsc;
+    _Atomic(u64) base_ns;
+    _Atomic(u64) mult;
+  } tsc;
+#endif
+
 
 WASM_IMPORT rerr_t unixtime(i64* sec, u64* nsec);
 #ifdef CLOCK_REALTIME
@@ -50,7 +112,7 @@ WASM_IMPORT rerr_t unixtime(i64* sec, u64* nsec);
   #error CLOCK_MONOTONIC not defined
 #endif
 
-u64 nanotime(void) {
+static u64 os_nanotime(void) {
   #if defined(__APPLE__)
     u64 t = mach_absolute_time();
     return (t * tbase.numer) / tbase.denom;
@@ -73,6 +135,155 @@ u64 nanotime(void) {
 }
 
 
+#ifdef NANOTIME_TSC
+static bool tsc_is_invariant() {
+  u32 eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007)
+    return false;
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+    return false;
+  return (edx >> 8) & 1; // "Invariant TSC"
+}
+
+// tsc_sample reads clock_gettime and the TSC at (about) the same time.
+// Returns false if the thread was interrupted in every try.
+static bool tsc_sample(u64* nsp, u64* tscp) {
+  u64 best = U64_MAX;
+  *nsp = *tscp = 0;
+  for (u32 i = 0; i < TSC_SAMPLE_TRIES; i++) {
+    u64 t1 = __rdtsc();
+    u64 ns = os_nanotime();
+    u64 t2 = __rdtsc();
+    if (t2 - t1 < best) {
+      best = t2 - t1;
+      *nsp = ns;
+      *tscp = t1 + (t2 - t1)/2;
+    }
+  }
+  return best <= TSC_SAMPLE_MAXTICKS;
+}
+
+// tsc_mult returns the mult for ns nanoseconds over ticks TSC ticks, or 0 if that
+// frequency is implausible
+static u64 tsc_mult(u64 ns, u64 ticks) {
+  if (ticks == 0 ||
+      (unsigned __int128)ticks * 1000000000u < (unsigned __int128)ns * TSC_MIN_HZ ||
+      (unsigned __int128)ticks * 1000000000u > (unsigned __int128)ns * TSC_MAX_HZ)
+  {
+    return 0;
+  }
+  return (u64)(((unsigned __int128)ns << TSC_SHIFT) / ticks);
+}
+
+// tsc_calibrate returns os_nanotime and advances TSC calibration (see tsc.state)
+static u64 tsc_calibrate(u32 state) {
+  u64 ns = os_nanotime();
+  if (state == TSC_BUSY || (state == TSC_SAMPLED && ns - tsc.ns0 < TSC_CALIBRATE_NSEC))
+    return ns;
+  if (!AtomicCASAcqRel(&tsc.state, &state, TSC_BUSY))
+    return ns;
+
+  u64 ns1, t;
+  if (!tsc_sample(&ns1, &t)) {
+    AtomicStoreRel(&tsc.state, state); // try again on a later call
+    return ns;
+  }
+
+  if (state == TSC_UNINIT) {
+    if (!tsc_is_invariant()) {
+      dlog("nanotime: TSC is not invariant; using clock_gettime");
+      AtomicStoreRel(&tsc.state, TSC_OFF);
+      return ns;
+    }
+    tsc.ns0 = ns1;
+    tsc.tsc0 = t;
+    AtomicStoreRel(&tsc.state, TSC_SAMPLED);
+    return ns;
+  }
+
+  // TSC_SAMPLED
+  u64 mult = t > tsc.tsc0 ? tsc_mult(ns1 - tsc.ns0, t - tsc.tsc0) : 0;
+  if (mult == 0) {
+    // implausible; start over, unless we tried too many times
+    dlog("nanotime: TSC calibration failed");
+    AtomicStoreRel(&tsc.state,
+      ++tsc.ncalibrate < TSC_CALIBRATE_TRIES ? TSC_UNINIT : TSC_OFF);
+    return ns;
+  }
+  tsc.anchor_ticks = (u64)(((unsigned __int128)TSC_ANCHOR_NSEC << TSC_SHIFT) / mult);
+  AtomicStore(&tsc.anchor_tsc, t + tsc.anchor_ticks, memory_order_relaxed);
+  AtomicStore(&tsc.base_tsc, t, memory_order_relaxed);
+  AtomicStore(&tsc.base_ns, ns1, memory_order_relaxed);
+  AtomicStore(&tsc.mult, mult, memory_order_relaxed);
+  AtomicStoreRel(&tsc.state, TSC_ON);
+  return ns;
+}
+
+// tsc_anchor re-anchors nanotime to clock_gettime (see TSC_ANCHOR_NSEC.)
+// now is nanotime at TSC t, computed from the parameters guarded by seq.
+static void tsc_anchor(u32 seq, u64 now, u64 t) {
+  if ((seq & 1) ||
+      !AtomicCAS(&tsc.seq, &seq, seq + 1, memory_order_acquire, memory_order_relaxed))
+  {
+    return; // another thread is updating
+  }
+  atomic_thread_fence(memory_order_release);
+
+  u64 ns, t2;
+  u64 mult = 0;
+  if (tsc_sample(&ns, &t2)) {
+    // frequency over the whole time since calibration
+    mult = tsc_mult(ns - tsc.ns0, t2 - tsc.tsc0);
+  }
+  if (mult) {
+    // nanotime at t2 with the current parameters; the new ones start from there,
+    // with a rate correction which makes nanotime meet clock_gettime in
+    // TSC_ANCHOR_NSEC. Limit the correction so that a step of the host clock
+    // doesn't swing the rate much.
+    u64 est = now + (u64)(((unsigned __int128)(t2 - t) *
+      AtomicLoad(&tsc.mult, memory_order_relaxed)) >> TSC_SHIFT);
+    i64 adj = (i64)(((__int128)(i64)(ns - est) << TSC_SHIFT) / (i64)tsc.anchor_ticks);
+    i64 maxadj = (i64)(mult / 64);
+    mult = (u64)((i64)mult + (adj > maxadj ? maxadj : adj < -maxadj ? -maxadj : adj));
+    AtomicStore(&tsc.base_tsc, t2, memory_order_relaxed);
+    AtomicStore(&tsc.base_ns, est, memory_order_relaxed);
+    AtomicStore(&tsc.mult, mult, memory_order_relaxed);
+    AtomicStore(&tsc.anchor_tsc, t2 + tsc.anchor_ticks, memory_order_relaxed);
+  } else {
+    // interrupted or implausible; try again soon
+    AtomicStore(&tsc.anchor_tsc, t + tsc.anchor_ticks/64, memory_order_relaxed);
+  }
+  AtomicStoreRel(&tsc.seq, seq + 2);
+}
+#endif // NANOTIME_TSC
+
+
+u64 nanotime(void) {
+  #ifdef NANOTIME_TSC
+    u32 state = AtomicLoadAcq(&tsc.state);
+    if LIKELY(state == TSC_ON) {
+      u32 seq;
+      u64 t, now;
+      do {
+        seq = AtomicLoadAcq(&tsc.seq);
+        t = __rdtsc();
+        u64 d = t - AtomicLoad(&tsc.base_tsc, memory_order_relaxed);
+        now = AtomicLoad(&tsc.base_ns, memory_order_relaxed) + (u64)(
+          ((unsigned __int128)d * AtomicLoad(&tsc.mult, memory_order_relaxed))
+          >> TSC_SHIFT);
+        atomic_thread_fence(memory_order_acquire);
+        if UNLIKELY(t >= AtomicLoad(&tsc.anchor_tsc, memory_order_relaxed))
+          tsc_anchor(seq, now, t);
+      } while UNLIKELY((seq & 1) || seq != AtomicLoad(&tsc.seq, memory_order_relaxed));
+      return now;
+    }
+    if (state != TSC_OFF)
+      return tsc_calibrate(state);
+  #endif
+  return os_nanotime();
+}
+
+
 // U64_MAX = 584.9 years (18446744073709551615/1000000000/60/60/24/365)
 u64 rsm_nanosleep(u64 nsec) {
   #ifdef CO_NO_LIBC
@@ -12,6 +12,9 @@
 // VM_TRACE: define to enable logging a lot of info via dlog
 //#define VM_TRACE
 
+// VM_BENCH_MAP: define to measure vm_map_add & vm_map_del of large ranges during init
+//#define VM_BENCH_MAP
+
 
 #if defined(VM_TRACE) && defined(DEBUG)
   #define trace(fmt, args...) dlog("[vm] " fmt, ##args)
@@ -63,7 +66,8 @@ static_assert(sizeof(vm_pte_t) == sizeof(u64), "vm_pte_t too large");
 
 
 void vm_cache_init(vm_cache_t* cache) {
-  memset(cache, 0xff, sizeof(vm_cache_t));
+  memset(cache, 0, sizeof(vm_cache_t));
+  memset(cache->entries, 0xff, sizeof(cache->entries));
 }
 
 
@@ -104,6 +108,67 @@ static u64 vm_cache_add(vm_cache_t* cache, u64 vpaddr, uintptr hpaddr) {
 }
 
 
+// vm_cache_faultaround adds cache entries for the pages around vpaddr, whose page
+// table entry is vpage, which are mapped & backed and have at least the permissions
+// of vpage. (Pages with fewer permissions must not end up in a cache meant for vpage.)
+// When isstore is true, the pages are marked as written, since cache is used for
+// stores and these won't miss. When prealloc is true (stores streaming through
+// memory), lazily-backed pages after vpaddr are allocated backing pages, saving
+// their own misses later on.
+// Must be called with map locked (at least vm_map_rlock.) Other threads may do the
+// same for the same pages, so PTEs are only updated atomically (vm_page_mark and
+// vm_map_back_page.)
+static void vm_cache_faultaround(
+  vm_cache_t* cache, vm_map_t* map, u64 vpaddr, vm_page_t* vpage,
+  bool isstore, bool prealloc)
+{
+  // limit to VM_CACHE_LEN so that entries of the window don't evict each other
+  static_assert(VM_CACHE_LEN <= VM_PTAB_LEN, "");
+  u32 n = MIN(map->faultaround, (u32)VM_CACHE_LEN);
+  assertf(IS_POW2(n), "vm_map_t.faultaround (%u) not a power of two", n);
+
+  // All pages of the window are in the same last-level table as vpage,
+  // so we can find them relative to vpage without walking the page directory again.
+  static_assert(offsetof(vm_pte_t, page) == 0, "");
+  vm_perm_t perm = vm_page_perm(vpage);
+  u32 index = (u32)(VM_VFN(vpaddr) & (VM_PTAB_LEN - 1));
+  vm_ptab_t ptab = (vm_pte_t*)vpage - index;
+  u32 start = index & ~(n - 1);
+  u64 vpaddr0 = vpaddr - (u64)(index - start)*PAGE_SIZE;
+
+  // preallocation is speculative; don't take the map up to its hard limit for it
+  u64 hard_limit = AtomicLoad(&map->hard_limit, memory_order_relaxed);
+  u64 prealloc_max = hard_limit ? hard_limit - MIN(hard_limit, n) : U64_MAX;
+
+  for (u32 i = start; i < start + n; i++) {
+    vm_page_t* page = &ptab[i].page;
+    if (i == index || *(u64*)page == 0 || page->uncacheable ||
+        !VM_PERM_CHECK(vm_page_perm(page), perm))
+    {
+      continue;
+    }
+    if (page->hfn == 0) {
+      if (!prealloc || i < index || page->type == VM_PAGE_T_GUARD ||
+          AtomicLoad(&map->npages, memory_order_relaxed) >= prealloc_max)
+      {
+        continue;
+      }
+      // note: not an error if we are out of memory; the page will be backed on access
+      if UNLIKELY(!vm_map_back_page(map, VM_VFN(vpaddr0) + (u64)(i - start), page))
+        continue;
+      cache->nprealloc++;
+    }
+    vm_page_mark(page, isstore);
+    vm_cache_add(cache, vpaddr0 + (u64)(i - start)*PAGE_SIZE, (uintptr)vm_page_haddr(page));
+    cache->nprefill++;
+  }
+
+  // consider the next store miss after this window a continuation of the stream
+  if (prealloc)
+    cache->last_store_vpaddr = vpaddr0 + (u64)(n - 1)*PAGE_SIZE;
+}
+
+
 // returns vm_cache_ent_t.haddr_diff
 u64 _vm_cache_miss(vm_cache_t* cache, vm_map_t* map, u64 vaddr, vm_op_t op) {
   trace("%s 0x%llx op=0x%x", __FUNCTION__, vaddr, op);
@@ -120,18 +185,32 @@ u64 _vm_cache_miss(vm_cache_t* cache, vm_map_t* map, u64 vaddr, vm_op_t op) {
     panic("misaligned %uB %s 0x%llx", VM_OP_ALIGNMENT(op), opname, vaddr);// FIXME
   }
 
+  cache->nmiss++;
+
+retry:
   // get page table entry for the virtual page address (lookup via VFN)
   assert(!rwmutex_islocked(&map->lock));
   vm_map_rlock(map);
   vm_page_t* page = vm_map_access(map, VM_VFN(vaddr), /*is_access*/true);
-  vm_map_runlock(map);
 
   // check if the lookup failed
   if UNLIKELY(!page) {
+    vm_map_runlock(map);
+    if (map->fault && map->fault(map->fault_ctx, vaddr, op))
+      goto retry;
     panic("invalid address 0x%llx (not mapped)", vaddr);
     return 0;
   }
 
+  // check if allocating a backing page failed
+  if UNLIKELY(page->hfn == 0 && page->type != VM_PAGE_T_GUARD) {
+    vm_map_runlock(map);
+    if (map->fault && map->fault(map->fault_ctx, vaddr, op | VM_OP_F_NOMEM))
+      goto retry;
+    panic("out of memory: no backing page for 0x%llx", vaddr);
+    return 0;
+  }
+
   // check permissions
   vm_perm_t wantperm = 0;
   wantperm |= (VM_OP_TYPE(op) == VM_OP_LOAD) * VM_PERM_R;
@@ -139,14 +218,26 @@ u64 _vm_cache_miss(vm_cache_t* cache, vm_map_t* map, u64 vaddr, vm_op_t op) {
   vm_perm_t hasperm = vm_page_perm(page);
   if UNLIKELY(!VM_PERM_CHECK(hasperm, wantperm)) {
     trace("wantperm %s not in hasperm %s", vm_perm_str(wantperm), vm_perm_str(hasperm));
+    vm_map_runlock(map);
+    if (map->fault && map->fault(map->fault_ctx, vaddr, op))
+      goto retry;
+    // copy-on-write of a deduplicated page (no-op for other pages)
+    if (VM_OP_TYPE(op) == VM_OP_STORE) {
+      rerr_t err = vm_ksm_cow(map, vaddr);
+      if (err == 0)
+        goto retry;
+      if (err == rerr_nomem)
+        panic("out of memory: no private copy of 0x%llx", vaddr);
+    }
+    if (page->type == VM_PAGE_T_GUARD)
+      panic("access to guard page at 0x%llx", vaddr);
     if (VM_OP_TYPE(op) == VM_PERM_R)
       panic("store to read-protected address 0x%llx", vaddr);
     panic("store to read-only address 0x%llx", vaddr);
     return 0;
   }
 
-  page->accessed = true;
-  page->written |= (VM_OP_TYPE(op) == VM_OP_STORE);
+  vm_page_mark(page, VM_OP_TYPE(op) == VM_OP_STORE);
 
   // calculate page addresses
   uintptr hpaddr = (uintptr)vm_page_haddr(page);
@@ -154,10 +245,25 @@ u64 _vm_cache_miss(vm_cache_t* cache, vm_map_t* map, u64 vaddr, vm_op_t op) {
 
   trace("%s 0x%llx -> %p", __FUNCTION__, vaddr, (void*)hpaddr);
 
-  if (page->uncacheable)
+  if (page->uncacheable) {
+    vm_map_runlock(map);
     return (u64)hpaddr - vpaddr; // vm_cache_ent_t.haddr_diff
+  }
 
-  return vm_cache_add(cache, vpaddr, hpaddr);
+  u64 haddr_diff = vm_cache_add(cache, vpaddr, hpaddr);
+
+  if (map->faultaround > 1) {
+    // a store miss on the page following that of the previous store miss
+    // suggests that stores are streaming through memory
+    bool isstore = VM_OP_TYPE(op) == VM_OP_STORE;
+    bool prealloc = isstore && vpaddr == cache->last_store_vpaddr + PAGE_SIZE;
+    if (isstore)
+      cache->last_store_vpaddr = vpaddr;
+    vm_cache_faultaround(cache, map, vpaddr, page, isstore, prealloc);
+  }
+
+  vm_map_runlock(map);
+  return haddr_diff;
 }
 
 
@@ -313,10 +419,60 @@ static void test_vm() {
 #endif // VM_RUN_TEST_ON_INIT
 
 
+//————————————————————————————————————————————————————————————————————————————————————
+#if defined(VM_BENCH_MAP) && !defined(RSM_NO_LIBC)
+
+#define BENCH_MAP_NPAGES     (1024lu*1024lu) // 4 GiB with 4 KiB pages
+#define BENCH_MAP_ITERATIONS 8
+
+// bench_map maps and unmaps a large range of lazily-backed pages, like a big heap
+static void bench_map() {
+  // page tables for BENCH_MAP_NPAGES, with plenty of headroom for rmm
+  usize memsize = ALIGN2(BENCH_MAP_NPAGES / VM_PTAB_LEN * VM_PTAB_SIZE * 4, PAGE_SIZE);
+  rmm_t* mm = rmm_create_host_vmmap(memsize);
+  vm_map_t map;
+  if (!mm || vm_map_init(&map, mm))
+    panic("bench_map: out of memory");
+
+  u64 vaddr = 0x100000000llu + VM_ADDR_MIN; // start of an L2 table
+  u64 add_ns = 0, del_ns = 0;
+
+  for (u32 i = 0; i < BENCH_MAP_ITERATIONS; i++) {
+    vm_map_lock(&map);
+    u64 t = nanotime();
+    rerr_t err = vm_map_add(&map, vaddr, 0, BENCH_MAP_NPAGES, VM_PERM_RW);
+    add_ns += nanotime() - t;
+    if UNLIKELY(err) panic("vm_map_add: %s (iteration %u)", rerr_str(err), i);
+
+    t = nanotime();
+    err = vm_map_del(&map, vaddr, BENCH_MAP_NPAGES);
+    del_ns += nanotime() - t;
+    if UNLIKELY(err) panic("vm_map_del: %s", rerr_str(err));
+    vm_map_unlock(&map);
+  }
+
+  double npages = (double)(BENCH_MAP_NPAGES * BENCH_MAP_ITERATIONS);
+  log("bench_map: %lu pages: vm_map_add %.2f ms (%.2f ns/page),"
+    " vm_map_del %.2f ms (%.2f ns/page)",
+    BENCH_MAP_NPAGES,
+    (double)add_ns / (BENCH_MAP_ITERATIONS * 1000000.0), (double)add_ns / npages,
+    (double)del_ns / (BENCH_MAP_ITERATIONS * 1000000.0), (double)del_ns / npages);
+
+  vm_map_dispose(&map);
+  rmm_dispose(mm);
+}
+
+#endif // VM_BENCH_MAP
+
+
 rerr_t init_vmem() {
   #if defined(VM_RUN_TEST_ON_INIT) && DEBUG
   test_vm();
   #endif
 
+  #if defined(VM_BENCH_MAP) && !defined(RSM_NO_LIBC)
+  bench_map();
+  #endif
+
   return 0;
 }
@@ -57,6 +57,17 @@ RSM_ASSUME_NONNULL_BEGIN
 #define VM_CACHE_INDEX_VFN_MASK  ((1llu << VM_CACHE_INDEX_BITS) - 1llu)
 #define VM_CACHE_LEN             (1lu << VM_CACHE_INDEX_BITS)
 #define VM_CACHE_DEL_TAG         (~0llu)
+#define VM_COWLOG_LEN            32u /* vm_map_t.cowlog, must be pow2 */
+
+// VM_PTAB_CACHE_MAX: max number of free page tables a map keeps for reuse
+#ifndef VM_PTAB_CACHE_MAX
+  #define VM_PTAB_CACHE_MAX  16u
+#endif
+
+// VM_FAULTAROUND_DEFAULT: default value of vm_map_t.faultaround
+#ifndef VM_FAULTAROUND_DEFAULT
+  #define VM_FAULTAROUND_DEFAULT  16u
+#endif
 
 // VM_CACHE_TAG_MASK is a neat trick we use to create a bitmask used for the
 // "tag" value of a vm cache entry to both verify that the entry's address
@@ -226,6 +237,13 @@ enum vm_perm {
   VM_PERM_MAX = VM_PERM_RW, // all bits set
 };
 
+// vm_page_type_t: type of a page (vm_page_t.type)
+enum vm_page_type {
+  VM_PAGE_T_NORMAL = 0,
+  VM_PAGE_T_GUARD  = 1, // guard page; any access faults (mapped with VM_PERM_NONE)
+  VM_PAGE_T_COW    = 2, // read-only page shared by vm_ksm; copied on first write
+};
+
 // vm_page_t is vm_pte_t for a page
 typedef struct {
   #if RSM_LITTLE_ENDIAN
@@ -236,7 +254,7 @@ typedef struct {
     bool  purgeable   : 1; // backing can be purged (can be handed to rmm_freepages)
     bool  accessed    : 1; // has been accessed
     bool  written     : 1; // has been written to
-    u64   type        : 3; // type of page
+    u64   type        : 3; // type of page (enum vm_page_type)
     u64   _reserved   : 3;
 
     // hfn is the host frame number (hfn=haddr>>PAGE_SIZE_BITS).
@@ -265,6 +283,26 @@ typedef union {
 // vm_ptab_t - virtual memory page table of size VM_PTAB_LEN
 typedef vm_pte_t* vm_ptab_t;
 
+// vm_op_t communicates a memory operation with optional alignment value (enum vm_op)
+typedef u32 vm_op_t;
+
+// vm_fault_f is called by _vm_cache_miss when vaddr is not mapped or when its page
+// does not permit the operation op (e.g. a guard page.) The map is not locked.
+// op has VM_OP_F_NOMEM set if vaddr is mapped but no backing page could be allocated.
+// The handler may change the mapping and return true to have the access retried,
+// or return false, in which case the fault is fatal.
+typedef bool(*vm_fault_f)(void* ctx, u64 vaddr, vm_op_t op);
+
+// vm_pressure_f is called when the backing memory charged to a map crosses the map's
+// soft limit (hard=false) or when a charge would exceed its hard limit (hard=true.)
+// npages is the number of pages charged to the map, not including the new charge.
+// After a hard-limit call, the charge is retried once, so the handler may raise the
+// limit or release memory to let it succeed. The map may be locked.
+typedef void(*vm_pressure_f)(void* ctx, u64 npages, bool hard);
+
+// vm_ksm_t is the state of page deduplication across maps sharing a rmm_t (vm_ksm.c)
+typedef struct vm_ksm_ vm_ksm_t;
+
 // vm_map_t is one map, a page directory managing mappings between
 // virtual page addresses and host page addresses.
 typedef struct {
@@ -273,6 +311,52 @@ typedef struct {
   u64       min_free_vfn; // smallest free VFN (larger VFNs may be allocated)
   vm_ptab_t root;
   u32       root_nuse; // number of page tables in use in root
+
+  // Page-table memory. Freed page tables are kept in ptab_cache for reuse, up to
+  // VM_PTAB_CACHE_MAX tables, linked through their first entry.
+  // All fields are protected by the map's exclusive lock.
+  vm_ptab_t nullable ptab_cache;
+  u32                ptab_ncache;
+  u32                ptab_count[VM_PTAB_LEVELS]; // tables in use per level (0=root)
+
+  vm_fault_f nullable fault;     // optional fault handler
+  void* nullable      fault_ctx; // ctx argument for fault
+
+  // faultaround is the number of pages _vm_cache_miss resolves per miss.
+  // A miss fills cache entries for all mapped & backed pages in the naturally-aligned
+  // window of faultaround pages around the missed page, which turns sequential scans
+  // from one miss per page into one miss per window.
+  // Must be a power of two; values larger than VM_CACHE_LEN are capped.
+  // 0 or 1 disables fault-around. Set with rmachine_set_faultaround; changes are
+  // made with the map locked.
+  u32 faultaround;
+
+  // gen is incremented when translations of the map change behind the back of
+  // its users, e.g. by rmm_ksm_scan. Users of vm_caches for the map must invalidate
+  // them when they observe a new value.
+  _Atomic(u32) gen;
+
+  // cowgen is incremented by vm_ksm_cow when it gives a single page a new
+  // translation. cowlog holds the page addresses of the last VM_COWLOG_LEN copies,
+  // indexed by cowgen, so that users can invalidate just those pages.
+  // cowlog is written with the map locked; read it with at least vm_map_rlock.
+  _Atomic(u32) cowgen;
+  u64          cowlog[VM_COWLOG_LEN];
+
+  vm_ksm_t* nullable ksm; // page deduplication the map takes part in
+
+  // Backing memory accounting, in pages (see vm_map_charge.)
+  // Limits can be changed at any time; 0 means "no limit".
+  _Atomic(u64)           npages;     // number of pages charged to the map
+  _Atomic(u64)           soft_limit; // call pressure when npages crosses this
+  _Atomic(u64)           hard_limit; // fail charges which would exceed this
+  vm_pressure_f nullable pressure;     // optional memory pressure handler
+  void* nullable         pressure_ctx; // ctx argument for pressure
+
+  // Direct window (see vm_map_direct_init.) Virtual addresses below direct_size
+  // live at host address direct_base+vaddr. direct_size is 0 for other maps.
+  uintptr direct_base;
+  u64     direct_size;
 } vm_map_t;
 
 // vm_cache_ent_t is the type of vm_cache_t entries
@@ -285,10 +369,12 @@ typedef struct {
 // Maps virtual page addresses to host page addresses. Not thread safe.
 typedef struct {
   vm_cache_ent_t entries[VM_CACHE_LEN];
+  u64 last_store_vpaddr; // page address of the most recent store miss
+  u64 nmiss;             // stats: number of calls to _vm_cache_miss
+  u64 nprefill;          // stats: entries filled by fault-around
+  u64 nprealloc;         // stats: backing pages allocated ahead of stores
 } vm_cache_t;
 
-// vm_op_t communicates a memory operation with optional alignment value
-typedef u32 vm_op_t;
 enum vm_op {
   VM_OP_STORE     = 0,
   VM_OP_STORE_1   = VM_OP_STORE + 1,
@@ -309,9 +395,12 @@ enum vm_op {
   VM_OP_LOAD_32  = VM_OP_LOAD + 32,
   VM_OP_LOAD_64  = VM_OP_LOAD + 64,
   VM_OP_LOAD_128 = VM_OP_LOAD + 128,
+
+  // flags, only passed to vm_fault_f
+  VM_OP_F_NOMEM = 0x1000, // failed to allocate a backing page
 };
 #define VM_OP_ALIGNMENT(op) ( (op) & 0xff ) /* e.g. 2, 4, 8 ... */
-#define VM_OP_TYPE(op)      ( (op) & (~0u << 8) ) /* e.g. VM_OP_LOAD, VM_OP_STORE */
+#define VM_OP_TYPE(op)      ( (op) & 0xf00 ) /* e.g. VM_OP_LOAD, VM_OP_STORE */
 
 
 // vm_map_init initializes a new vm_map_t, sourcing backing memory from mm.
@@ -328,6 +417,7 @@ static void vm_map_lock(vm_map_t*);
 static void vm_map_unlock(vm_map_t*);
 static void vm_map_rlock(vm_map_t*);
 static void vm_map_runlock(vm_map_t*);
+static bool vm_map_tryrlock(vm_map_t*); // lock-free; safe to call in signal handlers
 
 // vm_map_add maps npages pages starting at vaddr.
 // If haddr is not 0, the pages are mapped to the corresponding range of host pages.
@@ -335,22 +425,147 @@ static void vm_map_runlock(vm_map_t*);
 // When haddr is provided, vm_page_t.purgeable=false.
 // If haddr is 0, backing pages are allocated as needed on first access,
 // i.e. vm_page_t.purgeable=true.
+// Pages mapped with VM_PERM_NONE are guard pages (VM_PAGE_T_GUARD); they reserve
+// their address range and any access to them faults. haddr must be 0 for these.
 // The top PAGE_SIZE_BITS bits of vaddr and haddr are ignored.
 // map must be locked with vm_map_lock.
 rerr_t vm_map_add(vm_map_t*, u64 vaddr, uintptr haddr, u64 npages, vm_perm_t);
 
 // vm_map_del deallocates a range of virtual pages starting at vaddr.
-// Callers using caches should call vm_cache_invalidate.
+// Backing pages which belong to map are freed and uncharged, like vm_map_clear does,
+// in which case map.gen is bumped. Deduplicated pages in the range must have been
+// released with vm_ksm_release. Callers using caches should call vm_cache_invalidate.
 // map must be locked with vm_map_lock.
 rerr_t vm_map_del(vm_map_t*, u64 vaddr, u64 npages);
 
+// vm_map_clear unmaps all pages of map. Backing pages which belong to map are freed
+// and uncharged; others belong (and are charged) to whoever mapped them.
+// Keeps the direct window, discarding its contents, and map's settings, like its
+// fault handler and memory limits. Bumps map.gen.
+// map must not be locked.
+void vm_map_clear(vm_map_t*);
+
+// vm_map_compact frees page tables which have no entries, which can be left behind
+// by vm_map_add failing midway, and releases map's cache of free page tables.
+// Returns the number of bytes of page-table memory freed.
+// map must be locked with vm_map_lock.
+usize vm_map_compact(vm_map_t*);
+
+// vm_map_ptab_size returns the bytes of page tables in use by map at level
+// (0 = root table.) Tables kept for reuse are not included.
+// map must be locked with at least vm_map_rlock.
+inline static usize vm_map_ptab_size(const vm_map_t* map, u32 level) {
+  return (usize)map->ptab_count[level] * VM_PTAB_SIZE;
+}
+
+// vm_map_charge accounts npages of backing memory to map, calling map->pressure
+// if the soft limit is crossed. Returns rerr_nomem if the charge would exceed the
+// hard limit. vm_map_uncharge reverses a charge.
+rerr_t vm_map_charge(vm_map_t*, u64 npages);
+void vm_map_uncharge(vm_map_t*, u64 npages);
+
+// vm_map_alloc_backing allocates a backing page for a lazily-backed page of map,
+// charging it to map. Returns 0 if out of memory or if map's hard limit is reached.
+// map must be locked with at least vm_map_rlock.
+u64 vm_map_alloc_backing(vm_map_t*);
+
+// vm_map_back_page gives page, the lazily-backed page of vfn, a backing page.
+// In a map's direct window, the backing page is the page's host page in the window.
+// Returns false if out of memory or if map's hard limit is reached.
+// map must be locked with at least vm_map_rlock. The PTE is updated atomically; if
+// another thread backs the page first, its backing page is used and true returned.
+bool vm_map_back_page(vm_map_t*, u64 vfn, vm_page_t* page);
+
+// vm_map_back_direct_page is vm_map_back_page for a page in map's direct window which
+// doesn't call map->pressure, for the window's signal handler. If the charge crossed
+// map's soft limit, *pressurep is set to the number of pages charged before it (the
+// argument to pass map->pressure), otherwise to U64_MAX.
+bool vm_map_back_direct_page(vm_map_t*, u64 vfn, vm_page_t* page, u64* pressurep);
+
+// vm_map_direct_init makes the addresses [0, 2^addrbits) of map a direct window:
+// one host reservation (mmap PROT_NONE) in which the host page of each virtual page
+// is at a fixed offset. Pages in the window are backed on first access, by a SIGSEGV
+// handler which consults map the way _vm_cache_miss does. Alignment of accesses in
+// the window is not checked. Pages in the window can't be mapped to host pages with
+// vm_map_add. Must be called before anything is mapped in the window.
+// Returns rerr_not_supported if the host lacks support (Linux only, PAGE_SIZE pages.)
+//
+// The handler may interrupt code holding any lock, so it only takes the map's read
+// lock with vm_map_tryrlock and backs pages without calling map->pressure.
+// Faults on guard pages and at the hard limit, which need map->fault, are deferred:
+// the handler makes the page accessible so that the access completes, and records
+// the fault in vm_direct_pending, which VM_DLOAD & VM_DSTORE check after the access.
+// Thus, host code may only access the window:
+// - with VM_DLOAD & VM_DSTORE, or through pointers from vm_translate_direct followed
+//   by vm_direct_check, in code where map->fault may run (e.g. the interpreter); or
+// - through translations from a vm_cache (e.g. VM_TRANSLATE), which backs pages first.
+// Accesses faulting otherwise leave their faults pending until the next check on
+// the thread. The window must never be accessed with the map locked for writing.
+rerr_t vm_map_direct_init(vm_map_t*, u32 addrbits);
+
+// vm_direct_dispose releases the direct window of map; called by vm_map_dispose
+void vm_direct_dispose(vm_map_t*);
+
+// vm_direct_back makes the host page of vaddr in map's direct window accessible with
+// perm. vm_direct_release makes npages pages at vaddr inaccessible and frees their
+// memory; pages outside the window are ignored.
+bool vm_direct_back(vm_map_t*, u64 vaddr, vm_perm_t perm);
+void vm_direct_release(vm_map_t*, u64 vaddr, u64 npages);
+
+// vm_direct_pending_t holds the faults in direct windows which the window's signal
+// handler deferred on the calling thread (see vm_map_direct_init)
+#define VM_DIRECT_MAXPENDING 2 /* an access spans at most two pages */
+typedef struct {
+  bool    pending;  // true if there's anything below to complete
+  bool    pressure; // the soft limit was crossed; call map->pressure
+  u32     nfaults;
+  u64     pressure_npages; // npages argument for map->pressure
+  u64     vaddr[VM_DIRECT_MAXPENDING];
+  vm_op_t op[VM_DIRECT_MAXPENDING]; // VM_OP_F_NOMEM if not backed for lack of memory
+} vm_direct_pending_t;
+extern _Thread_local vm_direct_pending_t vm_direct_pending;
+
+// vm_direct_complete completes the faults in vm_direct_pending, calling map->pressure
+// and map->fault, which may not return (e.g. rsched_vm_fault calling task_fail.)
+void vm_direct_complete(vm_map_t*);
+
+// void vm_direct_check(vm_map_t*) calls vm_direct_complete if faults are pending
+#define vm_direct_check(map) \
+  ( UNLIKELY(vm_direct_pending.pending) ? vm_direct_complete(map) : ((void)0) )
+
+// vm_ksm_register adds map to ksm; vm_ksm_unregister removes it, dropping
+// its references to shared pages. Called by vm_map_init and vm_map_dispose.
+void vm_ksm_register(vm_ksm_t* ksm, vm_map_t* map);
+void vm_ksm_unregister(vm_ksm_t* ksm, vm_map_t* map);
+
+// vm_ksm_release drops map's references to the deduplicated pages in the range of
+// npages at vaddr, which are then unbacked. Call before vm_map_del of the range.
+// map must not be locked.
+void vm_ksm_release(vm_map_t* map, u64 vaddr, u64 npages);
+
+// vm_ksm_cow gives map a private, writable copy of the shared page at vaddr.
+// Returns rerr_not_found if the page is not a VM_PAGE_T_COW page and rerr_nomem
+// if a copy can't be allocated or charged to map. map must not be locked.
+rerr_t vm_ksm_cow(vm_map_t* map, u64 vaddr);
+
+// rmm_ksm returns the page deduplication state of mm, if enabled (mem_mm.c)
+vm_ksm_t* nullable rmm_ksm(const rmm_t* mm);
+void rmm_set_ksm(rmm_t* mm, vm_ksm_t* nullable ksm);
+
 // vm_map_findspace attempts to find a region with sufficient space for npages,
 // with minimum address *vaddr. On success, *vaddr contains the first virtual
 // address in the found region.
 // map must be locked with at least vm_map_rlock.
 rerr_t vm_map_findspace(vm_map_t*, u64* vaddr, u64 npages);
 
+// vm_map_lookup returns the page table entry of a Virtual Frame Number,
+// like vm_map_access but without allocating a backing page.
+// map must be locked with at least vm_map_rlock.
+vm_page_t* nullable vm_map_lookup(vm_map_t*, u64 vfn, bool isaccess);
+
 // vm_map_access returns the page table entry of a Virtual Frame Number.
+// A lazily-backed page is allocated a backing page; if that fails, the page is
+// returned with hfn==0 (see vm_map_alloc_backing.)
 // map must be locked with at least vm_map_rlock.
 // If isaccess is true, all parent page tables of VFN will be marked as
 // "accessed" by setting vm_page_t.accessed=true.
@@ -389,6 +604,17 @@ inline static void vm_page_set_haddr(vm_page_t* page, u64 haddr) {
   page->hfn = haddr >> PAGE_SIZE_BITS;
 }
 
+// vm_page_mark sets the accessed flag of page, and its written flag if written is
+// true. The PTE is updated atomically since it's done with the map read-locked,
+// possibly by several threads at once.
+inline static void vm_page_mark(vm_page_t* page, bool written) {
+  union { vm_page_t page; u64 u; } bits = { .page = { .accessed=true, .written=written } };
+  u64 mask = bits.u;
+  _Atomic(u64)* pte = (_Atomic(u64)*)page;
+  if ((AtomicLoad(pte, memory_order_relaxed) & mask) != mask)
+    AtomicOr(pte, mask, memory_order_relaxed);
+}
+
 // vm_table_ptab accesses the ptab; the array of entries, of a table
 inline static vm_ptab_t nullable vm_table_ptab(const vm_table_t* table) {
   return (void*)(uintptr)(table->hfn << PAGE_SIZE_BITS);
@@ -423,11 +649,14 @@ inline static u32 vm_vfn_ptab_index(u64 vfn, u32 level) {
 }
 
 
-// vm_ptab_alloc allocates a new page table (initialized, ready to be used)
-vm_ptab_t nullable vm_ptab_alloc(rmm_t* mm);
+// vm_ptab_alloc allocates a new page table for level of map (initialized, ready to
+// be used), reusing a table from map's cache when there is one.
+// map must be locked with vm_map_lock.
+vm_ptab_t nullable vm_ptab_alloc(vm_map_t* map, u32 level);
 
-// vm_ptab_free frees a page table previously allocated with the same mm
-void vm_ptab_free(rmm_t* mm, vm_ptab_t);
+// vm_ptab_free frees a page table of level, previously allocated with vm_ptab_alloc.
+// map must be locked with vm_map_lock.
+void vm_ptab_free(vm_map_t* map, vm_ptab_t, u32 level);
 
 
 // vm_cache_init initializes a vm_cache_t
@@ -475,6 +704,26 @@ u64 _vm_cache_miss(vm_cache_t*, vm_map_t*, u64 vaddr, vm_op_t);
   ) \
 )
 
+// VM_DLOAD & VM_DSTORE are VM_LOAD & VM_STORE for maps which may have a direct window,
+// where dbase & dsize are map->direct_base & map->direct_size (which the caller may
+// keep in locals.) Addresses in the window are translated with a single add.
+// Faults of the access, deferred by the window's signal handler, are completed after it.
+#define VM_DLOAD(type, vm_cache, map, dbase, dsize, vaddr) ({ \
+  vmtrace("VM_DLOAD %s (align %lu) 0x%llx", #type, _Alignof(type), vaddr); \
+  type vmvalue__ = *(type*)vm_translate_direct( \
+    (vm_cache), (map), (dbase), (dsize), (vaddr), \
+    _Alignof(type), VM_OP_LOAD + _Alignof(type)); \
+  vm_direct_check(map); \
+  vmvalue__; \
+})
+#define VM_DSTORE(type, vm_cache, map, dbase, dsize, vaddr, value) { \
+  vmtrace("VM_DSTORE %s (align %lu) 0x%llx", #type, _Alignof(type), vaddr); \
+  *(type*)vm_translate_direct( \
+    (vm_cache), (map), (dbase), (dsize), (vaddr), \
+    _Alignof(type), VM_OP_STORE + _Alignof(type)) = (value); \
+  vm_direct_check(map); \
+}
+
 // uintptr VM_TRANSLATE() translates a virtual address to a host address
 #define VM_TRANSLATE(vm_cache, map, vaddr, align) \
   vm_translate((vm_cache), (map), (vaddr), (align), VM_OP_LOAD + (u32)(align))
@@ -493,6 +742,16 @@ ALWAYS_INLINE static uintptr vm_translate(
   return (uintptr)(haddr_diff + vaddr);
 }
 
+// vm_translate_direct is vm_translate for maps which may have a direct window
+ALWAYS_INLINE static uintptr vm_translate_direct(
+  vm_cache_t* cache, vm_map_t* map, uintptr dbase, u64 dsize,
+  u64 vaddr, u64 align, vm_op_t op)
+{
+  if (vaddr < dsize)
+    return dbase + (uintptr)vaddr;
+  return vm_translate(cache, map, vaddr, align, op);
+}
+
 
 // void vm_map_assert_locked(vm_map_t*)
 #define vm_map_assert_locked(m)  assertf(rwmutex_islocked(&(m)->lock), "map locked")
@@ -504,6 +763,7 @@ inline static void vm_map_lock(vm_map_t* map) { rwmutex_lock(&map->lock); }
 inline static void vm_map_unlock(vm_map_t* map) { rwmutex_unlock(&map->lock); }
 inline static void vm_map_rlock(vm_map_t* map) { rwmutex_rlock(&map->lock); }
 inline static void vm_map_runlock(vm_map_t* map) { rwmutex_runlock(&map->lock); }
+inline static bool vm_map_tryrlock(vm_map_t* map) { return rwmutex_tryrlock(&map->lock); }
 
 
 RSM_ASSUME_NONNULL_END
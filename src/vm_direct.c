@@ -0,0 +1,323 @@
+// virtual memory direct window
+// See vm_map_direct_init in vm.h
+// SPDX-License-Identifier: Apache-2.0
+//
+// A map's direct window is a single host reservation of 2^addrbits bytes, made with
+// PROT_NONE, in which the host page of a virtual page vaddr is at direct_base+vaddr.
+// Loads and stores to the window skip the vm_cache and translate with one add.
+//
+// The page table remains the source of truth: a page in the window is made accessible
+// (mprotect) when it is backed by vm_map_back_page, either by _vm_cache_miss (host
+// code accessing guest memory, e.g. syscalls) or by the SIGSEGV handler below, which
+// runs when translated code touches a page which is not yet accessible.
+//
+// The handler may have interrupted the thread anywhere, e.g. in rmm or the scheduler
+// holding a lock, so it must not block nor unwind (longjmp.) It only try-locks the
+// map, backs pages with vm_map_back_direct_page and makes pages accessible with
+// mprotect. Whatever needs more than that is recorded in vm_direct_pending and done
+// by vm_direct_complete after the access, when VM_DLOAD or VM_DSTORE returns.
+//
+#include "rsmimpl.h"
+
+#define vmtrace trace
+#include "vm.h"
+
+#if defined(__linux__) && !defined(RSM_NO_LIBC)
+  #include <sys/mman.h>
+  #include <signal.h>
+  #define VM_DIRECT_SUPPORTED
+#endif
+
+// VM_DIRECT_TRACE: define to enable logging a lot of info via dlog
+//#define VM_DIRECT_TRACE
+
+#if (defined(VM_DIRECT_TRACE) || defined(VM_TRACE)) && defined(DEBUG)
+  #undef  VM_DIRECT_TRACE
+  #define VM_DIRECT_TRACE
+  #define trace(fmt, args...) dlog("[vm_direct] " fmt, ##args)
+#else
+  #ifdef VM_DIRECT_TRACE
+    #warning VM_DIRECT_TRACE has no effect unless DEBUG is enabled
+    #undef VM_DIRECT_TRACE
+  #endif
+  #define trace(...) ((void)0)
+#endif
+
+// VM_DIRECT_MINBITS & VM_DIRECT_MAXBITS limits the size of the window.
+// The upper limit keeps the window within the host's user address space and below
+// addresses which are mapped to host pages, like the vdso (at 1<<(VM_ADDR_BITS-1).)
+#define VM_DIRECT_MINBITS 20u
+#define VM_DIRECT_MAXBITS (VM_ADDR_BITS - 2u)
+
+// VM_DIRECT_MAXMAPS is the max number of maps with a direct window at once
+#define VM_DIRECT_MAXMAPS 64
+
+
+#ifdef VM_DIRECT_SUPPORTED
+
+static _Atomic(vm_map_t*) g_maps[VM_DIRECT_MAXMAPS];
+static _Atomic(u32)       g_sigstate; // 0: not installed, 1: installing, 2: installed
+static struct sigaction   g_prev_sigsegv;
+static struct sigaction   g_prev_sigbus;
+
+
+// direct_find returns the map which window (or its guard page) contains haddr
+static vm_map_t* nullable direct_find(uintptr haddr) {
+  for (u32 i = 0; i < VM_DIRECT_MAXMAPS; i++) {
+    vm_map_t* map = AtomicLoadAcq(&g_maps[i]);
+    if (map && haddr - map->direct_base < (uintptr)map->direct_size + PAGE_SIZE)
+      return map;
+  }
+  return NULL;
+}
+
+
+_Thread_local vm_direct_pending_t vm_direct_pending;
+
+
+// direct_defer records a fault at vaddr for vm_direct_complete and makes the page
+// accessible, so that the faulting access completes when the handler returns.
+// Called with the map read-locked.
+static void direct_defer(vm_map_t* map, u64 vaddr, vm_op_t op) {
+  vm_direct_pending_t* p = &vm_direct_pending;
+  trace("defer fault 0x%llx op 0x%x", vaddr, op);
+  safecheckf(p->nfaults < VM_DIRECT_MAXPENDING, "too many pending faults");
+  if UNLIKELY(!vm_direct_back(map, VM_PAGE_ADDR(vaddr), VM_PERM_RW))
+    panic("out of memory: can't access 0x%llx", vaddr);
+  p->vaddr[p->nfaults] = VM_PAGE_ADDR(vaddr);
+  p->op[p->nfaults] = op;
+  p->nfaults++;
+  p->pending = true;
+}
+
+
+// direct_fault handles a fault at vaddr in map's direct window.
+// Returns when the access should be retried.
+static void direct_fault(vm_map_t* map, u64 vaddr) {
+  // page of the previous fault on a backed, read-only page (see below)
+  static _Thread_local u64 lastfault = 0;
+
+  trace("fault 0x%llx", vaddr);
+  if UNLIKELY(vaddr < VM_ADDR_MIN || vaddr >= map->direct_size)
+    panic("invalid address 0x%llx (out of range)", vaddr);
+
+  // The map is locked for writing by another thread, which is changing mappings.
+  // The access is retried when the handler returns.
+  if (!vm_map_tryrlock(map)) {
+    cpu_yield();
+    return;
+  }
+
+  vm_page_t* page = vm_map_lookup(map, VM_VFN(vaddr), /*isaccess*/true);
+  if UNLIKELY(!page) {
+    vm_map_runlock(map);
+    panic("invalid address 0x%llx (not mapped)", vaddr);
+  }
+
+  // The kind of access is not known; a fault is handled as a load unless the page
+  // is already accessible, in which case it can only have been a store.
+  if (page->type == VM_PAGE_T_GUARD) {
+    // map->fault may grow a stack into the guard page
+    direct_defer(map, vaddr, VM_OP_LOAD_1);
+    vm_map_runlock(map);
+    return;
+  }
+
+  vm_page_mark(page, /*written*/false);
+  if (page->hfn == 0) {
+    u64 pressure;
+    if UNLIKELY(!vm_map_back_direct_page(map, VM_VFN(vaddr), page, &pressure)) {
+      direct_defer(map, vaddr, VM_OP_LOAD_1 | VM_OP_F_NOMEM);
+    } else if UNLIKELY(pressure != U64_MAX) {
+      vm_direct_pending.pressure = true;
+      vm_direct_pending.pressure_npages = pressure;
+      vm_direct_pending.pending = true;
+    }
+    vm_map_runlock(map);
+    return;
+  }
+
+  vm_perm_t perm = vm_page_perm(page);
+  vm_map_runlock(map);
+  // The page is backed, so either another thread backed it since the access, or
+  // this is a store to a read-only page. Retrying once tells them apart.
+  // (Pages in the window are never deduplicated, so the store can't be copy-on-write.)
+  if (VM_PERM_CHECK(perm, VM_PERM_RW) || lastfault != VM_PAGE_ADDR(vaddr)) {
+    lastfault = VM_PAGE_ADDR(vaddr);
+    return;
+  }
+  lastfault = 0;
+  panic("store to read-only address 0x%llx", vaddr);
+}
+
+
+// direct_complete_fault completes a fault at vaddr deferred by direct_defer
+static void direct_complete_fault(vm_map_t* map, u64 vaddr, vm_op_t op) {
+  void* haddr = (void*)(map->direct_base + vaddr);
+  bool isguard = (op & VM_OP_F_NOMEM) == 0;
+  u8 saved[PAGE_SIZE];
+  if (isguard) {
+    // Hide the guard page again while map->fault looks at it. If the stack grows
+    // into the page, what the access stored there is put back in its place.
+    memcpy(saved, haddr, PAGE_SIZE);
+    vm_direct_release(map, vaddr, 1);
+    if (!map->fault || !map->fault(map->fault_ctx, vaddr, op))
+      panic("access to guard page at 0x%llx", vaddr);
+  }
+
+  // Back the page for real, charging it to the map (which may call map->pressure)
+  vm_map_rlock(map);
+  vm_page_t* page = vm_map_lookup(map, VM_VFN(vaddr), /*isaccess*/true);
+  bool ok = page && (
+    page->type == VM_PAGE_T_GUARD || page->hfn ||
+    vm_map_back_page(map, VM_VFN(vaddr), page) );
+  if (ok && isguard && page->type != VM_PAGE_T_GUARD)
+    memcpy(haddr, saved, PAGE_SIZE);
+  vm_map_runlock(map);
+  if LIKELY(ok)
+    return;
+
+  // Out of memory. Discard the page, unless another thread managed to back it.
+  vm_map_lock(map);
+  page = vm_map_lookup(map, VM_VFN(vaddr), /*isaccess*/false);
+  if (!page || page->hfn == 0)
+    vm_direct_release(map, vaddr, 1);
+  vm_map_unlock(map);
+  if (map->fault && map->fault(map->fault_ctx, vaddr, op | VM_OP_F_NOMEM))
+    return;
+  panic("out of memory: no backing page for 0x%llx", vaddr);
+}
+
+
+void vm_direct_complete(vm_map_t* map) {
+  // clear the pending faults first; map->fault may not return
+  vm_direct_pending_t p = vm_direct_pending;
+  memset(&vm_direct_pending, 0, sizeof(vm_direct_pending));
+  if (p.pressure && map->pressure)
+    map->pressure(map->pressure_ctx, p.pressure_npages, /*hard*/false);
+  for (u32 i = 0; i < p.nfaults; i++)
+    direct_complete_fault(map, p.vaddr[i], p.op[i]);
+}
+
+
+static void direct_sighandler(int sig, siginfo_t* si, void* uctx) {
+  uintptr haddr = (uintptr)si->si_addr;
+  vm_map_t* map = direct_find(haddr);
+  if LIKELY(map)
+    return direct_fault(map, (u64)(haddr - map->direct_base));
+
+  // not ours; chain to the previous handler
+  struct sigaction* prev = (sig == SIGBUS) ? &g_prev_sigbus : &g_prev_sigsegv;
+  if (prev->sa_flags & SA_SIGINFO) {
+    prev->sa_sigaction(sig, si, uctx);
+  } else if (prev->sa_handler == SIG_DFL || prev->sa_handler == SIG_IGN) {
+    // restore the default action; the faulting instruction runs again and crashes
+    signal(sig, SIG_DFL);
+  } else {
+    prev->sa_handler(sig);
+  }
+}
+
+
+static void direct_install_sighandler() {
+  u32 state = 0;
+  if (!AtomicCAS(&g_sigstate, &state, 1, memory_order_acquire, memory_order_acquire)) {
+    while (AtomicLoadAcq(&g_sigstate) != 2)
+      cpu_yield();
+    return;
+  }
+  struct sigaction sa = {0};
+  sa.sa_sigaction = direct_sighandler;
+  sa.sa_flags = SA_SIGINFO; // the handler returns; it never unwinds (see top of file)
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGSEGV, &sa, &g_prev_sigsegv);
+  sigaction(SIGBUS, &sa, &g_prev_sigbus);
+  AtomicStoreRel(&g_sigstate, 2);
+}
+
+
+rerr_t vm_map_direct_init(vm_map_t* map, u32 addrbits) {
+  if (addrbits < VM_DIRECT_MINBITS || addrbits > VM_DIRECT_MAXBITS)
+    return rerr_invalid;
+  if (os_pagesize() != PAGE_SIZE)
+    return rerr_not_supported;
+  if (map->direct_size || map->root_nuse)
+    return rerr_exists;
+
+  // reserve the window, plus a guard page for accesses straddling its end
+  u64 size = 1llu << addrbits;
+  void* p = mmap(NULL, (usize)size + PAGE_SIZE, PROT_NONE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED)
+    return rerr_nomem;
+
+  u32 i = 0;
+  for (; i < VM_DIRECT_MAXMAPS; i++) {
+    vm_map_t* free = NULL;
+    if (AtomicCAS(&g_maps[i], &free, map, memory_order_acq_rel, memory_order_relaxed))
+      break;
+  }
+  if (i == VM_DIRECT_MAXMAPS) {
+    munmap(p, (usize)size + PAGE_SIZE);
+    return rerr_overflow;
+  }
+
+  map->direct_base = (uintptr)p;
+  map->direct_size = size;
+  direct_install_sighandler();
+  trace("window %p…%p", p, (char*)p + size);
+  return 0;
+}
+
+
+void vm_direct_dispose(vm_map_t* map) {
+  for (u32 i = 0; i < VM_DIRECT_MAXMAPS; i++) {
+    vm_map_t* expect = map;
+    if (AtomicCAS(&g_maps[i], &expect, NULL, memory_order_acq_rel, memory_order_relaxed))
+      break;
+  }
+  munmap((void*)map->direct_base, (usize)map->direct_size + PAGE_SIZE);
+  map->direct_base = 0;
+  map->direct_size = 0;
+}
+
+
+bool vm_direct_back(vm_map_t* map, u64 vaddr, vm_perm_t perm) {
+  assert(vaddr < map->direct_size);
+  int prot = (perm & VM_PERM_W) ? PROT_READ | PROT_WRITE :
+             (perm & VM_PERM_R) ? PROT_READ :
+             PROT_NONE;
+  return mprotect((void*)(map->direct_base + vaddr), PAGE_SIZE, prot) == 0;
+}
+
+
+void vm_direct_release(vm_map_t* map, u64 vaddr, u64 npages) {
+  if (vaddr >= map->direct_size)
+    return;
+  u64 size = MIN(npages * PAGE_SIZE, map->direct_size - vaddr);
+  // replacing the pages with a new reservation discards their memory
+  void* p = mmap((void*)(map->direct_base + vaddr), (usize)size, PROT_NONE,
+    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  safecheckf(p != MAP_FAILED, "mmap");
+}
+
+
+#else // !VM_DIRECT_SUPPORTED
+
+_Thread_local vm_direct_pending_t vm_direct_pending;
+
+void vm_direct_complete(vm_map_t* map) {}
+
+rerr_t vm_map_direct_init(vm_map_t* map, u32 addrbits) {
+  return rerr_not_supported;
+}
+
+void vm_direct_dispose(vm_map_t* map) {}
+
+bool vm_direct_back(vm_map_t* map, u64 vaddr, vm_perm_t perm) {
+  return false;
+}
+
+void vm_direct_release(vm_map_t* map, u64 vaddr, u64 npages) {}
+
+#endif // VM_DIRECT_SUPPORTED
@@ -0,0 +1,443 @@
+// virtual memory page deduplication ("samepage merging")
+// SPDX-License-Identifier: Apache-2.0
+//
+// Machines created from the same ROM often have pages with identical contents.
+// A scan (rmm_ksm_scan) hashes the resident pages of all maps using a rmm_t and
+// merges pages with identical contents into one shared host page, which is mapped
+// read-only (VM_PAGE_T_COW) into every map that had a copy. The first store to a
+// shared page faults and vm_ksm_cow gives the map a private copy again.
+//
+// Only pages whose backing belongs to the map (vm_page_t.purgeable) are merged,
+// since only those can be released one by one; pages mapped with an explicit
+// host address are part of some larger allocation owned by someone else.
+//
+// A page is merged only if it has not been written to since the previous scan,
+// which keeps frequently-written pages from bouncing between shared and private.
+// A scan clears vm_page_t.written of all pages it looks at and increments
+// vm_map_t.gen, which makes users drop their translation caches so that the
+// next write to any page is observed (written is set on a store cache miss.)
+//
+// Since there's no way to reach into the translation caches of machines while
+// they execute, a scan must not run concurrently with guest execution on the
+// maps involved. Machines pick up the new translations via vm_map_t.gen.
+// vm_ksm_cow, which gives a map a private copy of a page, instead records the page
+// in vm_map_t.cowlog, since other threads executing code of the map may have cached
+// the shared page for loads. They invalidate just that page at their next
+// preemption point (see m_vm_sync_cow.)
+//
+#include "rsmimpl.h"
+#include "vm.h"
+#include "hash.h"
+
+// VM_KSM_TRACE: define to enable logging a lot of info via dlog
+//#define VM_KSM_TRACE
+
+#if (defined(VM_KSM_TRACE) || defined(VM_TRACE)) && defined(DEBUG)
+  #define trace(fmt, args...) dlog("[vm_ksm] " fmt, ##args)
+#else
+  #ifdef VM_KSM_TRACE
+    #warning VM_KSM_TRACE has no effect unless DEBUG is enabled
+    #undef VM_KSM_TRACE
+  #endif
+  #define trace(...) ((void)0)
+#endif
+
+// VM_KSM_MAXMAPS: maximum number of maps taking part in deduplication
+#define VM_KSM_MAXMAPS 250
+
+// ksm_ent_t is an entry of a ksm_tab_t
+typedef struct {
+  u64                 hash;  // hash of page contents
+  uintptr             haddr; // host page address (0 for free slots)
+  vm_page_t* nullable pte;   // candidate: PTE of the page (only valid during a scan)
+  union {
+    u64       refs; // shared: number of PTEs referencing haddr
+    vm_map_t* map;  // candidate: map of pte
+  };
+} ksm_ent_t;
+
+// ksm_tab_t is an open-addressing hash table of pages, keyed by page contents
+typedef struct {
+  ksm_ent_t* nullable v;
+  u32                 cap; // power of two
+  u32                 len;
+} ksm_tab_t;
+
+struct vm_ksm_ {
+  rmm_t*    mm;
+  mutex_t   lock;   // protects all fields of vm_ksm_t
+  ksm_tab_t shared; // pages shared by at least one PTE
+  u64       seed;   // hash seed
+  u64       nmerged; // number of PTEs referencing shared pages
+  u32       nmaps;
+  vm_map_t* maps[VM_KSM_MAXMAPS];
+};
+static_assert(sizeof(vm_ksm_t) <= PAGE_SIZE, "");
+
+
+static u64 ksm_hash(const vm_ksm_t* ksm, uintptr haddr) {
+  return (u64)hash_mem((const void*)haddr, PAGE_SIZE, (hash_t)ksm->seed);
+}
+
+
+static void ksm_tab_dispose(rmm_t* mm, ksm_tab_t* tab) {
+  if (tab->v)
+    rmm_freepages(mm, tab->v, ((usize)tab->cap * sizeof(ksm_ent_t)) / PAGE_SIZE);
+  tab->v = NULL;
+  tab->cap = 0;
+  tab->len = 0;
+}
+
+
+// ksm_tab_find returns the entry of a page with the same contents as haddr
+static ksm_ent_t* nullable ksm_tab_find(ksm_tab_t* tab, u64 hash, uintptr haddr) {
+  if (tab->len == 0)
+    return NULL;
+  u32 mask = tab->cap - 1;
+  for (u32 i = (u32)hash & mask; tab->v[i].haddr; i = (i + 1) & mask) {
+    ksm_ent_t* e = &tab->v[i];
+    if (e->hash == hash && memcmp((void*)e->haddr, (void*)haddr, PAGE_SIZE) == 0)
+      return e;
+  }
+  return NULL;
+}
+
+
+// ksm_tab_find_haddr returns the entry for host page haddr with contents hash
+static ksm_ent_t* nullable ksm_tab_find_haddr(ksm_tab_t* tab, u64 hash, uintptr haddr) {
+  if (tab->len == 0)
+    return NULL;
+  u32 mask = tab->cap - 1;
+  for (u32 i = (u32)hash & mask; tab->v[i].haddr; i = (i + 1) & mask) {
+    if (tab->v[i].haddr == haddr)
+      return &tab->v[i];
+  }
+  return NULL;
+}
+
+
+static void ksm_tab_insert1(ksm_tab_t* tab, const ksm_ent_t* e) {
+  u32 mask = tab->cap - 1;
+  u32 i = (u32)e->hash & mask;
+  while (tab->v[i].haddr)
+    i = (i + 1) & mask;
+  tab->v[i] = *e;
+  tab->len++;
+}
+
+
+static bool ksm_tab_insert(rmm_t* mm, ksm_tab_t* tab, const ksm_ent_t* e) {
+  // grow at 75% load
+  if ((tab->len + 1) * 4 > tab->cap * 3) {
+    u32 newcap = tab->cap ? tab->cap * 2 : PAGE_SIZE / sizeof(ksm_ent_t);
+    usize npages = ((usize)newcap * sizeof(ksm_ent_t)) / PAGE_SIZE;
+    ksm_ent_t* newv = rmm_allocpages(mm, npages);
+    if UNLIKELY(!newv)
+      return false;
+    memset(newv, 0, npages * PAGE_SIZE);
+    ksm_tab_t old = *tab;
+    tab->v = newv;
+    tab->cap = newcap;
+    tab->len = 0;
+    for (u32 i = 0; i < old.cap; i++) {
+      if (old.v[i].haddr)
+        ksm_tab_insert1(tab, &old.v[i]);
+    }
+    ksm_tab_dispose(mm, &old);
+  }
+  ksm_tab_insert1(tab, e);
+  return true;
+}
+
+
+// ksm_tab_del removes e from tab, shifting back entries of its probe sequence
+static void ksm_tab_del(ksm_tab_t* tab, ksm_ent_t* e) {
+  u32 mask = tab->cap - 1;
+  u32 i = (u32)(e - tab->v);
+  for (u32 j = (i + 1) & mask; tab->v[j].haddr; j = (j + 1) & mask) {
+    u32 home = (u32)tab->v[j].hash & mask;
+    // move entry j into the hole at i if its home slot is not within (i, j]
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      tab->v[i] = tab->v[j];
+      i = j;
+    }
+  }
+  tab->v[i].haddr = 0;
+  tab->len--;
+}
+
+
+rerr_t rmm_ksm_enable(rmm_t* mm) {
+  if (rmm_ksm(mm))
+    return 0;
+  vm_ksm_t* ksm = rmm_allocpages(mm, 1);
+  if (!ksm)
+    return rerr_nomem;
+  memset(ksm, 0, sizeof(*ksm));
+  rerr_t err = mutex_init(&ksm->lock);
+  if UNLIKELY(err) {
+    rmm_freepages(mm, ksm, 1);
+    return err;
+  }
+  ksm->mm = mm;
+  ksm->seed = fastrand();
+  rmm_set_ksm(mm, ksm);
+  return 0;
+}
+
+
+void vm_ksm_register(vm_ksm_t* ksm, vm_map_t* map) {
+  mutex_lock(&ksm->lock);
+  if (ksm->nmaps < VM_KSM_MAXMAPS) {
+    ksm->maps[ksm->nmaps++] = map;
+    map->ksm = ksm;
+  } else {
+    dlog("[vm_ksm] too many maps; map %p does not take part in deduplication", map);
+  }
+  mutex_unlock(&ksm->lock);
+}
+
+
+// ksm_unshare drops a PTE's reference to shared page e, freeing it if unused
+static void ksm_unshare(vm_ksm_t* ksm, ksm_ent_t* e, bool freepage) {
+  assert(e->refs > 0);
+  ksm->nmerged--;
+  if (--e->refs > 0)
+    return;
+  if (freepage)
+    rmm_freepages(ksm->mm, (void*)e->haddr, 1);
+  ksm_tab_del(&ksm->shared, e);
+}
+
+
+// ksm_release_page drops the reference of a VM_PAGE_T_COW page, leaving it unbacked
+static void ksm_release_page(vm_ksm_t* ksm, vm_page_t* page) {
+  uintptr haddr = (uintptr)vm_page_haddr(page);
+  ksm_ent_t* e = ksm_tab_find_haddr(&ksm->shared, ksm_hash(ksm, haddr), haddr);
+  assertf(e, "shared page %p not found", (void*)haddr);
+  if (e)
+    ksm_unshare(ksm, e, true);
+  vm_page_set_haddr(page, 0);
+}
+
+
+static void ksm_unregister_ptab(vm_ksm_t* ksm, vm_ptab_t ptab, u32 level) {
+  for (u32 i = 0; i < VM_PTAB_LEN; i++) {
+    if (*(u64*)&ptab[i] == 0)
+      continue;
+    if (level < VM_PTAB_LEVELS-1) {
+      ksm_unregister_ptab(ksm, vm_table_ptab(&ptab[i].table), level+1);
+      continue;
+    }
+    vm_page_t* page = &ptab[i].page;
+    if (page->type == VM_PAGE_T_COW && page->hfn)
+      ksm_release_page(ksm, page);
+  }
+}
+
+
+void vm_ksm_unregister(vm_ksm_t* ksm, vm_map_t* map) {
+  mutex_lock(&ksm->lock);
+  for (u32 i = 0; i < ksm->nmaps; i++) {
+    if (ksm->maps[i] == map) {
+      ksm->maps[i] = ksm->maps[--ksm->nmaps];
+      break;
+    }
+  }
+  vm_map_lock(map);
+  ksm_unregister_ptab(ksm, map->root, 0);
+  vm_map_unlock(map);
+  map->ksm = NULL;
+  mutex_unlock(&ksm->lock);
+}
+
+
+// ksm_share makes page of map reference shared page e, releasing page's own
+// backing page. The backing page is no longer charged to map.
+static void ksm_share(vm_ksm_t* ksm, ksm_ent_t* e, vm_map_t* map, vm_page_t* page) {
+  uintptr haddr = (uintptr)vm_page_haddr(page);
+  if (haddr != e->haddr) {
+    rmm_freepages(ksm->mm, (void*)haddr, 1);
+    vm_page_set_haddr(page, e->haddr);
+  }
+  page->write = false;
+  page->purgeable = false; // backing belongs to ksm now
+  page->type = VM_PAGE_T_COW;
+  e->refs++;
+  ksm->nmerged++;
+  vm_map_uncharge(map, 1);
+}
+
+
+typedef struct {
+  vm_map_t* map;        // map being scanned
+  ksm_tab_t candidates; // pages seen during this scan which are not shared
+  u64       nscanned;
+  u64       nmerged;
+} scanctx_t;
+
+
+static void ksm_scan_page(vm_ksm_t* ksm, scanctx_t* ctx, vm_page_t* page) {
+  if (page->hfn == 0 || !page->purgeable || page->uncacheable ||
+      page->type != VM_PAGE_T_NORMAL || vm_page_perm(page) != VM_PERM_RW)
+  {
+    return;
+  }
+  if (page->written) {
+    // written since the last scan; check again on the next scan
+    page->written = false;
+    return;
+  }
+
+  ctx->nscanned++;
+  uintptr haddr = (uintptr)vm_page_haddr(page);
+  u64 hash = ksm_hash(ksm, haddr);
+
+  // a page with the same contents is already shared
+  ksm_ent_t* e = ksm_tab_find(&ksm->shared, hash, haddr);
+  if (e) {
+    ksm_share(ksm, e, ctx->map, page);
+    ctx->nmerged++;
+    return;
+  }
+
+  // another page seen during this scan has the same contents; share that page
+  ksm_ent_t* c = ksm_tab_find(&ctx->candidates, hash, haddr);
+  if (c) {
+    ksm_ent_t ent = { .hash = hash, .haddr = c->haddr };
+    if UNLIKELY(!ksm_tab_insert(ksm->mm, &ksm->shared, &ent))
+      return;
+    e = assertnotnull(ksm_tab_find_haddr(&ksm->shared, hash, c->haddr));
+    ksm_share(ksm, e, c->map, assertnotnull(c->pte));
+    ksm_share(ksm, e, ctx->map, page);
+    ksm_tab_del(&ctx->candidates, c);
+    ctx->nmerged += 2;
+    return;
+  }
+
+  ksm_ent_t ent = { .hash = hash, .haddr = haddr, .pte = page, .map = ctx->map };
+  ksm_tab_insert(ksm->mm, &ctx->candidates, &ent); // ok to fail; just a missed chance
+}
+
+
+static void ksm_scan_ptab(vm_ksm_t* ksm, scanctx_t* ctx, vm_ptab_t ptab, u32 level) {
+  for (u32 i = 0; i < VM_PTAB_LEN; i++) {
+    if (*(u64*)&ptab[i] == 0)
+      continue;
+    if (level < VM_PTAB_LEVELS-1) {
+      ksm_scan_ptab(ksm, ctx, vm_table_ptab(&ptab[i].table), level+1);
+    } else {
+      ksm_scan_page(ksm, ctx, &ptab[i].page);
+    }
+  }
+}
+
+
+size_t rmm_ksm_scan(rmm_t* mm) {
+  vm_ksm_t* ksm = rmm_ksm(mm);
+  if (!ksm)
+    return 0;
+
+  scanctx_t ctx = {0};
+
+  mutex_lock(&ksm->lock);
+  for (u32 i = 0; i < ksm->nmaps; i++)
+    vm_map_lock(ksm->maps[i]);
+
+  for (u32 i = 0; i < ksm->nmaps; i++) {
+    ctx.map = ksm->maps[i];
+    ksm_scan_ptab(ksm, &ctx, ctx.map->root, 0);
+  }
+
+  // Translations changed and written bits were cleared.
+  // Make users of the maps drop their translation caches.
+  for (u32 i = 0; i < ksm->nmaps; i++) {
+    AtomicAdd(&ksm->maps[i]->gen, 1, memory_order_release);
+    vm_map_unlock(ksm->maps[i]);
+  }
+
+  ksm_tab_dispose(mm, &ctx.candidates);
+
+  usize saved = (usize)(ksm->nmerged - ksm->shared.len) * PAGE_SIZE;
+  dlog("[vm_ksm] scanned %llu pages in %u maps, merged %llu;"
+    " %u shared pages referenced %llu times (%zu kB saved)",
+    ctx.nscanned, ksm->nmaps, ctx.nmerged, ksm->shared.len, ksm->nmerged, saved/1024);
+
+  mutex_unlock(&ksm->lock);
+  return saved;
+}
+
+
+void vm_ksm_release(vm_map_t* map, u64 vaddr, u64 npages) {
+  vm_ksm_t* ksm = map->ksm;
+  if (!ksm)
+    return;
+  mutex_lock(&ksm->lock);
+  vm_map_lock(map);
+  for (u64 vfn = VM_VFN(vaddr), end = vfn + npages; vfn < end; vfn++) {
+    vm_page_t* page = vm_map_access(map, vfn, /*isaccess*/false);
+    if (page && page->type == VM_PAGE_T_COW && page->hfn)
+      ksm_release_page(ksm, page);
+  }
+  vm_map_unlock(map);
+  mutex_unlock(&ksm->lock);
+}
+
+
+rerr_t vm_ksm_cow(vm_map_t* map, u64 vaddr) {
+  vm_ksm_t* ksm = map->ksm;
+  if (!ksm)
+    return rerr_not_found;
+
+  rerr_t err = rerr_not_found;
+  mutex_lock(&ksm->lock);
+  vm_map_lock(map);
+
+  vm_page_t* page = vm_map_access(map, VM_VFN(vaddr), /*isaccess*/false);
+  if (!page || page->type != VM_PAGE_T_COW) {
+    // not a shared page, or another M already made a copy
+    if (page && page->write)
+      err = 0;
+    goto end;
+  }
+
+  uintptr shared = (uintptr)vm_page_haddr(page);
+  ksm_ent_t* e = ksm_tab_find_haddr(&ksm->shared, ksm_hash(ksm, shared), shared);
+  assertf(e, "shared page %p not found", (void*)shared);
+  if UNLIKELY(!e)
+    goto end;
+
+  // the private page is charged to map, whether it's a copy or the shared page
+  if ((err = vm_map_charge(map, 1)))
+    goto end;
+
+  if (e->refs == 1) {
+    // last reference; take the shared page over
+    ksm_unshare(ksm, e, false);
+  } else {
+    void* haddr = rmm_allocpages(ksm->mm, 1);
+    if UNLIKELY(!haddr) {
+      vm_map_uncharge(map, 1);
+      err = rerr_nomem;
+      goto end;
+    }
+    memcpy(haddr, (void*)shared, PAGE_SIZE);
+    ksm_unshare(ksm, e, true);
+    vm_page_set_haddr(page, (u64)(uintptr)haddr);
+    // users of map may have cached the translation of the shared page
+    u32 cowgen = AtomicLoad(&map->cowgen, memory_order_relaxed);
+    map->cowlog[cowgen & (VM_COWLOG_LEN - 1)] = VM_PAGE_ADDR(vaddr);
+    AtomicStoreRel(&map->cowgen, cowgen + 1);
+  }
+  trace("copy-on-write %012llx (%p -> %p)", VM_PAGE_ADDR(vaddr),
+    (void*)shared, (void*)vm_page_haddr(page));
+
+  page->type = VM_PAGE_T_NORMAL;
+  page->write = true;
+  page->purgeable = true;
+
+end:
+  vm_map_unlock(map);
+  mutex_unlock(&ksm->lock);
+  return err;
+}
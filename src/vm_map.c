@@ -23,18 +23,48 @@
 #endif
 
 
-vm_ptab_t nullable vm_ptab_alloc(rmm_t* mm) {
-  // note: VM_PTAB_SIZE is always a multiple of PAGE_SIZE
-  vm_ptab_t ptab = rmm_allocpages(mm, (usize)VM_PTAB_SIZE / PAGE_SIZE);
-  if UNLIKELY(ptab == NULL)
-    return NULL;
+// ptab_cache_next accesses the link of a page table in vm_map_t.ptab_cache
+#define ptab_cache_next(ptab)  (*(vm_ptab_t*)(ptab))
+
+
+vm_ptab_t nullable vm_ptab_alloc(vm_map_t* map, u32 level) {
+  vm_ptab_t ptab = map->ptab_cache;
+  if (ptab) {
+    map->ptab_cache = ptab_cache_next(ptab);
+    map->ptab_ncache--;
+  } else {
+    // note: VM_PTAB_SIZE is always a multiple of PAGE_SIZE
+    ptab = rmm_allocpages(map->mm, (usize)VM_PTAB_SIZE / PAGE_SIZE);
+    if UNLIKELY(ptab == NULL)
+      return NULL;
+  }
   memset(ptab, 0, VM_PTAB_SIZE);
+  map->ptab_count[level]++;
   return ptab;
 }
 
 
-void vm_ptab_free(rmm_t* mm, vm_ptab_t ptab) {
-  rmm_freepages(mm, ptab, (usize)VM_PTAB_SIZE / PAGE_SIZE);
+void vm_ptab_free(vm_map_t* map, vm_ptab_t ptab, u32 level) {
+  assert(map->ptab_count[level] > 0);
+  map->ptab_count[level]--;
+  if (map->ptab_ncache < VM_PTAB_CACHE_MAX) {
+    ptab_cache_next(ptab) = map->ptab_cache;
+    map->ptab_cache = ptab;
+    map->ptab_ncache++;
+    return;
+  }
+  rmm_freepages(map->mm, ptab, (usize)VM_PTAB_SIZE / PAGE_SIZE);
+}
+
+
+// vm_ptab_cache_release frees all page tables in map's cache
+static void vm_ptab_cache_release(vm_map_t* map) {
+  while (map->ptab_cache) {
+    vm_ptab_t ptab = map->ptab_cache;
+    map->ptab_cache = ptab_cache_next(ptab);
+    rmm_freepages(map->mm, ptab, (usize)VM_PTAB_SIZE / PAGE_SIZE);
+  }
+  map->ptab_ncache = 0;
 }
 
 
@@ -42,15 +72,34 @@ rerr_t vm_map_init(vm_map_t* map, rmm_t* mm) {
   rerr_t err = rwmutex_init(&map->lock);
   if UNLIKELY(err)
     return err;
-  vm_ptab_t ptab = vm_ptab_alloc(mm); // root page table
+  map->mm = mm;
+  map->ptab_cache = NULL;
+  map->ptab_ncache = 0;
+  memset(map->ptab_count, 0, sizeof(map->ptab_count));
+  vm_ptab_t ptab = vm_ptab_alloc(map, 0); // root page table
   if UNLIKELY(!ptab) {
     trace("failed to allocate root page table");
     return rerr_nomem;
   }
   trace("allocated root vm_ptab_t %p", ptab);
   map->root = ptab;
-  map->mm = mm;
   map->min_free_vfn = 0;
+  map->fault = NULL;
+  map->fault_ctx = NULL;
+  map->faultaround = VM_FAULTAROUND_DEFAULT;
+  map->gen = 0;
+  map->cowgen = 0;
+  map->ksm = NULL;
+  map->npages = 0;
+  map->soft_limit = 0;
+  map->hard_limit = 0;
+  map->pressure = NULL;
+  map->pressure_ctx = NULL;
+  map->direct_base = 0;
+  map->direct_size = 0;
+  vm_ksm_t* ksm = rmm_ksm(mm);
+  if (ksm)
+    vm_ksm_register(ksm, map);
   return 0;
 }
 
@@ -82,30 +131,241 @@ static void vm_ptab_dispose(rmm_t* mm, vm_ptab_t ptab, u32 nuse, u32 level, u64
     }
   }
 
-  vm_ptab_free(mm, ptab);
+  rmm_freepages(mm, ptab, (usize)VM_PTAB_SIZE / PAGE_SIZE);
 }
 
 
 void vm_map_dispose(vm_map_t* map) {
   assert(!rwmutex_isrlocked(&map->lock)); // map should not be locked
+  if (map->ksm)
+    vm_ksm_unregister(map->ksm, map);
   rwmutex_dispose(&map->lock);
   vm_ptab_dispose(map->mm, map->root, map->root_nuse, 0, 0);
+  vm_ptab_cache_release(map);
+  if (map->direct_size)
+    vm_direct_dispose(map);
+}
+
+
+// clear_ptab zeroes ptab (at level), freeing its subtables and the backing pages
+// which belong to the map. Returns the number of charged pages released.
+static u64 clear_ptab(vm_map_t* map, vm_ptab_t ptab, u32 level) {
+  u64 nreleased = 0;
+  for (u32 i = 0; i < VM_PTAB_LEN; i++) {
+    if (*(u64*)&ptab[i] == 0)
+      continue;
+    if (level < VM_PTAB_LEVELS-1) {
+      vm_ptab_t subptab = vm_table_ptab(&ptab[i].table);
+      nreleased += clear_ptab(map, subptab, level+1);
+      vm_ptab_free(map, subptab, level+1);
+      continue;
+    }
+    vm_page_t* page = &ptab[i].page;
+    if (page->hfn == 0)
+      continue;
+    uintptr haddr = (uintptr)vm_page_haddr(page);
+    if (page->purgeable) {
+      rmm_freepages(map->mm, (void*)haddr, 1);
+      nreleased++;
+    } else if (haddr - map->direct_base < (uintptr)map->direct_size) {
+      nreleased++;
+    }
+  }
+  memset(ptab, 0, VM_PTAB_SIZE);
+  return nreleased;
+}
+
+
+void vm_map_clear(vm_map_t* map) {
+  // drop references to deduplicated pages
+  vm_ksm_t* ksm = map->ksm;
+  if (ksm)
+    vm_ksm_unregister(ksm, map);
+
+  vm_map_lock(map);
+  u64 nreleased = clear_ptab(map, map->root, 0);
+  map->root_nuse = 0;
+  map->min_free_vfn = 0;
+  if (map->direct_size)
+    vm_direct_release(map, 0, map->direct_size / PAGE_SIZE);
+  vm_map_uncharge(map, nreleased);
+  AtomicAdd(&map->gen, 1, memory_order_release); // invalidate vm_caches
+  vm_map_unlock(map);
+
+  if (ksm)
+    vm_ksm_register(ksm, map);
+}
+
+
+// compact_table frees the subtables of table (at level) which have no entries.
+// Returns the number of tables freed.
+static usize compact_table(vm_map_t* map, vm_table_t* table, u32 level) {
+  vm_ptab_t ptab = vm_table_ptab(table);
+  usize nfreed = 0;
+  for (u32 i = 0; i < VM_PTAB_LEN; i++) {
+    vm_table_t* subtable = &ptab[i].table;
+    vm_ptab_t subptab = vm_table_ptab(subtable);
+    if (!subptab)
+      continue;
+    if (level+1 < VM_PTAB_LEVELS-1 && subtable->nuse > 0)
+      nfreed += compact_table(map, subtable, level+1);
+    if (subtable->nuse == 0) {
+      trace("compact: free empty L%u table %p", level+2, subptab);
+      vm_ptab_free(map, subptab, level+1);
+      *(u64*)subtable = 0;
+      assert(table->nuse > 0);
+      table->nuse--;
+      nfreed++;
+    }
+  }
+  return nfreed;
 }
 
 
-static u64 alloc_backing_page(vm_map_t* map) {
+usize vm_map_compact(vm_map_t* map) {
+  vm_map_assert_locked(map);
+  usize nfreed = map->ptab_ncache;
+  vm_table_t root = { .nuse = map->root_nuse };
+  vm_table_set_ptab(&root, map->root);
+  nfreed += compact_table(map, &root, 0);
+  map->root_nuse = root.nuse;
+  vm_ptab_cache_release(map);
+  trace("compact: freed %zu page tables", nfreed);
+  return nfreed * VM_PTAB_SIZE;
+}
+
+
+// map_charge charges npages to map, unless that would exceed its hard limit.
+// *prevp is set to the number of pages charged before. Doesn't call map->pressure.
+static bool map_charge(vm_map_t* map, u64 npages, u64* prevp) {
+  u64 hard = AtomicLoad(&map->hard_limit, memory_order_relaxed);
+  u64 prev = AtomicAdd(&map->npages, npages, memory_order_relaxed);
+  *prevp = prev;
+  if LIKELY(hard == 0 || prev + npages <= hard)
+    return true;
+  AtomicSub(&map->npages, npages, memory_order_relaxed);
+  trace("charging %llu pages would exceed hard limit (%llu of %llu pages used)",
+    npages, prev, hard);
+  return false;
+}
+
+
+// map_crosses_soft returns true if charging npages on top of prev crossed
+// map's soft limit
+inline static bool map_crosses_soft(vm_map_t* map, u64 prev, u64 npages) {
+  u64 soft = AtomicLoad(&map->soft_limit, memory_order_relaxed);
+  return soft && prev < soft && prev + npages >= soft;
+}
+
+
+rerr_t vm_map_charge(vm_map_t* map, u64 npages) {
+  for (bool retry = true; ; retry = false) {
+    u64 prev;
+    if LIKELY(map_charge(map, npages, &prev)) {
+      if UNLIKELY(map_crosses_soft(map, prev, npages) && map->pressure)
+        map->pressure(map->pressure_ctx, prev, /*hard*/false);
+      return 0;
+    }
+    if (!retry || !map->pressure)
+      return rerr_nomem;
+    map->pressure(map->pressure_ctx, prev, /*hard*/true);
+  }
+}
+
+
+void vm_map_uncharge(vm_map_t* map, u64 npages) {
+  UNUSED u64 prev = AtomicSub(&map->npages, npages, memory_order_relaxed);
+  assertf(prev >= npages, "uncharge %llu > npages %llu", npages, prev);
+}
+
+
+u64 vm_map_alloc_backing(vm_map_t* map) {
+  if UNLIKELY(vm_map_charge(map, 1))
+    return 0;
   void* haddr = rmm_allocpages(map->mm, 1);
   if UNLIKELY(!haddr) {
     trace("FAILED to allocate backing page");
-    panic("TODO: purge a least-recently-used page");
+    vm_map_uncharge(map, 1);
+    return 0;
   }
   trace("allocated backing page %p", haddr);
   return (u64)haddr;
 }
 
 
-// vm_map_access returns the page table entry of a Virtual Frame Number
-vm_page_t* nullable vm_map_access(vm_map_t* map, u64 vfn, bool isaccess) {
+// install_backing makes haddr the backing page of page, a lazily-backed page, unless
+// another thread backed it first, in which case haddr is freed and uncharged.
+static void install_backing(vm_map_t* map, vm_page_t* page, u64 haddr, bool direct) {
+  // Other threads may back the same page, or mark it accessed, at the same time
+  // (the map is only read-locked), so install the backing page with CAS.
+  _Atomic(u64)* pte = (_Atomic(u64)*)page;
+  union { vm_page_t page; u64 u; } newpte;
+  u64 old = AtomicLoad(pte, memory_order_relaxed);
+  for (;;) {
+    newpte.u = old;
+    if (newpte.page.hfn != 0) {
+      // another thread won; drop our backing page
+      trace("page %p backed concurrently", (void*)(uintptr)haddr);
+      if (!direct)
+        rmm_freepages(map->mm, (void*)(uintptr)haddr, 1);
+      vm_map_uncharge(map, 1);
+      return;
+    }
+    vm_page_set_haddr(&newpte.page, haddr);
+    newpte.page.purgeable = !direct; // direct window memory is not rmm memory
+    if (AtomicCAS(pte, &old, newpte.u, memory_order_release, memory_order_relaxed))
+      return;
+  }
+}
+
+
+bool vm_map_back_page(vm_map_t* map, u64 vfn, vm_page_t* page) {
+  assert(page->type != VM_PAGE_T_GUARD);
+  u64 vaddr = VM_VFN_VADDR(vfn);
+  u64 haddr;
+
+  // in the direct window, the backing page is at a fixed host address
+  bool direct = vaddr < map->direct_size;
+  if (direct) {
+    if UNLIKELY(vm_map_charge(map, 1))
+      return false;
+    if UNLIKELY(!vm_direct_back(map, vaddr, vm_page_perm(page))) {
+      vm_map_uncharge(map, 1);
+      return false;
+    }
+    haddr = (u64)map->direct_base + vaddr;
+  } else {
+    haddr = vm_map_alloc_backing(map);
+    if UNLIKELY(haddr == 0)
+      return false;
+  }
+
+  install_backing(map, page, haddr, direct);
+  return true;
+}
+
+
+bool vm_map_back_direct_page(vm_map_t* map, u64 vfn, vm_page_t* page, u64* pressurep) {
+  assert(page->type != VM_PAGE_T_GUARD);
+  u64 vaddr = VM_VFN_VADDR(vfn);
+  assert(vaddr < map->direct_size);
+  u64 prev;
+  *pressurep = U64_MAX;
+  if UNLIKELY(!map_charge(map, 1, &prev))
+    return false;
+  if UNLIKELY(!vm_direct_back(map, vaddr, vm_page_perm(page))) {
+    vm_map_uncharge(map, 1);
+    return false;
+  }
+  if UNLIKELY(map_crosses_soft(map, prev, 1))
+    *pressurep = prev;
+  install_backing(map, page, (u64)map->direct_base + vaddr, /*direct*/true);
+  return true;
+}
+
+
+// vm_map_lookup returns the page table entry of a Virtual Frame Number
+vm_page_t* nullable vm_map_lookup(vm_map_t* map, u64 vfn, bool isaccess) {
   assertf(vfn <= VM_VFN_MAX, "invalid VFN 0x%llx", vfn);
   u64 index_vfn = vfn << ((sizeof(vfn)*8) - VM_VFN_BITS);
   vm_ptab_t ptab = map->root;
@@ -122,17 +382,8 @@ vm_page_t* nullable vm_map_access(vm_map_t* map, u64 vfn, bool isaccess) {
         VM_VFN_VADDR(VM_BLOCK_VFN(vfn, level)), level, index,
         *(u64*)page != 0 ? "mapped" : "unused");
 
-      if UNLIKELY(*(u64*)page == 0) {
+      if UNLIKELY(*(u64*)page == 0)
         page = NULL;
-        break;
-      }
-
-      // if there's no backing page, allocate one
-      if (page->hfn == 0) {
-        u64 haddr = alloc_backing_page(map);
-        vm_page_set_haddr(page, haddr);
-        page->purgeable = true;
-      }
       break;
     }
 
@@ -148,9 +399,26 @@ vm_page_t* nullable vm_map_access(vm_map_t* map, u64 vfn, bool isaccess) {
       break;
     }
 
-    subtable->accessed |= isaccess;
+    // atomic since the map may be only read-locked
+    if (isaccess && !subtable->accessed) {
+      union { vm_table_t table; u64 u; } bit = { .table = { .accessed = true } };
+      AtomicOr((_Atomic(u64)*)subtable, bit.u, memory_order_relaxed);
+    }
     ptab = vm_table_ptab(subtable);
   }
 
   return page;
 }
+
+
+// vm_map_access returns the page table entry of a Virtual Frame Number
+vm_page_t* nullable vm_map_access(vm_map_t* map, u64 vfn, bool isaccess) {
+  vm_page_t* page = vm_map_lookup(map, vfn, isaccess);
+
+  // if there's no backing page, allocate one (guard pages never have one).
+  // If we are out of memory, the caller sees hfn==0.
+  if (page && page->hfn == 0 && page->type != VM_PAGE_T_GUARD)
+    vm_map_back_page(map, vfn, page);
+
+  return page;
+}
@@ -39,10 +39,6 @@ typedef struct {
   u64       need_npages;   // total number of pages to map
   u64       mapped_npages; // number of pages mapped so far
   vm_perm_t perm;          // permissions for mapped PTEs
-
-  // fields only used in case of error
-  u64    vaddr; // start address
-  rerr_t err;
 } addctx_t;
 
 
@@ -58,16 +54,6 @@ typedef struct {
 #endif
 
 
-static u32 end_with_error(addctx_t* ctx, rerr_t err) {
-  trace("revert what was mapped so far");
-  ctx->err = err;
-  UNUSED rerr_t err2 = vm_map_del(ctx->map, ctx->vaddr, ctx->mapped_npages);
-  assertf(!err2, "vm_map_del(%012llx, %llu) => %s",
-    ctx->vaddr, ctx->mapped_npages, rerr_str(err2));
-  return 0;
-}
-
-
 #if DEBUG
   static void assert_nuse_integrity(vm_table_t* table, u32 level, u64 vfn) {
     u32 actual_nuse = 0;
@@ -83,7 +69,12 @@ static u32 end_with_error(addctx_t* ctx, rerr_t err) {
 #endif
 
 
-static rerr_t map_pages(vm_table_t* table, vm_ptab_t ptab, u64 vfn, addctx_t* ctx) {
+// map_pages maps pages into a table of pages (level VM_PTAB_LEVELS-1).
+// fresh is true if the table was just allocated, in which case we know all its
+// entries are free.
+static rerr_t map_pages(
+  vm_table_t* table, vm_ptab_t ptab, u64 vfn, addctx_t* ctx, bool fresh)
+{
   u32 index = vm_vfn_ptab_index(vfn, VM_PTAB_LEVELS-1);
   u64 end_index_need = (ctx->need_npages - ctx->mapped_npages) + (u64)index;
 
@@ -93,13 +84,14 @@ static rerr_t map_pages(vm_table_t* table, vm_ptab_t ptab, u64 vfn, addctx_t* ct
 
   u32 npages = end_index - index;
   u64 haddr = ctx->haddr;
+  u64* ptev = (u64*)&ptab[index];
 
   // fail if the table has less free space than requested
   if UNLIKELY(table->nuse > VM_PTAB_LEN - npages) {
     #if DEBUG
     for (u32 i = index; i < end_index; i++) {
       if UNLIKELY(*(u64*)&ptab[i] != 0) {
-        dlog("vaddr %012llx already mapped", VM_VFN_VADDR(vfn + i));
+        dlog("vaddr %012llx already mapped", VM_VFN_VADDR(vfn + (i - index)));
         break;
       }
     }
@@ -124,20 +116,37 @@ static rerr_t map_pages(vm_table_t* table, vm_ptab_t ptab, u64 vfn, addctx_t* ct
     }
   #endif
 
-  for (u32 i = index; i < end_index; i++) {
-    if UNLIKELY(*(u64*)&ptab[i] != 0) {
+  // Check that the entries are free. Branch-free so that it vectorizes;
+  // the (rare) case of overlap is handled after.
+  if (!fresh && table->nuse > 0) {
+    u64 used = 0;
+    for (u32 i = 0; i < npages; i++)
+      used |= ptev[i];
+    if UNLIKELY(used) {
+      u32 i = 0;
+      while (ptev[i] == 0)
+        i++;
       dlog("vaddr %012llx already mapped", VM_VFN_VADDR(vfn + i));
-      ctx->mapped_npages += (u64)(i - index); // for end_with_error & vm_map_del
       return rerr_exists;
     }
-
-    // sets all permission bits in one store
-    *(u8*)&ptab[i].page = ctx->perm;
-    // backing page address (haddr may be 0)
-    vm_page_set_haddr(&ptab[i].page, haddr);
-    haddr += PAGE_SIZE * !!haddr; // no-op in case haddr==0
   }
 
+  // Build the PTE of the first page and store a run of PTEs, each with the next
+  // backing page address (or all without backing when haddr==0.)
+  vm_page_t page = {0};
+  *(u8*)&page = ctx->perm; // sets all permission bits at once
+  // mark pages without permissions as guard pages, which also makes the PTE non-zero
+  if (ctx->perm == VM_PERM_NONE)
+    page.type = VM_PAGE_T_GUARD;
+  vm_page_set_haddr(&page, haddr);
+  vm_page_t step = {0};
+  vm_page_set_haddr(&step, PAGE_SIZE * !!haddr); // no-op in case haddr==0
+  u64 pte, pte_step;
+  memcpy(&pte, &page, sizeof(pte));
+  memcpy(&pte_step, &step, sizeof(pte_step));
+  for (u32 i = 0; i < npages; i++, pte += pte_step)
+    ptev[i] = pte;
+
   ctx->mapped_npages += (u64)npages;
   ctx->haddr += (u64)npages * PAGE_SIZE * !!haddr;
 
@@ -149,84 +158,40 @@ static rerr_t map_pages(vm_table_t* table, vm_ptab_t ptab, u64 vfn, addctx_t* ct
 }
 
 
-static rerr_t map_new_table(
-  vm_table_t* table, u32 level, vm_ptab_t ptab, u32 index, u64 vfn, addctx_t* ctx)
-{
-  assert(level < VM_PTAB_LEVELS-1);
-  assertf(index == vm_vfn_ptab_index(vfn, level),
-    "%u == %u", index, vm_vfn_ptab_index(vfn, level));
-
-  vm_table_t* subtable = &ptab[index].table;
-
-  vm_ptab_t newptab = vm_ptab_alloc(ctx->map->mm);
-  if UNLIKELY(!newptab)
-    return rerr_nomem;
-
-  vm_table_set_ptab(subtable, newptab);
-  table->nuse++;
-
-  // trace("allocated L%u vm_ptab_t %p at L%u[%u] ptab#%p",
-  //   level+1, newptab, level, index, ptab);
-
-  // map pages
-  if (level == VM_PTAB_LEVELS-2)
-    return map_pages(subtable, newptab, vfn, ctx);
-
-  // create & map sub tables
-  level++;
-  u64 block_vfn_mask = VM_BLOCK_VFN_MASK(level);
-  u64 block_npages = VM_PTAB_NPAGES(level+1);
-  index = vm_vfn_ptab_index(vfn, level);
-  for (;;) {
-    trace_table(subtable, level, vfn);
-    rerr_t err = map_new_table(subtable, level, newptab, index, vfn, ctx);
-    if (err || ctx->mapped_npages >= ctx->need_npages)
-      return err;
-    index++;
-    vfn = (vfn & block_vfn_mask) + block_npages;
-  }
-}
-
-
-static u32 visit_table(
-  vm_table_t* table, u32 level, vm_ptab_t ptab, u32 index, u64 vfn, uintptr data)
-{
-  addctx_t* ctx = (addctx_t*)data;
+// map_table maps pages into table (at level) starting at vfn, allocating missing
+// subtables, until all pages are mapped or the end of the table is reached.
+static rerr_t map_table(vm_table_t* table, u32 level, u64 vfn, addctx_t* ctx, bool fresh) {
+  vm_ptab_t ptab = vm_table_ptab(table);
+  if (level == VM_PTAB_LEVELS-1)
+    return map_pages(table, ptab, vfn, ctx, fresh);
 
   u64 block_vfn_mask = VM_BLOCK_VFN_MASK(level);
   u64 block_npages = VM_PTAB_NPAGES(level+1);
-  u32 i = index;
-  rerr_t err;
+  u32 i = vm_vfn_ptab_index(vfn, level);
 
   for (;i < VM_PTAB_LEN; i++, vfn = (vfn & block_vfn_mask) + block_npages) {
-    assert(level < VM_PTAB_LEVELS-1);
     vm_table_t* subtable = &ptab[i].table;
     trace_table(subtable, level, vfn);
 
-    if (*(u64*)subtable == 0) {
+    bool subfresh = (*(u64*)subtable == 0);
+    if (subfresh) {
       // missing table
-      if UNLIKELY(err = map_new_table(table, level, ptab, i, vfn, ctx))
-        return end_with_error(ctx, err);
-    } else {
-      // table of tables needs to be traversed
-      if (level < VM_PTAB_LEVELS-2) {
-        i++;
-        break;
-      }
-
-      // page table
-      if UNLIKELY(err = map_pages(subtable, vm_table_ptab(subtable), vfn, ctx))
-        return end_with_error(ctx, err);
+      vm_ptab_t newptab = vm_ptab_alloc(ctx->map, level+1);
+      if UNLIKELY(!newptab)
+        return rerr_nomem;
+      vm_table_set_ptab(subtable, newptab);
+      table->nuse++;
     }
 
-    if (ctx->mapped_npages >= ctx->need_npages) {
-      trace("done");
-      return 0;
-    }
+    rerr_t err = map_table(subtable, level+1, vfn, ctx, subfresh);
+    if UNLIKELY(err)
+      return err;
+
+    if (ctx->mapped_npages >= ctx->need_npages)
+      break;
   }
 
-  trace("advance %u", i - index);
-  return i - index;
+  return 0;
 }
 
 
@@ -239,9 +204,17 @@ rerr_t vm_map_add(vm_map_t* map, u64 vaddr, uintptr haddr1, u64 npages, vm_perm_
 
   vm_map_assert_locked(map);
 
-  if ((VM_ADDR_MIN > vaddr) | (vaddr > VM_ADDR_MAX) | (perm == 0)) {
+  if ((VM_ADDR_MIN > vaddr) | (vaddr > VM_ADDR_MAX) | (perm == 0 && haddr != 0)) {
     assertf(VM_ADDR_MIN <= vaddr && vaddr <= VM_ADDR_MAX, "invalid vaddr 0x%llx", vaddr);
-    assertf(perm != 0, "zero permissions");
+    assertf(perm != 0 || haddr == 0, "guard pages can't have backing pages");
+    return rerr_invalid;
+  }
+  if UNLIKELY(npages > VM_VFN_MAX - VM_VFN(vaddr) + 1) {
+    assertf(0, "%llu pages at 0x%llx extends beyond VM_ADDR_MAX", npages, vaddr);
+    return rerr_invalid;
+  }
+  if UNLIKELY(haddr != 0 && vaddr < map->direct_size) {
+    assertf(0, "host pages can't be mapped in direct window (0x%llx)", vaddr);
     return rerr_invalid;
   }
 
@@ -256,16 +229,24 @@ rerr_t vm_map_add(vm_map_t* map, u64 vaddr, uintptr haddr1, u64 npages, vm_perm_
 
   addctx_t ctx = {
     .map         = map,
-    .vaddr       = vaddr,
     .haddr       = haddr,
     .need_npages = npages,
     .perm        = perm,
   };
 
-  vm_map_iter(map, vaddr, &visit_table, (uintptr)&ctx);
+  vm_table_t root = { .nuse = map->root_nuse };
+  vm_table_set_ptab(&root, map->root);
+  rerr_t err = map_table(&root, 0, VM_VFN(vaddr), &ctx, /*fresh*/false);
+  map->root_nuse = root.nuse;
+
+  if UNLIKELY(err) {
+    trace("revert what was mapped so far");
+    UNUSED rerr_t err2 = vm_map_del(map, vaddr, ctx.mapped_npages);
+    assertf(!err2, "vm_map_del(%012llx, %llu) => %s",
+      vaddr, ctx.mapped_npages, rerr_str(err2));
+    return err;
+  }
 
-  assert(ctx.mapped_npages <= ctx.need_npages);
-  if (ctx.mapped_npages < ctx.need_npages)
-    assertf(ctx.err != 0, "failed to map all pages but did not set error");
-  return ctx.err;
+  assertf(ctx.mapped_npages == ctx.need_npages, "%llu", ctx.mapped_npages);
+  return 0;
 }
@@ -34,12 +34,34 @@
 
 
 typedef struct {
-  u64    npages; // remaining number of pages to unmap
-  u64    vaddr;  // start address
-  rerr_t err;
+  vm_map_t* map;
+  u64       npages;    // remaining number of pages to unmap
+  u64       nreleased; // number of charged backing pages released
 } delctx_t;
 
 
+// release_pages frees the backing pages of ptab[index:end_index] which belong to
+// the map (like clear_ptab in vm_map.c.) Pages in the direct window are released by
+// vm_map_del. Deduplicated pages belong to vm_ksm (see vm_ksm_release.)
+static void release_pages(vm_ptab_t ptab, u32 index, u32 end_index, delctx_t* ctx) {
+  vm_map_t* map = ctx->map;
+  for (u32 i = index; i < end_index; i++) {
+    vm_page_t* page = &ptab[i].page;
+    if (page->hfn == 0)
+      continue;
+    uintptr haddr = (uintptr)vm_page_haddr(page);
+    if (page->purgeable) {
+      trace("free purgeable backing page %p", (void*)haddr);
+      rmm_freepages(map->mm, (void*)haddr, 1);
+      ctx->nreleased++;
+    } else if (haddr - map->direct_base < (uintptr)map->direct_size) {
+      ctx->nreleased++;
+    }
+    assertf(page->type != VM_PAGE_T_COW, "deduplicated page %p not released", (void*)haddr);
+  }
+}
+
+
 static rerr_t unmap_pages(vm_table_t* table, vm_ptab_t ptab, u64 vfn, delctx_t* ctx) {
   u32 index = vm_vfn_ptab_index(vfn, VM_PTAB_LEVELS-1);
   u64 end_index_need = ctx->npages + (u64)index;
@@ -60,19 +82,24 @@ static rerr_t unmap_pages(vm_table_t* table, vm_ptab_t ptab, u64 vfn, delctx_t*
   #if DEBUG
     for (u32 i = index; i < end_index; i++) {
       if (*(u64*)&ptab[i] == 0)
-        dlog("[vm_map_del] page %012llx is not mapped", VM_VFN_VADDR(vfn + i));
+        dlog("[vm_map_del] page %012llx is not mapped", VM_VFN_VADDR(vfn + (i - index)));
     }
   #endif
 
-  // pave entries at ptab[index:end_index]
-  memset(&ptab[index], 0, sizeof(ptab[0]) * (usize)npages);
+  release_pages(ptab, index, end_index, ctx);
 
   if UNLIKELY(table->nuse < npages) {
+    memset(&ptab[index], 0, sizeof(ptab[0]) * (usize)npages);
     table->nuse = 0;
     return rerr_not_found;
   }
   table->nuse -= npages;
 
+  // pave entries at ptab[index:end_index], unless the table is now unused,
+  // in which case the caller frees it
+  if (table->nuse > 0)
+    memset(&ptab[index], 0, sizeof(ptab[0]) * (usize)npages);
+
   assert(ctx->npages >= (u64)npages);
   ctx->npages -= (u64)npages;
 
@@ -80,46 +107,42 @@ static rerr_t unmap_pages(vm_table_t* table, vm_ptab_t ptab, u64 vfn, delctx_t*
 }
 
 
-static u32 visit_table(
-  vm_table_t* table, u32 level, vm_ptab_t ptab, u32 index, u64 vfn, uintptr data)
-{
-  delctx_t* ctx = (delctx_t*)data;
+// unmap_table unmaps pages in table (at level) starting at vfn, until all pages
+// are unmapped or the end of the table is reached. Subtables which become unused
+// are freed without visiting their entries.
+static rerr_t unmap_table(vm_table_t* table, u32 level, u64 vfn, delctx_t* ctx) {
+  vm_ptab_t ptab = vm_table_ptab(table);
+  if (level == VM_PTAB_LEVELS-1)
+    return unmap_pages(table, ptab, vfn, ctx);
 
   u64 block_vfn_mask = VM_BLOCK_VFN_MASK(level);
   u64 block_npages = VM_PTAB_NPAGES(level+1);
-  u32 i = index;
+  u32 i = vm_vfn_ptab_index(vfn, level);
 
   for (;i < VM_PTAB_LEN; i++, vfn = (vfn & block_vfn_mask) + block_npages) {
-    assert(level < VM_PTAB_LEVELS-1);
     vm_table_t* subtable = &ptab[i].table;
     trace_table(subtable, level, vfn);
 
     if UNLIKELY(*(u64*)subtable == 0) {
       dlog("[vm_map_del] vaddr %llx not mapped", VM_VFN_VADDR(vfn));
-      ctx->err = rerr_not_found;
-      return 0;
+      return rerr_not_found;
     }
 
-    // table of tables needs to be traversed
-    if (level < VM_PTAB_LEVELS-2) {
-      i++;
-      break;
-    }
+    rerr_t err = unmap_table(subtable, level+1, vfn, ctx);
 
-    // page table
-    rerr_t err = unmap_pages(subtable, vm_table_ptab(subtable), vfn, ctx);
-    if UNLIKELY(err) {
-      ctx->err = err;
-      return 0;
-    }
-    if (ctx->npages == 0) {
-      trace("done");
-      return 0;
+    if (subtable->nuse == 0) {
+      trace("free L%u table %012llx", level+2, VM_VFN_VADDR(VM_BLOCK_VFN(vfn, level)));
+      vm_ptab_free(ctx->map, vm_table_ptab(subtable), level+1);
+      *(u64*)subtable = 0;
+      assert(table->nuse > 0);
+      table->nuse--;
     }
+
+    if (err || ctx->npages == 0)
+      return err;
   }
 
-  trace("advance %u", i - index);
-  return i - index;
+  return 0;
 }
 
 
@@ -135,16 +158,34 @@ rerr_t vm_map_del(vm_map_t* map, u64 vaddr, u64 npages) {
     assertf(0, "invalid vaddr 0x%llx", vaddr);
     return rerr_invalid;
   }
+  if UNLIKELY(npages > VM_VFN_MAX - VM_VFN(vaddr) + 1) {
+    assertf(0, "%llu pages at 0x%llx extends beyond VM_ADDR_MAX", npages, vaddr);
+    return rerr_invalid;
+  }
 
   trace("unmap %llu pages at %012llx…%012llx",
     npages, vaddr, vaddr + (npages-1)*PAGE_SIZE);
 
   delctx_t ctx = {
-    .vaddr  = vaddr,
+    .map    = map,
     .npages = npages,
   };
 
-  vm_map_iter(map, vaddr, &visit_table, (uintptr)&ctx);
+  vm_table_t root = { .nuse = map->root_nuse };
+  vm_table_set_ptab(&root, map->root);
+  rerr_t err = unmap_table(&root, 0, VM_VFN(vaddr), &ctx);
+  map->root_nuse = root.nuse;
+
+  // make the pages inaccessible through the direct window
+  if (vaddr < map->direct_size)
+    vm_direct_release(map, vaddr, npages - ctx.npages);
+
+  // Users of map may have cached translations to the backing pages we freed.
+  // This M's caches must be invalidated by the caller before the next access.
+  if (ctx.nreleased) {
+    vm_map_uncharge(map, ctx.nreleased);
+    AtomicAdd(&map->gen, 1, memory_order_release);
+  }
 
-  return ctx.err;
+  return err;
 }
@@ -50,40 +50,27 @@ typedef struct {
 static void visit_page_table(vm_table_t* table, u64 vfn, findspace_t* ctx) {
   vm_ptab_t ptab = vm_table_ptab(table);
   u32 end_index = vm_ptab_page_end_index(vfn);
-  u32 free_index = 0; // start of range of free pages
 
-  for (u32 i = 0; i < end_index; i++) {
-    //dlog("page %012llx %s", VM_VFN_VADDR(vfn + i), *(u64*)&ptab[i] ? "used" : "free");
+  // vfn may be offset into the table (only for the first table visited)
+  u32 i = (u32)(vfn & (u64)(VM_PTAB_LEN - 1));
+  u64 block_vfn = vfn - (u64)i;
 
-    if (*(u64*)&ptab[i] == 0) // page is free
-      continue;
+  for (; i < end_index; i++) {
+    //dlog("page %012llx %s", VM_VFN_VADDR(block_vfn + i), *(u64*)&ptab[i] ? "used" : "free");
 
-    // check if we found enough free pages already
-    u64 found_npages = (u64)(end_index - free_index);
-    if (ctx->found_npages + found_npages >= ctx->want_npages) {
-      ctx->found_npages += found_npages;
-      return;
+    if (*(u64*)&ptab[i] != 0) {
+      // page is used; start over
+      ctx->found_npages = 0;
+      ctx->start_vaddr = 0;
+      continue;
     }
 
-    // fast forward to the next free page
-    while (i < end_index && *(u64*)&ptab[i])
-      i++;
+    if (ctx->found_npages == 0)
+      ctx->start_vaddr = VM_VFN_VADDR(block_vfn + i);
 
-    ctx->found_npages = 0;
-    free_index = i;
-
-    if (i == end_index) {
-      // all remaining pages are used
-      ctx->start_vaddr = 0;
+    if (++ctx->found_npages >= ctx->want_npages)
       return;
-    }
-
-    ctx->start_vaddr = VM_VFN_VADDR(vfn + i);
   }
-
-  // when we get here we found at least one free page in the tail of the table
-  assert((end_index - free_index) > 0);
-  ctx->found_npages += (u64)(end_index - free_index);
 }
 
 
@@ -16,8 +16,12 @@ for srcfile in examples/*.rsm; do
     fail-*) continue ;;
   esac
 
-  # skip source files containing "//!exe2-only"
-  grep -qE "^\/\/\!exe2-only" "$srcfile" && continue
+  # run source files containing "//!exe2-only" with the v2 execution engine
+  if grep -qE "^\/\/\!exe2-only" "$srcfile"; then
+    echo "rsm -X -R0=3 '$srcfile'"
+    $RSM -X -R0=3 "$srcfile" </dev/null
+    continue
+  fi
 
   ROM=$OUTDIR/test_${FILENAME%*.rsm}.rom
 
@@ -0,0 +1,367 @@
+// rsm-cachesim: replays a memory-access trace through a cache model
+// SPDX-License-Identifier: Apache-2.0
+//
+// Reads a trace written by "rsm -X -T <file>" (see src/memtrace.h) and runs every
+// access through a two-level set-associative LRU model of the host's data caches
+// and through a model of the scheduler's vm_cache (one direct-mapped cache for loads
+// and one for stores, indexed by page number.) The vm_cache model is that of a single
+// M without fault-around, so it counts an upper bound of vm_cache misses.
+//
+// Misses are reported in total, per memory region (data, stack, other), per
+// instruction (pc) and per cache line of the data section.
+// An access which spans several cache lines or pages counts once per line or page.
+//
+#include "../src/rsmimpl.h"
+#include "../src/memtrace.h"
+#include "../src/lz4.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// cache_t is a set-associative cache with LRU replacement
+typedef struct {
+  u64  size, assoc, linesize;
+  u64  nsets;
+  u64* tags;   // [nsets*assoc] line number + 1 (0 = empty)
+  u64* stamps; // [nsets*assoc] time of last use
+  u64  clock;
+} cache_t;
+
+// stats_t counts accesses and misses
+typedef struct {
+  u64 naccess;  // cache lines accessed
+  u64 nl1miss;
+  u64 nl2miss;
+  u64 nvmcache; // vm_cache lookups
+  u64 nvmmiss;  // vm_cache misses
+} stats_t;
+
+enum { REGION_DATA, REGION_STACK, REGION_OTHER, REGION_MAX };
+static const char* region_names[REGION_MAX] = { "data", "stack", "other" };
+
+static const char* prog = "";
+static cache_t     l1 = { .size = 32*1024, .assoc = 8, .linesize = 64 };
+static cache_t     l2 = { .size = 256*1024, .assoc = 8, .linesize = 64 };
+static u32         topn = 10;
+
+static memtrace_hdr_t hdr;
+static u64*     vmcache[2]; // [MEMTRACE_LOAD, MEMTRACE_STORE][vm_cache_len] VFN + 1
+static stats_t  total;
+static stats_t  regions[REGION_MAX];
+static stats_t* pcstats;     // [npcstats] indexed by pc
+static u32      npcstats;
+static stats_t* linestats;   // [nlinestats] indexed by data-section cache line
+static u64      nlinestats;
+
+#define errmsg(fmt, args...) fprintf(stderr, "%s: " fmt "\n", prog, ##args)
+
+
+static void* xcalloc(usize count, usize size) {
+  void* p = calloc(count, size);
+  if (!p) {
+    errmsg("out of memory");
+    exit(1);
+  }
+  return p;
+}
+
+
+static void cache_init(cache_t* c) {
+  c->nsets = c->size / (c->assoc * c->linesize);
+  c->tags = xcalloc(c->nsets * c->assoc, sizeof(u64));
+  c->stamps = xcalloc(c->nsets * c->assoc, sizeof(u64));
+}
+
+
+// cache_access accesses the cache line containing addr. Returns true on hit.
+static bool cache_access(cache_t* c, u64 addr) {
+  u64 line = addr / c->linesize;
+  u64 tag = line + 1;
+  u64* tags = &c->tags[(line % c->nsets) * c->assoc];
+  u64* stamps = &c->stamps[(line % c->nsets) * c->assoc];
+  u64 victim = 0;
+  c->clock++;
+  for (u64 i = 0; i < c->assoc; i++) {
+    if (tags[i] == tag) {
+      stamps[i] = c->clock;
+      return true;
+    }
+    if (stamps[i] < stamps[victim])
+      victim = i;
+  }
+  tags[victim] = tag;
+  stamps[victim] = c->clock;
+  return false;
+}
+
+
+// vmcache_access looks up the page containing vaddr. Returns true on hit.
+static bool vmcache_access(memtrace_kind_t kind, u64 vaddr) {
+  u64 vfn = vaddr / hdr.page_size;
+  u64* entry = &vmcache[kind][vfn & (hdr.vm_cache_len - 1)];
+  if (*entry == vfn + 1)
+    return true;
+  *entry = vfn + 1;
+  return false;
+}
+
+
+static stats_t* pc_stats(u32 pc) {
+  if (pc >= npcstats) {
+    u32 n = MAX(npcstats * 2, MAX(pc + 1, 1024u));
+    pcstats = realloc(pcstats, n * sizeof(stats_t));
+    if (!pcstats) {
+      errmsg("out of memory");
+      exit(1);
+    }
+    memset(&pcstats[npcstats], 0, (n - npcstats) * sizeof(stats_t));
+    npcstats = n;
+  }
+  return &pcstats[pc];
+}
+
+
+// count adds n to field f of all the stats that rec is counted in
+#define count(rec_region, st_pc, st_line, f, n) { \
+  total.f += (n); regions[rec_region].f += (n); st_pc->f += (n); \
+  if (st_line) st_line->f += (n); \
+}
+
+
+static void simulate(const memtrace_rec_t* rec) {
+  u64 vaddr = rec->vaddr;
+  u64 size = MAX(rec->size, 1u);
+  int region = (rec->flags & MEMTRACE_F_STACK) ? REGION_STACK :
+               (vaddr - hdr.data_vaddr < hdr.data_size) ? REGION_DATA :
+               REGION_OTHER;
+  stats_t* st_pc = pc_stats(rec->pc);
+
+  // vm_cache: one lookup per page
+  u64 page_end = (vaddr + size - 1) / hdr.page_size;
+  for (u64 page = vaddr / hdr.page_size; page <= page_end; page++) {
+    stats_t* st_line = NULL;
+    u64 pageaddr = MAX(page * hdr.page_size, vaddr);
+    if (region == REGION_DATA && pageaddr - hdr.data_vaddr < hdr.data_size)
+      st_line = &linestats[(pageaddr - hdr.data_vaddr) / l1.linesize];
+    bool hit = vmcache_access(rec->kind, pageaddr);
+    count(region, st_pc, st_line, nvmcache, 1);
+    count(region, st_pc, st_line, nvmmiss, !hit);
+  }
+
+  // L1 & L2: one access per cache line
+  u64 line_end = (vaddr + size - 1) / l1.linesize;
+  for (u64 line = vaddr / l1.linesize; line <= line_end; line++) {
+    u64 addr = line * l1.linesize;
+    stats_t* st_line = NULL;
+    if (region == REGION_DATA && addr - hdr.data_vaddr < hdr.data_size)
+      st_line = &linestats[(addr - hdr.data_vaddr) / l1.linesize];
+    count(region, st_pc, st_line, naccess, 1);
+    if (cache_access(&l1, addr))
+      continue;
+    count(region, st_pc, st_line, nl1miss, 1);
+    if (!cache_access(&l2, addr))
+      count(region, st_pc, st_line, nl2miss, 1);
+  }
+}
+
+
+static double pct(u64 n, u64 of) {
+  return of ? (double)n * 100.0 / (double)of : 0.0;
+}
+
+
+static void print_stats_header(const char* title) {
+  printf("%-12s %12s %12s %7s %12s %7s %12s %7s\n",
+    title, "lines", "L1 misses", "", "L2 misses", "", "vmc misses", "");
+}
+
+
+static void print_stats(const char* name, const stats_t* st) {
+  printf("%-12s %12llu %12llu %6.2f%% %12llu %6.2f%% %12llu %6.2f%%\n",
+    name, st->naccess,
+    st->nl1miss, pct(st->nl1miss, st->naccess),
+    st->nl2miss, pct(st->nl2miss, st->naccess),
+    st->nvmmiss, pct(st->nvmmiss, st->nvmcache));
+}
+
+
+// top_l1miss returns the indices of the (up to) n stats with the most L1 misses
+static u32 top_l1miss(const stats_t* v, u64 len, u64* idxv, u32 n) {
+  u32 count = 0;
+  for (u64 i = 0; i < len; i++) {
+    if (v[i].nl1miss == 0)
+      continue;
+    u32 j = count < n ? count++ : n;
+    if (j == n && v[i].nl1miss <= v[idxv[n - 1]].nl1miss)
+      continue;
+    if (j == n)
+      j--;
+    while (j > 0 && v[idxv[j - 1]].nl1miss < v[i].nl1miss) {
+      idxv[j] = idxv[j - 1];
+      j--;
+    }
+    idxv[j] = i;
+  }
+  return count;
+}
+
+
+static void report() {
+  printf("L1: %llu KiB, %llu-way, %llu B lines\n",
+    l1.size / 1024, l1.assoc, l1.linesize);
+  printf("L2: %llu KiB, %llu-way, %llu B lines\n",
+    l2.size / 1024, l2.assoc, l2.linesize);
+  printf("vm_cache: %u entries per kind of access, %u B pages\n\n",
+    hdr.vm_cache_len, hdr.page_size);
+
+  print_stats_header("region");
+  for (int i = 0; i < REGION_MAX; i++)
+    print_stats(region_names[i], &regions[i]);
+  print_stats("total", &total);
+
+  u64* idxv = xcalloc(topn, sizeof(u64));
+  char name[32];
+
+  u32 n = top_l1miss(pcstats, npcstats, idxv, topn);
+  if (n) {
+    printf("\n");
+    print_stats_header("pc");
+    for (u32 i = 0; i < n; i++) {
+      snprintf(name, sizeof(name), "%llu", idxv[i]);
+      print_stats(name, &pcstats[idxv[i]]);
+    }
+  }
+
+  n = top_l1miss(linestats, nlinestats, idxv, topn);
+  if (n) {
+    printf("\n");
+    print_stats_header("data line");
+    for (u32 i = 0; i < n; i++) {
+      snprintf(name, sizeof(name), "data+0x%llx", idxv[i] * l1.linesize);
+      print_stats(name, &linestats[idxv[i]]);
+    }
+  }
+  free(idxv);
+}
+
+
+static rerr_t replay(const u8* p, usize size) {
+  if (size < sizeof(hdr) || memcmp(p, MEMTRACE_MAGIC, 4) != 0)
+    return rerr_invalid;
+  memcpy(&hdr, p, sizeof(hdr));
+  if (hdr.version != MEMTRACE_VERSION)
+    return rerr_not_supported;
+  if (!IS_POW2(hdr.vm_cache_len) || !IS_POW2(hdr.page_size) ||
+      hdr.data_vaddr % hdr.page_size || hdr.page_size < l1.linesize)
+  {
+    return rerr_invalid;
+  }
+
+  vmcache[MEMTRACE_LOAD] = xcalloc(hdr.vm_cache_len, sizeof(u64));
+  vmcache[MEMTRACE_STORE] = xcalloc(hdr.vm_cache_len, sizeof(u64));
+  nlinestats = hdr.data_size / l1.linesize + 1;
+  linestats = xcalloc(nlinestats, sizeof(stats_t));
+
+  memtrace_rec_t* recv = xcalloc(MEMTRACE_NREC, sizeof(memtrace_rec_t));
+  usize offs = sizeof(hdr);
+  while (offs < size) {
+    memtrace_blk_t blk;
+    if (size - offs < sizeof(blk))
+      return rerr_invalid;
+    memcpy(&blk, p + offs, sizeof(blk));
+    offs += sizeof(blk);
+    if (blk.zsize > size - offs || blk.rawsize > MEMTRACE_NREC * sizeof(memtrace_rec_t))
+      return rerr_invalid;
+    int n = LZ4_decompress_safe(
+      (const char*)p + offs, (char*)recv, (int)blk.zsize, (int)blk.rawsize);
+    if (n != (int)blk.rawsize || n % sizeof(memtrace_rec_t))
+      return rerr_invalid;
+    offs += blk.zsize;
+    for (usize i = 0; i < (usize)n / sizeof(memtrace_rec_t); i++)
+      simulate(&recv[i]);
+  }
+  free(recv);
+  return 0;
+}
+
+
+// parse_cache parses "<size>:<assoc>:<linesize>", e.g. "32k:8:64"
+static bool parse_cache(const char* s, cache_t* c) {
+  char* end;
+  u64 size = strtoull(s, &end, 10);
+  if (*end == 'k' || *end == 'K') { size *= 1024; end++; }
+  else if (*end == 'm' || *end == 'M') { size *= 1024*1024; end++; }
+  if (*end != ':')
+    return false;
+  u64 assoc = strtoull(end + 1, &end, 10);
+  if (*end != ':')
+    return false;
+  u64 linesize = strtoull(end + 1, &end, 10);
+  if (*end || !IS_POW2(linesize) || assoc == 0 || size % (assoc * linesize))
+    return false;
+  c->size = size;
+  c->assoc = assoc;
+  c->linesize = linesize;
+  return true;
+}
+
+
+static void usage() {
+  printf(
+    "Replay a memory-access trace through a cache model\n"
+    "Usage: %s [options] <tracefile>\n"
+    "Options:\n"
+    "  -h                     Show help and exit\n"
+    "  -1 <size>:<ways>:<B>   L1 cache geometry (default: 32k:8:64)\n"
+    "  -2 <size>:<ways>:<B>   L2 cache geometry (default: 256k:8:64)\n"
+    "  -n <N>                 Report the top N instructions and data lines (default: %u)\n"
+    "Traces are written by rsm built with SCHED_MEMTRACE, e.g.\n"
+    "  rsm -X -T prog.rsmt prog.rsm && %s prog.rsmt\n"
+    ,prog, topn, prog);
+}
+
+
+int main(int argc, char* argv[]) {
+  prog = argv[0];
+  extern char* optarg;
+  extern int optind, optopt;
+  int nerrs = 0;
+  for (int c; (c = getopt(argc, argv, ":h1:2:n:")) != -1;) switch(c) {
+    case 'h': usage(); exit(0);
+    case '1':
+      if (!parse_cache(optarg, &l1)) { errmsg("invalid -1 %s", optarg); nerrs++; }
+      break;
+    case '2':
+      if (!parse_cache(optarg, &l2)) { errmsg("invalid -2 %s", optarg); nerrs++; }
+      break;
+    case 'n': topn = (u32)strtoul(optarg, NULL, 10); break;
+    case ':': errmsg("option -%c requires a value", optopt); nerrs++; break;
+    case '?': errmsg("unrecognized option -%c", optopt); nerrs++; break;
+  }
+  if (l1.linesize != l2.linesize) {
+    errmsg("L1 and L2 must have the same line size");
+    nerrs++;
+  }
+  if (optind != argc - 1) {
+    errmsg("missing <tracefile> (see %s -h for help)", prog);
+    nerrs++;
+  }
+  if (nerrs)
+    return 1;
+
+  rmem_t data;
+  rerr_t err = rsm_loadfile(argv[optind], &data);
+  if (!err) {
+    cache_init(&l1);
+    cache_init(&l2);
+    err = replay(data.p, data.size);
+    if (!err)
+      report();
+    rsm_unloadfile(data);
+  }
+  if (err) {
+    errmsg("%s: %s", argv[optind], rerr_str(err));
+    return 1;
+  }
+  return 0;
+}
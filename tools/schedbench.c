@@ -0,0 +1,159 @@
+// rsm-schedbench: measures scheduler latencies
+// SPDX-License-Identifier: Apache-2.0
+//
+// Runs benchmarks of the scheduler's building blocks on a machine with no program
+// loaded:
+// - park: M park/unpark round trip (mnote_t on futexes or sema_t)
+// - switch: task switch through a P's run queue
+// - wake: CPU time burned by idle M's against wake latency, running a program which
+//   spawns a short task and then sleeps, over and over (see "Spinning policy" in
+//   sched.h; the policy is tuned with the S_SPIN* and S_MAXSPINNING constants)
+//
+#include "../src/rsmimpl.h"
+#include "../src/machine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char* prog = "";
+static u32 niterations = 10000;
+static u32 nrounds = 500;
+static u64 sleep_ns = 1000000; // 1ms
+
+#define errmsg(fmt, args...) fprintf(stderr, "%s: " fmt "\n", prog, ##args)
+
+static void bench_park(rmachine_t* m) {
+  u64 ns = rsched_bench_park(&m->sched, niterations);
+  char buf[25];
+  fmtduration(buf, ns);
+  printf("park   %s per round trip (%u iterations, %s)\n", buf, niterations,
+    #ifdef RSM_FUTEX
+      "futex"
+    #else
+      "sema_t"
+    #endif
+  );
+}
+
+static void bench_switch(rmachine_t* m) {
+  // switches are cheap; do more of them than round trips
+  u32 n = niterations * 100;
+  double ns = rsched_bench_switch(&m->sched, n);
+  printf("switch %.1f ns per switch (%u iterations)\n", ns, n);
+}
+
+static u64 cputime_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ((u64)(ts.tv_sec) * 1000000000) + ts.tv_nsec;
+}
+
+static void bench_wake(rmachine_t* m) {
+  char src[512];
+  snprintf(src, sizeof(src),
+    "fun main() {\n"
+    "  R8 = %u\n"
+    "loop:\n"
+    "  tspawn worker\n"
+    "  R0 = %llu ; syscall 1\n"
+    "  R8 = R8 - 1\n"
+    "  if R8 loop\n"
+    "  R0 = 0\n"
+    "}\n"
+    "fun worker() {\n"
+    "  R1 = 1000\n"
+    "spin:\n"
+    "  R1 = R1 - 1\n"
+    "  if R1 spin\n"
+    "}\n",
+    nrounds, sleep_ns);
+  rasm_t a = {
+    .memalloc = m->malloc,
+    .srcname = "wake",
+    .srcdata = src,
+    .srclen = strlen(src),
+  };
+  rnode_t* mod = rasm_parse(&a);
+  rrom_t rom = {0};
+  if (!mod || a.errcount || rasm_gen(&a, mod, &rom)) {
+    errmsg("failed to assemble benchmark program");
+    exit(1);
+  }
+
+  rsched_t* s = &m->sched;
+  u64 nwake0 = s->stats.nwake, wakens0 = s->stats.wakens;
+  u64 nspin0 = s->stats.nspin, nspinpark0 = s->stats.nspinpark;
+  u64 spinns0 = s->stats.spinns;
+  u64 cpu0 = cputime_ns(), t0 = nanotime();
+  rerr_t err = rmachine_execrom(m, &rom);
+  u64 cpu = cputime_ns() - cpu0, wall = nanotime() - t0;
+  rsm_freerom(&rom, m->malloc);
+  if (err) {
+    errmsg("benchmark program failed: %s", rerr_str(err));
+    exit(1);
+  }
+
+  // The tasks themselves need little CPU time; most of it is burned by M's which
+  // spin looking for work, and by waking and parking M's.
+  u64 nwake = s->stats.nwake - nwake0;
+  u64 nspin = s->stats.nspin - nspin0;
+  u64 spinns = s->stats.spinns - spinns0;
+  char wakedur[25], spindur[25], cpudur[25], walldur[25], sleepdur[25];
+  fmtduration(wakedur, nwake ? (s->stats.wakens - wakens0) / nwake : 0);
+  fmtduration(spindur, spinns / nrounds);
+  fmtduration(cpudur, cpu);
+  fmtduration(walldur, wall);
+  fmtduration(sleepdur, sleep_ns);
+  printf("wake   %s avg wake latency (%llu wakeups);"
+    " %s spinning per round (%llu spins, %llu parked)\n",
+    wakedur, nwake, spindur, nspin, s->stats.nspinpark - nspinpark0);
+  printf("wake   %s CPU in %s (%.1f%% of one CPU; %u rounds of spawn + sleep %s)\n",
+    cpudur, walldur, (double)cpu * 100.0 / (double)wall, nrounds, sleepdur);
+}
+
+static void usage() {
+  printf(
+    "Measure scheduler latencies\n"
+    "Usage: %s [options]\n"
+    "Options:\n"
+    "  -h       Show help and exit\n"
+    "  -n <N>   Number of iterations (default: %u)\n"
+    "  -r <N>   Number of spawn + sleep rounds of the wake benchmark (default: %u)\n"
+    "  -s <us>  Sleep time per round in microseconds (default: %llu)\n"
+    ,prog, niterations, nrounds, sleep_ns / 1000);
+}
+
+int main(int argc, char* argv[]) {
+  prog = argv[0];
+  extern char* optarg;
+  extern int optind, optopt;
+  int nerrs = 0;
+  for (int c; (c = getopt(argc, argv, ":hn:r:s:")) != -1;) switch(c) {
+    case 'h': usage(); exit(0);
+    case 'n': niterations = MAX(1u, (u32)strtoul(optarg, NULL, 10)); break;
+    case 'r': nrounds = MAX(1u, (u32)strtoul(optarg, NULL, 10)); break;
+    case 's': sleep_ns = MAX(1llu, (u64)strtoull(optarg, NULL, 10)) * 1000; break;
+    case ':': errmsg("option -%c requires a value", optopt); nerrs++; break;
+    case '?': errmsg("unrecognized option -%c", optopt); nerrs++; break;
+  }
+  if (nerrs)
+    return 1;
+  if (!rsm_init())
+    return 1;
+
+  rmm_t* mm = rmm_create_host_vmmap(64 * MiB);
+  rmachine_t* m = mm ? rmachine_create(mm) : NULL;
+  if (!m) {
+    errmsg("failed to create machine");
+    return 1;
+  }
+
+  bench_park(m);
+  bench_switch(m);
+  bench_wake(m);
+
+  rmachine_dispose(m);
+  rmm_dispose(mm);
+  return 0;
+}
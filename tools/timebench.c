@@ -0,0 +1,107 @@
+// rsm-timebench: measures nanotime overhead and accuracy
+// SPDX-License-Identifier: Apache-2.0
+//
+// Compares nanotime (src/time.c), which uses the CPU's time-stamp counter when it
+// is invariant, with clock_gettime(CLOCK_MONOTONIC):
+// - cost of nanotime calls while TSC calibration is pending and after it completed
+// - ns/call of both clocks
+// - drift of nanotime relative to clock_gettime over a sleep
+//
+#include "../src/rsmimpl.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char* prog = "";
+static u32 niterations = 1000000;
+static u64 sleep_ns = 50000000; // 50ms
+
+#define errmsg(fmt, args...) fprintf(stderr, "%s: " fmt "\n", prog, ##args)
+
+static u64 os_nanotime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((u64)(ts.tv_sec) * 1000000000) + ts.tv_nsec;
+}
+
+static void bench_calibration() {
+  // The first nanotime call starts calibration; nanotime uses clock_gettime
+  // until calibration completes. Measure the first call and how many calls it
+  // takes until the cost of a call drops to that of a calibrated call.
+  u64 t0 = os_nanotime();
+  u64 sink = nanotime();
+  u64 first_ns = os_nanotime() - t0;
+
+  u32 ncalls = 0;
+  t0 = os_nanotime();
+  u64 tend = t0 + 10000000; // give up after 10ms
+  u64 t;
+  do {
+    sink += nanotime();
+    ncalls++;
+  } while ((t = os_nanotime()) < tend);
+  printf("first call    %6llu ns; %u calls in %.1f ms (sink %llu)\n",
+    first_ns, ncalls, (double)(t - t0) / 1000000.0, sink & 1);
+}
+
+static void bench_overhead() {
+  u64 sink = 0;
+
+  u64 t0 = os_nanotime();
+  for (u32 i = 0; i < niterations; i++)
+    sink += os_nanotime();
+  u64 os_ns = os_nanotime() - t0;
+
+  t0 = os_nanotime();
+  for (u32 i = 0; i < niterations; i++)
+    sink += nanotime();
+  u64 ns = os_nanotime() - t0;
+
+  printf("nanotime      %6.1f ns/call\n", (double)ns / niterations);
+  printf("clock_gettime %6.1f ns/call (sink %llu)\n",
+    (double)os_ns / niterations, sink & 1);
+}
+
+static void bench_drift() {
+  // compare elapsed time of both clocks over a sleep
+  u64 a0 = nanotime(), b0 = os_nanotime();
+  rsm_nanosleep(sleep_ns);
+  i64 drift = (i64)(nanotime() - a0) - (i64)(os_nanotime() - b0);
+  char buf[25];
+  fmtduration(buf, sleep_ns);
+  printf("drift         %6lld ns over %s\n", drift, buf);
+}
+
+static void usage() {
+  printf(
+    "Measure nanotime overhead and accuracy\n"
+    "Usage: %s [options]\n"
+    "Options:\n"
+    "  -h       Show help and exit\n"
+    "  -n <N>   Number of calls to time (default: %u)\n"
+    "  -s <ms>  Duration of drift measurement in milliseconds (default: %llu)\n"
+    ,prog, niterations, sleep_ns / 1000000);
+}
+
+int main(int argc, char* argv[]) {
+  prog = argv[0];
+  extern char* optarg;
+  extern int optind, optopt;
+  int nerrs = 0;
+  for (int c; (c = getopt(argc, argv, ":hn:s:")) != -1;) switch(c) {
+    case 'h': usage(); exit(0);
+    case 'n': niterations = MAX(1u, (u32)strtoul(optarg, NULL, 10)); break;
+    case 's': sleep_ns = (u64)strtoull(optarg, NULL, 10) * 1000000; break;
+    case ':': errmsg("option -%c requires a value", optopt); nerrs++; break;
+    case '?': errmsg("unrecognized option -%c", optopt); nerrs++; break;
+  }
+  if (nerrs)
+    return 1;
+  if (!rsm_init())
+    return 1;
+  bench_calibration();
+  bench_overhead();
+  bench_drift();
+  return 0;
+}